@@ -4,14 +4,121 @@
 #include "./nsuv.h"
 
 #if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>  // open, splice
+#include <sys/mman.h>  // mmap, madvise, memfd_create
+#include <sys/stat.h>  // fstat
 #include <sys/un.h>  // sockaddr_un
+#include <unistd.h>  // dup, close
 #endif
 
+#if defined(__linux__)
+#include <linux/errqueue.h>  // sock_extended_err
+#include <linux/filter.h>  // sock_filter, SKF_AD_CPU
+#include <sys/eventfd.h>  // eventfd
+#include <sys/syscall.h>  // __NR_io_uring_setup
+#include <sys/sysmacros.h>  // makedev
+#  if defined(__has_include)
+#    if __has_include(<linux/io_uring.h>)
+#      include <linux/io_uring.h>
+#    endif
+#  endif
+/* ns_fs_uring also needs the syscall numbers and struct statx. */
+#  if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup) &&           \
+      defined(STATX_BASIC_STATS)
+#    define NSUV_HAVE_IO_URING 1
+#  endif
+#endif
+
+#include <climits>  // UINT_MAX
+#include <cstdint>  // SIZE_MAX
 #include <cstdlib>  // abort
 #include <cstring>  // memcpy
 #include <new>      // nothrow
 #include <type_traits>  // is_trivial
 
+/* Allow users to define if they want the scalar paths. */
+#if !defined(NSUV_DISABLE_SIMD)
+#  if defined(__AVX2__)
+#    define NSUV_HAVE_AVX2 1
+#  endif
+#  if defined(__SSE2__) || defined(_M_X64) ||                                  \
+      (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define NSUV_HAVE_SSE2 1
+#  endif
+#endif
+
+#if defined(NSUV_HAVE_AVX2)
+#include <immintrin.h>
+#elif defined(NSUV_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(NSUV_HAVE_SSE2) && defined(_MSC_VER)
+#include <intrin.h>  // _BitScanForward
+#endif
+
+#if defined(NSUV_HAVE_USDT)
+#include <sys/sdt.h>  // DTRACE_PROBE3
+#endif
+
+/* Wraps every proxy that calls into user code. fn is the user's callback.
+ * Expands to nothing unless there are USDT probes or NSUV_ENABLE_WATCHDOG is
+ * defined.
+ */
+#if defined(NSUV_HAVE_USDT) || defined(NSUV_ENABLE_WATCHDOG)
+#  define NSUV_TRACE_HANDLE(cb, handle, fn)                                    \
+    util::cb_trace nsuv_trace_(cb,                                             \
+                               handle,                                         \
+                               static_cast<int>((handle)->type),               \
+                               false,                                          \
+                               reinterpret_cast<void (*)()>(fn))
+#  define NSUV_TRACE_REQ(cb, req, fn)                                          \
+    util::cb_trace nsuv_trace_(cb,                                             \
+                               req,                                            \
+                               static_cast<int>((req)->type),                  \
+                               true,                                           \
+                               reinterpret_cast<void (*)()>(fn))
+/* For objects that aren't a handle or request themselves, reported as the
+ * uv type they stand in for.
+ */
+#  define NSUV_TRACE_OBJ(cb, ptr, type, req, fn)                               \
+    util::cb_trace nsuv_trace_(cb,                                             \
+                               ptr,                                            \
+                               static_cast<int>(type),                         \
+                               req,                                            \
+                               reinterpret_cast<void (*)()>(fn))
+#else
+/* Some proxies only take the handle or request for tracing. */
+#  define NSUV_TRACE_HANDLE(cb, handle, fn) static_cast<void>(handle)
+#  define NSUV_TRACE_REQ(cb, req, fn) static_cast<void>(req)
+#  define NSUV_TRACE_OBJ(cb, ptr, type, req, fn) static_cast<void>(ptr)
+#endif
+
+/* Not all headers define these yet. */
+#if defined(__linux__)
+#  ifndef SO_ZEROCOPY
+#    define SO_ZEROCOPY 60
+#  endif
+#  ifndef MSG_ZEROCOPY
+#    define MSG_ZEROCOPY 0x4000000
+#  endif
+#  ifndef SO_EE_ORIGIN_ZEROCOPY
+#    define SO_EE_ORIGIN_ZEROCOPY 5
+#  endif
+#  ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#    define SO_EE_CODE_ZEROCOPY_COPIED 1
+#  endif
+#  ifndef UDP_SEGMENT
+#    define UDP_SEGMENT 103
+#  endif
+#  ifndef UDP_GRO
+#    define UDP_GRO 104
+#  endif
+#  ifndef SO_ATTACH_REUSEPORT_CBPF
+#    define SO_ATTACH_REUSEPORT_CBPF 51
+#  endif
+#endif
+
 namespace nsuv {
 
 #define NSUV_CAST_NULLPTR static_cast<void*>(nullptr)
@@ -174,6 +281,62 @@ const sockaddr* ns_connect<H_T>::sockaddr() {
 }
 
 
+/* ns_shared_buf */
+
+ns_shared_buf* ns_shared_buf::create(size_t len) {
+  if (len > SIZE_MAX - sizeof(ns_shared_buf))
+    return nullptr;
+  void* mem = ::operator new(sizeof(ns_shared_buf) + len, std::nothrow);
+  if (mem == nullptr)
+    return nullptr;
+  return new (mem) ns_shared_buf(len);
+}
+
+ns_shared_buf* ns_shared_buf::create(const char* data, size_t len) {
+  ns_shared_buf* buf = create(len);
+  if (buf != nullptr && len > 0)
+    memcpy(buf->data(), data, len);
+  return buf;
+}
+
+char* ns_shared_buf::data() {
+  // The data is allocated right after the header.
+  return reinterpret_cast<char*>(this + 1);
+}
+
+size_t ns_shared_buf::size() {
+  return len_;
+}
+
+uv_buf_t ns_shared_buf::buf() {
+  uv_buf_t buf;
+
+  // Not uv_buf_init(), which takes an unsigned int length.
+  buf.base = data();
+#if defined(_WIN32)
+  buf.len = static_cast<ULONG>(len_ > UINT_MAX ? UINT_MAX : len_);
+#else
+  buf.len = len_;
+#endif
+  return buf;
+}
+
+void ns_shared_buf::ref() {
+  refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ns_shared_buf::unref() {
+  if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+  this->~ns_shared_buf();
+  ::operator delete(this);
+}
+
+size_t ns_shared_buf::ref_count() {
+  return refs_.load(std::memory_order_relaxed);
+}
+
+
 /* ns_write */
 
 template <class H_T>
@@ -228,6 +391,58 @@ int ns_write<H_T>::init(const std::vector<uv_buf_t>& bufs,
   return bufs_.replace(bufs.data(), bufs.size());
 }
 
+template <class H_T>
+void ns_write<H_T>::take_payload_(util::write_payload* payload) {
+  *payload = std::move(payload_);
+}
+
+template <class H_T>
+int ns_write<H_T>::own_(ns_shared_buf* payload, uv_buf_t* buf) {
+  payload->ref();
+  payload_.reset(payload, [](void* p) {
+    static_cast<ns_shared_buf*>(p)->unref();
+  });
+  *buf = payload->buf();
+  return NSUV_OK;
+}
+
+template <class H_T>
+int ns_write<H_T>::own_(std::string&& payload, uv_buf_t* buf) {
+  // Moved to the heap, since short strings keep their data inline.
+  auto* str = new (std::nothrow) std::string(std::move(payload));
+  if (str == nullptr)
+    return UV_ENOMEM;
+  payload_.reset(str, [](void* p) {
+    delete static_cast<std::string*>(p);
+  });
+  *buf = uv_buf_init(&(*str)[0], str->size());
+  return NSUV_OK;
+}
+
+template <class H_T>
+int ns_write<H_T>::own_(std::vector<char>&& payload, uv_buf_t* buf) {
+  auto* vec = new (std::nothrow) std::vector<char>(std::move(payload));
+  if (vec == nullptr)
+    return UV_ENOMEM;
+  payload_.reset(vec, [](void* p) {
+    delete static_cast<std::vector<char>*>(p);
+  });
+  *buf = uv_buf_init(vec->data(), vec->size());
+  return NSUV_OK;
+}
+
+template <class H_T>
+int ns_write<H_T>::own_(std::unique_ptr<char[]> payload,
+                        size_t len,
+                        uv_buf_t* buf) {
+  char* ptr = payload.release();
+  payload_.reset(ptr, [](void* p) {
+    delete[] static_cast<char*>(p);
+  });
+  *buf = uv_buf_init(ptr, len);
+  return NSUV_OK;
+}
+
 template <class H_T>
 const uv_buf_t* ns_write<H_T>::bufs() {
   return bufs_.data();
@@ -438,6 +653,7 @@ void ns_addrinfo::addrinfo_proxy_(uv_getaddrinfo_t* req,
                                   struct addrinfo*) {
   auto* ai_req = ns_addrinfo::cast(req);
   auto* cb_ = reinterpret_cast<CB_T>(ai_req->req_cb_);
+  NSUV_TRACE_REQ("addrinfo", req, cb_);
   cb_(ai_req, status);
 }
 
@@ -447,6 +663,7 @@ void ns_addrinfo::addrinfo_proxy_(uv_getaddrinfo_t* req,
                                   struct addrinfo*) {
   auto* ai_req = ns_addrinfo::cast(req);
   auto* cb_ = reinterpret_cast<CB_T>(ai_req->req_cb_);
+  NSUV_TRACE_REQ("addrinfo", req, cb_);
   cb_(ai_req, status, static_cast<D_T*>(ai_req->req_cb_data_));
 }
 
@@ -456,6 +673,7 @@ void ns_addrinfo::addrinfo_proxy_wp_(uv_getaddrinfo_t* req,
                                      struct addrinfo*) {
   auto* ai_req = ns_addrinfo::cast(req);
   auto* cb_ = reinterpret_cast<CB_T>(ai_req->req_cb_);
+  NSUV_TRACE_REQ("addrinfo", req, cb_);
   auto data = ai_req->req_cb_wp_.lock();
   cb_(ai_req, status, std::static_pointer_cast<D_T>(data));
 }
@@ -463,6 +681,11 @@ void ns_addrinfo::addrinfo_proxy_wp_(uv_getaddrinfo_t* req,
 
 /* ns_fs */
 
+ns_fs::~ns_fs() {
+  if (needs_cleanup_)
+    cleanup();
+}
+
 uv_fs_type ns_fs::get_type() {
   return uv_fs_get_type(this);
 }
@@ -488,47 +711,83 @@ uv_stat_t* ns_fs::get_statbuf() {
 }
 
 void ns_fs::cleanup() {
-  return uv_fs_req_cleanup(this);
+  needs_cleanup_ = false;
+  uv_fs_req_cleanup(this);
 }
 
 int ns_fs::scandir_next(uv_dirent_t* ent) {
   return uv_fs_scandir_next(this, ent);
 }
 
+ns_histogram ns_fs::get_stats(uv_fs_type type) {
+  return histogram_(type)->get();
+}
+
+void ns_fs::reset_stats() {
+  for (size_t i = 0; i < kFsTypes; i++)
+    histogram_(static_cast<uv_fs_type>(static_cast<int>(i) - 1))->reset();
+}
+
+util::histogram* ns_fs::histogram_(uv_fs_type type) {
+  static util::histogram histograms[kFsTypes];
+  // UV_FS_UNKNOWN is -1. Types added after kFsTypes share its slot.
+  size_t i = static_cast<size_t>(type + 1);
+  return &histograms[i < kFsTypes ? i : 0];
+}
+
+void ns_fs::reset_() {
+  if (needs_cleanup_)
+    cleanup();
+  needs_cleanup_ = true;
+}
+
+int ns_fs::submitted_(int r) {
+  in_flight_ = r == 0;
+  return r;
+}
+
 #define NSUV_ARGS(...) __VA_ARGS__
 #define NSUV_STRIP(X) X
 #define NSUV_PASS(X) NSUV_STRIP(NSUV_ARGS X)
 #define NSUV_FS_FN(name, P1, P2)                                               \
   int ns_fs::name(NSUV_PASS(P1)) {                                             \
+    reset_();                                                                  \
     return uv_fs_##name(nullptr, this, NSUV_PASS(P2), nullptr);                \
   }                                                                            \
   int ns_fs::name(uv_loop_t* loop, NSUV_PASS(P1), ns_fs_cb cb) {               \
+    reset_();                                                                  \
     ns_base_req<uv_fs_t, ns_fs>::init(loop, cb);                               \
-    return uv_fs_##name(loop,                                                  \
-                        this,                                                  \
-                        NSUV_PASS(P2),                                         \
-                        util::check_null_cb(cb, &cb_proxy_<decltype(cb)>));    \
+    pool_timer_.submit();                                                      \
+    return submitted_(uv_fs_##name(                                            \
+        loop,                                                                  \
+        this,                                                                  \
+        NSUV_PASS(P2),                                                         \
+        util::check_null_cb(cb, &cb_proxy_<decltype(cb)>)));                   \
   }                                                                            \
   template <typename D_T>                                                      \
   int ns_fs::name(uv_loop_t* loop, NSUV_PASS(P1), ns_fs_cb_d<D_T> cb, D_T* d) {\
+    reset_();                                                                  \
     ns_base_req<uv_fs_t, ns_fs>::init(loop, cb, d);                            \
-    return uv_fs_##name(                                                       \
-      loop,                                                                    \
-      this,                                                                    \
-      NSUV_PASS(P2),                                                           \
-      util::check_null_cb(cb, &cb_proxy_<decltype(cb), D_T>));                 \
+    pool_timer_.submit();                                                      \
+    return submitted_(uv_fs_##name(                                            \
+        loop,                                                                  \
+        this,                                                                  \
+        NSUV_PASS(P2),                                                         \
+        util::check_null_cb(cb, &cb_proxy_<decltype(cb), D_T>)));              \
   }                                                                            \
   template <typename D_T>                                                      \
   int ns_fs::name(uv_loop_t* loop,                                             \
                   NSUV_PASS(P1),                                               \
                   ns_fs_cb_wp<D_T> cb,                                         \
                   std::weak_ptr<D_T> d) {                                      \
+    reset_();                                                                  \
     ns_base_req<uv_fs_t, ns_fs>::init(loop, cb, d);                            \
-    return uv_fs_##name(                                                       \
-      loop,                                                                    \
-      this,                                                                    \
-      NSUV_PASS(P2),                                                           \
-      util::check_null_cb(cb, &cb_proxy_wp_<decltype(cb), D_T>));              \
+    pool_timer_.submit();                                                      \
+    return submitted_(uv_fs_##name(                                            \
+        loop,                                                                  \
+        this,                                                                  \
+        NSUV_PASS(P2),                                                         \
+        util::check_null_cb(cb, &cb_proxy_wp_<decltype(cb), D_T>)));           \
   }
 
 NSUV_FS_FN(close, (uv_file file), (file))
@@ -606,23 +865,39 @@ NSUV_FS_FN(statfs, (const char* path), (path))
 template <typename CB_T>
 void ns_fs::cb_proxy_(uv_fs_t* req) {
   auto* fs_req = ns_fs::cast(req);
+  fs_req->pool_timer_.complete(histogram_(fs_req->fs_type));
   auto* cb = reinterpret_cast<CB_T>(fs_req->req_cb_);
+  // cb may delete a request that isn't pooled.
+  ns_fs_pool* pool = fs_req->pool_;
+  fs_req->in_flight_ = false;
+  NSUV_TRACE_REQ("fs", req, cb);
   cb(fs_req);
+  recycle_(pool, fs_req);
 }
 
 template <typename CB_T, typename D_T>
 void ns_fs::cb_proxy_(uv_fs_t* req) {
   auto* fs_req = ns_fs::cast(req);
+  fs_req->pool_timer_.complete(histogram_(fs_req->fs_type));
   auto* cb = reinterpret_cast<CB_T>(fs_req->req_cb_);
+  ns_fs_pool* pool = fs_req->pool_;
+  fs_req->in_flight_ = false;
+  NSUV_TRACE_REQ("fs", req, cb);
   cb(fs_req, static_cast<D_T*>(fs_req->req_cb_data_));
+  recycle_(pool, fs_req);
 }
 
 template <typename CB_T, typename D_T>
 void ns_fs::cb_proxy_wp_(uv_fs_t* req) {
   auto* fs_req = ns_fs::cast(req);
+  fs_req->pool_timer_.complete(histogram_(fs_req->fs_type));
   auto* cb = reinterpret_cast<CB_T>(fs_req->req_cb_);
+  ns_fs_pool* pool = fs_req->pool_;
+  fs_req->in_flight_ = false;
+  NSUV_TRACE_REQ("fs", req, cb);
   auto data = fs_req->req_cb_wp_.lock();
   cb(fs_req, std::static_pointer_cast<D_T>(data));
+  recycle_(pool, fs_req);
 }
 
 
@@ -689,6 +964,7 @@ void ns_random::random_proxy_(uv_random_t* req,
                               size_t buflen) {
   auto* r_req = ns_random::cast(req);
   auto* cb = reinterpret_cast<CB_T>(r_req->req_cb_);
+  NSUV_TRACE_REQ("random", req, cb);
   cb(r_req, status, buf, buflen);
 }
 
@@ -699,6 +975,7 @@ void ns_random::random_proxy_(uv_random_t* req,
                               size_t buflen) {
   auto* r_req = ns_random::cast(req);
   auto* cb = reinterpret_cast<CB_T>(r_req->req_cb_);
+  NSUV_TRACE_REQ("random", req, cb);
   cb(r_req, status, buf, buflen, static_cast<D_T*>(r_req->req_cb_data_));
 }
 
@@ -709,6 +986,7 @@ void ns_random::random_proxy_wp_(uv_random_t* req,
                                  size_t buflen) {
   auto* r_req = ns_random::cast(req);
   auto* cb = reinterpret_cast<CB_T>(r_req->req_cb_);
+  NSUV_TRACE_REQ("random", req, cb);
   auto data = r_req->req_cb_wp_.lock();
   cb(r_req, status, buf, buflen, std::static_pointer_cast<D_T>(data));
 }
@@ -722,6 +1000,7 @@ int ns_work::queue_work(uv_loop_t* loop,
   work_cb_ptr_ = reinterpret_cast<void (*)()>(work_cb);
   after_cb_ptr_ = reinterpret_cast<void (*)()>(after_cb);
 
+  pool_timer_.submit();
   return uv_queue_work(
       loop,
       this,
@@ -738,6 +1017,8 @@ int ns_work::queue_work(uv_loop_t* loop,
   after_cb_ptr_ = reinterpret_cast<void (*)()>(after_cb);
   cb_data_ = data;
 
+  pool_timer_.submit();
+
   // Need a nullptr check in case someone decides to static_cast a nullptr to
   // the work_cb sig. Yes the user shouldn't do this but still need to check.
   return uv_queue_work(
@@ -756,6 +1037,8 @@ int ns_work::queue_work(uv_loop_t* loop,
   after_cb_ptr_ = reinterpret_cast<void (*)()>(after_cb);
   cb_wp_ = data;
 
+  pool_timer_.submit();
+
   // Need a nullptr check in case someone decides to static_cast a nullptr to
   // the work_cb sig. Yes the user shouldn't do this but still need to check.
   return uv_queue_work(
@@ -768,6 +1051,7 @@ int ns_work::queue_work(uv_loop_t* loop,
 int ns_work::queue_work(uv_loop_t* loop, ns_work_cb work_cb) {
   work_cb_ptr_ = reinterpret_cast<void (*)()>(work_cb);
 
+  pool_timer_.submit();
   return uv_queue_work(
       loop,
       this,
@@ -782,6 +1066,7 @@ int ns_work::queue_work(uv_loop_t* loop,
   work_cb_ptr_ = reinterpret_cast<void (*)()>(work_cb);
   cb_data_ = data;
 
+  pool_timer_.submit();
   return uv_queue_work(
       loop,
       this,
@@ -796,6 +1081,7 @@ int ns_work::queue_work(uv_loop_t* loop,
   work_cb_ptr_ = reinterpret_cast<void (*)()>(work_cb);
   cb_wp_ = data;
 
+  pool_timer_.submit();
   return uv_queue_work(
       loop,
       this,
@@ -807,13 +1093,18 @@ template <typename CB_T>
 void ns_work::work_proxy_(uv_work_t* req) {
   auto* w_req = ns_work::cast(req);
   auto* cb = reinterpret_cast<CB_T>(w_req->work_cb_ptr_);
+  NSUV_TRACE_REQ("work", req, cb);
+  w_req->pool_timer_.start(histograms_());
   cb(w_req);
+  w_req->pool_timer_.end(histograms_());
 }
 
 template <typename CB_T>
 void ns_work::after_proxy_(uv_work_t* req, int status) {
   auto* w_req = ns_work::cast(req);
+  w_req->pool_timer_.complete(&histograms_()->total);
   auto* cb = reinterpret_cast<CB_T>(w_req->after_cb_ptr_);
+  NSUV_TRACE_REQ("after_work", req, cb);
   cb(w_req, status);
 }
 
@@ -821,33 +1112,57 @@ template <typename CB_T, typename D_T>
 void ns_work::work_proxy_(uv_work_t* req) {
   auto* w_req = ns_work::cast(req);
   auto* cb = reinterpret_cast<CB_T>(w_req->work_cb_ptr_);
+  NSUV_TRACE_REQ("work", req, cb);
+  w_req->pool_timer_.start(histograms_());
   cb(w_req, static_cast<D_T*>(w_req->cb_data_));
+  w_req->pool_timer_.end(histograms_());
 }
 
 template <typename CB_T, typename D_T>
 void ns_work::work_proxy_wp_(uv_work_t* req) {
   auto* w_req = ns_work::cast(req);
   auto* cb = reinterpret_cast<CB_T>(w_req->work_cb_ptr_);
+  NSUV_TRACE_REQ("work", req, cb);
   auto data = w_req->cb_wp_.lock();
+  w_req->pool_timer_.start(histograms_());
   cb(w_req, std::static_pointer_cast<D_T>(data));
+  w_req->pool_timer_.end(histograms_());
 }
 
 template <typename CB_T, typename D_T>
 void ns_work::after_proxy_(uv_work_t* req, int status) {
   auto* w_req = ns_work::cast(req);
+  w_req->pool_timer_.complete(&histograms_()->total);
   auto* cb = reinterpret_cast<CB_T>(w_req->after_cb_ptr_);
+  NSUV_TRACE_REQ("after_work", req, cb);
   cb(w_req, status, static_cast<D_T*>(w_req->cb_data_));
 }
 
 template <typename CB_T, typename D_T>
 void ns_work::after_proxy_wp_(uv_work_t* req, int status) {
   auto* w_req = ns_work::cast(req);
+  w_req->pool_timer_.complete(&histograms_()->total);
   auto* cb = reinterpret_cast<CB_T>(w_req->after_cb_ptr_);
+  NSUV_TRACE_REQ("after_work", req, cb);
   auto data = w_req->cb_wp_.lock();
   cb(w_req, status, std::static_pointer_cast<D_T>(data));
 }
 
 
+ns_threadpool_stats ns_work::get_stats() {
+  return histograms_()->get();
+}
+
+void ns_work::reset_stats() {
+  histograms_()->reset();
+}
+
+util::pool_histograms* ns_work::histograms_() {
+  static util::pool_histograms histograms;
+  return &histograms;
+}
+
+
 /* ns_handle */
 
 template <class UV_T, class H_T>
@@ -907,14 +1222,14 @@ bool ns_handle<UV_T, H_T>::is_active() {
 
 template <class UV_T, class H_T>
 void ns_handle<UV_T, H_T>::close() {
-  uv_close(base_handle(), nullptr);
+  uv_close(base_handle(), &closed_proxy_);
 }
 
 template <class UV_T, class H_T>
 void ns_handle<UV_T, H_T>::close(ns_close_cb cb) {
   close_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
   uv_close(base_handle(),
-           util::check_null_cb(cb, &close_proxy_<decltype(cb)>));
+           cb == nullptr ? &closed_proxy_ : &close_proxy_<decltype(cb)>);
 }
 
 template <class UV_T, class H_T>
@@ -923,7 +1238,7 @@ void ns_handle<UV_T, H_T>::close(ns_close_cb_d<D_T> cb, D_T* data) {
   close_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
   close_cb_data_ = data;
   uv_close(base_handle(),
-           util::check_null_cb(cb, &close_proxy_<decltype(cb), D_T>));
+           cb == nullptr ? &closed_proxy_ : &close_proxy_<decltype(cb), D_T>);
 }
 
 template <class UV_T, class H_T>
@@ -937,8 +1252,9 @@ void ns_handle<UV_T, H_T>::close(ns_close_cb_wp<D_T> cb,
                                  std::weak_ptr<D_T> data) {
   close_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
   close_cb_wp_ = data;
-  uv_close(base_handle(),
-           util::check_null_cb(cb, &close_proxy_wp_<decltype(cb), D_T>));
+  uv_close(
+      base_handle(),
+      cb == nullptr ? &closed_proxy_ : &close_proxy_wp_<decltype(cb), D_T>);
 }
 
 template <class UV_T, class H_T>
@@ -986,6 +1302,8 @@ template <typename CB_T>
 void ns_handle<UV_T, H_T>::close_proxy_(uv_handle_t* handle) {
   H_T* wrap = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(wrap->close_cb_ptr_);
+  NSUV_TRACE_HANDLE("close", handle, cb_);
+  wrap->closed_();
   cb_(wrap);
 }
 
@@ -994,6 +1312,8 @@ template <typename CB_T, typename D_T>
 void ns_handle<UV_T, H_T>::close_proxy_(uv_handle_t* handle) {
   H_T* wrap = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(wrap->close_cb_ptr_);
+  NSUV_TRACE_HANDLE("close", handle, cb_);
+  wrap->closed_();
   cb_(wrap, static_cast<D_T*>(wrap->close_cb_data_));
 }
 
@@ -1002,18 +1322,45 @@ template <typename CB_T, typename D_T>
 void ns_handle<UV_T, H_T>::close_proxy_wp_(uv_handle_t* handle) {
   H_T* wrap = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(wrap->close_cb_ptr_);
+  NSUV_TRACE_HANDLE("close", handle, cb_);
+  wrap->closed_();
   auto data = wrap->close_cb_wp_.lock();
   cb_(wrap, std::static_pointer_cast<D_T>(data));
 }
 
 template <class UV_T, class H_T>
 void ns_handle<UV_T, H_T>::close_delete_cb_(uv_handle_t* handle) {
+  H_T::cast(handle)->closed_();
   delete H_T::cast(handle);
 }
 
+template <class UV_T, class H_T>
+void ns_handle<UV_T, H_T>::closed_() {
+}
+
+template <class UV_T, class H_T>
+void ns_handle<UV_T, H_T>::closed_proxy_(uv_handle_t* handle) {
+  H_T::cast(handle)->closed_();
+}
+
 
 /* ns_stream */
 
+template <class UV_T, class H_T>
+ns_stream<UV_T, H_T>::~ns_stream() {
+  while (write_pool_ != nullptr) {
+    ns_write<H_T>* req = write_pool_;
+    write_pool_ = req->pool_next_;
+    delete req;
+  }
+
+  if (pump_ != nullptr) {
+    pump_->src = nullptr;
+    if (pump_->inflight == 0)
+      pump_free_(pump_);
+  }
+}
+
 template <class UV_T, class H_T>
 uv_stream_t* ns_stream<UV_T, H_T>::base_stream() {
   return reinterpret_cast<uv_stream_t*>(this->uv_handle());
@@ -1024,6 +1371,16 @@ size_t ns_stream<UV_T, H_T>::get_write_queue_size() {
   return uv_stream_get_write_queue_size(base_stream());
 }
 
+template <class UV_T, class H_T>
+ns_io_stats ns_stream<UV_T, H_T>::get_stats() {
+  return stats_.get();
+}
+
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::reset_stats() {
+  stats_.reset();
+}
+
 template <class UV_T, class H_T>
 int ns_stream<UV_T, H_T>::is_readable() {
   return uv_is_readable(base_stream());
@@ -1131,6 +1488,7 @@ int ns_stream<UV_T, H_T>::read_start(ns_alloc_cb_wp<D_T> alloc_cb,
 
 template <class UV_T, class H_T>
 int ns_stream<UV_T, H_T>::read_stop() {
+  ring_paused_ = false;
   return uv_read_stop(base_stream());
 }
 
@@ -1143,11 +1501,7 @@ int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
   if (ret != NSUV_OK)
     return ret;
 
-  return uv_write(req->uv_req(),
-                  base_stream(),
-                  req->bufs(),
-                  req->size(),
-                  util::check_null_cb(cb, &write_proxy_<decltype(cb)>));
+  return write_(req, util::check_null_cb(cb, &write_proxy_<decltype(cb)>));
 }
 
 template <class UV_T, class H_T>
@@ -1158,11 +1512,7 @@ int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
   if (ret != NSUV_OK)
     return ret;
 
-  return uv_write(req->uv_req(),
-                  base_stream(),
-                  req->bufs(),
-                  req->size(),
-                  util::check_null_cb(cb, &write_proxy_<decltype(cb)>));
+  return write_(req, util::check_null_cb(cb, &write_proxy_<decltype(cb)>));
 }
 
 template <class UV_T, class H_T>
@@ -1176,11 +1526,9 @@ int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
   if (ret != NSUV_OK)
     return ret;
 
-  return uv_write(req->uv_req(),
-                  base_stream(),
-                  req->bufs(),
-                  req->size(),
-                  util::check_null_cb(cb, &write_proxy_<decltype(cb), D_T>));
+  return write_(
+      req,
+      util::check_null_cb(cb, &write_proxy_<decltype(cb), D_T>));
 }
 
 template <class UV_T, class H_T>
@@ -1203,11 +1551,9 @@ int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
   if (ret != NSUV_OK)
     return ret;
 
-  return uv_write(req->uv_req(),
-                  base_stream(),
-                  req->bufs(),
-                  req->size(),
-                  util::check_null_cb(cb, &write_proxy_wp_<decltype(cb), D_T>));
+  return write_(
+      req,
+      util::check_null_cb(cb, &write_proxy_wp_<decltype(cb), D_T>));
 }
 
 template <class UV_T, class H_T>
@@ -1220,11 +1566,9 @@ int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
   if (ret != NSUV_OK)
     return ret;
 
-  return uv_write(req->uv_req(),
-                  base_stream(),
-                  req->bufs(),
-                  req->size(),
-                  util::check_null_cb(cb, &write_proxy_<decltype(cb), D_T>));
+  return write_(
+      req,
+      util::check_null_cb(cb, &write_proxy_<decltype(cb), D_T>));
 }
 
 template <class UV_T, class H_T>
@@ -1245,11 +1589,9 @@ int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
   if (ret != NSUV_OK)
     return ret;
 
-  return uv_write(req->uv_req(),
-                  base_stream(),
-                  req->bufs(),
-                  req->size(),
-                  util::check_null_cb(cb, &write_proxy_wp_<decltype(cb), D_T>));
+  return write_(
+      req,
+      util::check_null_cb(cb, &write_proxy_wp_<decltype(cb), D_T>));
 }
 
 template <class UV_T, class H_T>
@@ -1257,6 +1599,7 @@ template <typename CB_T>
 void ns_stream<UV_T, H_T>::listen_proxy_(uv_stream_t* handle, int status) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->listen_cb_ptr_);
+  NSUV_TRACE_HANDLE("listen", handle, cb_);
   cb_(server, status);
 }
 
@@ -1265,6 +1608,7 @@ template <typename CB_T, typename D_T>
 void ns_stream<UV_T, H_T>::listen_proxy_(uv_stream_t* handle, int status) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->listen_cb_ptr_);
+  NSUV_TRACE_HANDLE("listen", handle, cb_);
   cb_(server, status, static_cast<D_T*>(server->listen_cb_data_));
 }
 
@@ -1273,6 +1617,7 @@ template <typename CB_T, typename D_T>
 void ns_stream<UV_T, H_T>::listen_proxy_wp_(uv_stream_t* handle, int status) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->listen_cb_ptr_);
+  NSUV_TRACE_HANDLE("listen", handle, cb_);
   auto data = server->listen_cb_wp_.lock();
   cb_(server, status, std::static_pointer_cast<D_T>(data));
 }
@@ -1284,6 +1629,7 @@ void ns_stream<UV_T, H_T>::alloc_proxy_(uv_handle_t* handle,
                                         uv_buf_t* buf) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->alloc_cb_ptr_);
+  NSUV_TRACE_HANDLE("alloc", handle, cb_);
   cb_(server, suggested_size, buf);
 }
 
@@ -1294,6 +1640,7 @@ void ns_stream<UV_T, H_T>::alloc_proxy_(uv_handle_t* handle,
                                         uv_buf_t* buf) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->alloc_cb_ptr_);
+  NSUV_TRACE_HANDLE("alloc", handle, cb_);
   cb_(server, suggested_size, buf, static_cast<D_T*>(server->read_cb_data_));
 }
 
@@ -1304,6 +1651,7 @@ void ns_stream<UV_T, H_T>::alloc_proxy_wp_(uv_handle_t* handle,
                                            uv_buf_t* buf) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->alloc_cb_ptr_);
+  NSUV_TRACE_HANDLE("alloc", handle, cb_);
   auto data = server->read_cb_wp_.lock();
   cb_(server, suggested_size, buf, std::static_pointer_cast<D_T>(data));
 }
@@ -1315,7 +1663,11 @@ void ns_stream<UV_T, H_T>::read_proxy_(uv_stream_t* handle,
                                        const uv_buf_t* buf) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  server->stats_.read(nread);
+  uint64_t start = server->stats_.cb_start();
   cb_(server, nread, buf);
+  server->stats_.cb_end(start);
 }
 
 template <class UV_T, class H_T>
@@ -1325,7 +1677,11 @@ void ns_stream<UV_T, H_T>::read_proxy_(uv_stream_t* handle,
                                        const uv_buf_t* buf) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  server->stats_.read(nread);
+  uint64_t start = server->stats_.cb_start();
   cb_(server, nread, buf, static_cast<D_T*>(server->read_cb_data_));
+  server->stats_.cb_end(start);
 }
 
 template <class UV_T, class H_T>
@@ -1335,649 +1691,4612 @@ void ns_stream<UV_T, H_T>::read_proxy_wp_(uv_stream_t* handle,
                                           const uv_buf_t* buf) {
   auto* server = H_T::cast(handle);
   auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
   auto data = server->read_cb_wp_.lock();
+  server->stats_.read(nread);
+  uint64_t start = server->stats_.cb_start();
   cb_(server, nread, buf, std::static_pointer_cast<D_T>(data));
+  server->stats_.cb_end(start);
 }
 
 template <class UV_T, class H_T>
 template <typename CB_T>
 void ns_stream<UV_T, H_T>::write_proxy_(uv_write_t* uv_req, int status) {
   auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
   auto* cb_ = reinterpret_cast<CB_T>(wreq->req_cb_);
+  NSUV_TRACE_REQ("write", uv_req, cb_);
+  util::write_payload payload;
+  wreq->take_payload_(&payload);
+  stream->stats_.write_cb();
+  uint64_t start = stream->stats_.cb_start();
   cb_(wreq, status);
+  stream->stats_.cb_end(start);
+  stream->check_low_watermark_();
 }
 
 template <class UV_T, class H_T>
 template <typename CB_T, typename D_T>
 void ns_stream<UV_T, H_T>::write_proxy_(uv_write_t* uv_req, int status) {
   auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
   auto* cb_ = reinterpret_cast<CB_T>(wreq->req_cb_);
+  NSUV_TRACE_REQ("write", uv_req, cb_);
+  util::write_payload payload;
+  wreq->take_payload_(&payload);
+  stream->stats_.write_cb();
+  uint64_t start = stream->stats_.cb_start();
   cb_(wreq, status, static_cast<D_T*>(wreq->req_cb_data_));
+  stream->stats_.cb_end(start);
+  stream->check_low_watermark_();
 }
 
 template <class UV_T, class H_T>
 template <typename CB_T, typename D_T>
 void ns_stream<UV_T, H_T>::write_proxy_wp_(uv_write_t* uv_req, int status) {
   auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
   auto* cb_ = reinterpret_cast<CB_T>(wreq->req_cb_);
+  NSUV_TRACE_REQ("write", uv_req, cb_);
   auto data = wreq->req_cb_wp_.lock();
+  util::write_payload payload;
+  wreq->take_payload_(&payload);
+  stream->stats_.write_cb();
+  uint64_t start = stream->stats_.cb_start();
   cb_(wreq, status, std::static_pointer_cast<D_T>(data));
+  stream->stats_.cb_end(start);
+  stream->check_low_watermark_();
 }
 
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::write_drain_proxy_(uv_write_t* uv_req, int) {
+  auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
+  wreq->payload_.reset();
+  stream->check_low_watermark_();
+}
 
-/* ns_async */
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write_(ns_write<H_T>* req, uv_write_cb cb) {
+  // Writes without a callback still need to report back so the low
+  // watermark can be checked and any owned payload released.
+  if (cb == nullptr && (wm_high_ > 0 || !req->payload_.empty()))
+    cb = &write_drain_proxy_;
 
-int ns_async::init(uv_loop_t* loop, ns_async_cb cb) {
-  async_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  async_cb_data_ = nullptr;
+  int r = uv_write(req->uv_req(), base_stream(), req->bufs(), req->size(), cb);
+  if (r == 0) {
+    stats_.write(req->bufs(), req->size(), [this]() {
+      return get_write_queue_size();
+    });
+    check_high_watermark_();
+  } else {
+    req->payload_.reset();
+  }
+  return r;
+}
 
-  return uv_async_init(loop,
-                       uv_handle(),
-                       util::check_null_cb(cb, &async_proxy_<decltype(cb)>));
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                ns_shared_buf* buf,
+                                ns_write_cb cb) {
+  uv_buf_t b;
+  int r = req->own_(buf, &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(
+      req, b, cb, NSUV_CAST_NULLPTR, &write_proxy_<decltype(cb)>);
 }
 
+template <class UV_T, class H_T>
 template <typename D_T>
-int ns_async::init(uv_loop_t* loop, ns_async_cb_d<D_T> cb, D_T* data) {
-  async_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  async_cb_data_ = data;
-
-  return uv_async_init(
-    loop,
-    uv_handle(),
-    util::check_null_cb(cb, &async_proxy_<decltype(cb), D_T>));
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                ns_shared_buf* buf,
+                                ns_write_cb_d<D_T> cb,
+                                D_T* data) {
+  uv_buf_t b;
+  int r = req->own_(buf, &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_<decltype(cb), D_T>);
 }
 
-int ns_async::init(uv_loop_t* loop,
-                   void (*cb)(ns_async*, void*),
-                   std::nullptr_t) {
-  return init(loop, cb, NSUV_CAST_NULLPTR);
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                ns_shared_buf* buf,
+                                void (*cb)(ns_write<H_T>*, int, void*),
+                                std::nullptr_t) {
+  return write(req, buf, cb, NSUV_CAST_NULLPTR);
 }
 
+template <class UV_T, class H_T>
 template <typename D_T>
-int ns_async::init(uv_loop_t* loop,
-                   ns_async_cb_wp<D_T> cb,
-                   std::weak_ptr<D_T> data) {
-  async_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  async_cb_wp_ = data;
-
-  return uv_async_init(
-    loop,
-    uv_handle(),
-    util::check_null_cb(cb, &async_proxy_wp_<decltype(cb), D_T>));
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                ns_shared_buf* buf,
+                                ns_write_cb_wp<D_T> cb,
+                                std::weak_ptr<D_T> data) {
+  uv_buf_t b;
+  int r = req->own_(buf, &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_wp_<decltype(cb), D_T>);
 }
 
-int ns_async::send() {
-  return uv_async_send(uv_handle());
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::string&& payload,
+                                ns_write_cb cb) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(
+      req, b, cb, NSUV_CAST_NULLPTR, &write_proxy_<decltype(cb)>);
 }
 
-template <typename CB_T>
-void ns_async::async_proxy_(uv_async_t* handle) {
-  ns_async* wrap = ns_async::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->async_cb_ptr_);
-  cb_(wrap);
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::string&& payload,
+                                ns_write_cb_d<D_T> cb,
+                                D_T* data) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_<decltype(cb), D_T>);
 }
 
-template <typename CB_T, typename D_T>
-void ns_async::async_proxy_(uv_async_t* handle) {
-  auto* wrap = ns_async::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->async_cb_ptr_);
-  cb_(wrap, static_cast<D_T*>(wrap->async_cb_data_));
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::string&& payload,
+                                void (*cb)(ns_write<H_T>*, int, void*),
+                                std::nullptr_t) {
+  return write(req, std::move(payload), cb, NSUV_CAST_NULLPTR);
 }
 
-template <typename CB_T, typename D_T>
-void ns_async::async_proxy_wp_(uv_async_t* handle) {
-  auto* wrap = ns_async::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->async_cb_ptr_);
-  auto data = wrap->async_cb_wp_.lock();
-  cb_(wrap, std::static_pointer_cast<D_T>(data));
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::string&& payload,
+                                ns_write_cb_wp<D_T> cb,
+                                std::weak_ptr<D_T> data) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_wp_<decltype(cb), D_T>);
 }
 
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::vector<char>&& payload,
+                                ns_write_cb cb) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(
+      req, b, cb, NSUV_CAST_NULLPTR, &write_proxy_<decltype(cb)>);
+}
 
-/* ns_poll */
-
-int ns_poll::init(uv_loop_t* loop, int fd) {
-  poll_cb_ptr_ = nullptr;
-  poll_cb_data_ = nullptr;
-  return uv_poll_init(loop, uv_handle(), fd);
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::vector<char>&& payload,
+                                ns_write_cb_d<D_T> cb,
+                                D_T* data) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_<decltype(cb), D_T>);
 }
 
-int ns_poll::init_socket(uv_loop_t* loop, uv_os_sock_t socket) {
-  poll_cb_ptr_ = nullptr;
-  poll_cb_data_ = nullptr;
-  return uv_poll_init_socket(loop, uv_handle(), socket);
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::vector<char>&& payload,
+                                void (*cb)(ns_write<H_T>*, int, void*),
+                                std::nullptr_t) {
+  return write(req, std::move(payload), cb, NSUV_CAST_NULLPTR);
 }
 
-int ns_poll::start(int events, ns_poll_cb cb) {
-  poll_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::vector<char>&& payload,
+                                ns_write_cb_wp<D_T> cb,
+                                std::weak_ptr<D_T> data) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_wp_<decltype(cb), D_T>);
+}
 
-  return uv_poll_start(uv_handle(),
-                       events,
-                       util::check_null_cb(cb, &poll_proxy_<decltype(cb)>));
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::unique_ptr<char[]> payload,
+                                size_t len,
+                                ns_write_cb cb) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), len, &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(
+      req, b, cb, NSUV_CAST_NULLPTR, &write_proxy_<decltype(cb)>);
 }
 
+template <class UV_T, class H_T>
 template <typename D_T>
-int ns_poll::start(int events,
-                   ns_poll_cb_d<D_T> cb,
-                   D_T* data) {
-  poll_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  poll_cb_data_ = data;
-
-  return uv_poll_start(
-    uv_handle(),
-    events,
-    util::check_null_cb(cb, &poll_proxy_<decltype(cb), D_T>));
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::unique_ptr<char[]> payload,
+                                size_t len,
+                                ns_write_cb_d<D_T> cb,
+                                D_T* data) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), len, &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_<decltype(cb), D_T>);
 }
 
-int ns_poll::start(int events,
-                   void (*cb)(ns_poll*, int, int, void*),
-                   std::nullptr_t) {
-  return start(events, cb, NSUV_CAST_NULLPTR);
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::unique_ptr<char[]> payload,
+                                size_t len,
+                                void (*cb)(ns_write<H_T>*, int, void*),
+                                std::nullptr_t) {
+  return write(req, std::move(payload), len, cb, NSUV_CAST_NULLPTR);
 }
 
+template <class UV_T, class H_T>
 template <typename D_T>
-int ns_poll::start(int events,
-                   ns_poll_cb_wp<D_T> cb,
-                   std::weak_ptr<D_T> data) {
-  poll_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  poll_cb_wp_ = data;
-
-  return uv_poll_start(
-    uv_handle(),
-    events,
-    util::check_null_cb(cb, &poll_proxy_wp_<decltype(cb), D_T>));
+int ns_stream<UV_T, H_T>::write(ns_write<H_T>* req,
+                                std::unique_ptr<char[]> payload,
+                                size_t len,
+                                ns_write_cb_wp<D_T> cb,
+                                std::weak_ptr<D_T> data) {
+  uv_buf_t b;
+  int r = req->own_(std::move(payload), len, &b);
+  if (r != NSUV_OK)
+    return r;
+  return write_owned_(req, b, cb, data, &write_proxy_wp_<decltype(cb), D_T>);
 }
 
-int ns_poll::stop() {
-  return uv_poll_stop(uv_handle());
-}
+template <class UV_T, class H_T>
+template <typename CB, typename D_T>
+int ns_stream<UV_T, H_T>::write_owned_(ns_write<H_T>* req,
+                                       uv_buf_t buf,
+                                       CB cb,
+                                       D_T data,
+                                       uv_write_cb proxy) {
+  int ret = req->init(&buf, 1, cb, data);
+  if (ret != NSUV_OK) {
+    req->payload_.reset();
+    return ret;
+  }
 
-template <typename CB_T>
-void ns_poll::poll_proxy_(uv_poll_t* handle, int poll, int events) {
-  ns_poll* wrap = ns_poll::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->poll_cb_ptr_);
-  cb_(wrap, poll, events);
+  return write_(req, util::check_null_cb(cb, proxy));
 }
 
-template <typename CB_T, typename D_T>
-void ns_poll::poll_proxy_(uv_poll_t* handle, int poll, int events) {
-  ns_poll* wrap = ns_poll::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->poll_cb_ptr_);
-  cb_(wrap, poll, events, static_cast<D_T*>(wrap->poll_cb_data_));
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::try_write(const uv_buf_t bufs[], size_t nbufs) {
+  int r = uv_try_write(base_stream(), bufs, nbufs);
+  stats_.try_write(r);
+  return r;
 }
 
-template <typename CB_T, typename D_T>
-void ns_poll::poll_proxy_wp_(uv_poll_t* handle, int poll, int events) {
-  ns_poll* wrap = ns_poll::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->poll_cb_ptr_);
-  auto data = wrap->poll_cb_wp_.lock();
-  cb_(wrap, poll, events, std::static_pointer_cast<D_T>(data));
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::try_write(const std::vector<uv_buf_t>& bufs) {
+  return try_write(bufs.data(), bufs.size());
 }
 
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write_fast(const uv_buf_t bufs[],
+                                     size_t nbufs,
+                                     ns_write_fast_cb cb) {
+  return write_fast_(bufs,
+                     nbufs,
+                     cb,
+                     NSUV_CAST_NULLPTR,
+                     &write_fast_proxy_<decltype(cb)>);
+}
 
-/* ns_tcp */
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::write_fast(const uv_buf_t bufs[],
+                                     size_t nbufs,
+                                     ns_write_fast_cb_d<D_T> cb,
+                                     D_T* data) {
+  return write_fast_(bufs,
+                     nbufs,
+                     cb,
+                     data,
+                     &write_fast_proxy_<decltype(cb), D_T>);
+}
 
-int ns_tcp::init(uv_loop_t* loop) {
-  return uv_tcp_init(loop, uv_handle());
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::write_fast(const uv_buf_t bufs[],
+                                     size_t nbufs,
+                                     void (*cb)(H_T*, int, void*),
+                                     std::nullptr_t) {
+  return write_fast(bufs, nbufs, cb, NSUV_CAST_NULLPTR);
 }
 
-int ns_tcp::init_ex(uv_loop_t* loop, unsigned int flags) {
-  return uv_tcp_init_ex(loop, uv_handle(), flags);
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::write_fast(const uv_buf_t bufs[],
+                                     size_t nbufs,
+                                     ns_write_fast_cb_wp<D_T> cb,
+                                     std::weak_ptr<D_T> data) {
+  return write_fast_(bufs,
+                     nbufs,
+                     cb,
+                     data,
+                     &write_fast_proxy_wp_<decltype(cb), D_T>);
 }
 
-int ns_tcp::open(uv_os_sock_t sock) {
-  return uv_tcp_open(uv_handle(), sock);
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::set_write_fast_sync(bool sync) {
+  write_fast_sync_ = sync;
 }
 
-int ns_tcp::nodelay(bool enable) {
-  return uv_tcp_nodelay(uv_handle(), enable);
+template <class UV_T, class H_T>
+template <typename CB, typename D_T>
+int ns_stream<UV_T, H_T>::write_fast_(const uv_buf_t bufs[],
+                                      size_t nbufs,
+                                      CB cb,
+                                      D_T data,
+                                      uv_write_cb proxy) {
+  size_t offset = 0;
+  size_t i = 0;
+
+  // uv_try_write() returns UV_EAGAIN if there are already queued writes, so
+  // the ordering with write() is preserved.
+  int r = uv_try_write(base_stream(), bufs, nbufs);
+  stats_.try_write(r);
+  if (r >= 0) {
+    offset = r;
+    while (i < nbufs && offset >= bufs[i].len)
+      offset -= bufs[i++].len;
+  } else if (r != UV_EAGAIN && r != UV_ENOSYS) {
+    return r;
+  }
+
+  if (i == nbufs && cb == nullptr)
+    return NSUV_OK;
+
+  ns_write<H_T>* req = acquire_write_();
+  if (req == nullptr)
+    return UV_ENOMEM;
+
+  // The ns_write is returned to the pool before the callback runs, so it
+  // always needs to go through a proxy.
+  if (cb == nullptr)
+    proxy = &write_fast_release_proxy_;
+
+  if (i == nbufs) {
+    uv_buf_t empty = uv_buf_init(nullptr, 0);
+    r = req->init(&empty, 1, cb, data);
+  } else {
+    r = req->init(bufs + i, nbufs - i, cb, data);
+  }
+  if (r != NSUV_OK) {
+    release_write_(req);
+    return r;
+  }
+
+  if (i == nbufs && write_fast_sync_) {
+    req->uv_req()->handle = base_stream();
+    proxy(req->uv_req(), NSUV_OK);
+    return NSUV_OK;
+  }
+
+  // Everything was sent, but libuv still runs the callback of a zero-length
+  // write after those of earlier writes, and cancels it on close.
+  if (i == nbufs) {
+    r = uv_write(req->uv_req(), base_stream(), req->bufs(), req->size(), proxy);
+    if (r != NSUV_OK)
+      release_write_(req);
+    return r;
+  }
+
+  if (offset > 0) {
+    uv_buf_t* buf = req->bufs_.mutable_data_();
+    buf->base += offset;
+    buf->len -= offset;
+  }
+
+  r = write_(req, proxy);
+  if (r != NSUV_OK)
+    release_write_(req);
+  return r;
 }
 
-int ns_tcp::keepalive(bool enable, int delay) {
-  return uv_tcp_keepalive(uv_handle(), enable, delay);
+template <class UV_T, class H_T>
+ns_write<H_T>* ns_stream<UV_T, H_T>::acquire_write_() {
+  ns_write<H_T>* req = write_pool_;
+  if (req == nullptr)
+    return new (std::nothrow) ns_write<H_T>();
+
+  write_pool_ = req->pool_next_;
+  write_pool_size_--;
+  return req;
 }
 
-int ns_tcp::simultaneous_accepts(bool enable) {
-  return uv_tcp_simultaneous_accepts(uv_handle(), enable);
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::release_write_(ns_write<H_T>* req) {
+  if (write_pool_size_ >= kWritePoolMax) {
+    delete req;
+    return;
+  }
+
+  req->req_cb_wp_.reset();
+  req->pool_next_ = write_pool_;
+  write_pool_ = req;
+  write_pool_size_++;
 }
 
-int ns_tcp::bind(const struct sockaddr* addr, unsigned int flags) {
-  return uv_tcp_bind(uv_handle(), addr, flags);
+template <class UV_T, class H_T>
+template <typename CB_T>
+void ns_stream<UV_T, H_T>::write_fast_proxy_(uv_write_t* uv_req, int status) {
+  auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
+  auto* cb_ = reinterpret_cast<CB_T>(wreq->req_cb_);
+  NSUV_TRACE_REQ("write", uv_req, cb_);
+  stream->release_write_(wreq);
+  stream->stats_.write_cb();
+  uint64_t start = stream->stats_.cb_start();
+  cb_(stream, status);
+  stream->stats_.cb_end(start);
+  stream->check_low_watermark_();
 }
 
-int ns_tcp::getsockname(struct sockaddr* name, int* namelen) {
-  return uv_tcp_getsockname(uv_handle(), name, namelen);
+template <class UV_T, class H_T>
+template <typename CB_T, typename D_T>
+void ns_stream<UV_T, H_T>::write_fast_proxy_(uv_write_t* uv_req, int status) {
+  auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
+  auto* cb_ = reinterpret_cast<CB_T>(wreq->req_cb_);
+  NSUV_TRACE_REQ("write", uv_req, cb_);
+  auto* data = static_cast<D_T*>(wreq->req_cb_data_);
+  stream->release_write_(wreq);
+  stream->stats_.write_cb();
+  uint64_t start = stream->stats_.cb_start();
+  cb_(stream, status, data);
+  stream->stats_.cb_end(start);
+  stream->check_low_watermark_();
 }
 
-int ns_tcp::getpeername(struct sockaddr* name, int* namelen) {
-  return uv_tcp_getpeername(uv_handle(), name, namelen);
+template <class UV_T, class H_T>
+template <typename CB_T, typename D_T>
+void ns_stream<UV_T, H_T>::write_fast_proxy_wp_(uv_write_t* uv_req,
+                                                int status) {
+  auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
+  auto* cb_ = reinterpret_cast<CB_T>(wreq->req_cb_);
+  NSUV_TRACE_REQ("write", uv_req, cb_);
+  auto data = wreq->req_cb_wp_.lock();
+  stream->release_write_(wreq);
+  stream->stats_.write_cb();
+  uint64_t start = stream->stats_.cb_start();
+  cb_(stream, status, std::static_pointer_cast<D_T>(data));
+  stream->stats_.cb_end(start);
+  stream->check_low_watermark_();
 }
 
-int ns_tcp::close_reset(ns_close_cb cb) {
-  close_reset_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  return uv_tcp_close_reset(
-      uv_handle(),
-      util::check_null_cb(cb, &close_reset_proxy_<decltype(cb)>));
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::write_fast_release_proxy_(uv_write_t* uv_req,
+                                                     int) {
+  auto* wreq = ns_write<H_T>::cast(uv_req);
+  auto* stream = wreq->handle();
+  stream->release_write_(wreq);
+  stream->check_low_watermark_();
 }
 
-template <typename D_T>
-int ns_tcp::close_reset(ns_close_cb_d<D_T> cb, D_T* data) {
-  close_reset_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  close_reset_data_ = data;
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::set_write_watermarks(size_t low,
+                                               size_t high,
+                                               ns_watermark_cb cb) {
+  if (high > 0 && (low > high || cb == nullptr))
+    return UV_EINVAL;
 
-  return uv_tcp_close_reset(
-      uv_handle(),
-      util::check_null_cb(cb, &close_reset_proxy_<decltype(cb), D_T>));
-}
+  wm_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  wm_proxy_ = &watermark_proxy_<decltype(cb)>;
+  wm_low_ = low;
+  wm_high_ = high;
+  wm_paused_ = false;
 
-int ns_tcp::close_reset(void (*cb)(ns_tcp*, void*), std::nullptr_t) {
-  return close_reset(cb, NSUV_CAST_NULLPTR);
+  return NSUV_OK;
 }
 
+template <class UV_T, class H_T>
 template <typename D_T>
-int ns_tcp::close_reset(ns_close_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {
-  close_reset_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  close_reset_wp_ = data;
+int ns_stream<UV_T, H_T>::set_write_watermarks(size_t low,
+                                               size_t high,
+                                               ns_watermark_cb_d<D_T> cb,
+                                               D_T* data) {
+  if (high > 0 && (low > high || cb == nullptr))
+    return UV_EINVAL;
 
-  return uv_tcp_close_reset(
-      uv_handle(),
-      util::check_null_cb(cb, &close_reset_proxy_wp_<decltype(cb), D_T>));
-}
+  wm_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  wm_proxy_ = &watermark_proxy_<decltype(cb), D_T>;
+  wm_cb_data_ = data;
+  wm_low_ = low;
+  wm_high_ = high;
+  wm_paused_ = false;
 
-int ns_tcp::connect(ns_connect<ns_tcp>* req,
-                    const struct sockaddr* addr,
-                    ns_connect_cb cb) {
-  int ret = req->init(addr, cb);
-  if (ret != NSUV_OK)
-    return ret;
+  return NSUV_OK;
+}
 
-  return uv_tcp_connect(
-      req->uv_req(),
-      uv_handle(),
-      addr,
-      util::check_null_cb(cb, &connect_proxy_<decltype(cb)>));
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::set_write_watermarks(
+    size_t low,
+    size_t high,
+    void (*cb)(H_T*, bool, size_t, void*),
+    std::nullptr_t) {
+  return set_write_watermarks(low, high, cb, NSUV_CAST_NULLPTR);
 }
 
+template <class UV_T, class H_T>
 template <typename D_T>
-int ns_tcp::connect(ns_connect<ns_tcp>* req,
-                    const struct sockaddr* addr,
-                    ns_connect_cb_d<D_T> cb,
-                    D_T* data) {
-  int ret = req->init(addr, cb, data);
-  if (ret != NSUV_OK)
-    return ret;
+int ns_stream<UV_T, H_T>::set_write_watermarks(size_t low,
+                                               size_t high,
+                                               ns_watermark_cb_wp<D_T> cb,
+                                               std::weak_ptr<D_T> data) {
+  if (high > 0 && (low > high || cb == nullptr))
+    return UV_EINVAL;
 
-  return uv_tcp_connect(
-      req->uv_req(),
-      uv_handle(),
-      addr,
-      util::check_null_cb(cb, &connect_proxy_<decltype(cb), D_T>));
+  wm_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  wm_proxy_ = &watermark_proxy_wp_<decltype(cb), D_T>;
+  wm_cb_wp_ = data;
+  wm_low_ = low;
+  wm_high_ = high;
+  wm_paused_ = false;
+
+  return NSUV_OK;
 }
 
-int ns_tcp::connect(ns_connect<ns_tcp>* req,
-                    const struct sockaddr* addr,
-                    void (*cb)(ns_connect<ns_tcp>*, int, void*),
-                    std::nullptr_t) {
-  return connect(req, addr, cb, NSUV_CAST_NULLPTR);
+template <class UV_T, class H_T>
+bool ns_stream<UV_T, H_T>::is_write_paused() {
+  return wm_paused_;
 }
 
-template <typename D_T>
-int ns_tcp::connect(ns_connect<ns_tcp>* req,
-                    const struct sockaddr* addr,
-                    ns_connect_cb_wp<D_T> cb,
-                    std::weak_ptr<D_T> data) {
-  int ret = req->init(addr, cb, data);
-  if (ret != NSUV_OK)
-    return ret;
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::check_high_watermark_() {
+  if (wm_high_ == 0 || wm_paused_)
+    return;
 
-  return uv_tcp_connect(
-      req->uv_req(),
-      uv_handle(),
-      addr,
-      util::check_null_cb(cb, &connect_proxy_wp_<decltype(cb), D_T>));
-}
+  size_t size = get_write_queue_size();
+  if (size <= wm_high_)
+    return;
 
-template <typename CB_T>
-void ns_tcp::connect_proxy_(uv_connect_t* uv_req, int status) {
-  auto* creq = ns_connect<ns_tcp>::cast(uv_req);
-  auto* cb_ = reinterpret_cast<CB_T>(creq->req_cb_);
-  cb_(creq, status);
+  wm_paused_ = true;
+  wm_proxy_(H_T::cast(this->uv_handle()), true, size);
 }
 
-template <typename CB_T, typename D_T>
-void ns_tcp::connect_proxy_(uv_connect_t* uv_req, int status) {
-  auto* creq = ns_connect<ns_tcp>::cast(uv_req);
-  auto* cb_ = reinterpret_cast<CB_T>(creq->req_cb_);
-  cb_(creq, status, static_cast<D_T*>(creq->req_cb_data_));
-}
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::check_low_watermark_() {
+  if (!wm_paused_ || this->is_closing())
+    return;
 
-template <typename CB_T, typename D_T>
-void ns_tcp::connect_proxy_wp_(uv_connect_t* uv_req, int status) {
-  auto* creq = ns_connect<ns_tcp>::cast(uv_req);
-  auto* cb_ = reinterpret_cast<CB_T>(creq->req_cb_);
-  auto data = creq->req_cb_wp_.lock();
-  cb_(creq, status, std::static_pointer_cast<D_T>(data));
+  size_t size = get_write_queue_size();
+  if (size > wm_low_)
+    return;
+
+  wm_paused_ = false;
+  wm_proxy_(H_T::cast(this->uv_handle()), false, size);
 }
 
+template <class UV_T, class H_T>
 template <typename CB_T>
-void ns_tcp::close_reset_proxy_(uv_handle_t* handle) {
-  ns_tcp* wrap = ns_tcp::cast(handle);
-  auto* cb = reinterpret_cast<CB_T>(wrap->close_reset_cb_ptr_);
-  cb(wrap);
+void ns_stream<UV_T, H_T>::watermark_proxy_(H_T* handle,
+                                            bool paused,
+                                            size_t size) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->wm_cb_ptr_);
+  NSUV_TRACE_HANDLE("watermark", handle, cb_);
+  cb_(handle, paused, size);
 }
 
+template <class UV_T, class H_T>
 template <typename CB_T, typename D_T>
-void ns_tcp::close_reset_proxy_(uv_handle_t* handle) {
-  ns_tcp* wrap = ns_tcp::cast(handle);
-  auto* cb = reinterpret_cast<CB_T>(wrap->close_reset_cb_ptr_);
-  cb(wrap, static_cast<D_T*>(wrap->close_reset_data_));
+void ns_stream<UV_T, H_T>::watermark_proxy_(H_T* handle,
+                                            bool paused,
+                                            size_t size) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->wm_cb_ptr_);
+  NSUV_TRACE_HANDLE("watermark", handle, cb_);
+  cb_(handle, paused, size, static_cast<D_T*>(handle->wm_cb_data_));
 }
 
+template <class UV_T, class H_T>
 template <typename CB_T, typename D_T>
-void ns_tcp::close_reset_proxy_wp_(uv_handle_t* handle) {
-  ns_tcp* wrap = ns_tcp::cast(handle);
-  auto* cb = reinterpret_cast<CB_T>(wrap->close_reset_cb_ptr_);
-  auto data = wrap->close_reset_wp_.lock();
-  cb(wrap, std::static_pointer_cast<D_T>(data));
+void ns_stream<UV_T, H_T>::watermark_proxy_wp_(H_T* handle,
+                                               bool paused,
+                                               size_t size) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->wm_cb_ptr_);
+  NSUV_TRACE_HANDLE("watermark", handle, cb_);
+  auto data = handle->wm_cb_wp_.lock();
+  cb_(handle, paused, size, std::static_pointer_cast<D_T>(data));
 }
 
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::read_ring_start(size_t capacity, ns_ring_read_cb cb) {
+  int er = ring_init_(capacity);
+  if (er != NSUV_OK)
+    return er;
 
-/* ns_timer */
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  ring_proxy_ = util::check_null_cb(cb, &ring_read_proxy_<decltype(cb)>);
 
-int ns_timer::init(uv_loop_t* loop) {
-  timer_cb_ptr_ = nullptr;
-  timer_cb_data_ = nullptr;
-  return uv_timer_init(loop, uv_handle());
+  return uv_read_start(base_stream(), &ring_alloc_proxy_, ring_proxy_);
 }
 
-int ns_timer::start(ns_timer_cb cb, uint64_t timeout, uint64_t repeat) {
-  timer_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::read_ring_start(size_t capacity,
+                                          ns_ring_read_cb_d<D_T> cb,
+                                          D_T* data) {
+  int er = ring_init_(capacity);
+  if (er != NSUV_OK)
+    return er;
 
-  return uv_timer_start(uv_handle(),
-                        util::check_null_cb(cb, &timer_proxy_<decltype(cb)>),
-                        timeout,
-                        repeat);
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  read_cb_data_ = data;
+  ring_proxy_ =
+      util::check_null_cb(cb, &ring_read_proxy_<decltype(cb), D_T>);
+
+  return uv_read_start(base_stream(), &ring_alloc_proxy_, ring_proxy_);
+}
+
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::read_ring_start(
+    size_t capacity,
+    void (*cb)(H_T*, ssize_t, const uv_buf_t*, void*),
+    std::nullptr_t) {
+  return read_ring_start(capacity, cb, NSUV_CAST_NULLPTR);
 }
 
+template <class UV_T, class H_T>
 template <typename D_T>
-int ns_timer::start(ns_timer_cb_d<D_T> cb,
-                    uint64_t timeout,
-                    uint64_t repeat,
-                    D_T* data) {
-  timer_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  timer_cb_data_ = data;
+int ns_stream<UV_T, H_T>::read_ring_start(size_t capacity,
+                                          ns_ring_read_cb_wp<D_T> cb,
+                                          std::weak_ptr<D_T> data) {
+  int er = ring_init_(capacity);
+  if (er != NSUV_OK)
+    return er;
 
-  return uv_timer_start(
-    uv_handle(),
-    util::check_null_cb(cb, &timer_proxy_<decltype(cb), D_T>),
-    timeout,
-    repeat);
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  read_cb_wp_ = data;
+  ring_proxy_ =
+      util::check_null_cb(cb, &ring_read_proxy_wp_<decltype(cb), D_T>);
+
+  return uv_read_start(base_stream(), &ring_alloc_proxy_, ring_proxy_);
 }
 
-int ns_timer::start(void (*cb)(ns_timer*, void*),
-                    uint64_t timeout,
-                    uint64_t repeat,
-                    std::nullptr_t) {
-  return start(cb, timeout, repeat, NSUV_CAST_NULLPTR);
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::read_consume(size_t len) {
+  if (ring_ == nullptr || len > ring_->size())
+    return UV_EINVAL;
+
+  ring_->consume(len);
+  if (!ring_paused_ || len == 0 || this->is_closing())
+    return NSUV_OK;
+
+  ring_paused_ = false;
+  return uv_read_start(base_stream(), &ring_alloc_proxy_, ring_proxy_);
 }
 
-template <typename D_T>
-int ns_timer::start(ns_timer_cb_wp<D_T> cb,
-                    uint64_t timeout,
-                    uint64_t repeat,
-                    std::weak_ptr<D_T> data) {
-  timer_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  timer_cb_wp_ = data;
+template <class UV_T, class H_T>
+uv_buf_t ns_stream<UV_T, H_T>::read_ring_data() {
+  if (ring_ == nullptr)
+    return uv_buf_init(nullptr, 0);
+  return ring_->readable();
+}
 
-  return uv_timer_start(
-    uv_handle(),
-    util::check_null_cb(cb, &timer_proxy_wp_<decltype(cb), D_T>),
-    timeout,
-    repeat);
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::ring_init_(size_t capacity) {
+  ring_paused_ = false;
+  if (ring_ != nullptr)
+    return NSUV_OK;
+
+  ring_.reset(new (std::nothrow) util::ring_buffer());
+  if (ring_ == nullptr)
+    return UV_ENOMEM;
+
+  int er = ring_->init(capacity);
+  if (er != NSUV_OK)
+    ring_.reset();
+  return er;
 }
 
-int ns_timer::stop() {
-  return uv_timer_stop(uv_handle());
+template <class UV_T, class H_T>
+template <typename F>
+void ns_stream<UV_T, H_T>::ring_read_(ssize_t nread, F emit) {
+  if (nread == 0)
+    return;
+
+  // Only reported when the ring had no free space left to read into.
+  if (nread == UV_ENOBUFS && ring_->size() == ring_->capacity()) {
+    uv_read_stop(base_stream());
+    ring_paused_ = true;
+    return;
+  }
+
+  if (nread > 0)
+    ring_->commit(nread);
+
+  stats_.read(nread);
+  uv_buf_t data = ring_->readable();
+  uint64_t start = stats_.cb_start();
+  emit(nread, &data);
+  stats_.cb_end(start);
 }
 
-size_t ns_timer::get_repeat() {
-  return uv_timer_get_repeat(uv_handle());
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::ring_alloc_proxy_(uv_handle_t* handle,
+                                             size_t,
+                                             uv_buf_t* buf) {
+  H_T::cast(handle)->ring_->alloc(buf);
 }
 
+template <class UV_T, class H_T>
 template <typename CB_T>
-void ns_timer::timer_proxy_(uv_timer_t* handle) {
-  ns_timer* wrap = ns_timer::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->timer_cb_ptr_);
-  cb_(wrap);
+void ns_stream<UV_T, H_T>::ring_read_proxy_(uv_stream_t* handle,
+                                            ssize_t nread,
+                                            const uv_buf_t*) {
+  auto* server = H_T::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  server->ring_read_(nread, [&](ssize_t n, const uv_buf_t* data) {
+    cb_(server, n, data);
+  });
 }
 
+template <class UV_T, class H_T>
 template <typename CB_T, typename D_T>
-void ns_timer::timer_proxy_(uv_timer_t* handle) {
-  ns_timer* wrap = ns_timer::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->timer_cb_ptr_);
-  cb_(wrap, static_cast<D_T*>(wrap->timer_cb_data_));
+void ns_stream<UV_T, H_T>::ring_read_proxy_(uv_stream_t* handle,
+                                            ssize_t nread,
+                                            const uv_buf_t*) {
+  auto* server = H_T::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  server->ring_read_(nread, [&](ssize_t n, const uv_buf_t* data) {
+    cb_(server, n, data, static_cast<D_T*>(server->read_cb_data_));
+  });
 }
 
+template <class UV_T, class H_T>
 template <typename CB_T, typename D_T>
-void ns_timer::timer_proxy_wp_(uv_timer_t* handle) {
-  ns_timer* wrap = ns_timer::cast(handle);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->timer_cb_ptr_);
-  auto data = wrap->timer_cb_wp_.lock();
-  cb_(wrap, std::static_pointer_cast<D_T>(data));
+void ns_stream<UV_T, H_T>::ring_read_proxy_wp_(uv_stream_t* handle,
+                                               ssize_t nread,
+                                               const uv_buf_t*) {
+  auto* server = H_T::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  auto data = server->read_cb_wp_.lock();
+  server->ring_read_(nread, [&](ssize_t n, const uv_buf_t* buf) {
+    cb_(server, n, buf, std::static_pointer_cast<D_T>(data));
+  });
 }
 
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::pump(H_T* dst, ns_pump_cb cb) {
+  int er = pump_init_(dst);
+  if (er != NSUV_OK)
+    return er;
 
-/* ns_check, ns_idle, ns_prepare */
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  pump_proxy_ = util::check_null_cb(cb, &pump_done_proxy_<decltype(cb)>);
 
-#define NSUV_LOOP_WATCHER_DEFINE(name)                                         \
-  int ns_##name::init(uv_loop_t* loop) {                                       \
-    name##_cb_ptr_ = nullptr;                                                  \
-    name##_cb_data_ = nullptr;                                                 \
-    return uv_##name##_init(loop, uv_handle());                                \
-  }                                                                            \
-                                                                               \
-  int ns_##name::start(ns_##name##_cb cb) {                                    \
-    if (is_active())                                                           \
-      return 0;                                                                \
-    name##_cb_ptr_ = reinterpret_cast<void (*)()>(cb);                         \
-    return uv_##name##_start(                                                  \
-        uv_handle(),                                                           \
-        util::check_null_cb(cb, &name##_proxy_<decltype(cb)>));                \
-  }                                                                            \
-                                                                               \
-  template <typename D_T>                                                      \
-  int ns_##name::start(ns_##name##_cb_d<D_T> cb, D_T* data) {                  \
-    if (is_active())                                                           \
-      return 0;                                                                \
-    name##_cb_ptr_ = reinterpret_cast<void (*)()>(cb);                         \
-    name##_cb_data_ = data;                                                    \
-    return uv_##name##_start(                                                  \
-        uv_handle(),                                                           \
-        util::check_null_cb(cb, &name##_proxy_<decltype(cb), D_T>));           \
-  }                                                                            \
-                                                                               \
-  int ns_##name::start(void (*cb)(ns_##name*, void*), std::nullptr_t) {        \
-    return start(cb, NSUV_CAST_NULLPTR);                                       \
-  }                                                                            \
-                                                                               \
-  template <typename D_T>                                                      \
-  int ns_##name::start(ns_##name##_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {   \
-    if (is_active())                                                           \
-      return 0;                                                                \
-    name##_cb_ptr_ = reinterpret_cast<void (*)()>(cb);                         \
-    name##_cb_wp_ = data;                                                      \
-    return uv_##name##_start(                                                  \
-        uv_handle(),                                                           \
-        util::check_null_cb(cb, &name##_proxy_wp_<decltype(cb), D_T>));        \
-  }                                                                            \
-                                                                               \
-  int ns_##name::stop() { return uv_##name##_stop(uv_handle()); }              \
-                                                                               \
-  template <typename CB_T>                                                     \
-  void ns_##name::name##_proxy_(uv_##name##_t* handle) {                       \
-    ns_##name* wrap = ns_##name::cast(handle);                                 \
-    auto* cb_ = reinterpret_cast<CB_T>(wrap->name##_cb_ptr_);                  \
-    cb_(wrap);                                                                 \
-  }                                                                            \
-                                                                               \
-  template <typename CB_T, typename D_T>                                       \
-  void ns_##name::name##_proxy_(uv_##name##_t* handle) {                       \
-    ns_##name* wrap = ns_##name::cast(handle);                                 \
-    auto* cb_ = reinterpret_cast<CB_T>(wrap->name##_cb_ptr_);                  \
-    cb_(wrap, static_cast<D_T*>(wrap->name##_cb_data_));                       \
-  }                                                                            \
-                                                                               \
-  template <typename CB_T, typename D_T>                                       \
-  void ns_##name::name##_proxy_wp_(uv_##name##_t* handle) {                    \
-    ns_##name* wrap = ns_##name::cast(handle);                                 \
-    auto* cb_ = reinterpret_cast<CB_T>(wrap->name##_cb_ptr_);                  \
-    auto data = wrap->name##_cb_wp_.lock();                                    \
-    cb_(wrap, std::static_pointer_cast<D_T>(data));                            \
-  }
+  return pump_start_();
+}
+
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::pump(H_T* dst, ns_pump_cb_d<D_T> cb, D_T* data) {
+  int er = pump_init_(dst);
+  if (er != NSUV_OK)
+    return er;
 
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  read_cb_data_ = data;
+  pump_proxy_ =
+      util::check_null_cb(cb, &pump_done_proxy_<decltype(cb), D_T>);
 
-NSUV_LOOP_WATCHER_DEFINE(check)
-NSUV_LOOP_WATCHER_DEFINE(idle)
-NSUV_LOOP_WATCHER_DEFINE(prepare)
+  return pump_start_();
+}
 
-#undef NSUV_LOOP_WATCHER_DEFINE
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::pump(H_T* dst,
+                               void (*cb)(H_T*, int, void*),
+                               std::nullptr_t) {
+  return pump(dst, cb, NSUV_CAST_NULLPTR);
+}
 
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::pump(H_T* dst,
+                               ns_pump_cb_wp<D_T> cb,
+                               std::weak_ptr<D_T> data) {
+  int er = pump_init_(dst);
+  if (er != NSUV_OK)
+    return er;
 
-/* ns_udp */
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  read_cb_wp_ = data;
+  pump_proxy_ =
+      util::check_null_cb(cb, &pump_done_proxy_wp_<decltype(cb), D_T>);
 
-int ns_udp::init(uv_loop_t* loop) {
-  return uv_udp_init(loop, uv_handle());
+  return pump_start_();
 }
 
-int ns_udp::init_ex(uv_loop_t* loop, unsigned int flags) {
-  return uv_udp_init_ex(loop, uv_handle(), flags);
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::pump_init_(H_T* dst) {
+  if (dst == nullptr)
+    return UV_EINVAL;
+
+  if (pump_ == nullptr) {
+    pump_ = new (std::nothrow) pump_state();
+    if (pump_ == nullptr)
+      return UV_ENOMEM;
+    pump_->src = H_T::cast(this->uv_handle());
+    pump_->done = true;
+  }
+
+  // The shutdown req can't be reused until the previous one completed.
+  if (!pump_->done || pump_->inflight > 0)
+    return UV_EBUSY;
+
+  pump_->dst = dst;
+  pump_->bytes = 0;
+  pump_->paused = false;
+  pump_->done = false;
+  return NSUV_OK;
 }
 
-int ns_udp::bind(const struct sockaddr* addr, unsigned int flags) {
-  int r = uv_udp_bind(uv_handle(), addr, flags);
-  if (r == 0) {
-    if (addr == nullptr) {
-      local_addr_.reset(nullptr);
-    } else {
-      local_addr_.reset(new (std::nothrow) struct sockaddr_storage());
-      if (local_addr_ == nullptr)
-        return UV_ENOMEM;
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::pump_start_() {
+  return uv_read_start(base_stream(), &pump_alloc_proxy_, &pump_read_proxy_);
+}
 
-      int len = util::addr_size(addr);
-      if (len < 0)
-        return len;
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::pump_finish_(int status) {
+  if (pump_->done)
+    return;
 
-      std::memcpy(local_addr_.get(), addr, len);
-    }
+  pump_->done = true;
+  uv_read_stop(base_stream());
+  if (pump_proxy_ != nullptr)
+    pump_proxy_(H_T::cast(this->uv_handle()), status);
+}
+
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::closed_() {
+  // The read callback won't run again to finish a pump().
+  if (pump_ != nullptr)
+    pump_finish_(UV_ECANCELED);
+}
+
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::pump_alloc_proxy_(uv_handle_t* handle,
+                                             size_t,
+                                             uv_buf_t* buf) {
+  pump_state* state = H_T::cast(handle)->pump_;
+
+  if (state->cur == nullptr) {
+    state->cur = state->pool;
+    if (state->cur != nullptr)
+      state->pool = static_cast<pump_chunk*>(state->cur->pool_next_);
+    else
+      state->cur = new (std::nothrow) pump_chunk;
   }
 
-  return r;
+  // An empty buffer makes libuv report UV_ENOBUFS to the read callback.
+  if (state->cur == nullptr)
+    *buf = uv_buf_init(nullptr, 0);
+  else
+    *buf = uv_buf_init(state->cur->data, kPumpChunkSize);
 }
 
-int ns_udp::connect(const struct sockaddr* addr) {
-  int r = uv_udp_connect(uv_handle(), addr);
-  if (r == 0) {
-    if (addr == nullptr) {
-      remote_addr_.reset(nullptr);
-    } else {
-      remote_addr_.reset(new (std::nothrow) struct sockaddr_storage());
-      if (remote_addr_ == nullptr)
-        return UV_ENOMEM;
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::pump_read_proxy_(uv_stream_t* handle,
+                                            ssize_t nread,
+                                            const uv_buf_t*) {
+  auto* stream = H_T::cast(handle);
+  pump_state* state = stream->pump_;
+  int r;
+
+  stream->stats_.read(nread);
+  // The chunk stays in cur to be handed out again.
+  if (nread == 0)
+    return;
+
+  if (nread == UV_EOF) {
+    uv_read_stop(handle);
+    state->shutdown_req.data = state;
+    r = uv_shutdown(
+        &state->shutdown_req, state->dst->base_stream(), &pump_shutdown_proxy_);
+    if (r != NSUV_OK)
+      return stream->pump_finish_(r);
+    state->inflight++;
+    return;
+  }
 
-      int len = util::addr_size(addr);
-      if (len < 0)
-        return len;
+  if (nread < 0)
+    return stream->pump_finish_(nread);
 
-      std::memcpy(remote_addr_.get(), addr, len);
-    }
+  pump_chunk* chunk = state->cur;
+  uv_buf_t buf = uv_buf_init(chunk->data, nread);
+  state->cur = nullptr;
+
+  r = chunk->init(&buf, 1, static_cast<uv_write_cb>(nullptr), state);
+  if (r == NSUV_OK)
+    r = state->dst->write_(chunk, &pump_write_proxy_);
+  if (r != NSUV_OK) {
+    chunk->pool_next_ = state->pool;
+    state->pool = chunk;
+    return stream->pump_finish_(r);
   }
+  state->bytes += nread;
 
-  return r;
+  // Writes that complete right away still hold their chunk until the
+  // callback, so count pending writes rather than dst's write queue size.
+  if (++state->inflight >= kPumpMaxChunks) {
+    state->paused = true;
+    uv_read_stop(handle);
+  }
 }
 
-int ns_udp::getpeername(struct sockaddr* name, int* namelen) {
-  return uv_udp_getpeername(uv_handle(), name, namelen);
-}
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::pump_write_proxy_(uv_write_t* uv_req, int status) {
+  auto* chunk = static_cast<pump_chunk*>(ns_write<H_T>::cast(uv_req));
+  auto* state = static_cast<pump_state*>(chunk->req_cb_data_);
+  auto* dst = chunk->handle();
 
-int ns_udp::getsockname(struct sockaddr* name, int* namelen) {
-  return uv_udp_getsockname(uv_handle(), name, namelen);
+  chunk->pool_next_ = state->pool;
+  state->pool = chunk;
+  state->inflight--;
+  pump_complete_(state, status);
+  dst->check_low_watermark_();
 }
 
-int ns_udp::try_send(const uv_buf_t bufs[],
-                     size_t nbufs,
-                     const struct sockaddr* addr) {
-  return uv_udp_try_send(uv_handle(), bufs, nbufs, addr);
-}
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::pump_shutdown_proxy_(uv_shutdown_t* req,
+                                                int status) {
+  auto* state = static_cast<pump_state*>(req->data);
 
-int ns_udp::try_send(const std::vector<uv_buf_t>& bufs,
-                     const struct sockaddr* addr) {
-  return uv_udp_try_send(uv_handle(), bufs.data(), bufs.size(), addr);
+  state->inflight--;
+  if (state->src == nullptr || state->done || status < 0)
+    return pump_complete_(state, status);
+
+  state->src->pump_finish_(NSUV_OK);
 }
 
-int ns_udp::send(ns_udp_send* req,
-                 const uv_buf_t bufs[],
-                 size_t nbufs,
-                 const struct sockaddr* addr) {
-  int r = req->init(bufs, nbufs, addr, NSUV_CAST_NULLPTR);
-  if (r != 0)
-    return r;
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::pump_complete_(pump_state* state, int status) {
+  H_T* src = state->src;
+
+  // The stream is gone, so the state is only kept for the pending writes.
+  if (src == nullptr) {
+    if (state->inflight == 0)
+      pump_free_(state);
+    return;
+  }
 
-  return uv_udp_send(req->uv_req(),
-                     uv_handle(),
-                     req->bufs(),
-                     req->size(),
-                     addr,
-                     nullptr);
-}
+  if (state->done)
+    return;
 
-int ns_udp::send(ns_udp_send* req,
-                 const std::vector<uv_buf_t>& bufs,
-                 const struct sockaddr* addr) {
-  int r = req->init(bufs, addr, NSUV_CAST_NULLPTR);
-  if (r != 0)
-    return r;
+  if (status < 0)
+    return src->pump_finish_(status);
 
-  return uv_udp_send(req->uv_req(),
-                     uv_handle(),
-                     req->bufs(),
-                     req->size(),
-                     addr,
-                     nullptr);
+  if (!state->paused ||
+      state->inflight >= kPumpMaxChunks ||
+      src->is_closing()) {
+    return;
+  }
+
+  state->paused = false;
+  int r = src->pump_start_();
+  if (r != NSUV_OK)
+    src->pump_finish_(r);
 }
 
-int ns_udp::send(ns_udp_send* req,
-                 const uv_buf_t bufs[],
-                 size_t nbufs,
-                 const struct sockaddr* addr,
-                 ns_udp_send_cb cb) {
-  int r = req->init(bufs, nbufs, addr, cb);
-  if (r != 0)
-    return r;
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::pump_free_(pump_state* state) {
+  delete state->cur;
+  while (state->pool != nullptr) {
+    pump_chunk* chunk = state->pool;
+    state->pool = static_cast<pump_chunk*>(chunk->pool_next_);
+    delete chunk;
+  }
+  delete state;
+}
 
-  return uv_udp_send(req->uv_req(),
-                     uv_handle(),
-                     req->bufs(),
-                     req->size(),
-                     addr,
-                     util::check_null_cb(cb, &send_proxy_<decltype(cb)>));
+template <class UV_T, class H_T>
+template <typename CB_T>
+void ns_stream<UV_T, H_T>::pump_done_proxy_(H_T* handle, int status) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("pump", handle, cb_);
+  cb_(handle, status);
 }
 
-int ns_udp::send(ns_udp_send* req,
-                 const std::vector<uv_buf_t>& bufs,
-                 const struct sockaddr* addr,
-                 ns_udp_send_cb cb) {
-  int r = req->init(bufs, addr, cb);
-  if (r != 0)
-    return r;
+template <class UV_T, class H_T>
+template <typename CB_T, typename D_T>
+void ns_stream<UV_T, H_T>::pump_done_proxy_(H_T* handle, int status) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("pump", handle, cb_);
+  cb_(handle, status, static_cast<D_T*>(handle->read_cb_data_));
+}
 
-  return uv_udp_send(req->uv_req(),
-                     uv_handle(),
-                     req->bufs(),
-                     req->size(),
-                     addr,
-                     util::check_null_cb(cb, &send_proxy_<decltype(cb)>));
+template <class UV_T, class H_T>
+template <typename CB_T, typename D_T>
+void ns_stream<UV_T, H_T>::pump_done_proxy_wp_(H_T* handle, int status) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("pump", handle, cb_);
+  auto data = handle->read_cb_wp_.lock();
+  cb_(handle, status, std::static_pointer_cast<D_T>(data));
 }
 
-template <typename D_T>
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::read_lines_start(ns_lines_cb cb) {
+  int er = init_line_reader_();
+  if (er != NSUV_OK)
+    return er;
+
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+
+  return uv_read_start(
+      base_stream(),
+      util::check_null_cb(cb, &lines_alloc_proxy_),
+      util::check_null_cb(cb, &lines_proxy_<decltype(cb)>));
+}
+
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::read_lines_start(ns_lines_cb_d<D_T> cb, D_T* data) {
+  int er = init_line_reader_();
+  if (er != NSUV_OK)
+    return er;
+
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  read_cb_data_ = data;
+
+  return uv_read_start(
+      base_stream(),
+      util::check_null_cb(cb, &lines_alloc_proxy_),
+      util::check_null_cb(cb, &lines_proxy_<decltype(cb), D_T>));
+}
+
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::read_lines_start(
+    void (*cb)(H_T*, int, const uv_buf_t*, size_t, void*), std::nullptr_t) {
+  return read_lines_start(cb, NSUV_CAST_NULLPTR);
+}
+
+template <class UV_T, class H_T>
+template <typename D_T>
+int ns_stream<UV_T, H_T>::read_lines_start(ns_lines_cb_wp<D_T> cb,
+                                           std::weak_ptr<D_T> data) {
+  int er = init_line_reader_();
+  if (er != NSUV_OK)
+    return er;
+
+  read_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  read_cb_wp_ = data;
+
+  return uv_read_start(
+      base_stream(),
+      util::check_null_cb(cb, &lines_alloc_proxy_),
+      util::check_null_cb(cb, &lines_proxy_wp_<decltype(cb), D_T>));
+}
+
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::set_max_line_length(size_t len) {
+  if (len == 0)
+    return UV_EINVAL;
+
+  if (line_reader_ == nullptr) {
+    line_reader_.reset(new (std::nothrow) util::line_reader());
+    if (line_reader_ == nullptr)
+      return UV_ENOMEM;
+  }
+
+  line_reader_->max_line(len);
+  return NSUV_OK;
+}
+
+template <class UV_T, class H_T>
+int ns_stream<UV_T, H_T>::init_line_reader_() {
+  if (line_reader_ == nullptr) {
+    line_reader_.reset(new (std::nothrow) util::line_reader());
+    if (line_reader_ == nullptr)
+      return UV_ENOMEM;
+  }
+
+  return line_reader_->init();
+}
+
+template <class UV_T, class H_T>
+template <typename F>
+void ns_stream<UV_T, H_T>::split_lines_(ssize_t nread,
+                                        const uv_buf_t* buf,
+                                        F emit) {
+  auto timed_emit = [&](int status, const uv_buf_t* lines, size_t n) {
+    uint64_t start = stats_.cb_start();
+    bool ret = emit(status, lines, n);
+    stats_.cb_end(start);
+    return ret;
+  };
+
+  stats_.read(nread);
+  if (nread > 0) {
+    line_reader_->split(buf->base, nread, timed_emit);
+  } else if (nread == UV_ENOBUFS) {
+    // The slab couldn't be allocated. Nothing was read, so don't flush.
+    timed_emit(UV_ENOBUFS, nullptr, 0);
+  } else if (nread < 0) {
+    line_reader_->finish(static_cast<int>(nread), timed_emit);
+  }
+}
+
+template <class UV_T, class H_T>
+void ns_stream<UV_T, H_T>::lines_alloc_proxy_(uv_handle_t* handle,
+                                              size_t,
+                                              uv_buf_t* buf) {
+  H_T::cast(handle)->line_reader_->alloc(buf);
+}
+
+template <class UV_T, class H_T>
+template <typename CB_T>
+void ns_stream<UV_T, H_T>::lines_proxy_(uv_stream_t* handle,
+                                        ssize_t nread,
+                                        const uv_buf_t* buf) {
+  auto* server = H_T::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  server->split_lines_(
+      nread, buf, [&](int status, const uv_buf_t* lines, size_t n) {
+    cb_(server, status, lines, n);
+    return !server->is_closing();
+  });
+}
+
+template <class UV_T, class H_T>
+template <typename CB_T, typename D_T>
+void ns_stream<UV_T, H_T>::lines_proxy_(uv_stream_t* handle,
+                                        ssize_t nread,
+                                        const uv_buf_t* buf) {
+  auto* server = H_T::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  server->split_lines_(
+      nread, buf, [&](int status, const uv_buf_t* lines, size_t n) {
+    cb_(server, status, lines, n, static_cast<D_T*>(server->read_cb_data_));
+    return !server->is_closing();
+  });
+}
+
+template <class UV_T, class H_T>
+template <typename CB_T, typename D_T>
+void ns_stream<UV_T, H_T>::lines_proxy_wp_(uv_stream_t* handle,
+                                           ssize_t nread,
+                                           const uv_buf_t* buf) {
+  auto* server = H_T::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(server->read_cb_ptr_);
+  NSUV_TRACE_HANDLE("read", handle, cb_);
+  auto data = server->read_cb_wp_.lock();
+  server->split_lines_(
+      nread, buf, [&](int status, const uv_buf_t* lines, size_t n) {
+    cb_(server, status, lines, n, std::static_pointer_cast<D_T>(data));
+    return !server->is_closing();
+  });
+}
+
+
+/* ns_async */
+
+int ns_async::init(uv_loop_t* loop, ns_async_cb cb) {
+  async_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  async_cb_data_ = nullptr;
+
+  return uv_async_init(loop,
+                       uv_handle(),
+                       util::check_null_cb(cb, &async_proxy_<decltype(cb)>));
+}
+
+template <typename D_T>
+int ns_async::init(uv_loop_t* loop, ns_async_cb_d<D_T> cb, D_T* data) {
+  async_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  async_cb_data_ = data;
+
+  return uv_async_init(
+    loop,
+    uv_handle(),
+    util::check_null_cb(cb, &async_proxy_<decltype(cb), D_T>));
+}
+
+int ns_async::init(uv_loop_t* loop,
+                   void (*cb)(ns_async*, void*),
+                   std::nullptr_t) {
+  return init(loop, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_async::init(uv_loop_t* loop,
+                   ns_async_cb_wp<D_T> cb,
+                   std::weak_ptr<D_T> data) {
+  async_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  async_cb_wp_ = data;
+
+  return uv_async_init(
+    loop,
+    uv_handle(),
+    util::check_null_cb(cb, &async_proxy_wp_<decltype(cb), D_T>));
+}
+
+int ns_async::send() {
+  return uv_async_send(uv_handle());
+}
+
+template <typename CB_T>
+void ns_async::async_proxy_(uv_async_t* handle) {
+  ns_async* wrap = ns_async::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->async_cb_ptr_);
+  NSUV_TRACE_HANDLE("async", handle, cb_);
+  cb_(wrap);
+}
+
+template <typename CB_T, typename D_T>
+void ns_async::async_proxy_(uv_async_t* handle) {
+  auto* wrap = ns_async::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->async_cb_ptr_);
+  NSUV_TRACE_HANDLE("async", handle, cb_);
+  cb_(wrap, static_cast<D_T*>(wrap->async_cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_async::async_proxy_wp_(uv_async_t* handle) {
+  auto* wrap = ns_async::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->async_cb_ptr_);
+  NSUV_TRACE_HANDLE("async", handle, cb_);
+  auto data = wrap->async_cb_wp_.lock();
+  cb_(wrap, std::static_pointer_cast<D_T>(data));
+}
+
+
+/* ns_poll */
+
+int ns_poll::init(uv_loop_t* loop, int fd) {
+  poll_cb_ptr_ = nullptr;
+  poll_cb_data_ = nullptr;
+  return uv_poll_init(loop, uv_handle(), fd);
+}
+
+int ns_poll::init_socket(uv_loop_t* loop, uv_os_sock_t socket) {
+  poll_cb_ptr_ = nullptr;
+  poll_cb_data_ = nullptr;
+  return uv_poll_init_socket(loop, uv_handle(), socket);
+}
+
+int ns_poll::start(int events, ns_poll_cb cb) {
+  poll_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+
+  return uv_poll_start(uv_handle(),
+                       events,
+                       util::check_null_cb(cb, &poll_proxy_<decltype(cb)>));
+}
+
+template <typename D_T>
+int ns_poll::start(int events,
+                   ns_poll_cb_d<D_T> cb,
+                   D_T* data) {
+  poll_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  poll_cb_data_ = data;
+
+  return uv_poll_start(
+    uv_handle(),
+    events,
+    util::check_null_cb(cb, &poll_proxy_<decltype(cb), D_T>));
+}
+
+int ns_poll::start(int events,
+                   void (*cb)(ns_poll*, int, int, void*),
+                   std::nullptr_t) {
+  return start(events, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_poll::start(int events,
+                   ns_poll_cb_wp<D_T> cb,
+                   std::weak_ptr<D_T> data) {
+  poll_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  poll_cb_wp_ = data;
+
+  return uv_poll_start(
+    uv_handle(),
+    events,
+    util::check_null_cb(cb, &poll_proxy_wp_<decltype(cb), D_T>));
+}
+
+int ns_poll::stop() {
+  return uv_poll_stop(uv_handle());
+}
+
+template <typename CB_T>
+void ns_poll::poll_proxy_(uv_poll_t* handle, int poll, int events) {
+  ns_poll* wrap = ns_poll::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->poll_cb_ptr_);
+  NSUV_TRACE_HANDLE("poll", handle, cb_);
+  cb_(wrap, poll, events);
+}
+
+template <typename CB_T, typename D_T>
+void ns_poll::poll_proxy_(uv_poll_t* handle, int poll, int events) {
+  ns_poll* wrap = ns_poll::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->poll_cb_ptr_);
+  NSUV_TRACE_HANDLE("poll", handle, cb_);
+  cb_(wrap, poll, events, static_cast<D_T*>(wrap->poll_cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_poll::poll_proxy_wp_(uv_poll_t* handle, int poll, int events) {
+  ns_poll* wrap = ns_poll::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->poll_cb_ptr_);
+  NSUV_TRACE_HANDLE("poll", handle, cb_);
+  auto data = wrap->poll_cb_wp_.lock();
+  cb_(wrap, poll, events, std::static_pointer_cast<D_T>(data));
+}
+
+
+/* ns_tcp */
+
+int ns_tcp::init(uv_loop_t* loop) {
+  return uv_tcp_init(loop, uv_handle());
+}
+
+int ns_tcp::init_ex(uv_loop_t* loop, unsigned int flags) {
+  return uv_tcp_init_ex(loop, uv_handle(), flags);
+}
+
+int ns_tcp::open(uv_os_sock_t sock) {
+  return uv_tcp_open(uv_handle(), sock);
+}
+
+int ns_tcp::nodelay(bool enable) {
+  return uv_tcp_nodelay(uv_handle(), enable);
+}
+
+int ns_tcp::keepalive(bool enable, int delay) {
+  return uv_tcp_keepalive(uv_handle(), enable, delay);
+}
+
+int ns_tcp::simultaneous_accepts(bool enable) {
+  return uv_tcp_simultaneous_accepts(uv_handle(), enable);
+}
+
+int ns_tcp::bind(const struct sockaddr* addr, unsigned int flags) {
+  return uv_tcp_bind(uv_handle(), addr, flags);
+}
+
+int ns_tcp::getsockname(struct sockaddr* name, int* namelen) {
+  return uv_tcp_getsockname(uv_handle(), name, namelen);
+}
+
+int ns_tcp::getpeername(struct sockaddr* name, int* namelen) {
+  return uv_tcp_getpeername(uv_handle(), name, namelen);
+}
+
+int ns_tcp::close_reset(ns_close_cb cb) {
+  close_reset_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  return uv_tcp_close_reset(
+      uv_handle(),
+      cb == nullptr ? &closed_proxy_ : &close_reset_proxy_<decltype(cb)>);
+}
+
+template <typename D_T>
+int ns_tcp::close_reset(ns_close_cb_d<D_T> cb, D_T* data) {
+  close_reset_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  close_reset_data_ = data;
+
+  return uv_tcp_close_reset(
+      uv_handle(),
+      cb == nullptr ? &closed_proxy_
+                    : &close_reset_proxy_<decltype(cb), D_T>);
+}
+
+int ns_tcp::close_reset(void (*cb)(ns_tcp*, void*), std::nullptr_t) {
+  return close_reset(cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_tcp::close_reset(ns_close_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {
+  close_reset_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  close_reset_wp_ = data;
+
+  return uv_tcp_close_reset(
+      uv_handle(),
+      cb == nullptr ? &closed_proxy_
+                    : &close_reset_proxy_wp_<decltype(cb), D_T>);
+}
+
+int ns_tcp::connect(ns_connect<ns_tcp>* req,
+                    const struct sockaddr* addr,
+                    ns_connect_cb cb) {
+  int ret = req->init(addr, cb);
+  if (ret != NSUV_OK)
+    return ret;
+
+  return uv_tcp_connect(
+      req->uv_req(),
+      uv_handle(),
+      addr,
+      util::check_null_cb(cb, &connect_proxy_<decltype(cb)>));
+}
+
+template <typename D_T>
+int ns_tcp::connect(ns_connect<ns_tcp>* req,
+                    const struct sockaddr* addr,
+                    ns_connect_cb_d<D_T> cb,
+                    D_T* data) {
+  int ret = req->init(addr, cb, data);
+  if (ret != NSUV_OK)
+    return ret;
+
+  return uv_tcp_connect(
+      req->uv_req(),
+      uv_handle(),
+      addr,
+      util::check_null_cb(cb, &connect_proxy_<decltype(cb), D_T>));
+}
+
+int ns_tcp::connect(ns_connect<ns_tcp>* req,
+                    const struct sockaddr* addr,
+                    void (*cb)(ns_connect<ns_tcp>*, int, void*),
+                    std::nullptr_t) {
+  return connect(req, addr, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_tcp::connect(ns_connect<ns_tcp>* req,
+                    const struct sockaddr* addr,
+                    ns_connect_cb_wp<D_T> cb,
+                    std::weak_ptr<D_T> data) {
+  int ret = req->init(addr, cb, data);
+  if (ret != NSUV_OK)
+    return ret;
+
+  return uv_tcp_connect(
+      req->uv_req(),
+      uv_handle(),
+      addr,
+      util::check_null_cb(cb, &connect_proxy_wp_<decltype(cb), D_T>));
+}
+
+template <typename CB_T>
+void ns_tcp::connect_proxy_(uv_connect_t* uv_req, int status) {
+  auto* creq = ns_connect<ns_tcp>::cast(uv_req);
+  auto* cb_ = reinterpret_cast<CB_T>(creq->req_cb_);
+  NSUV_TRACE_REQ("connect", uv_req, cb_);
+  cb_(creq, status);
+}
+
+template <typename CB_T, typename D_T>
+void ns_tcp::connect_proxy_(uv_connect_t* uv_req, int status) {
+  auto* creq = ns_connect<ns_tcp>::cast(uv_req);
+  auto* cb_ = reinterpret_cast<CB_T>(creq->req_cb_);
+  NSUV_TRACE_REQ("connect", uv_req, cb_);
+  cb_(creq, status, static_cast<D_T*>(creq->req_cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_tcp::connect_proxy_wp_(uv_connect_t* uv_req, int status) {
+  auto* creq = ns_connect<ns_tcp>::cast(uv_req);
+  auto* cb_ = reinterpret_cast<CB_T>(creq->req_cb_);
+  NSUV_TRACE_REQ("connect", uv_req, cb_);
+  auto data = creq->req_cb_wp_.lock();
+  cb_(creq, status, std::static_pointer_cast<D_T>(data));
+}
+
+template <typename CB_T>
+void ns_tcp::close_reset_proxy_(uv_handle_t* handle) {
+  ns_tcp* wrap = ns_tcp::cast(handle);
+  auto* cb = reinterpret_cast<CB_T>(wrap->close_reset_cb_ptr_);
+  NSUV_TRACE_HANDLE("close", handle, cb);
+  wrap->closed_();
+  cb(wrap);
+}
+
+template <typename CB_T, typename D_T>
+void ns_tcp::close_reset_proxy_(uv_handle_t* handle) {
+  ns_tcp* wrap = ns_tcp::cast(handle);
+  auto* cb = reinterpret_cast<CB_T>(wrap->close_reset_cb_ptr_);
+  NSUV_TRACE_HANDLE("close", handle, cb);
+  wrap->closed_();
+  cb(wrap, static_cast<D_T*>(wrap->close_reset_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_tcp::close_reset_proxy_wp_(uv_handle_t* handle) {
+  ns_tcp* wrap = ns_tcp::cast(handle);
+  auto* cb = reinterpret_cast<CB_T>(wrap->close_reset_cb_ptr_);
+  NSUV_TRACE_HANDLE("close", handle, cb);
+  wrap->closed_();
+  auto data = wrap->close_reset_wp_.lock();
+  cb(wrap, std::static_pointer_cast<D_T>(data));
+}
+
+
+/* ns_relay */
+
+ns_relay::~ns_relay() {
+#if defined(__linux__)
+  for (direction* d : { &a_to_b_, &b_to_a_ }) {
+    for (int fd : d->pipe_fds) {
+      if (fd != -1)
+        ::close(fd);
+    }
+  }
+#endif
+  while (pool_ != nullptr) {
+    chunk* c = pool_;
+    pool_ = c->next;
+    delete c;
+  }
+}
+
+int ns_relay::start(ns_tcp* a, ns_tcp* b, ns_relay_cb cb) {
+  int r;
+
+  cb_ = cb;
+  r = start_(&a_to_b_, a, b);
+  if (r != NSUV_OK)
+    return r;
+  r = start_(&b_to_a_, b, a);
+  if (r != NSUV_OK) {
+    uv_read_stop(a->base_stream());
+    return r;
+  }
+  return NSUV_OK;
+}
+
+void ns_relay::set_use_splice(bool use) {
+  use_splice_ = use;
+}
+
+uint64_t ns_relay::bytes_a_to_b() {
+  return a_to_b_.bytes + pumped_(&a_to_b_);
+}
+
+uint64_t ns_relay::bytes_b_to_a() {
+  return b_to_a_.bytes + pumped_(&b_to_a_);
+}
+
+uint64_t ns_relay::bytes_copied() {
+  return bytes_copied_ + pumped_(&a_to_b_) + pumped_(&b_to_a_);
+}
+
+int ns_relay::start_(direction* d, ns_tcp* src, ns_tcp* dst) {
+  d->relay = this;
+  d->src = src;
+  d->dst = dst;
+#if defined(__linux__)
+  if (use_splice_ && pipe2(d->pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0)
+    d->splice = true;
+#endif
+  if (!d->splice)
+    return pump_start_(d);
+  return read_start_(d);
+}
+
+int ns_relay::read_start_(direction* d) {
+  return d->src->read_start(alloc_cb_, read_cb_, d);
+}
+
+int ns_relay::pump_start_(direction* d) {
+  int r = d->src->pump(d->dst, pump_cb_, d);
+  if (r == NSUV_OK)
+    d->pumping = true;
+  return r;
+}
+
+uint64_t ns_relay::pumped_(direction* d) {
+  // Only read from the pump while it runs, src may be gone afterwards.
+  return d->pumping ? d->src->pump_->bytes : 0;
+}
+
+void ns_relay::alloc_cb_(ns_tcp*, size_t, uv_buf_t* buf, direction*) {
+  // An empty buffer makes libuv report readability with UV_ENOBUFS without
+  // reading anything, so the data can be spliced instead.
+  *buf = uv_buf_init(nullptr, 0);
+}
+
+void ns_relay::read_cb_(ns_tcp*,
+                        ssize_t nread,
+                        const uv_buf_t*,
+                        direction* d) {
+  ns_relay* relay = d->relay;
+
+  if (nread == UV_ENOBUFS)
+    return relay->pump_(d);
+  if (nread < 0)
+    return relay->fail_(nread);
+}
+
+void ns_relay::write_cb_(ns_write<ns_tcp>* req, int status, direction* d) {
+  ns_relay* relay = d->relay;
+
+  relay->release_(static_cast<chunk*>(req));
+  if (relay->finished_)
+    return;
+
+  if (status < 0) {
+    relay->fail_(status);
+    return;
+  }
+
+  // Spliced data can only go straight to the socket once everything that was
+  // queued has been written.
+  if (!d->paused || d->dst->get_write_queue_size() > 0)
+    return;
+
+  d->paused = false;
+  if (d->eof)
+    return;
+
+  int r = relay->read_start_(d);
+  if (r != NSUV_OK)
+    relay->fail_(r);
+}
+
+void ns_relay::pump_cb_(ns_tcp*, int status, direction* d) {
+  ns_relay* relay = d->relay;
+  uint64_t bytes = relay->pumped_(d);
+
+  d->pumping = false;
+  d->bytes += bytes;
+  relay->bytes_copied_ += bytes;
+  if (status < 0)
+    return relay->fail_(status);
+
+  // The pump has already shut dst down.
+  relay->done_(d);
+}
+
+void ns_relay::pump_(direction* d) {
+#if defined(__linux__)
+  uv_os_fd_t src_fd;
+  uv_os_fd_t dst_fd;
+
+  if (uv_fileno(d->src->base_handle(), &src_fd) != 0 ||
+      uv_fileno(d->dst->base_handle(), &dst_fd) != 0) {
+    return fail_(UV_EBADF);
+  }
+
+  // The pipe is always empty here, so EAGAIN means the source is drained.
+  // Like libuv's reads, a busy source only gets so many chunks per callback,
+  // the rest waits for the next time it's reported readable.
+  for (size_t i = 0; i < kSplicesPerCb; i++) {
+    ssize_t n;
+    do {
+      n = splice(src_fd, nullptr, d->pipe_fds[1], nullptr, kChunkSize,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == 0) {
+      d->eof = true;
+      uv_read_stop(d->src->base_stream());
+      return shutdown_(d);
+    }
+
+    if (n == -1) {
+      if (errno == EAGAIN)
+        return;
+      // Not supported for this socket, so fall back to a pump().
+      if (errno == EINVAL && d->bytes == 0) {
+        d->splice = false;
+        uv_read_stop(d->src->base_stream());
+        int r = pump_start_(d);
+        if (r != NSUV_OK)
+          fail_(r);
+        return;
+      }
+      return fail_(-errno);
+    }
+
+    d->pipe_len += n;
+    d->bytes += n;
+
+    while (d->pipe_len > 0) {
+      do {
+        n = splice(d->pipe_fds[0], nullptr, dst_fd, nullptr, d->pipe_len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      } while (n == -1 && errno == EINTR);
+
+      if (n == -1 && errno != EAGAIN)
+        return fail_(-errno);
+
+      if (n == -1) {
+        // The destination is full. Queue what's left in the pipe and wait
+        // for it to be written before reading any more.
+        int r = spill_(d);
+        if (r != NSUV_OK)
+          return fail_(r);
+        d->paused = true;
+        uv_read_stop(d->src->base_stream());
+        return;
+      }
+
+      d->pipe_len -= n;
+    }
+  }
+#else
+  static_cast<void>(d);
+#endif
+}
+
+int ns_relay::spill_(direction* d) {
+#if defined(__linux__)
+  while (d->pipe_len > 0) {
+    chunk* c = acquire_();
+    if (c == nullptr)
+      return UV_ENOMEM;
+
+    size_t len = d->pipe_len < kChunkSize ? d->pipe_len : kChunkSize;
+    ssize_t n;
+    do {
+      n = read(d->pipe_fds[0], c->data, len);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+      release_(c);
+      return n == 0 ? UV_EIO : -errno;
+    }
+
+    uv_buf_t buf = uv_buf_init(c->data, n);
+    int r = d->dst->write(c, &buf, 1, write_cb_, d);
+    if (r != NSUV_OK) {
+      release_(c);
+      return r;
+    }
+    d->pipe_len -= n;
+    bytes_copied_ += n;
+  }
+#else
+  static_cast<void>(d);
+#endif
+  return NSUV_OK;
+}
+
+void ns_relay::shutdown_(direction* d) {
+  d->shutdown_req.data = d;
+  // Queued writes still go out before the shutdown.
+  int r = uv_shutdown(&d->shutdown_req, d->dst->base_stream(), shutdown_cb_);
+  if (r != NSUV_OK)
+    fail_(r);
+}
+
+void ns_relay::shutdown_cb_(uv_shutdown_t* req, int status) {
+  direction* d = static_cast<direction*>(req->data);
+  ns_relay* relay = d->relay;
+
+  if (relay->finished_)
+    return;
+  if (status < 0)
+    return relay->fail_(status);
+
+  relay->done_(d);
+}
+
+void ns_relay::done_(direction* d) {
+  d->done = true;
+  if (finished_ || !a_to_b_.done || !b_to_a_.done)
+    return;
+
+  finished_ = true;
+  if (cb_ != nullptr)
+    cb_(this, NSUV_OK);
+}
+
+void ns_relay::fail_(int status) {
+  if (finished_)
+    return;
+
+  finished_ = true;
+  for (direction* d : { &a_to_b_, &b_to_a_ }) {
+    // Ends the pump, which calls pump_cb_() while finished_ is already set.
+    if (d->pumping)
+      d->src->pump_finish_(UV_ECANCELED);
+    else
+      uv_read_stop(d->src->base_stream());
+  }
+  if (cb_ != nullptr)
+    cb_(this, status);
+}
+
+ns_relay::chunk* ns_relay::acquire_() {
+  chunk* c = pool_;
+  if (c == nullptr)
+    return new (std::nothrow) chunk;
+
+  pool_ = c->next;
+  pool_size_--;
+  return c;
+}
+
+void ns_relay::release_(chunk* c) {
+  if (pool_size_ >= kPoolMax) {
+    delete c;
+    return;
+  }
+
+  c->next = pool_;
+  pool_ = c;
+  pool_size_++;
+}
+
+
+/* ns_zerocopy */
+
+int ns_zerocopy::init(ns_tcp* handle) {
+#if defined(__linux__)
+  uv_os_fd_t fd;
+  int one = 1;
+  int r;
+
+  r = uv_fileno(handle->base_handle(), &fd);
+  if (r != 0)
+    return r;
+  if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+    return -errno;
+
+  fd_ = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (fd_ == -1)
+    return -errno;
+
+  r = poll_.init_socket(handle->get_loop(), fd_);
+  if (r != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return r;
+  }
+
+  handle_ = handle;
+  return NSUV_OK;
+#else
+  (void)handle;
+  return UV_ENOTSUP;
+#endif
+}
+
+int ns_zerocopy::write(ns_write<ns_tcp>* req,
+                       const uv_buf_t bufs[],
+                       size_t nbufs,
+                       ns_tcp::ns_write_cb cb) {
+  if (use_copy_(bufs, nbufs))
+    return handle_->write(req, bufs, nbufs, cb);
+  return write_(req,
+                bufs,
+                nbufs,
+                cb,
+                NSUV_CAST_NULLPTR,
+                &ns_tcp::write_proxy_<decltype(cb)>);
+}
+
+template <typename D_T>
+int ns_zerocopy::write(ns_write<ns_tcp>* req,
+                       const uv_buf_t bufs[],
+                       size_t nbufs,
+                       ns_tcp::ns_write_cb_d<D_T> cb,
+                       D_T* data) {
+  if (use_copy_(bufs, nbufs))
+    return handle_->write(req, bufs, nbufs, cb, data);
+  return write_(req,
+                bufs,
+                nbufs,
+                cb,
+                data,
+                &ns_tcp::write_proxy_<decltype(cb), D_T>);
+}
+
+int ns_zerocopy::write(ns_write<ns_tcp>* req,
+                       const uv_buf_t bufs[],
+                       size_t nbufs,
+                       void (*cb)(ns_write<ns_tcp>*, int, void*),
+                       std::nullptr_t) {
+  return write(req, bufs, nbufs, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_zerocopy::write(ns_write<ns_tcp>* req,
+                       const uv_buf_t bufs[],
+                       size_t nbufs,
+                       ns_tcp::ns_write_cb_wp<D_T> cb,
+                       std::weak_ptr<D_T> data) {
+  if (use_copy_(bufs, nbufs))
+    return handle_->write(req, bufs, nbufs, cb, data);
+  return write_(req,
+                bufs,
+                nbufs,
+                cb,
+                data,
+                &ns_tcp::write_proxy_wp_<decltype(cb), D_T>);
+}
+
+void ns_zerocopy::set_min_size(size_t size) {
+  min_size_ = size;
+}
+
+void ns_zerocopy::close(void (*cb)(ns_zerocopy*)) {
+  close_cb_ptr_ = cb;
+  // The poll handle was never initialized.
+  if (fd_ == -1) {
+    if (cb != nullptr)
+      cb(this);
+    return;
+  }
+  poll_.close(close_cb_, this);
+#if defined(__linux__)
+  // uv_close() has already removed the fd from the poller.
+  ::close(fd_);
+#endif
+  fd_ = -1;
+}
+
+uint64_t ns_zerocopy::completions() {
+  return completions_;
+}
+
+uint64_t ns_zerocopy::copied() {
+  return copied_;
+}
+
+template <typename CB, typename D_T>
+int ns_zerocopy::write_(ns_write<ns_tcp>* req,
+                        const uv_buf_t bufs[],
+                        size_t nbufs,
+                        CB cb,
+                        D_T data,
+                        uv_write_cb proxy) {
+  if (fd_ == -1)
+    return UV_EBADF;
+
+  int r = req->init(bufs, nbufs, cb, data);
+  if (r != NSUV_OK)
+    return r;
+
+  entry* e = new (std::nothrow) entry();
+  if (e == nullptr)
+    return UV_ENOMEM;
+
+  req->uv_req()->handle = handle_->base_stream();
+  e->req = req;
+  e->proxy = util::check_null_cb(cb, proxy);
+  if (tail_ == nullptr)
+    head_ = e;
+  else
+    tail_->next = e;
+  tail_ = e;
+  if (unsent_ == nullptr)
+    unsent_ = e;
+
+  r = flush_();
+  if (r != NSUV_OK && r != UV_EAGAIN)
+    fail_(r);
+  // Callbacks are only ever called from the poll callback.
+  update_poll_();
+  return NSUV_OK;
+}
+
+bool ns_zerocopy::use_copy_(const uv_buf_t bufs[], size_t nbufs) {
+  size_t len = 0;
+
+  // Without a successful init() there's no handle_, write_() returns
+  // UV_EBADF.
+  if (fd_ == -1 || head_ != nullptr)
+    return false;
+  for (size_t i = 0; i < nbufs && len < min_size_; i++)
+    len += bufs[i].len;
+  return len < min_size_;
+}
+
+int ns_zerocopy::flush_() {
+#if defined(__linux__)
+  enum { kMaxIov = 64 };
+  struct iovec iov[kMaxIov];
+
+  while (unsent_ != nullptr) {
+    entry* e = unsent_;
+    const uv_buf_t* bufs = e->req->bufs();
+    size_t nbufs = e->req->size();
+
+    while (e->buf_idx < nbufs && e->offset == bufs[e->buf_idx].len) {
+      e->buf_idx++;
+      e->offset = 0;
+    }
+    if (e->buf_idx == nbufs) {
+      e->sent = true;
+      unsent_ = e->next;
+      continue;
+    }
+
+    // Anything queued with uv_write() needs to go out first.
+    if (handle_->get_write_queue_size() > 0)
+      return UV_EAGAIN;
+
+    struct msghdr msg;
+    size_t n = 0;
+    memset(&msg, 0, sizeof(msg));
+    for (size_t i = e->buf_idx; i < nbufs && n < kMaxIov; i++, n++) {
+      size_t off = i == e->buf_idx ? e->offset : 0;
+      iov[n].iov_base = bufs[i].base + off;
+      iov[n].iov_len = bufs[i].len - off;
+    }
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    ssize_t r;
+    do {
+      r = sendmsg(fd_, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (r == -1 && errno == EINTR);
+
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return UV_EAGAIN;
+      // Out of optmem for pinned pages, wait for completions to free some.
+      if (errno == ENOBUFS && pending_acks_ > 0) {
+        wait_acks_ = true;
+        return UV_EAGAIN;
+      }
+      return -errno;
+    }
+
+    // Each successful call is assigned the next notification sequence.
+    if (e->nseq == 0)
+      e->first_seq = next_seq_;
+    e->nseq++;
+    next_seq_++;
+    pending_acks_++;
+
+    size_t left = r;
+    while (left > 0) {
+      size_t avail = bufs[e->buf_idx].len - e->offset;
+      if (left < avail) {
+        e->offset += left;
+        break;
+      }
+      left -= avail;
+      e->buf_idx++;
+      e->offset = 0;
+    }
+  }
+#endif
+  return NSUV_OK;
+}
+
+void ns_zerocopy::drain_() {
+#if defined(__linux__)
+  char control[128];
+  struct msghdr msg;
+
+  while (true) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+         cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      struct sock_extended_err ee;
+      memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+      if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee.ee_errno != 0)
+        continue;
+      completions_++;
+      if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        copied_++;
+      wait_acks_ = false;
+      ack_(ee.ee_info, ee.ee_data);
+    }
+  }
+#endif
+}
+
+void ns_zerocopy::ack_(uint32_t lo, uint32_t hi) {
+  pending_acks_ -= hi - lo + 1;
+
+  for (entry* e = head_; e != nullptr; e = e->next) {
+    // Skip entries that haven't sent anything or have already failed.
+    if (e->ndone == e->nseq)
+      continue;
+    // Compare relative to the entry so the sequence can wrap around.
+    int64_t start = static_cast<int32_t>(lo - e->first_seq);
+    int64_t end = static_cast<int32_t>(hi - e->first_seq);
+    if (start < 0)
+      start = 0;
+    if (end > static_cast<int64_t>(e->nseq) - 1)
+      end = e->nseq - 1;
+    if (start <= end)
+      e->ndone += static_cast<uint32_t>(end - start + 1);
+    if (e->ndone > e->nseq)
+      e->ndone = e->nseq;
+  }
+}
+
+void ns_zerocopy::fail_(int status) {
+  for (entry* e = head_; e != nullptr; e = e->next) {
+    if (e->sent && e->ndone == e->nseq)
+      continue;
+    e->status = status;
+    e->sent = true;
+    e->ndone = e->nseq;
+  }
+  unsent_ = nullptr;
+}
+
+void ns_zerocopy::complete_() {
+  while (head_ != nullptr && head_->sent && head_->ndone == head_->nseq) {
+    entry* e = head_;
+    head_ = e->next;
+    if (head_ == nullptr)
+      tail_ = nullptr;
+
+    ns_write<ns_tcp>* req = e->req;
+    uv_write_cb proxy = e->proxy;
+    int status = e->status;
+    delete e;
+    if (proxy != nullptr)
+      proxy(req->uv_req(), status);
+  }
+}
+
+void ns_zerocopy::update_poll_() {
+  int events = 0;
+
+  if (fd_ == -1)
+    return;
+
+  if (head_ != nullptr) {
+    // Errors, and so the error queue, are always polled for. Writability is
+    // also used to get back to the loop once the head can be completed.
+    events = UV_PRIORITIZED;
+    if ((unsent_ != nullptr && !wait_acks_) ||
+        (head_->sent && head_->ndone == head_->nseq)) {
+      events |= UV_WRITABLE;
+    }
+  }
+
+  if (events == poll_events_)
+    return;
+
+  int r = events == 0 ? poll_.stop() : poll_.start(events, poll_cb_, this);
+  if (r == NSUV_OK)
+    poll_events_ = events;
+}
+
+void ns_zerocopy::poll_cb_(ns_poll*, int status, int, ns_zerocopy* self) {
+  size_t before = self->completions_;
+
+  self->drain_();
+
+  if (status < 0) {
+    // libuv stops the poll handle on POLLERR, which also fires while the
+    // error queue has completions.
+    self->poll_events_ = 0;
+#if defined(__linux__)
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (self->completions_ == before &&
+        getsockopt(self->fd_, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+        err != 0) {
+      self->fail_(-err);
+    }
+#endif
+  }
+
+  int r = self->flush_();
+  if (r != NSUV_OK && r != UV_EAGAIN)
+    self->fail_(r);
+
+  self->complete_();
+  self->update_poll_();
+}
+
+void ns_zerocopy::close_cb_(ns_poll*, ns_zerocopy* self) {
+  self->fail_(UV_ECANCELED);
+  self->complete_();
+  self->unsent_ = nullptr;
+  if (self->close_cb_ptr_ != nullptr)
+    self->close_cb_ptr_(self);
+}
+
+
+/* ns_timer */
+
+int ns_timer::init(uv_loop_t* loop) {
+  timer_cb_ptr_ = nullptr;
+  timer_cb_data_ = nullptr;
+  return uv_timer_init(loop, uv_handle());
+}
+
+int ns_timer::start(ns_timer_cb cb, uint64_t timeout, uint64_t repeat) {
+  timer_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+
+  return uv_timer_start(uv_handle(),
+                        util::check_null_cb(cb, &timer_proxy_<decltype(cb)>),
+                        timeout,
+                        repeat);
+}
+
+template <typename D_T>
+int ns_timer::start(ns_timer_cb_d<D_T> cb,
+                    uint64_t timeout,
+                    uint64_t repeat,
+                    D_T* data) {
+  timer_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  timer_cb_data_ = data;
+
+  return uv_timer_start(
+    uv_handle(),
+    util::check_null_cb(cb, &timer_proxy_<decltype(cb), D_T>),
+    timeout,
+    repeat);
+}
+
+int ns_timer::start(void (*cb)(ns_timer*, void*),
+                    uint64_t timeout,
+                    uint64_t repeat,
+                    std::nullptr_t) {
+  return start(cb, timeout, repeat, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_timer::start(ns_timer_cb_wp<D_T> cb,
+                    uint64_t timeout,
+                    uint64_t repeat,
+                    std::weak_ptr<D_T> data) {
+  timer_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  timer_cb_wp_ = data;
+
+  return uv_timer_start(
+    uv_handle(),
+    util::check_null_cb(cb, &timer_proxy_wp_<decltype(cb), D_T>),
+    timeout,
+    repeat);
+}
+
+int ns_timer::stop() {
+  return uv_timer_stop(uv_handle());
+}
+
+size_t ns_timer::get_repeat() {
+  return uv_timer_get_repeat(uv_handle());
+}
+
+template <typename CB_T>
+void ns_timer::timer_proxy_(uv_timer_t* handle) {
+  ns_timer* wrap = ns_timer::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->timer_cb_ptr_);
+  NSUV_TRACE_HANDLE("timer", handle, cb_);
+  cb_(wrap);
+}
+
+template <typename CB_T, typename D_T>
+void ns_timer::timer_proxy_(uv_timer_t* handle) {
+  ns_timer* wrap = ns_timer::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->timer_cb_ptr_);
+  NSUV_TRACE_HANDLE("timer", handle, cb_);
+  cb_(wrap, static_cast<D_T*>(wrap->timer_cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_timer::timer_proxy_wp_(uv_timer_t* handle) {
+  ns_timer* wrap = ns_timer::cast(handle);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->timer_cb_ptr_);
+  NSUV_TRACE_HANDLE("timer", handle, cb_);
+  auto data = wrap->timer_cb_wp_.lock();
+  cb_(wrap, std::static_pointer_cast<D_T>(data));
+}
+
+
+/* ns_check, ns_idle, ns_prepare */
+
+#define NSUV_LOOP_WATCHER_DEFINE(name)                                         \
+  int ns_##name::init(uv_loop_t* loop) {                                       \
+    name##_cb_ptr_ = nullptr;                                                  \
+    name##_cb_data_ = nullptr;                                                 \
+    return uv_##name##_init(loop, uv_handle());                                \
+  }                                                                            \
+                                                                               \
+  int ns_##name::start(ns_##name##_cb cb) {                                    \
+    if (is_active())                                                           \
+      return 0;                                                                \
+    name##_cb_ptr_ = reinterpret_cast<void (*)()>(cb);                         \
+    return uv_##name##_start(                                                  \
+        uv_handle(),                                                           \
+        util::check_null_cb(cb, &name##_proxy_<decltype(cb)>));                \
+  }                                                                            \
+                                                                               \
+  template <typename D_T>                                                      \
+  int ns_##name::start(ns_##name##_cb_d<D_T> cb, D_T* data) {                  \
+    if (is_active())                                                           \
+      return 0;                                                                \
+    name##_cb_ptr_ = reinterpret_cast<void (*)()>(cb);                         \
+    name##_cb_data_ = data;                                                    \
+    return uv_##name##_start(                                                  \
+        uv_handle(),                                                           \
+        util::check_null_cb(cb, &name##_proxy_<decltype(cb), D_T>));           \
+  }                                                                            \
+                                                                               \
+  int ns_##name::start(void (*cb)(ns_##name*, void*), std::nullptr_t) {        \
+    return start(cb, NSUV_CAST_NULLPTR);                                       \
+  }                                                                            \
+                                                                               \
+  template <typename D_T>                                                      \
+  int ns_##name::start(ns_##name##_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {   \
+    if (is_active())                                                           \
+      return 0;                                                                \
+    name##_cb_ptr_ = reinterpret_cast<void (*)()>(cb);                         \
+    name##_cb_wp_ = data;                                                      \
+    return uv_##name##_start(                                                  \
+        uv_handle(),                                                           \
+        util::check_null_cb(cb, &name##_proxy_wp_<decltype(cb), D_T>));        \
+  }                                                                            \
+                                                                               \
+  int ns_##name::stop() { return uv_##name##_stop(uv_handle()); }              \
+                                                                               \
+  template <typename CB_T>                                                     \
+  void ns_##name::name##_proxy_(uv_##name##_t* handle) {                       \
+    ns_##name* wrap = ns_##name::cast(handle);                                 \
+    auto* cb_ = reinterpret_cast<CB_T>(wrap->name##_cb_ptr_);                  \
+    NSUV_TRACE_HANDLE(#name, handle, cb_);                                     \
+    cb_(wrap);                                                                 \
+  }                                                                            \
+                                                                               \
+  template <typename CB_T, typename D_T>                                       \
+  void ns_##name::name##_proxy_(uv_##name##_t* handle) {                       \
+    ns_##name* wrap = ns_##name::cast(handle);                                 \
+    auto* cb_ = reinterpret_cast<CB_T>(wrap->name##_cb_ptr_);                  \
+    NSUV_TRACE_HANDLE(#name, handle, cb_);                                     \
+    cb_(wrap, static_cast<D_T*>(wrap->name##_cb_data_));                       \
+  }                                                                            \
+                                                                               \
+  template <typename CB_T, typename D_T>                                       \
+  void ns_##name::name##_proxy_wp_(uv_##name##_t* handle) {                    \
+    ns_##name* wrap = ns_##name::cast(handle);                                 \
+    auto* cb_ = reinterpret_cast<CB_T>(wrap->name##_cb_ptr_);                  \
+    NSUV_TRACE_HANDLE(#name, handle, cb_);                                     \
+    auto data = wrap->name##_cb_wp_.lock();                                    \
+    cb_(wrap, std::static_pointer_cast<D_T>(data));                            \
+  }
+
+
+NSUV_LOOP_WATCHER_DEFINE(check)
+NSUV_LOOP_WATCHER_DEFINE(idle)
+NSUV_LOOP_WATCHER_DEFINE(prepare)
+
+#undef NSUV_LOOP_WATCHER_DEFINE
+
+
+/* ns_fs_uring */
+
+int ns_fs_uring::init(uv_loop_t* loop, size_t entries) {
+  loop_ = loop;
+#if defined(NSUV_HAVE_IO_URING)
+  if (entries == 0)
+    return UV_EINVAL;
+
+  int r = setup_(entries);
+  if (r != 0) {
+    destroy_();
+    return r;
+  }
+
+  r = poll_.init(loop, event_fd_);
+  if (r != 0) {
+    destroy_();
+    return r;
+  }
+  r = prepare_.init(loop);
+  if (r != 0) {
+    poll_.close();
+    destroy_();
+    return r;
+  }
+
+  return NSUV_OK;
+#else
+  return UV_ENOTSUP;
+#endif
+}
+
+#define NSUV_ARGS(...) __VA_ARGS__
+#define NSUV_STRIP(X) X
+#define NSUV_PASS(X) NSUV_STRIP(NSUV_ARGS X)
+#define NSUV_FS_URING_FN(name, P1, P2, OP)                                     \
+  int ns_fs_uring::name(ns_fs* req, NSUV_PASS(P1), ns_fs::ns_fs_cb cb) {       \
+    if (!use_ring_(cb != nullptr))                                             \
+      return req->name(loop_, NSUV_PASS(P2), cb);                              \
+    req->init(loop_, cb);                                                      \
+    return submit_(req, { NSUV_PASS(OP) }, &ns_fs::cb_proxy_<decltype(cb)>);   \
+  }                                                                            \
+  template <typename D_T>                                                      \
+  int ns_fs_uring::name(ns_fs* req,                                            \
+                        NSUV_PASS(P1),                                         \
+                        ns_fs::ns_fs_cb_d<D_T> cb,                             \
+                        D_T* data) {                                           \
+    if (!use_ring_(cb != nullptr))                                             \
+      return req->name(loop_, NSUV_PASS(P2), cb, data);                        \
+    req->init(loop_, cb, data);                                                \
+    return submit_(                                                            \
+        req, { NSUV_PASS(OP) }, &ns_fs::cb_proxy_<decltype(cb), D_T>);         \
+  }                                                                            \
+  template <typename D_T>                                                      \
+  int ns_fs_uring::name(ns_fs* req,                                            \
+                        NSUV_PASS(P1),                                         \
+                        ns_fs::ns_fs_cb_wp<D_T> cb,                            \
+                        std::weak_ptr<D_T> data) {                             \
+    if (!use_ring_(cb != nullptr))                                             \
+      return req->name(loop_, NSUV_PASS(P2), cb, data);                        \
+    req->init(loop_, cb, data);                                                \
+    return submit_(                                                            \
+        req, { NSUV_PASS(OP) }, &ns_fs::cb_proxy_wp_<decltype(cb), D_T>);      \
+  }
+
+NSUV_FS_URING_FN(close,
+                 (uv_file file),
+                 (file),
+                 (UV_FS_CLOSE, file, nullptr, nullptr, 0, 0, 0, 0))
+NSUV_FS_URING_FN(open,
+                 (const char* path, int flags, int mode),
+                 (path, flags, mode),
+                 (UV_FS_OPEN, -1, path, nullptr, 0, 0, flags, mode))
+NSUV_FS_URING_FN(
+    read,
+    (uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset),
+    (file, bufs, nbufs, offset),
+    (UV_FS_READ, file, nullptr, bufs, nbufs, offset, 0, 0))
+NSUV_FS_URING_FN(
+    read,
+    (uv_file file, const std::vector<uv_buf_t>& bufs, int64_t offset),
+    (file, bufs.data(), bufs.size(), offset),
+    (UV_FS_READ, file, nullptr, bufs.data(), bufs.size(), offset, 0, 0))
+NSUV_FS_URING_FN(
+    write,
+    (uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset),
+    (file, bufs, nbufs, offset),
+    (UV_FS_WRITE, file, nullptr, bufs, nbufs, offset, 0, 0))
+NSUV_FS_URING_FN(
+    write,
+    (uv_file file, const std::vector<uv_buf_t>& bufs, int64_t offset),
+    (file, bufs.data(), bufs.size(), offset),
+    (UV_FS_WRITE, file, nullptr, bufs.data(), bufs.size(), offset, 0, 0))
+NSUV_FS_URING_FN(fsync,
+                 (uv_file file),
+                 (file),
+                 (UV_FS_FSYNC, file, nullptr, nullptr, 0, 0, 0, 0))
+NSUV_FS_URING_FN(fdatasync,
+                 (uv_file file),
+                 (file),
+                 (UV_FS_FDATASYNC, file, nullptr, nullptr, 0, 0, 0, 0))
+NSUV_FS_URING_FN(stat,
+                 (const char* path),
+                 (path),
+                 (UV_FS_STAT, -1, path, nullptr, 0, 0, 0, 0))
+NSUV_FS_URING_FN(fstat,
+                 (uv_file file),
+                 (file),
+                 (UV_FS_FSTAT, file, nullptr, nullptr, 0, 0, 0, 0))
+NSUV_FS_URING_FN(lstat,
+                 (const char* path),
+                 (path),
+                 (UV_FS_LSTAT, -1, path, nullptr, 0, 0, 0, 0))
+
+#undef NSUV_FS_URING_FN
+#undef NSUV_PASS
+#undef NSUV_STRIP
+#undef NSUV_ARGS
+
+void ns_fs_uring::close(void (*cb)(ns_fs_uring*)) {
+  close_cb_ptr_ = cb;
+  closing_ = true;
+  if (ring_fd_ == -1) {
+    if (cb != nullptr)
+      cb(this);
+    return;
+  }
+  // Otherwise the handles are closed by reap_() once the ring is empty.
+  if (inflight_ == 0)
+    poll_.close(poll_close_cb_, this);
+}
+
+uint64_t ns_fs_uring::submitted() {
+  return submitted_;
+}
+
+uint64_t ns_fs_uring::fallbacks() {
+  return fallbacks_;
+}
+
+void ns_fs_uring::poll_cb_(ns_poll*, int, int, ns_fs_uring* ring) {
+#if defined(NSUV_HAVE_IO_URING)
+  uint64_t count;
+  // Only needs to be cleared, reap_() finds the completions itself.
+  ssize_t r = ::read(ring->event_fd_, &count, sizeof(count));
+  static_cast<void>(r);
+#endif
+  ring->reap_();
+}
+
+void ns_fs_uring::prepare_cb_(ns_prepare*, ns_fs_uring* ring) {
+  ring->flush_();
+}
+
+void ns_fs_uring::poll_close_cb_(ns_poll*, ns_fs_uring* ring) {
+  ring->prepare_.close(prepare_close_cb_, ring);
+}
+
+void ns_fs_uring::prepare_close_cb_(ns_prepare*, ns_fs_uring* ring) {
+  ring->destroy_();
+  if (ring->close_cb_ptr_ != nullptr)
+    ring->close_cb_ptr_(ring);
+}
+
+int ns_fs_uring::setup_(size_t entries) {
+#if defined(NSUV_HAVE_IO_URING)
+  struct io_uring_params params;
+  int r;
+
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup,
+                                      static_cast<unsigned>(entries),
+                                      &params));
+  if (ring_fd_ == -1)
+    return -errno;
+  // Current file positions, openat, statx and close all came in 5.6.
+  if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    return UV_ENOSYS;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size_ > sq_ring_size_)
+      sq_ring_size_ = cq_ring_size_;
+    cq_ring_size_ = 0;
+  }
+
+  sq_ring_ = mmap(nullptr,
+                  sq_ring_size_,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  ring_fd_,
+                  IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    return -errno;
+  }
+  cq_ring_ = sq_ring_;
+  if (cq_ring_size_ > 0) {
+    cq_ring_ = mmap(nullptr,
+                    cq_ring_size_,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring_fd_,
+                    IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      return -errno;
+    }
+  }
+  sqes_ = mmap(nullptr,
+               sqes_size_,
+               PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE,
+               ring_fd_,
+               IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = nullptr;
+    return -errno;
+  }
+
+  char* sq = static_cast<char*>(sq_ring_);
+  char* cq = static_cast<char*>(cq_ring_);
+  sq_tail_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+  cq_head_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+  // SQ slots are used in order, so the index array never changes.
+  uint32_t* array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+  for (uint32_t i = 0; i < params.sq_entries; i++)
+    array[i] = i;
+
+  event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (event_fd_ == -1)
+    return -errno;
+  r = static_cast<int>(syscall(__NR_io_uring_register,
+                               ring_fd_,
+                               IORING_REGISTER_EVENTFD,
+                               &event_fd_,
+                               1));
+  if (r == -1)
+    return -errno;
+
+  // Every request has a CQ slot, since the kernel makes the CQ twice as big.
+  entries_ = params.sq_entries;
+  return NSUV_OK;
+#else
+  static_cast<void>(entries);
+  return UV_ENOTSUP;
+#endif
+}
+
+void ns_fs_uring::destroy_() {
+#if defined(NSUV_HAVE_IO_URING)
+  if (sqes_ != nullptr)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != nullptr)
+    munmap(sq_ring_, sq_ring_size_);
+  if (event_fd_ != -1)
+    ::close(event_fd_);
+  if (ring_fd_ != -1)
+    ::close(ring_fd_);
+#endif
+  sqes_ = nullptr;
+  cq_ring_ = nullptr;
+  sq_ring_ = nullptr;
+  event_fd_ = -1;
+  ring_fd_ = -1;
+  entries_ = 0;
+}
+
+bool ns_fs_uring::use_ring_(bool has_cb) {
+  if (has_cb && ring_fd_ != -1 && !closing_ && inflight_ < entries_)
+    return true;
+  fallbacks_++;
+  return false;
+}
+
+int ns_fs_uring::submit_(ns_fs* req, const op& o, uv_fs_cb proxy) {
+#if defined(NSUV_HAVE_IO_URING)
+  bool is_rw = o.type == UV_FS_READ || o.type == UV_FS_WRITE;
+  bool is_stat = o.type == UV_FS_STAT || o.type == UV_FS_LSTAT ||
+                 o.type == UV_FS_FSTAT;
+  char* path = nullptr;
+  uv_buf_t* bufs = nullptr;
+  void* statxbuf = nullptr;
+
+  if (is_rw && (o.bufs == nullptr || o.nbufs == 0))
+    return UV_EINVAL;
+
+  // Copied like libuv does for its own async requests, so ns_fs::cleanup()
+  // frees them the same way.
+  if (o.path != nullptr) {
+    path = strdup(o.path);
+    if (path == nullptr)
+      return UV_ENOMEM;
+  }
+  if (is_stat) {
+    statxbuf = malloc(sizeof(struct statx));
+    if (statxbuf == nullptr) {
+      free(path);
+      return UV_ENOMEM;
+    }
+  }
+  if (is_rw) {
+    bufs = req->bufsml;
+    if (o.nbufs > sizeof(req->bufsml) / sizeof(req->bufsml[0])) {
+      bufs = static_cast<uv_buf_t*>(malloc(o.nbufs * sizeof(*bufs)));
+      if (bufs == nullptr)
+        return UV_ENOMEM;
+    }
+    memcpy(bufs, o.bufs, o.nbufs * sizeof(*bufs));
+  }
+
+  req->reset_();
+  req->type = UV_FS;
+  req->fs_type = o.type;
+  req->loop = loop_;
+  req->cb = proxy;
+  req->result = 0;
+  req->ptr = statxbuf;
+  req->path = path;
+  req->new_path = nullptr;
+  req->file = o.file;
+  req->bufs = bufs;
+  req->nbufs = static_cast<unsigned int>(o.nbufs);
+  req->off = o.offset;
+  req->pool_timer_.submit();
+  req->in_flight_ = true;
+
+  uint32_t tail = *sq_tail_;
+  auto* sqe = static_cast<struct io_uring_sqe*>(sqes_) + (tail & *sq_mask_);
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = reinterpret_cast<uint64_t>(req);
+  sqe->fd = o.file;
+
+  switch (o.type) {
+    case UV_FS_OPEN:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = reinterpret_cast<uint64_t>(path);
+      sqe->len = o.mode;
+      sqe->open_flags = o.flags | O_CLOEXEC;
+      break;
+    case UV_FS_CLOSE:
+      sqe->opcode = IORING_OP_CLOSE;
+      break;
+    case UV_FS_READ:
+    case UV_FS_WRITE:
+      // uv_buf_t has the same layout as struct iovec. An offset of -1 uses
+      // the file position.
+      sqe->opcode = o.type == UV_FS_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+      sqe->addr = reinterpret_cast<uint64_t>(bufs);
+      sqe->len = req->nbufs;
+      sqe->off = static_cast<uint64_t>(o.offset < 0 ? -1 : o.offset);
+      break;
+    case UV_FS_FSYNC:
+    case UV_FS_FDATASYNC:
+      sqe->opcode = IORING_OP_FSYNC;
+      if (o.type == UV_FS_FDATASYNC)
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+      break;
+    default:
+      sqe->opcode = IORING_OP_STATX;
+      sqe->addr = reinterpret_cast<uint64_t>(o.type == UV_FS_FSTAT ? "" : path);
+      sqe->len = STATX_BASIC_STATS | STATX_BTIME;
+      sqe->off = reinterpret_cast<uint64_t>(statxbuf);
+      if (o.type == UV_FS_FSTAT)
+        sqe->statx_flags = AT_EMPTY_PATH;
+      else
+        sqe->fd = AT_FDCWD;
+      if (o.type == UV_FS_LSTAT)
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+      break;
+  }
+
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  submitted_++;
+  if (inflight_++ == 0) {
+    int r = poll_.start(UV_READABLE, poll_cb_, this);
+    static_cast<void>(r);
+  }
+  if (unsubmitted_++ == 0) {
+    int r = prepare_.start(prepare_cb_, this);
+    static_cast<void>(r);
+  }
+
+  return NSUV_OK;
+#else
+  static_cast<void>(req);
+  static_cast<void>(o);
+  static_cast<void>(proxy);
+  return UV_ENOTSUP;
+#endif
+}
+
+void ns_fs_uring::flush_() {
+#if defined(NSUV_HAVE_IO_URING)
+  while (unsubmitted_ > 0) {
+    int r = static_cast<int>(syscall(__NR_io_uring_enter,
+                                     ring_fd_,
+                                     static_cast<unsigned>(unsubmitted_),
+                                     0,
+                                     0,
+                                     nullptr,
+                                     0));
+    // Anything else, like EAGAIN or EBUSY, is retried on the next iteration.
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return;
+    unsubmitted_ -= r;
+  }
+  int r = prepare_.stop();
+  static_cast<void>(r);
+#endif
+}
+
+void ns_fs_uring::reap_() {
+#if defined(NSUV_HAVE_IO_URING)
+  auto* cqes = static_cast<struct io_uring_cqe*>(cqes_);
+  uint32_t head = *cq_head_;
+
+  while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &cqes[head & *cq_mask_];
+    auto* req = reinterpret_cast<ns_fs*>(cqe->user_data);
+    int res = cqe->res;
+    // Release the slot first, the callback may queue another request.
+    __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+    inflight_--;
+    complete_(req, res);
+  }
+
+  // close() may have already closed the poll handle from the last callback.
+  if (inflight_ > 0 || poll_.is_closing())
+    return;
+  if (closing_) {
+    poll_.close(poll_close_cb_, this);
+    return;
+  }
+  int r = poll_.stop();
+  static_cast<void>(r);
+#endif
+}
+
+void ns_fs_uring::complete_(ns_fs* req, int res) {
+#if defined(NSUV_HAVE_IO_URING)
+  if (req->fs_type == UV_FS_READ || req->fs_type == UV_FS_WRITE) {
+    if (req->bufs != req->bufsml)
+      free(req->bufs);
+    req->bufs = nullptr;
+    req->nbufs = 0;
+  } else if (req->fs_type == UV_FS_STAT ||
+             req->fs_type == UV_FS_LSTAT ||
+             req->fs_type == UV_FS_FSTAT) {
+    auto* stx = static_cast<struct statx*>(req->ptr);
+    uv_stat_t* buf = &req->statbuf;
+    if (res == 0) {
+      buf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+      buf->st_mode = stx->stx_mode;
+      buf->st_nlink = stx->stx_nlink;
+      buf->st_uid = stx->stx_uid;
+      buf->st_gid = stx->stx_gid;
+      buf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+      buf->st_ino = stx->stx_ino;
+      buf->st_size = stx->stx_size;
+      buf->st_blksize = stx->stx_blksize;
+      buf->st_blocks = stx->stx_blocks;
+      buf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+      buf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+      buf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+      buf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+      buf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+      buf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+      buf->st_birthtim.tv_sec = stx->stx_btime.tv_sec;
+      buf->st_birthtim.tv_nsec = stx->stx_btime.tv_nsec;
+      buf->st_flags = 0;
+      buf->st_gen = 0;
+    }
+    free(stx);
+    req->ptr = res == 0 ? buf : nullptr;
+  }
+
+  req->result = res;
+  req->cb(req);
+#else
+  static_cast<void>(req);
+  static_cast<void>(res);
+#endif
+}
+
+
+/* ns_mapped_file */
+
+// Shared by a mapping and its pending prefetches. If the ns_mapped_file is
+// destroyed first, file is set to nullptr and the last prefetch unmaps.
+struct ns_mapped_file::prefetch_state {
+  ns_mapped_file* file;
+  char* data;
+  size_t size;
+  size_t pending;
+};
+
+struct ns_mapped_file::prefetch_req {
+  ns_work work;
+  ns_mapped_file* file = nullptr;
+  prefetch_state* state = nullptr;
+  // Page aligned range to fault in.
+  char* start = nullptr;
+  size_t len = 0;
+  size_t page_size = 0;
+  int status = 0;
+  void (*proxy)(prefetch_req*, int) = nullptr;
+  void (*cb_ptr)() = nullptr;
+  void* cb_data = nullptr;
+  std::weak_ptr<void> cb_wp;
+};
+
+ns_mapped_file::~ns_mapped_file() {
+  // The pending prefetches keep the mapping, and their callbacks aren't
+  // called.
+  if (state_ != nullptr && state_->pending > 0) {
+    state_->file = nullptr;
+    return;
+  }
+  int r = close();
+  static_cast<void>(r);
+}
+
+int ns_mapped_file::open(const char* path) {
+#if !defined(_WIN32)
+  if (mapped_)
+    return UV_EBUSY;
+
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -errno;
+  // The mapping stays valid after the file is closed.
+  int r = map(fd);
+  ::close(fd);
+  return r;
+#else
+  static_cast<void>(path);
+  return UV_ENOTSUP;
+#endif
+}
+
+int ns_mapped_file::map(uv_file file) {
+#if !defined(_WIN32)
+  struct stat st;
+
+  if (mapped_)
+    return UV_EBUSY;
+  if (fstat(file, &st) == -1)
+    return -errno;
+  if (!S_ISREG(st.st_mode))
+    return UV_EINVAL;
+
+  // mmap() rejects a length of 0, so empty files have no mapping.
+  data_ = nullptr;
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ > 0) {
+    void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, file, 0);
+    if (p == MAP_FAILED) {
+      size_ = 0;
+      return -errno;
+    }
+    data_ = static_cast<char*>(p);
+  }
+
+  page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  mapped_ = true;
+  return NSUV_OK;
+#else
+  static_cast<void>(file);
+  return UV_ENOTSUP;
+#endif
+}
+
+const char* ns_mapped_file::data() {
+  return data_;
+}
+
+size_t ns_mapped_file::size() {
+  return size_;
+}
+
+uv_buf_t ns_mapped_file::span(size_t offset, size_t len) {
+  uv_buf_t buf;
+
+  if (offset >= size_)
+    return uv_buf_init(nullptr, 0);
+  if (len > size_ - offset)
+    len = size_ - offset;
+  // Not uv_buf_init(), which takes an unsigned int length.
+  buf.base = data_ + offset;
+#if defined(_WIN32)
+  buf.len = static_cast<ULONG>(len > UINT_MAX ? UINT_MAX : len);
+#else
+  buf.len = len;
+#endif
+  return buf;
+}
+
+int ns_mapped_file::prefetch(uv_loop_t* loop,
+                             size_t offset,
+                             size_t len,
+                             ns_prefetch_cb cb) {
+  prefetch_req* req = new_prefetch_(
+      reinterpret_cast<void (*)()>(cb),
+      util::check_null_cb(cb, &prefetch_proxy_<decltype(cb)>));
+  if (req == nullptr)
+    return UV_ENOMEM;
+  return prefetch_(loop, offset, len, req);
+}
+
+template <typename D_T>
+int ns_mapped_file::prefetch(uv_loop_t* loop,
+                             size_t offset,
+                             size_t len,
+                             ns_prefetch_cb_d<D_T> cb,
+                             D_T* data) {
+  prefetch_req* req = new_prefetch_(
+      reinterpret_cast<void (*)()>(cb),
+      util::check_null_cb(cb, &prefetch_proxy_<decltype(cb), D_T>));
+  if (req == nullptr)
+    return UV_ENOMEM;
+  req->cb_data = data;
+  return prefetch_(loop, offset, len, req);
+}
+
+int ns_mapped_file::prefetch(uv_loop_t* loop,
+                             size_t offset,
+                             size_t len,
+                             void (*cb)(ns_mapped_file*, int, void*),
+                             std::nullptr_t) {
+  return prefetch(loop, offset, len, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_mapped_file::prefetch(uv_loop_t* loop,
+                             size_t offset,
+                             size_t len,
+                             ns_prefetch_cb_wp<D_T> cb,
+                             std::weak_ptr<D_T> data) {
+  prefetch_req* req = new_prefetch_(
+      reinterpret_cast<void (*)()>(cb),
+      util::check_null_cb(cb, &prefetch_proxy_wp_<decltype(cb), D_T>));
+  if (req == nullptr)
+    return UV_ENOMEM;
+  req->cb_wp = data;
+  return prefetch_(loop, offset, len, req);
+}
+
+int ns_mapped_file::close() {
+  if (state_ != nullptr && state_->pending > 0)
+    return UV_EBUSY;
+  delete state_;
+  state_ = nullptr;
+#if !defined(_WIN32)
+  if (data_ != nullptr)
+    munmap(data_, size_);
+#endif
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = false;
+  return NSUV_OK;
+}
+
+template <typename CB_T>
+void ns_mapped_file::prefetch_proxy_(prefetch_req* req, int status) {
+  auto* cb = reinterpret_cast<CB_T>(req->cb_ptr);
+  NSUV_TRACE_REQ("prefetch", &req->work, cb);
+  cb(req->file, status);
+}
+
+template <typename CB_T, typename D_T>
+void ns_mapped_file::prefetch_proxy_(prefetch_req* req, int status) {
+  auto* cb = reinterpret_cast<CB_T>(req->cb_ptr);
+  NSUV_TRACE_REQ("prefetch", &req->work, cb);
+  cb(req->file, status, static_cast<D_T*>(req->cb_data));
+}
+
+template <typename CB_T, typename D_T>
+void ns_mapped_file::prefetch_proxy_wp_(prefetch_req* req, int status) {
+  auto* cb = reinterpret_cast<CB_T>(req->cb_ptr);
+  NSUV_TRACE_REQ("prefetch", &req->work, cb);
+  auto data = req->cb_wp.lock();
+  cb(req->file, status, std::static_pointer_cast<D_T>(data));
+}
+
+void ns_mapped_file::prefetch_work_(ns_work*, prefetch_req* req) {
+#if !defined(_WIN32)
+  if (req->len == 0)
+    return;
+  if (madvise(req->start, req->len, MADV_WILLNEED) == -1) {
+    req->status = -errno;
+    return;
+  }
+  // WILLNEED only starts the readahead, reading a byte from each page waits
+  // for it to finish.
+  unsigned char sum = 0;
+  for (size_t i = 0; i < req->len; i += req->page_size)
+    sum += static_cast<volatile char*>(req->start)[i];
+  static_cast<void>(sum);
+#else
+  static_cast<void>(req);
+#endif
+}
+
+void ns_mapped_file::prefetch_done_(ns_work*, int status, prefetch_req* req) {
+  prefetch_state* state = req->state;
+
+  state->pending--;
+  req->file = state->file;
+  if (req->file == nullptr) {
+#if !defined(_WIN32)
+    if (state->pending == 0 && state->data != nullptr)
+      munmap(state->data, state->size);
+#endif
+    if (state->pending == 0)
+      delete state;
+  } else if (req->proxy != nullptr) {
+    req->proxy(req, status != 0 ? status : req->status);
+  }
+  delete req;
+}
+
+ns_mapped_file::prefetch_req* ns_mapped_file::new_prefetch_(
+    void (*cb)(),
+    void (*proxy)(prefetch_req*, int)) {
+  auto* req = new (std::nothrow) prefetch_req();
+  if (req == nullptr)
+    return nullptr;
+  req->file = this;
+  req->cb_ptr = cb;
+  req->proxy = proxy;
+  return req;
+}
+
+int ns_mapped_file::prefetch_(uv_loop_t* loop,
+                              size_t offset,
+                              size_t len,
+                              prefetch_req* req) {
+  if (!mapped_ || offset > size_) {
+    delete req;
+    return UV_EINVAL;
+  }
+
+  if (state_ == nullptr) {
+    state_ = new (std::nothrow) prefetch_state{ this, data_, size_, 0 };
+    if (state_ == nullptr) {
+      delete req;
+      return UV_ENOMEM;
+    }
+  }
+
+  if (len > size_ - offset)
+    len = size_ - offset;
+  if (len > 0) {
+    // madvise() needs a page aligned start.
+    size_t start = offset - offset % page_size_;
+    req->start = data_ + start;
+    req->len = offset + len - start;
+  }
+  req->page_size = page_size_;
+  req->state = state_;
+
+  int r = req->work.queue_work(loop, prefetch_work_, prefetch_done_, req);
+  if (r != 0) {
+    delete req;
+    return r;
+  }
+  state_->pending++;
+  return NSUV_OK;
+}
+
+
+/* ns_fs_walk */
+
+struct ns_fs_walk::job {
+  ns_fs req;
+  ns_fs_walk* walk = nullptr;
+  job* next = nullptr;
+  std::string path;
+  // Offset of the last path component, for lstat() jobs.
+  size_t name_off = 0;
+  // Depth of the directory's entries, or of the lstat()'d entry.
+  size_t depth = 0;
+  bool dir = false;
+  bool root = false;
+  uv_dir_t* uv_dir = nullptr;
+  // batch_size entries for readdir(), kept while the job is on the free list.
+  uv_dirent_t* dirents = nullptr;
+
+  ~job() { delete[] dirents; }
+};
+
+ns_fs_walk::~ns_fs_walk() {
+  free_jobs_();
+}
+
+int ns_fs_walk::init(uv_loop_t* loop,
+                     size_t concurrency,
+                     size_t batch_size,
+                     int flags) {
+  if (active_)
+    return UV_EBUSY;
+  if (loop == nullptr || concurrency == 0 || batch_size == 0)
+    return UV_EINVAL;
+
+  // Cached dirent arrays are sized for the old batch_size.
+  if (batch_size != batch_size_)
+    free_jobs_();
+  loop_ = loop;
+  concurrency_ = concurrency;
+  batch_size_ = batch_size;
+  flags_ = flags;
+  return NSUV_OK;
+}
+
+int ns_fs_walk::start(const char* path,
+                      ns_walk_cb cb,
+                      ns_walk_done_cb done_cb) {
+  if (active_)
+    return UV_EBUSY;
+  walk_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  done_cb_ptr_ = reinterpret_cast<void (*)()>(done_cb);
+  walk_proxy_ptr_ = util::check_null_cb(cb, &walk_proxy_<decltype(cb)>);
+  done_proxy_ptr_ =
+      util::check_null_cb(done_cb, &done_proxy_<decltype(done_cb)>);
+  return start_(path);
+}
+
+template <typename D_T>
+int ns_fs_walk::start(const char* path,
+                      ns_walk_cb_d<D_T> cb,
+                      ns_walk_done_cb_d<D_T> done_cb,
+                      D_T* data) {
+  if (active_)
+    return UV_EBUSY;
+  walk_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  done_cb_ptr_ = reinterpret_cast<void (*)()>(done_cb);
+  walk_proxy_ptr_ = util::check_null_cb(cb, &walk_proxy_<decltype(cb), D_T>);
+  done_proxy_ptr_ =
+      util::check_null_cb(done_cb, &done_proxy_<decltype(done_cb), D_T>);
+  cb_data_ = data;
+  return start_(path);
+}
+
+int ns_fs_walk::start(const char* path,
+                      void (*cb)(ns_fs_walk*, const entry*, void*),
+                      void (*done_cb)(ns_fs_walk*, int, void*),
+                      std::nullptr_t) {
+  return start(path, cb, done_cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_fs_walk::start(const char* path,
+                      ns_walk_cb_wp<D_T> cb,
+                      ns_walk_done_cb_wp<D_T> done_cb,
+                      std::weak_ptr<D_T> data) {
+  if (active_)
+    return UV_EBUSY;
+  walk_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  done_cb_ptr_ = reinterpret_cast<void (*)()>(done_cb);
+  walk_proxy_ptr_ =
+      util::check_null_cb(cb, &walk_proxy_wp_<decltype(cb), D_T>);
+  done_proxy_ptr_ =
+      util::check_null_cb(done_cb, &done_proxy_wp_<decltype(done_cb), D_T>);
+  cb_wp_ = data;
+  return start_(path);
+}
+
+void ns_fs_walk::stop() {
+  if (active_)
+    fail_(UV_ECANCELED);
+}
+
+bool ns_fs_walk::is_active() {
+  return active_;
+}
+
+uint64_t ns_fs_walk::entries() {
+  return entries_;
+}
+
+uint64_t ns_fs_walk::directories() {
+  return directories_;
+}
+
+size_t ns_fs_walk::peak_inflight() {
+  return peak_inflight_;
+}
+
+template <typename CB_T>
+void ns_fs_walk::walk_proxy_(ns_fs_walk* walk,
+                             ns_fs* req,
+                             const entry* ent) {
+  auto* cb = reinterpret_cast<CB_T>(walk->walk_cb_ptr_);
+  NSUV_TRACE_REQ("fs_walk", req->uv_req(), cb);
+  cb(walk, ent);
+}
+
+template <typename CB_T, typename D_T>
+void ns_fs_walk::walk_proxy_(ns_fs_walk* walk,
+                             ns_fs* req,
+                             const entry* ent) {
+  auto* cb = reinterpret_cast<CB_T>(walk->walk_cb_ptr_);
+  NSUV_TRACE_REQ("fs_walk", req->uv_req(), cb);
+  cb(walk, ent, static_cast<D_T*>(walk->cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_fs_walk::walk_proxy_wp_(ns_fs_walk* walk,
+                                ns_fs* req,
+                                const entry* ent) {
+  auto* cb = reinterpret_cast<CB_T>(walk->walk_cb_ptr_);
+  NSUV_TRACE_REQ("fs_walk", req->uv_req(), cb);
+  auto data = walk->cb_wp_.lock();
+  cb(walk, ent, std::static_pointer_cast<D_T>(data));
+}
+
+template <typename CB_T>
+void ns_fs_walk::done_proxy_(ns_fs_walk* walk, ns_fs* req, int status) {
+  auto* cb = reinterpret_cast<CB_T>(walk->done_cb_ptr_);
+  NSUV_TRACE_REQ("fs_walk_done", req->uv_req(), cb);
+  cb(walk, status);
+}
+
+template <typename CB_T, typename D_T>
+void ns_fs_walk::done_proxy_(ns_fs_walk* walk, ns_fs* req, int status) {
+  auto* cb = reinterpret_cast<CB_T>(walk->done_cb_ptr_);
+  NSUV_TRACE_REQ("fs_walk_done", req->uv_req(), cb);
+  cb(walk, status, static_cast<D_T*>(walk->cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_fs_walk::done_proxy_wp_(ns_fs_walk* walk, ns_fs* req, int status) {
+  auto* cb = reinterpret_cast<CB_T>(walk->done_cb_ptr_);
+  NSUV_TRACE_REQ("fs_walk_done", req->uv_req(), cb);
+  auto data = walk->cb_wp_.lock();
+  cb(walk, status, std::static_pointer_cast<D_T>(data));
+}
+
+void ns_fs_walk::opendir_cb_(ns_fs* req, job* j) {
+  ns_fs_walk* walk = j->walk;
+  int r = static_cast<int>(req->get_result());
+
+  if (r < 0) {
+    req->cleanup();
+    // The root has to exist, anything below it may be removed mid-walk.
+    if (j->root || (r != UV_ENOENT && r != UV_ENOTDIR))
+      walk->fail_(r);
+    walk->finish_job_(j);
+    return;
+  }
+
+  j->uv_dir = static_cast<uv_dir_t*>(req->get_ptr());
+  req->cleanup();
+  walk->directories_++;
+  if (walk->stopping_)
+    walk->closedir_(j);
+  else
+    walk->readdir_(j);
+}
+
+void ns_fs_walk::readdir_cb_(ns_fs* req, job* j) {
+  ns_fs_walk* walk = j->walk;
+  ssize_t n = req->get_result();
+
+  if (n < 0)
+    walk->fail_(static_cast<int>(n));
+  for (ssize_t i = 0; i < n && !walk->stopping_; i++)
+    walk->add_dirent_(j, &j->dirents[i]);
+  // Frees the names in dirents.
+  req->cleanup();
+  // Start the new work first, this job's slot keeps the walk from finishing.
+  walk->pump_();
+
+  if (n <= 0 || walk->stopping_)
+    walk->closedir_(j);
+  else
+    walk->readdir_(j);
+}
+
+void ns_fs_walk::closedir_cb_(ns_fs* req, job* j) {
+  int r = static_cast<int>(req->get_result());
+  req->cleanup();
+  if (r < 0)
+    j->walk->fail_(r);
+  j->walk->finish_job_(j);
+}
+
+void ns_fs_walk::lstat_cb_(ns_fs* req, job* j) {
+  ns_fs_walk* walk = j->walk;
+  int r = static_cast<int>(req->get_result());
+
+  if (r < 0) {
+    if (r != UV_ENOENT)
+      walk->fail_(r);
+  } else if (!walk->stopping_) {
+    const uv_stat_t* statbuf = req->get_statbuf();
+    uv_dirent_type_t type = dirent_type_(statbuf->st_mode);
+    walk->emit_(req, j->path, j->name_off, type, j->depth, statbuf);
+    if (type == UV_DIRENT_DIR && !walk->stopping_)
+      walk->queue_dir_(j->path, j->depth + 1);
+  }
+
+  req->cleanup();
+  walk->finish_job_(j);
+}
+
+uv_dirent_type_t ns_fs_walk::dirent_type_(uint64_t mode) {
+  switch (mode & S_IFMT) {
+    case S_IFREG: return UV_DIRENT_FILE;
+    case S_IFDIR: return UV_DIRENT_DIR;
+    case S_IFLNK: return UV_DIRENT_LINK;
+    case S_IFIFO: return UV_DIRENT_FIFO;
+    case S_IFCHR: return UV_DIRENT_CHAR;
+#if defined(S_IFSOCK)
+    case S_IFSOCK: return UV_DIRENT_SOCKET;
+#endif
+#if defined(S_IFBLK)
+    case S_IFBLK: return UV_DIRENT_BLOCK;
+#endif
+    default: return UV_DIRENT_UNKNOWN;
+  }
+}
+
+int ns_fs_walk::start_(const char* path) {
+  if (loop_ == nullptr || path == nullptr)
+    return UV_EINVAL;
+
+  job* j = new_job_(true);
+  if (j == nullptr)
+    return UV_ENOMEM;
+  j->path = path;
+  j->root = true;
+
+  inflight_ = 0;
+  peak_inflight_ = 0;
+  entries_ = 0;
+  directories_ = 0;
+  status_ = 0;
+  stopping_ = false;
+
+  int r = dispatch_(j);
+  if (r != 0) {
+    free_job_(j);
+    return r;
+  }
+  active_ = true;
+  return NSUV_OK;
+}
+
+ns_fs_walk::job* ns_fs_walk::new_job_(bool dir) {
+  job* j = free_head_;
+
+  if (j != nullptr) {
+    free_head_ = j->next;
+  } else {
+    j = new (std::nothrow) job();
+    if (j == nullptr)
+      return nullptr;
+    j->walk = this;
+  }
+
+  if (dir && j->dirents == nullptr) {
+    j->dirents = new (std::nothrow) uv_dirent_t[batch_size_];
+    if (j->dirents == nullptr) {
+      free_job_(j);
+      return nullptr;
+    }
+  }
+
+  j->next = nullptr;
+  j->dir = dir;
+  j->root = false;
+  j->depth = 0;
+  j->name_off = 0;
+  j->uv_dir = nullptr;
+  return j;
+}
+
+void ns_fs_walk::free_job_(job* j) {
+  j->path.clear();
+  j->next = free_head_;
+  free_head_ = j;
+}
+
+void ns_fs_walk::free_jobs_() {
+  while (free_head_ != nullptr) {
+    job* j = free_head_;
+    free_head_ = j->next;
+    delete j;
+  }
+}
+
+void ns_fs_walk::queue_(job* j) {
+  if (pending_tail_ == nullptr)
+    pending_head_ = j;
+  else
+    pending_tail_->next = j;
+  pending_tail_ = j;
+}
+
+void ns_fs_walk::queue_dir_(const std::string& path, size_t depth) {
+  job* j = new_job_(true);
+  if (j == nullptr) {
+    fail_(UV_ENOMEM);
+    return;
+  }
+  j->path = path;
+  j->depth = depth;
+  queue_(j);
+}
+
+int ns_fs_walk::dispatch_(job* j) {
+  int r;
+
+  if (j->dir)
+    r = j->req.opendir(loop_, j->path.c_str(), opendir_cb_, j);
+  else
+    r = j->req.lstat(loop_, j->path.c_str(), lstat_cb_, j);
+  if (r != 0)
+    return r;
+
+  if (++inflight_ > peak_inflight_)
+    peak_inflight_ = inflight_;
+  return NSUV_OK;
+}
+
+void ns_fs_walk::pump_() {
+  while (!stopping_ && inflight_ < concurrency_ && pending_head_ != nullptr) {
+    job* j = pending_head_;
+    pending_head_ = j->next;
+    if (pending_head_ == nullptr)
+      pending_tail_ = nullptr;
+
+    int r = dispatch_(j);
+    if (r != 0) {
+      free_job_(j);
+      fail_(r);
+    }
+  }
+}
+
+void ns_fs_walk::readdir_(job* j) {
+  // An open directory keeps its slot until it's closed.
+  j->uv_dir->dirents = j->dirents;
+  j->uv_dir->nentries = batch_size_;
+  int r = j->req.readdir(loop_, j->uv_dir, readdir_cb_, j);
+  if (r != 0) {
+    fail_(r);
+    closedir_(j);
+  }
+}
+
+void ns_fs_walk::closedir_(job* j) {
+  int r = j->req.closedir(loop_, j->uv_dir, closedir_cb_, j);
+  if (r != 0) {
+    fail_(r);
+    finish_job_(j);
+  }
+}
+
+void ns_fs_walk::add_dirent_(job* j, const uv_dirent_t* ent) {
+  path_ = j->path;
+  if (path_.empty() || path_.back() != '/')
+    path_ += '/';
+  size_t name_off = path_.size();
+  path_ += ent->name;
+
+  if ((flags_ & kStat) || ent->type == UV_DIRENT_UNKNOWN) {
+    job* s = new_job_(false);
+    if (s == nullptr) {
+      fail_(UV_ENOMEM);
+      return;
+    }
+    s->path = path_;
+    s->name_off = name_off;
+    s->depth = j->depth;
+    queue_(s);
+    return;
+  }
+
+  emit_(&j->req, path_, name_off, ent->type, j->depth, nullptr);
+  if (ent->type == UV_DIRENT_DIR && !stopping_)
+    queue_dir_(path_, j->depth + 1);
+}
+
+void ns_fs_walk::emit_(ns_fs* req,
+                       const std::string& path,
+                       size_t name_off,
+                       uv_dirent_type_t type,
+                       size_t depth,
+                       const uv_stat_t* statbuf) {
+  entry ent = { path.c_str(), path.c_str() + name_off, type, depth, statbuf };
+
+  entries_++;
+  if (walk_proxy_ptr_ != nullptr)
+    walk_proxy_ptr_(this, req, &ent);
+}
+
+void ns_fs_walk::fail_(int status) {
+  if (status_ == 0)
+    status_ = status;
+  stopping_ = true;
+
+  while (pending_head_ != nullptr) {
+    job* j = pending_head_;
+    pending_head_ = j->next;
+    free_job_(j);
+  }
+  pending_tail_ = nullptr;
+}
+
+void ns_fs_walk::finish_job_(job* j) {
+  inflight_--;
+  free_job_(j);
+  pump_();
+  if (inflight_ > 0)
+    return;
+
+  // done_cb may start another walk or delete this one, so nothing is touched
+  // after it.
+  active_ = false;
+  if (done_proxy_ptr_ != nullptr)
+    done_proxy_ptr_(this, &j->req, status_);
+}
+
+
+/* ns_fs_pool */
+
+ns_fs_pool::~ns_fs_pool() {
+  for (ns_fs* req : free_)
+    delete req;
+}
+
+int ns_fs_pool::init(uv_loop_t* loop, size_t max_free) {
+  if (loop == nullptr)
+    return UV_EINVAL;
+  if (active_ > 0)
+    return UV_EBUSY;
+
+  while (free_.size() > max_free) {
+    delete free_.back();
+    free_.pop_back();
+  }
+  // Returning a request never allocates.
+  free_.reserve(max_free);
+  loop_ = loop;
+  max_free_ = max_free;
+  return NSUV_OK;
+}
+
+#define NSUV_ARGS(...) __VA_ARGS__
+#define NSUV_STRIP(X) X
+#define NSUV_PASS(X) NSUV_STRIP(NSUV_ARGS X)
+#define NSUV_FS_POOL_FN(name, P1, P2)                                          \
+  int ns_fs_pool::name(NSUV_PASS(P1), ns_fs::ns_fs_cb cb) {                    \
+    if (cb == nullptr || loop_ == nullptr)                                     \
+      return UV_EINVAL;                                                        \
+    ns_fs* req = acquire_();                                                   \
+    if (req == nullptr)                                                        \
+      return UV_ENOMEM;                                                        \
+    return submitted_(req, req->name(loop_, NSUV_PASS(P2), cb));               \
+  }                                                                            \
+  template <typename D_T>                                                      \
+  int ns_fs_pool::name(                                                        \
+      NSUV_PASS(P1), ns_fs::ns_fs_cb_d<D_T> cb, D_T* data) {                   \
+    if (cb == nullptr || loop_ == nullptr)                                     \
+      return UV_EINVAL;                                                        \
+    ns_fs* req = acquire_();                                                   \
+    if (req == nullptr)                                                        \
+      return UV_ENOMEM;                                                        \
+    return submitted_(req, req->name(loop_, NSUV_PASS(P2), cb, data));         \
+  }                                                                            \
+  template <typename D_T>                                                      \
+  int ns_fs_pool::name(NSUV_PASS(P1),                                          \
+                       ns_fs::ns_fs_cb_wp<D_T> cb,                             \
+                       std::weak_ptr<D_T> data) {                              \
+    if (cb == nullptr || loop_ == nullptr)                                     \
+      return UV_EINVAL;                                                        \
+    ns_fs* req = acquire_();                                                   \
+    if (req == nullptr)                                                        \
+      return UV_ENOMEM;                                                        \
+    return submitted_(req, req->name(loop_, NSUV_PASS(P2), cb, data));         \
+  }
+
+NSUV_FS_POOL_FN(close, (uv_file file), (file))
+NSUV_FS_POOL_FN(open,
+                (const char* path, int flags, int mode),
+                (path, flags, mode))
+NSUV_FS_POOL_FN(
+    read,
+    (uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset),
+    (file, bufs, nbufs, offset))
+NSUV_FS_POOL_FN(
+    read,
+    (uv_file file, const std::vector<uv_buf_t>& bufs, int64_t offset),
+    (file, bufs, offset))
+NSUV_FS_POOL_FN(unlink, (const char* path), (path))
+NSUV_FS_POOL_FN(
+    write,
+    (uv_file file, const uv_buf_t bufs[], unsigned int nbufs, int64_t offset),
+    (file, bufs, nbufs, offset))
+NSUV_FS_POOL_FN(
+    write,
+    (uv_file file, const std::vector<uv_buf_t>& bufs, int64_t offset),
+    (file, bufs, offset))
+NSUV_FS_POOL_FN(copyfile,
+                (const char* path, const char* new_path, int flags),
+                (path, new_path, flags))
+NSUV_FS_POOL_FN(mkdir, (const char* path, int mode), (path, mode))
+NSUV_FS_POOL_FN(mkdtemp, (const char* tpl), (tpl))
+NSUV_FS_POOL_FN(mkstemp, (const char* tpl), (tpl))
+NSUV_FS_POOL_FN(rmdir, (const char* path), (path))
+NSUV_FS_POOL_FN(scandir, (const char* path, int flags), (path, flags))
+NSUV_FS_POOL_FN(opendir, (const char* path), (path))
+NSUV_FS_POOL_FN(readdir, (uv_dir_t* dir), (dir))
+NSUV_FS_POOL_FN(closedir, (uv_dir_t* dir), (dir))
+NSUV_FS_POOL_FN(stat, (const char* path), (path))
+NSUV_FS_POOL_FN(fstat, (uv_file file), (file))
+NSUV_FS_POOL_FN(rename,
+                (const char* path, const char* new_path),
+                (path, new_path))
+NSUV_FS_POOL_FN(fsync, (uv_file file), (file))
+NSUV_FS_POOL_FN(fdatasync, (uv_file file), (file))
+NSUV_FS_POOL_FN(ftruncate, (uv_file file, int64_t offset), (file, offset))
+NSUV_FS_POOL_FN(
+    sendfile,
+    (uv_file out_fd, uv_file in_fd, int64_t in_offset, size_t length),
+    (out_fd, in_fd, in_offset, length))
+NSUV_FS_POOL_FN(access, (const char* path, int mode), (path, mode))
+NSUV_FS_POOL_FN(chmod, (const char* path, int mode), (path, mode))
+NSUV_FS_POOL_FN(utime,
+                (const char* path, double atime, double mtime),
+                (path, atime, mtime))
+NSUV_FS_POOL_FN(futime,
+                (uv_file file, double atime, double mtime),
+                (file, atime, mtime))
+NSUV_FS_POOL_FN(lutime,
+                (const char* path, double atime, double mtime),
+                (path, atime, mtime))
+NSUV_FS_POOL_FN(lstat, (const char* path), (path))
+NSUV_FS_POOL_FN(link,
+                (const char* path, const char* new_path),
+                (path, new_path))
+NSUV_FS_POOL_FN(symlink,
+                (const char* path, const char* new_path, int flags),
+                (path, new_path, flags))
+NSUV_FS_POOL_FN(readlink, (const char* path), (path))
+NSUV_FS_POOL_FN(realpath, (const char* path), (path))
+NSUV_FS_POOL_FN(fchmod, (uv_file file, int mode), (file, mode))
+NSUV_FS_POOL_FN(chown,
+                (const char* path, uv_uid_t uid, uv_gid_t gid),
+                (path, uid, gid))
+NSUV_FS_POOL_FN(fchown,
+                (uv_file file, uv_uid_t uid, uv_gid_t gid),
+                (file, uid, gid))
+NSUV_FS_POOL_FN(lchown,
+                (const char* path, uv_uid_t uid, uv_gid_t gid),
+                (path, uid, gid))
+NSUV_FS_POOL_FN(statfs, (const char* path), (path))
+
+#undef NSUV_FS_POOL_FN
+#undef NSUV_PASS
+#undef NSUV_STRIP
+#undef NSUV_ARGS
+
+size_t ns_fs_pool::active() {
+  return active_;
+}
+
+size_t ns_fs_pool::available() {
+  return free_.size();
+}
+
+uint64_t ns_fs_pool::allocations() {
+  return allocations_;
+}
+
+ns_fs* ns_fs_pool::acquire_() {
+  ns_fs* req;
+
+  if (!free_.empty()) {
+    req = free_.back();
+    free_.pop_back();
+  } else {
+    req = new (std::nothrow) ns_fs();
+    if (req == nullptr)
+      return nullptr;
+    allocations_++;
+  }
+
+  req->pool_ = this;
+  active_++;
+  return req;
+}
+
+void ns_fs_pool::release_(ns_fs* req) {
+  req->pool_ = nullptr;
+  req->cleanup();
+  active_--;
+  if (free_.size() < max_free_)
+    free_.push_back(req);
+  else
+    delete req;
+}
+
+int ns_fs_pool::submitted_(ns_fs* req, int r) {
+  // The callback won't run, so it's returned here instead.
+  if (r != 0)
+    release_(req);
+  return r;
+}
+
+void ns_fs::recycle_(ns_fs_pool* pool, ns_fs* req) {
+  // A pooled request the callback reused for its next step goes back once
+  // that one's callback returns.
+  if (pool != nullptr && !req->in_flight_)
+    pool->release_(req);
+}
+
+
+/* ns_fs_cache */
+
+struct ns_fs_cache::entry {
+  ns_fs_cache* cache = nullptr;
+  std::string path;
+  uint64_t hash = 0;
+  // Loop time the result expires at, or 0 for never.
+  uint64_t expires = 0;
+  // Offset of the last path component.
+  size_t name_off = 0;
+  // Cached results, in ns_fs_cache's LRU list.
+  entry* prev = nullptr;
+  entry* next = nullptr;
+  // The watcher of the entry's directory, and the other entries it covers.
+  entry* watch = nullptr;
+  entry* sib_prev = nullptr;
+  entry* sib_next = nullptr;
+  // For kDirWatch.
+  entry* children = nullptr;
+  uv_fs_event_t* event = nullptr;
+  // Waiting on the request while pending.
+  waiter* waiters = nullptr;
+  waiter* waiters_tail = nullptr;
+  uv_stat_t statbuf;
+  std::string real;
+  int status = 0;
+  kind k = kStatOp;
+  bool pending = false;
+  // Invalidated while pending, so the result isn't kept.
+  bool stale = false;
+  bool cached = false;
+};
+
+ns_fs_cache::~ns_fs_cache() {
+  for (size_t i = 0; i < table_.capacity(); i++) {
+    entry* e = table_.at(i);
+    if (e == nullptr)
+      continue;
+    while (e->waiters != nullptr) {
+      waiter* w = e->waiters;
+      e->waiters = w->next;
+      delete w;
+    }
+    delete e;
+  }
+}
+
+int ns_fs_cache::init(uv_loop_t* loop,
+                      uint64_t ttl,
+                      int flags,
+                      size_t max_entries) {
+  if (loop == nullptr || max_entries == 0)
+    return UV_EINVAL;
+  // Nothing would ever invalidate an entry.
+  if (ttl == 0 && !(flags & kWatch))
+    return UV_EINVAL;
+  if (table_.capacity() != 0)
+    return UV_EBUSY;
+
+  int r = pool_.init(loop);
+  if (r != NSUV_OK)
+    return r;
+  r = table_.init();
+  if (r != NSUV_OK)
+    return r;
+
+  // Paths often come from requests, so they can't be used to force
+  // collisions.
+  if (uv_random(nullptr, nullptr, &seed_, sizeof(seed_), 0, nullptr) != 0)
+    seed_ = uv_hrtime();
+
+  loop_ = loop;
+  ttl_ = ttl;
+  flags_ = flags;
+  max_entries_ = max_entries;
+  hits_ = 0;
+  misses_ = 0;
+  return NSUV_OK;
+}
+
+#define NSUV_FS_CACHE_FN(name, op)                                             \
+  int ns_fs_cache::name(const char* path, ns_fs_cache_cb cb) {                 \
+    waiter w = { nullptr,                                                      \
+                 util::check_null_cb(cb, &cache_proxy_<decltype(cb)>),        \
+                 reinterpret_cast<void (*)()>(cb),                             \
+                 nullptr,                                                      \
+                 {} };                                                         \
+    return request_(op, path, w);                                              \
+  }                                                                            \
+  template <typename D_T>                                                      \
+  int ns_fs_cache::name(const char* path,                                      \
+                        ns_fs_cache_cb_d<D_T> cb,                              \
+                        D_T* data) {                                           \
+    waiter w = { nullptr,                                                      \
+                 util::check_null_cb(cb, &cache_proxy_<decltype(cb), D_T>),   \
+                 reinterpret_cast<void (*)()>(cb),                             \
+                 data,                                                         \
+                 {} };                                                         \
+    return request_(op, path, w);                                              \
+  }                                                                            \
+  int ns_fs_cache::name(const char* path,                                      \
+                        void (*cb)(ns_fs_cache*, const result*, void*),        \
+                        std::nullptr_t) {                                      \
+    return name(path, cb, NSUV_CAST_NULLPTR);                                  \
+  }                                                                            \
+  template <typename D_T>                                                      \
+  int ns_fs_cache::name(const char* path,                                      \
+                        ns_fs_cache_cb_wp<D_T> cb,                             \
+                        std::weak_ptr<D_T> data) {                             \
+    auto* proxy = &cache_proxy_wp_<decltype(cb), D_T>;                        \
+    waiter w = { nullptr,                                                      \
+                 util::check_null_cb(cb, proxy),                               \
+                 reinterpret_cast<void (*)()>(cb),                             \
+                 nullptr,                                                      \
+                 data };                                                       \
+    return request_(op, path, w);                                              \
+  }
+
+NSUV_FS_CACHE_FN(stat, kStatOp)
+NSUV_FS_CACHE_FN(lstat, kLstatOp)
+NSUV_FS_CACHE_FN(realpath, kRealpathOp)
+
+#undef NSUV_FS_CACHE_FN
+
+void ns_fs_cache::invalidate(const char* path) {
+  if (table_.capacity() == 0)
+    return;
+
+  if (path != nullptr) {
+    size_t len = strlen(path);
+    for (kind k : { kStatOp, kLstatOp, kRealpathOp }) {
+      entry* e = table_.at(find_(k, path, len, hash_(k, path, len)));
+      if (e == nullptr)
+        continue;
+      if (e->pending)
+        e->stale = true;
+      else
+        remove_(e);
+    }
+    return;
+  }
+
+  // Watchers go with the last entry they cover.
+  while (table_.head() != nullptr)
+    remove_(table_.head());
+  for (size_t i = 0; i < table_.capacity(); i++) {
+    if (table_.at(i) != nullptr && table_.at(i)->pending)
+      table_.at(i)->stale = true;
+  }
+}
+
+void ns_fs_cache::close(void (*cb)(ns_fs_cache*)) {
+  close_cb_ptr_ = cb;
+  closing_ = true;
+  invalidate();
+  finish_close_();
+}
+
+size_t ns_fs_cache::size() {
+  return size_;
+}
+
+uint64_t ns_fs_cache::hits() {
+  return hits_;
+}
+
+uint64_t ns_fs_cache::misses() {
+  return misses_;
+}
+
+template <typename CB_T>
+void ns_fs_cache::cache_proxy_(ns_fs_cache* cache,
+                               const waiter* w,
+                               const result* res) {
+  auto* cb = reinterpret_cast<CB_T>(w->cb_ptr);
+  NSUV_TRACE_OBJ("fs_cache", cache, UV_FS, true, cb);
+  cb(cache, res);
+}
+
+template <typename CB_T, typename D_T>
+void ns_fs_cache::cache_proxy_(ns_fs_cache* cache,
+                               const waiter* w,
+                               const result* res) {
+  auto* cb = reinterpret_cast<CB_T>(w->cb_ptr);
+  NSUV_TRACE_OBJ("fs_cache", cache, UV_FS, true, cb);
+  cb(cache, res, static_cast<D_T*>(w->cb_data));
+}
+
+template <typename CB_T, typename D_T>
+void ns_fs_cache::cache_proxy_wp_(ns_fs_cache* cache,
+                                  const waiter* w,
+                                  const result* res) {
+  auto* cb = reinterpret_cast<CB_T>(w->cb_ptr);
+  NSUV_TRACE_OBJ("fs_cache", cache, UV_FS, true, cb);
+  auto data = w->cb_wp.lock();
+  cb(cache, res, std::static_pointer_cast<D_T>(data));
+}
+
+void ns_fs_cache::fs_cb_(ns_fs* req, entry* e) {
+  ns_fs_cache* cache = e->cache;
+  ssize_t r = req->get_result();
+  waiter* w = e->waiters;
+
+  e->status = r < 0 ? static_cast<int>(r) : 0;
+  if (e->status == 0 && e->k == kRealpathOp)
+    e->real = static_cast<const char*>(req->get_ptr());
+  else if (e->status == 0)
+    e->statbuf = *req->get_statbuf();
+  e->pending = false;
+  e->waiters = nullptr;
+  e->waiters_tail = nullptr;
+
+  // Copied, since a callback may invalidate the entry.
+  uv_stat_t statbuf = e->statbuf;
+  std::string real = e->real;
+  result res = { e->status, nullptr, nullptr };
+  if (e->status == 0 && e->k == kRealpathOp)
+    res.path = real.c_str();
+  else if (e->status == 0)
+    res.statbuf = &statbuf;
+
+  bool keep = !e->stale && !cache->closing_ &&
+              (e->status == 0 || e->status == UV_ENOENT ||
+               e->status == UV_ENOTDIR);
+  if (keep && (cache->flags_ & kWatch))
+    cache->watch_(e);
+  // Without a TTL, an entry that isn't watched could never be invalidated.
+  if (keep && cache->ttl_ == 0 && e->watch == nullptr)
+    keep = false;
+
+  if (keep) {
+    e->expires = cache->ttl_ > 0 ? uv_now(cache->loop_) + cache->ttl_ : 0;
+    e->cached = true;
+    cache->table_.push_back(e);
+    cache->size_++;
+    while (cache->size_ > cache->max_entries_)
+      cache->remove_(cache->table_.head());
+  } else {
+    cache->remove_(e);
+  }
+
+  while (w != nullptr) {
+    waiter* next = w->next;
+    w->proxy(cache, w, &res);
+    delete w;
+    w = next;
+  }
+
+  // Only now, so a close() from a callback waits for the rest of them.
+  cache->pending_--;
+  cache->finish_close_();
+}
+
+void ns_fs_cache::event_cb_(uv_fs_event_t* handle,
+                            const char* filename,
+                            int,
+                            int status) {
+  entry* w = static_cast<entry*>(handle->data);
+  ns_fs_cache* cache = w->cache;
+  entry* e = w->children;
+
+  // Removing the last child removes the watcher too, but by then there's
+  // nothing left to look at.
+  while (e != nullptr) {
+    entry* next = e->sib_next;
+    if (status != 0 ||
+        filename == nullptr ||
+        strcmp(e->path.c_str() + e->name_off, filename) == 0) {
+      cache->remove_(e);
+    }
+    e = next;
+  }
+}
+
+void ns_fs_cache::event_close_cb_(uv_handle_t* handle) {
+  auto* cache = static_cast<ns_fs_cache*>(handle->data);
+  delete reinterpret_cast<uv_fs_event_t*>(handle);
+  cache->handles_--;
+  cache->finish_close_();
+}
+
+int ns_fs_cache::request_(kind k, const char* path, const waiter& w) {
+  if (table_.capacity() == 0 ||
+      closing_ ||
+      path == nullptr ||
+      w.proxy == nullptr) {
+    return UV_EINVAL;
+  }
+
+  size_t len = strlen(path);
+  entry* e = table_.at(find_(k, path, len, hash_(k, path, len)));
+
+  if (e != nullptr && !e->pending) {
+    if (e->expires == 0 || uv_now(loop_) < e->expires) {
+      result res = { e->status, nullptr, nullptr };
+      if (e->status == 0 && k == kRealpathOp)
+        res.path = e->real.c_str();
+      else if (e->status == 0)
+        res.statbuf = &e->statbuf;
+      hits_++;
+      table_.unlink(e);
+      table_.push_back(e);
+      w.proxy(this, &w, &res);
+      return NSUV_OK;
+    }
+    remove_(e);
+    e = nullptr;
+  }
+
+  auto* copy = new (std::nothrow) waiter(w);
+  if (copy == nullptr)
+    return UV_ENOMEM;
+
+  if (e == nullptr) {
+    int r = UV_ENOMEM;
+    e = insert_(k, path, len);
+    if (e != nullptr && k == kStatOp)
+      r = pool_.stat(e->path.c_str(), fs_cb_, e);
+    else if (e != nullptr && k == kLstatOp)
+      r = pool_.lstat(e->path.c_str(), fs_cb_, e);
+    else if (e != nullptr)
+      r = pool_.realpath(e->path.c_str(), fs_cb_, e);
+    if (r != 0) {
+      if (e != nullptr)
+        remove_(e);
+      delete copy;
+      return r;
+    }
+    pending_++;
+  }
+
+  // Lookups that wait on another's request count as misses too.
+  misses_++;
+  if (e->waiters_tail == nullptr)
+    e->waiters = copy;
+  else
+    e->waiters_tail->next = copy;
+  e->waiters_tail = copy;
+  return NSUV_OK;
+}
+
+uint64_t ns_fs_cache::hash_(kind k, const char* path, size_t len) {
+  // FNV-1a.
+  uint64_t hash = 0xcbf29ce484222325ull ^ seed_;
+  hash = (hash ^ k) * 0x100000001b3ull;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ static_cast<uint8_t>(path[i])) * 0x100000001b3ull;
+  return hash;
+}
+
+size_t ns_fs_cache::find_(kind k,
+                          const char* path,
+                          size_t len,
+                          uint64_t hash) {
+  return table_.find(hash, [k, path, len](const entry* e) {
+    return e->k == k &&
+           e->path.size() == len &&
+           std::memcmp(e->path.data(), path, len) == 0;
+  });
+}
+
+ns_fs_cache::entry* ns_fs_cache::insert_(kind k,
+                                         const char* path,
+                                         size_t len) {
+  if (table_.reserve() != NSUV_OK)
+    return nullptr;
+
+  uint64_t hash = hash_(k, path, len);
+  size_t idx = find_(k, path, len, hash);
+  auto* e = new (std::nothrow) entry();
+  if (e == nullptr)
+    return nullptr;
+
+  e->cache = this;
+  e->path.assign(path, len);
+  e->hash = hash;
+  e->k = k;
+  e->pending = true;
+  size_t slash = e->path.rfind('/');
+  e->name_off = slash == std::string::npos ? 0 : slash + 1;
+  table_.insert(idx, e);
+  return e;
+}
+
+void ns_fs_cache::remove_(entry* e) {
+  table_.erase(e);
+  if (e->cached)
+    size_--;
+  if (e->watch != nullptr)
+    unwatch_(e);
+  if (e->event != nullptr) {
+    e->event->data = this;
+    uv_close(reinterpret_cast<uv_handle_t*>(e->event), event_close_cb_);
+  }
+  delete e;
+}
+
+void ns_fs_cache::watch_(entry* e) {
+  std::string dir = e->path.substr(0, e->name_off);
+  if (dir.empty())
+    dir = ".";
+  else if (dir.size() > 1)
+    dir.pop_back();
+
+  entry* w = table_.at(find_(kDirWatch,
+                              dir.data(),
+                              dir.size(),
+                              hash_(kDirWatch, dir.data(), dir.size())));
+  if (w == nullptr) {
+    w = insert_(kDirWatch, dir.data(), dir.size());
+    if (w == nullptr)
+      return;
+    w->pending = false;
+    w->event = new (std::nothrow) uv_fs_event_t();
+    if (w->event == nullptr || uv_fs_event_init(loop_, w->event) != 0) {
+      delete w->event;
+      w->event = nullptr;
+      remove_(w);
+      return;
+    }
+    handles_++;
+    w->event->data = w;
+    if (uv_fs_event_start(w->event, event_cb_, w->path.c_str(), 0) != 0) {
+      remove_(w);
+      return;
+    }
+    uv_unref(reinterpret_cast<uv_handle_t*>(w->event));
+  }
+
+  e->watch = w;
+  e->sib_prev = nullptr;
+  e->sib_next = w->children;
+  if (w->children != nullptr)
+    w->children->sib_prev = e;
+  w->children = e;
+}
+
+void ns_fs_cache::unwatch_(entry* e) {
+  entry* w = e->watch;
+
+  if (e->sib_prev == nullptr)
+    w->children = e->sib_next;
+  else
+    e->sib_prev->sib_next = e->sib_next;
+  if (e->sib_next != nullptr)
+    e->sib_next->sib_prev = e->sib_prev;
+  e->watch = nullptr;
+
+  if (w->children == nullptr)
+    remove_(w);
+}
+
+void ns_fs_cache::finish_close_() {
+  if (!closing_ || pending_ > 0 || handles_ > 0)
+    return;
+
+  closing_ = false;
+  table_.destroy();
+  loop_ = nullptr;
+  if (close_cb_ptr_ != nullptr)
+    close_cb_ptr_(this);
+}
+
+
+/* ns_loop */
+
+int ns_loop::init() {
+  int r = uv_loop_init(&storage_);
+  if (r != 0)
+    return r;
+  return init(&storage_);
+}
+
+int ns_loop::init(uv_loop_t* loop) {
+  if (loop == nullptr)
+    return UV_EINVAL;
+  // The metrics handles of the previous loop can't be reused yet.
+  if (closing_ > 0)
+    return UV_EBUSY;
+  loop_ = loop;
+  metrics_ = ns_loop_metrics();
+  iter_start_ = 0;
+  idle_time_ = false;
+  metrics_init_ = false;
+  return 0;
+}
+
+int ns_loop::configure_idle_time() {
+  if (loop_ == nullptr)
+    return UV_EINVAL;
+  int r = uv_loop_configure(loop_, UV_METRICS_IDLE_TIME);
+  if (r == 0)
+    idle_time_ = true;
+  return r;
+}
+
+int ns_loop::run(uv_run_mode mode) {
+  int r = uv_run(loop_, mode);
+  // The last iteration never reaches another prepare phase, so end it here.
+  // Otherwise the time between runs would be counted as part of it.
+  if (iter_start_ != 0)
+    end_iteration_(uv_hrtime());
+  return r;
+}
+
+void ns_loop::stop() {
+  uv_stop(loop_);
+}
+
+int ns_loop::close() {
+  if (loop_ == nullptr)
+    return UV_EINVAL;
+
+  if (metrics_init_) {
+    metrics_init_ = false;
+    iter_start_ = 0;
+    closing_ = 2;
+    prepare_.close(prepare_close_cb_, this);
+    check_.close(check_close_cb_, this);
+  }
+
+  // Running a wrapped loop would call its owner's callbacks from here.
+  if (loop_ == &storage_) {
+    if (closing_ > 0)
+      uv_run(loop_, UV_RUN_NOWAIT);
+    int r = uv_loop_close(loop_);
+    if (r != 0)
+      return r;
+  }
+
+  loop_ = nullptr;
+  return 0;
+}
+
+bool ns_loop::alive() {
+  return uv_loop_alive(loop_) != 0;
+}
+
+uint64_t ns_loop::now() {
+  return uv_now(loop_);
+}
+
+void ns_loop::update_time() {
+  uv_update_time(loop_);
+}
+
+uv_loop_t* ns_loop::base() {
+  return loop_;
+}
+
+int ns_loop::metrics_start() {
+  int r;
+
+  if (loop_ == nullptr)
+    return UV_EINVAL;
+
+  if (!metrics_init_) {
+    r = prepare_.init(loop_);
+    if (r != 0)
+      return r;
+    r = check_.init(loop_);
+    if (r != 0) {
+      prepare_.close();
+      return r;
+    }
+    prepare_.unref();
+    check_.unref();
+    metrics_init_ = true;
+  }
+
+  iter_start_ = 0;
+  r = prepare_.start(prepare_cb_, this);
+  if (r != 0)
+    return r;
+  return check_.start(check_cb_, this);
+}
+
+int ns_loop::metrics_stop() {
+  if (!metrics_init_)
+    return 0;
+  iter_start_ = 0;
+  int r = prepare_.stop();
+  if (r != 0)
+    return r;
+  return check_.stop();
+}
+
+ns_loop_metrics ns_loop::get_metrics() {
+  return metrics_;
+}
+
+void ns_loop::reset_metrics() {
+  metrics_ = ns_loop_metrics();
+}
+
+void ns_loop::prepare_cb_(ns_prepare*, ns_loop* loop) {
+  uint64_t now = uv_hrtime();
+
+  if (loop->iter_start_ != 0)
+    loop->end_iteration_(now);
+
+  loop->iter_start_ = now;
+  loop->iter_wait_ = 0;
+  if (loop->idle_time_)
+    loop->idle_start_ = uv_metrics_idle_time(loop->loop_);
+  loop->events_start_ = loop->events_();
+}
+
+void ns_loop::check_cb_(ns_check*, ns_loop* loop) {
+  // Metrics were started from a callback in the middle of an iteration.
+  if (loop->iter_start_ == 0)
+    return;
+
+  uint64_t poll_time = uv_hrtime() - loop->iter_start_;
+  uint64_t events = loop->events_() - loop->events_start_;
+
+  loop->metrics_.poll_time += poll_time;
+  loop->metrics_.events += events;
+  if (events > loop->metrics_.max_events)
+    loop->metrics_.max_events = events;
+
+  if (loop->idle_time_) {
+    loop->iter_wait_ = uv_metrics_idle_time(loop->loop_) - loop->idle_start_;
+    loop->metrics_.idle_time += loop->iter_wait_;
+  } else {
+    loop->iter_wait_ = poll_time;
+  }
+}
+
+void ns_loop::prepare_close_cb_(ns_prepare*, ns_loop* loop) {
+  loop->closing_--;
+}
+
+void ns_loop::check_close_cb_(ns_check*, ns_loop* loop) {
+  loop->closing_--;
+}
+
+void ns_loop::end_iteration_(uint64_t now) {
+  uint64_t duration = now - iter_start_;
+  uint64_t lag = duration > iter_wait_ ? duration - iter_wait_ : 0;
+
+  metrics_.iterations++;
+  metrics_.iteration_time += duration;
+  if (duration > metrics_.max_iteration_time)
+    metrics_.max_iteration_time = duration;
+  if (lag > metrics_.max_lag)
+    metrics_.max_lag = lag;
+  iter_start_ = 0;
+}
+
+uint64_t ns_loop::events_() {
+  // uv_metrics_info() was added in libuv 1.45.0.
+#if UV_VERSION_HEX >= 77056
+  uv_metrics_t metrics;
+  if (uv_metrics_info(loop_, &metrics) == 0)
+    return metrics.events;
+#endif
+  return 0;
+}
+
+
+/* ns_udp */
+
+int ns_udp::init(uv_loop_t* loop) {
+  return uv_udp_init(loop, uv_handle());
+}
+
+int ns_udp::init_ex(uv_loop_t* loop, unsigned int flags) {
+  return uv_udp_init_ex(loop, uv_handle(), flags);
+}
+
+int ns_udp::bind(const struct sockaddr* addr, unsigned int flags) {
+  int r = uv_udp_bind(uv_handle(), addr, flags);
+  if (r == 0) {
+    if (addr == nullptr) {
+      local_addr_.reset(nullptr);
+    } else {
+      local_addr_.reset(new (std::nothrow) struct sockaddr_storage());
+      if (local_addr_ == nullptr)
+        return UV_ENOMEM;
+
+      int len = util::addr_size(addr);
+      if (len < 0)
+        return len;
+
+      std::memcpy(local_addr_.get(), addr, len);
+    }
+  }
+
+  return r;
+}
+
+int ns_udp::connect(const struct sockaddr* addr) {
+  int r = uv_udp_connect(uv_handle(), addr);
+  if (r == 0) {
+    if (addr == nullptr) {
+      remote_addr_.reset(nullptr);
+    } else {
+      remote_addr_.reset(new (std::nothrow) struct sockaddr_storage());
+      if (remote_addr_ == nullptr)
+        return UV_ENOMEM;
+
+      int len = util::addr_size(addr);
+      if (len < 0)
+        return len;
+
+      std::memcpy(remote_addr_.get(), addr, len);
+    }
+  }
+
+  return r;
+}
+
+int ns_udp::getpeername(struct sockaddr* name, int* namelen) {
+  return uv_udp_getpeername(uv_handle(), name, namelen);
+}
+
+int ns_udp::getsockname(struct sockaddr* name, int* namelen) {
+  return uv_udp_getsockname(uv_handle(), name, namelen);
+}
+
+int ns_udp::try_send(const uv_buf_t bufs[],
+                     size_t nbufs,
+                     const struct sockaddr* addr) {
+  int r = uv_udp_try_send(uv_handle(), bufs, nbufs, addr);
+  stats_.try_write(r);
+  return r;
+}
+
+int ns_udp::try_send(const std::vector<uv_buf_t>& bufs,
+                     const struct sockaddr* addr) {
+  return try_send(bufs.data(), bufs.size(), addr);
+}
+
+int ns_udp::send(ns_udp_send* req,
+                 const uv_buf_t bufs[],
+                 size_t nbufs,
+                 const struct sockaddr* addr) {
+  int r = req->init(bufs, nbufs, addr, NSUV_CAST_NULLPTR);
+  if (r != 0)
+    return r;
+
+  return send_(req, addr, nullptr);
+}
+
+int ns_udp::send(ns_udp_send* req,
+                 const std::vector<uv_buf_t>& bufs,
+                 const struct sockaddr* addr) {
+  int r = req->init(bufs, addr, NSUV_CAST_NULLPTR);
+  if (r != 0)
+    return r;
+
+  return send_(req, addr, nullptr);
+}
+
+int ns_udp::send(ns_udp_send* req,
+                 const uv_buf_t bufs[],
+                 size_t nbufs,
+                 const struct sockaddr* addr,
+                 ns_udp_send_cb cb) {
+  int r = req->init(bufs, nbufs, addr, cb);
+  if (r != 0)
+    return r;
+
+  return send_(req, addr, util::check_null_cb(cb, &send_proxy_<decltype(cb)>));
+}
+
+int ns_udp::send(ns_udp_send* req,
+                 const std::vector<uv_buf_t>& bufs,
+                 const struct sockaddr* addr,
+                 ns_udp_send_cb cb) {
+  int r = req->init(bufs, addr, cb);
+  if (r != 0)
+    return r;
+
+  return send_(req, addr, util::check_null_cb(cb, &send_proxy_<decltype(cb)>));
+}
+
+template <typename D_T>
 int ns_udp::send(ns_udp_send* req,
                  const uv_buf_t bufs[],
                  size_t nbufs,
@@ -1988,437 +6307,2354 @@ int ns_udp::send(ns_udp_send* req,
   if (r != 0)
     return r;
 
-  return uv_udp_send(req->uv_req(),
-                     uv_handle(),
-                     req->bufs(),
-                     req->size(),
-                     addr,
-                     util::check_null_cb(cb, &send_proxy_<decltype(cb), D_T>));
+  return send_(
+      req, addr, util::check_null_cb(cb, &send_proxy_<decltype(cb), D_T>));
+}
+
+int ns_udp::send(ns_udp_send* req,
+                 const uv_buf_t bufs[],
+                 size_t nbufs,
+                 const struct sockaddr* addr,
+                 void (*cb)(ns_udp_send*, int, void*),
+                 std::nullptr_t) {
+  return send(req, bufs, nbufs, addr, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_udp::send(ns_udp_send* req,
+                 const uv_buf_t bufs[],
+                 size_t nbufs,
+                 const struct sockaddr* addr,
+                 ns_udp_send_cb_wp<D_T> cb,
+                 std::weak_ptr<D_T> data) {
+  int r = req->init(bufs, nbufs, addr, cb, data);
+  if (r != 0)
+    return r;
+
+  return send_(
+      req, addr, util::check_null_cb(cb, &send_proxy_wp_<decltype(cb), D_T>));
+}
+
+template <typename D_T>
+int ns_udp::send(ns_udp_send* req,
+                 const std::vector<uv_buf_t>& bufs,
+                 const struct sockaddr* addr,
+                 ns_udp_send_cb_d<D_T> cb,
+                 D_T* data) {
+  int r = req->init(bufs, addr, cb, data);
+  if (r != 0)
+    return r;
+
+  return send_(
+      req, addr, util::check_null_cb(cb, &send_proxy_<decltype(cb), D_T>));
+}
+
+int ns_udp::send(ns_udp_send* req,
+                 const std::vector<uv_buf_t>& bufs,
+                 const struct sockaddr* addr,
+                 void (*cb)(ns_udp_send*, int, void*),
+                 std::nullptr_t) {
+  return send(req, bufs, addr, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_udp::send(ns_udp_send* req,
+                 const std::vector<uv_buf_t>& bufs,
+                 const struct sockaddr* addr,
+                 ns_udp_send_cb_wp<D_T> cb,
+                 std::weak_ptr<D_T> data) {
+  int r = req->init(bufs, addr, cb, data);
+  if (r != 0)
+    return r;
+
+  return send_(
+      req, addr, util::check_null_cb(cb, &send_proxy_wp_<decltype(cb), D_T>));
+}
+
+const sockaddr* ns_udp::local_addr() {
+  if (local_addr_ == nullptr) {
+    local_addr_.reset(new (std::nothrow) struct sockaddr_storage());
+    if (local_addr_ == nullptr)
+      return nullptr;
+
+    int len = sizeof(struct sockaddr_storage);
+    int r = getsockname(
+        reinterpret_cast<struct sockaddr*>(local_addr_.get()),
+        &len);
+    if (r != 0)
+      local_addr_.reset(nullptr);
+  }
+
+  return reinterpret_cast<struct sockaddr*>(local_addr_.get());
+}
+
+const sockaddr* ns_udp::remote_addr() {
+  return reinterpret_cast<struct sockaddr*>(remote_addr_.get());
+}
+
+ns_io_stats ns_udp::get_stats() {
+  return stats_.get();
+}
+
+void ns_udp::reset_stats() {
+  stats_.reset();
+}
+
+int ns_udp::set_send_watermarks(size_t low,
+                                size_t high,
+                                send_policy policy) {
+  return set_send_watermarks_(low, high, policy, nullptr);
+}
+
+int ns_udp::set_send_watermarks(size_t low,
+                                size_t high,
+                                send_policy policy,
+                                ns_watermark_cb cb) {
+  wm_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  return set_send_watermarks_(
+      low,
+      high,
+      policy,
+      util::check_null_cb(cb, &watermark_proxy_<decltype(cb)>));
+}
+
+template <typename D_T>
+int ns_udp::set_send_watermarks(size_t low,
+                                size_t high,
+                                send_policy policy,
+                                ns_watermark_cb_d<D_T> cb,
+                                D_T* data) {
+  wm_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  wm_cb_data_ = data;
+  return set_send_watermarks_(
+      low,
+      high,
+      policy,
+      util::check_null_cb(cb, &watermark_proxy_<decltype(cb), D_T>));
+}
+
+int ns_udp::set_send_watermarks(size_t low,
+                                size_t high,
+                                send_policy policy,
+                                void (*cb)(ns_udp*, bool, size_t, void*),
+                                std::nullptr_t) {
+  return set_send_watermarks(low, high, policy, cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_udp::set_send_watermarks(size_t low,
+                                size_t high,
+                                send_policy policy,
+                                ns_watermark_cb_wp<D_T> cb,
+                                std::weak_ptr<D_T> data) {
+  wm_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  wm_cb_wp_ = data;
+  return set_send_watermarks_(
+      low,
+      high,
+      policy,
+      util::check_null_cb(cb, &watermark_proxy_wp_<decltype(cb), D_T>));
+}
+
+bool ns_udp::is_send_paused() {
+  return wm_paused_;
+}
+
+size_t ns_udp::held_send_size() {
+  return held_size_;
+}
+
+uint64_t ns_udp::dropped_sends() {
+  return dropped_sends_;
+}
+
+int ns_udp::send_(ns_udp_send* req,
+                  const struct sockaddr* addr,
+                  uv_udp_send_cb cb) {
+  // Sends without a callback still need to report back so the low watermark
+  // can be checked.
+  if (cb == nullptr && wm_high_ > 0)
+    cb = &send_drain_proxy_;
+
+  if (wm_paused_ && wm_policy_ == kSendReject)
+    return UV_ENOBUFS;
+  if (wm_paused_ && wm_policy_ == kSendDropOldest) {
+    hold_send_(req, cb);
+    return NSUV_OK;
+  }
+
+  int r = uv_udp_send(
+      req->uv_req(), uv_handle(), req->bufs(), req->size(), addr, cb);
+  if (r == 0) {
+    stats_.write(req->bufs(), req->size(), [this]() {
+      return uv_udp_get_send_queue_size(uv_handle());
+    });
+    check_send_high_watermark_();
+  }
+  return r;
+}
+
+int ns_udp::set_send_watermarks_(size_t low,
+                                 size_t high,
+                                 send_policy policy,
+                                 void (*proxy)(ns_udp*, bool, size_t)) {
+  if (high > 0 && low > high)
+    return UV_EINVAL;
+
+  wm_proxy_ = proxy;
+  wm_low_ = low;
+  wm_high_ = high;
+  wm_policy_ = policy;
+  wm_paused_ = false;
+  // Whatever was held back goes out now, the next send() checks the new
+  // high watermark.
+  release_held_sends_();
+
+  return NSUV_OK;
+}
+
+void ns_udp::hold_send_(ns_udp_send* req, uv_udp_send_cb cb) {
+  // libuv hasn't seen the request, but its callback may still need handle().
+  req->uv_req()->handle = uv_handle();
+  req->held_cb_ = cb;
+  req->held_next_ = nullptr;
+  if (held_tail_ == nullptr)
+    held_head_ = req;
+  else
+    held_tail_->held_next_ = req;
+  held_tail_ = req;
+  held_size_ += util::bufs_size(req->bufs(), req->size());
+
+  // The newest send is always kept.
+  while (held_size_ > wm_high_ && held_head_ != req) {
+    ns_udp_send* old = held_head_;
+    held_head_ = old->held_next_;
+    held_size_ -= util::bufs_size(old->bufs(), old->size());
+    old->held_next_ = nullptr;
+    if (dropped_tail_ == nullptr)
+      dropped_head_ = old;
+    else
+      dropped_tail_->held_next_ = old;
+    dropped_tail_ = old;
+    dropped_sends_++;
+  }
+}
+
+// The callbacks called from here and from complete_dropped_sends_() come
+// back through check_send_low_watermark_(). The nested calls return right
+// away and leave the rest to the outer loop, so the stack doesn't grow with
+// the number of sends.
+void ns_udp::release_held_sends_() {
+  if (releasing_)
+    return;
+  releasing_ = true;
+  while (held_head_ != nullptr) {
+    ns_udp_send* req = held_head_;
+    held_head_ = req->held_next_;
+    if (held_head_ == nullptr)
+      held_tail_ = nullptr;
+    req->held_next_ = nullptr;
+    held_size_ -= util::bufs_size(req->bufs(), req->size());
+
+    int r = UV_ECANCELED;
+    if (!is_closing()) {
+      r = uv_udp_send(req->uv_req(),
+                      uv_handle(),
+                      req->bufs(),
+                      req->size(),
+                      req->sockaddr(),
+                      req->held_cb_);
+    }
+    if (r == 0) {
+      stats_.write(req->bufs(), req->size(), [this]() {
+        return uv_udp_get_send_queue_size(uv_handle());
+      });
+    } else if (req->held_cb_ != nullptr) {
+      req->held_cb_(req->uv_req(), r);
+    }
+  }
+  releasing_ = false;
+}
+
+void ns_udp::complete_dropped_sends_() {
+  if (completing_)
+    return;
+  completing_ = true;
+  // Sends dropped by the callbacks land on a fresh list.
+  while (dropped_head_ != nullptr) {
+    ns_udp_send* req = dropped_head_;
+    dropped_head_ = nullptr;
+    dropped_tail_ = nullptr;
+    while (req != nullptr) {
+      ns_udp_send* next = req->held_next_;
+      req->held_next_ = nullptr;
+      if (req->held_cb_ != nullptr)
+        req->held_cb_(req->uv_req(), UV_ECANCELED);
+      req = next;
+    }
+  }
+  completing_ = false;
+}
+
+void ns_udp::check_send_high_watermark_() {
+  if (wm_high_ == 0 || wm_paused_)
+    return;
+
+  size_t size = uv_udp_get_send_queue_size(uv_handle());
+  if (size <= wm_high_)
+    return;
+
+  wm_paused_ = true;
+  if (wm_proxy_ != nullptr)
+    wm_proxy_(this, true, size);
+}
+
+void ns_udp::check_send_low_watermark_() {
+  // Dropped sends are completed here, from a send callback, so their
+  // callbacks are never called from inside send().
+  complete_dropped_sends_();
+
+  if (is_closing()) {
+    release_held_sends_();
+    return;
+  }
+
+  if (!wm_paused_)
+    return;
+
+  size_t size = uv_udp_get_send_queue_size(uv_handle());
+  if (size > wm_low_)
+    return;
+
+  // Held sends go first so they stay ahead of anything sent from the
+  // watermark callback.
+  wm_paused_ = false;
+  release_held_sends_();
+  if (wm_proxy_ != nullptr)
+    wm_proxy_(this, false, size);
+  check_send_high_watermark_();
+}
+
+void ns_udp::send_drain_proxy_(uv_udp_send_t* uv_req, int) {
+  ns_udp_send::cast(uv_req)->handle()->check_send_low_watermark_();
+}
+
+template <typename CB_T>
+void ns_udp::watermark_proxy_(ns_udp* handle, bool paused, size_t size) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->wm_cb_ptr_);
+  NSUV_TRACE_HANDLE("watermark", handle, cb_);
+  cb_(handle, paused, size);
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp::watermark_proxy_(ns_udp* handle, bool paused, size_t size) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->wm_cb_ptr_);
+  NSUV_TRACE_HANDLE("watermark", handle, cb_);
+  cb_(handle, paused, size, static_cast<D_T*>(handle->wm_cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp::watermark_proxy_wp_(ns_udp* handle, bool paused, size_t size) {
+  auto* cb_ = reinterpret_cast<CB_T>(handle->wm_cb_ptr_);
+  NSUV_TRACE_HANDLE("watermark", handle, cb_);
+  auto data = handle->wm_cb_wp_.lock();
+  cb_(handle, paused, size, std::static_pointer_cast<D_T>(data));
+}
+
+template <typename CB_T>
+void ns_udp::send_proxy_(uv_udp_send_t* uv_req, int status) {
+  auto* ureq = ns_udp_send::cast(uv_req);
+  auto* cb_ = reinterpret_cast<CB_T>(ureq->req_cb_);
+  NSUV_TRACE_REQ("send", uv_req, cb_);
+  auto* handle = ureq->handle();
+  handle->stats_.write_cb();
+  uint64_t start = handle->stats_.cb_start();
+  cb_(ureq, status);
+  handle->stats_.cb_end(start);
+  handle->check_send_low_watermark_();
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp::send_proxy_(uv_udp_send_t* uv_req, int status) {
+  auto* ureq = ns_udp_send::cast(uv_req);
+  auto* cb_ = reinterpret_cast<CB_T>(ureq->req_cb_);
+  NSUV_TRACE_REQ("send", uv_req, cb_);
+  auto* handle = ureq->handle();
+  handle->stats_.write_cb();
+  uint64_t start = handle->stats_.cb_start();
+  cb_(ureq, status, static_cast<D_T*>(ureq->req_cb_data_));
+  handle->stats_.cb_end(start);
+  handle->check_send_low_watermark_();
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp::send_proxy_wp_(uv_udp_send_t* uv_req, int status) {
+  auto* ureq = ns_udp_send::cast(uv_req);
+  auto* cb_ = reinterpret_cast<CB_T>(ureq->req_cb_);
+  NSUV_TRACE_REQ("send", uv_req, cb_);
+  auto data = ureq->req_cb_wp_.lock();
+  auto* handle = ureq->handle();
+  handle->stats_.write_cb();
+  uint64_t start = handle->stats_.cb_start();
+  cb_(ureq, status, std::static_pointer_cast<D_T>(data));
+  handle->stats_.cb_end(start);
+  handle->check_send_low_watermark_();
+}
+
+
+/* ns_udp_batch */
+
+ns_udp_batch::~ns_udp_batch() {
+  delete[] slots_;
+}
+
+int ns_udp_batch::init(ns_udp* handle, size_t capacity) {
+  if (handle == nullptr || capacity == 0)
+    return UV_EINVAL;
+  if (sending_)
+    return UV_EBUSY;
+
+  delete[] slots_;
+  slots_ = new (std::nothrow) slot[capacity];
+  if (slots_ == nullptr) {
+    capacity_ = 0;
+    return UV_ENOMEM;
+  }
+
+  handle_ = handle;
+  capacity_ = capacity;
+  count_ = 0;
+  return 0;
+}
+
+int ns_udp_batch::add(const uv_buf_t& buf, const struct sockaddr* addr) {
+  if (sending_)
+    return UV_EBUSY;
+  if (count_ == capacity_)
+    return UV_ENOBUFS;
+
+  slot* s = &slots_[count_];
+  s->buf = buf;
+  s->has_addr = addr != nullptr;
+  if (addr != nullptr) {
+    int len = util::addr_size(addr);
+    if (len <= 0)
+      return UV_EINVAL;
+    std::memcpy(&s->addr, addr, len);
+  }
+
+  count_++;
+  return 0;
+}
+
+int ns_udp_batch::add_segments(const uv_buf_t& buf,
+                               size_t segment_size,
+                               const struct sockaddr* addr) {
+  size_t n;
+
+  if (segment_size == 0 || buf.len == 0)
+    return UV_EINVAL;
+  if (sending_)
+    return UV_EBUSY;
+
+  n = (buf.len + segment_size - 1) / segment_size;
+  if (n > capacity_ - count_)
+    return UV_ENOBUFS;
+
+  for (size_t off = 0; off < buf.len; off += segment_size) {
+    size_t len = buf.len - off < segment_size ? buf.len - off : segment_size;
+    int r = add(uv_buf_init(buf.base + off, len), addr);
+    if (r != 0) {
+      count_ -= off / segment_size;
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+void ns_udp_batch::set_gso(bool enable) {
+#if defined(__linux__)
+  gso_ = enable;
+#else
+  static_cast<void>(enable);
+#endif
+}
+
+bool ns_udp_batch::gso() {
+  return gso_;
+}
+
+int ns_udp_batch::send(ns_udp_batch_cb cb) {
+  // Don't touch the callback of the batch that's in flight.
+  if (sending_)
+    return UV_EBUSY;
+  batch_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  done_ = util::check_null_cb(cb, &done_proxy_<decltype(cb)>);
+  return send_();
+}
+
+template <typename D_T>
+int ns_udp_batch::send(ns_udp_batch_cb_d<D_T> cb, D_T* data) {
+  if (sending_)
+    return UV_EBUSY;
+  batch_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  batch_cb_data_ = data;
+  done_ = util::check_null_cb(cb, &done_proxy_<decltype(cb), D_T>);
+  return send_();
+}
+
+int ns_udp_batch::send(void (*cb)(ns_udp_batch*, int, void*), std::nullptr_t) {
+  return send(cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_udp_batch::send(ns_udp_batch_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {
+  if (sending_)
+    return UV_EBUSY;
+  batch_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  batch_cb_wp_ = data;
+  done_ = util::check_null_cb(cb, &done_proxy_wp_<decltype(cb), D_T>);
+  return send_();
+}
+
+ns_udp* ns_udp_batch::handle() {
+  return handle_;
+}
+
+size_t ns_udp_batch::size() {
+  return count_;
+}
+
+size_t ns_udp_batch::sent() {
+  return sent_;
+}
+
+size_t ns_udp_batch::failed() {
+  return failed_;
+}
+
+size_t ns_udp_batch::syscalls() {
+  return syscalls_;
+}
+
+size_t ns_udp_batch::gso_segments() {
+  return gso_segments_;
+}
+
+int ns_udp_batch::send_() {
+  size_t i = 0;
+
+  if (count_ == 0)
+    return UV_EINVAL;
+
+  sent_ = 0;
+  failed_ = 0;
+  syscalls_ = 0;
+  gso_segments_ = 0;
+  status_ = 0;
+  pending_ = 0;
+
+  // Sending directly while libuv has sends queued would reorder them.
+  if (uv_udp_get_send_queue_count(handle_->uv_handle()) == 0)
+    i = try_send_(count_ - 1);
+
+  for (; i < count_; i++) {
+    slot* s = &slots_[i];
+    s->req.data = this;
+    int r = uv_udp_send(
+        &s->req, handle_->uv_handle(), &s->buf, 1, addr_(s), queued_cb_);
+    if (r != 0) {
+      fail_(r);
+      continue;
+    }
+    handle_->stats_.write(&s->buf, 1, [this]() {
+      return uv_udp_get_send_queue_size(handle_->uv_handle());
+    });
+    pending_++;
+  }
+
+  count_ = 0;
+  if (pending_ == 0)
+    return status_;
+
+  sending_ = true;
+  // What's queued counts towards the handle's send queue like any send().
+  handle_->check_send_high_watermark_();
+  return 0;
+}
+
+#if defined(__linux__)
+size_t ns_udp_batch::try_send_(size_t count) {
+  struct mmsghdr msgs[kMmsgChunk];
+  struct iovec iovs[kMmsgChunk];
+  // Datagrams covered by each message, more than one when segmented.
+  size_t runs[kMmsgChunk];
+  alignas(struct cmsghdr) char ctrl[kMmsgChunk][CMSG_SPACE(sizeof(uint16_t))];
+  size_t no_gso_until = 0;
+  uv_os_fd_t fd;
+  size_t i = 0;
+
+  if (count == 0)
+    return 0;
+
+  // The socket is created lazily, so let uv_udp_try_send() bind it.
+  if (uv_fileno(handle_->base_handle(), &fd) != 0) {
+    slot* s = &slots_[0];
+    int r = uv_udp_try_send(handle_->uv_handle(), &s->buf, 1, addr_(s));
+    syscalls_++;
+    if (r == UV_EAGAIN)
+      return 0;
+    if (r < 0) {
+      fail_(r);
+    } else {
+      handle_->stats_.try_write(r);
+      sent_++;
+    }
+    i++;
+    if (uv_fileno(handle_->base_handle(), &fd) != 0)
+      return i;
+  }
+
+  while (i < count) {
+    size_t n = 0;
+    size_t k = i;
+    int r;
+
+    // Each message takes a run of datagrams, but no more than kMmsgChunk
+    // datagrams go into a single call.
+    while (k < count && k - i < kMmsgChunk) {
+      size_t len = 1;
+      if (gso_ && k >= no_gso_until)
+        len = gso_run_(k, i + kMmsgChunk < count ? i + kMmsgChunk : count);
+
+      struct msghdr* hdr = &msgs[n].msg_hdr;
+      slot* s = &slots_[k];
+      std::memset(&msgs[n], 0, sizeof(msgs[n]));
+      for (size_t j = 0; j < len; j++) {
+        iovs[k - i + j].iov_base = slots_[k + j].buf.base;
+        iovs[k - i + j].iov_len = slots_[k + j].buf.len;
+      }
+      hdr->msg_iov = &iovs[k - i];
+      hdr->msg_iovlen = len;
+      if (s->has_addr) {
+        hdr->msg_name = &s->addr;
+        hdr->msg_namelen = util::addr_size(addr_(s));
+      }
+      if (len > 1) {
+        uint16_t segment_size = static_cast<uint16_t>(s->buf.len);
+        struct cmsghdr* cm;
+        hdr->msg_control = ctrl[n];
+        hdr->msg_controllen = sizeof(ctrl[n]);
+        cm = CMSG_FIRSTHDR(hdr);
+        cm->cmsg_level = IPPROTO_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(segment_size));
+        std::memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+      }
+      runs[n++] = len;
+      k += len;
+    }
+
+    do {
+      r = sendmmsg(fd, msgs, n, 0);
+    } while (r == -1 && errno == EINTR);
+    syscalls_++;
+
+    if (r == -1) {
+      if (errno == EAGAIN || errno == ENOBUFS)
+        break;
+      if (runs[0] > 1) {
+        // Resend the run one datagram at a time so each gets its own result,
+        // and stop trying if segmentation itself isn't supported.
+        if (errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+          gso_ = false;
+        no_gso_until = i + runs[0];
+        continue;
+      }
+      // sendmmsg() stops at the first datagram that fails, so skip it.
+      fail_(-errno);
+      i++;
+      continue;
+    }
+
+    for (int m = 0; m < r; m++) {
+      for (size_t j = 0; j < runs[m]; j++)
+        handle_->stats_.try_write(slots_[i + j].buf.len);
+      if (runs[m] > 1)
+        gso_segments_ += runs[m];
+      sent_ += runs[m];
+      i += runs[m];
+    }
+  }
+
+  return i;
+}
+#else
+size_t ns_udp_batch::try_send_(size_t count) {
+  size_t i = 0;
+
+  for (; i < count; i++) {
+    slot* s = &slots_[i];
+    int r = uv_udp_try_send(handle_->uv_handle(), &s->buf, 1, addr_(s));
+    syscalls_++;
+    if (r == UV_EAGAIN)
+      break;
+    if (r < 0) {
+      fail_(r);
+      continue;
+    }
+    handle_->stats_.try_write(r);
+    sent_++;
+  }
+
+  return i;
+}
+#endif
+
+size_t ns_udp_batch::gso_run_(size_t i, size_t end) {
+  const slot* first = &slots_[i];
+  size_t size = first->buf.len;
+  size_t total = size;
+  size_t len = 1;
+  int addr_len = first->has_addr ?
+      util::addr_size(reinterpret_cast<const struct sockaddr*>(&first->addr)) :
+      0;
+
+  if (size == 0)
+    return 1;
+
+  // Every datagram but the last must be exactly segment size.
+  while (i + len < end && len < kGsoMaxSegments) {
+    const slot* s = &slots_[i + len];
+    if (s->buf.len == 0 || s->buf.len > size ||
+        total + s->buf.len > kGsoMaxBytes ||
+        s->has_addr != first->has_addr ||
+        std::memcmp(&s->addr, &first->addr, addr_len) != 0) {
+      break;
+    }
+    total += s->buf.len;
+    len++;
+    if (s->buf.len < size)
+      break;
+  }
+
+  return len;
+}
+
+void ns_udp_batch::fail_(int status) {
+  if (status_ == 0)
+    status_ = status;
+  failed_++;
+}
+
+const struct sockaddr* ns_udp_batch::addr_(slot* s) {
+  if (!s->has_addr)
+    return nullptr;
+  return reinterpret_cast<const struct sockaddr*>(&s->addr);
+}
+
+void ns_udp_batch::queued_cb_(uv_udp_send_t* req, int status) {
+  auto* batch = static_cast<ns_udp_batch*>(req->data);
+  // The done callback may free the batch.
+  ns_udp* handle = batch->handle_;
+
+  handle->stats_.write_cb();
+  if (status < 0)
+    batch->fail_(status);
+  else
+    batch->sent_++;
+
+  if (--batch->pending_ == 0) {
+    batch->sending_ = false;
+    if (batch->done_ != nullptr)
+      batch->done_(batch, batch->status_);
+  }
+
+  handle->check_send_low_watermark_();
+}
+
+template <typename CB_T>
+void ns_udp_batch::done_proxy_(ns_udp_batch* batch, int status) {
+  auto* cb_ = reinterpret_cast<CB_T>(batch->batch_cb_ptr_);
+  NSUV_TRACE_HANDLE("send_batch", batch->handle_, cb_);
+  cb_(batch, status);
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp_batch::done_proxy_(ns_udp_batch* batch, int status) {
+  auto* cb_ = reinterpret_cast<CB_T>(batch->batch_cb_ptr_);
+  NSUV_TRACE_HANDLE("send_batch", batch->handle_, cb_);
+  cb_(batch, status, static_cast<D_T*>(batch->batch_cb_data_));
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp_batch::done_proxy_wp_(ns_udp_batch* batch, int status) {
+  auto* cb_ = reinterpret_cast<CB_T>(batch->batch_cb_ptr_);
+  NSUV_TRACE_HANDLE("send_batch", batch->handle_, cb_);
+  auto data = batch->batch_cb_wp_.lock();
+  cb_(batch, status, std::static_pointer_cast<D_T>(data));
+}
+
+
+/* ns_udp_gro */
+
+ns_udp_gro::~ns_udp_gro() {
+  delete[] buf_;
+}
+
+int ns_udp_gro::init(ns_udp* handle) {
+#if defined(__linux__)
+  uv_os_fd_t fd;
+  int one = 1;
+  int r;
+
+  if (fd_ != -1)
+    return UV_EBUSY;
+
+  r = uv_fileno(handle->base_handle(), &fd);
+  if (r != 0)
+    return r;
+
+  if (buf_ == nullptr) {
+    buf_ = new (std::nothrow) char[kBufSize];
+    if (buf_ == nullptr)
+      return UV_ENOMEM;
+  }
+
+  // Not fatal, it only means every datagram is read on its own.
+  gro_ = setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+
+  fd_ = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (fd_ == -1)
+    return -errno;
+
+  r = poll_.init_socket(handle->get_loop(), fd_);
+  if (r != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return r;
+  }
+
+  handle_ = handle;
+  return NSUV_OK;
+#else
+  (void)handle;
+  return UV_ENOTSUP;
+#endif
+}
+
+int ns_udp_gro::start(ns_udp_gro_cb cb) {
+  recv_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  recv_ = util::check_null_cb(cb, &recv_proxy_<decltype(cb)>);
+  return start_();
+}
+
+template <typename D_T>
+int ns_udp_gro::start(ns_udp_gro_cb_d<D_T> cb, D_T* data) {
+  recv_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  recv_cb_data_ = data;
+  recv_ = util::check_null_cb(cb, &recv_proxy_<decltype(cb), D_T>);
+  return start_();
+}
+
+int ns_udp_gro::start(void (*cb)(ns_udp_gro*,
+                                 int,
+                                 const uv_buf_t*,
+                                 size_t,
+                                 const struct sockaddr*,
+                                 void*),
+                      std::nullptr_t) {
+  return start(cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_udp_gro::start(ns_udp_gro_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {
+  recv_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  recv_cb_wp_ = data;
+  recv_ = util::check_null_cb(cb, &recv_proxy_wp_<decltype(cb), D_T>);
+  return start_();
+}
+
+int ns_udp_gro::stop() {
+  reading_ = false;
+  if (fd_ == -1)
+    return NSUV_OK;
+  return poll_.stop();
+}
+
+void ns_udp_gro::close(void (*cb)(ns_udp_gro*)) {
+  close_cb_ptr_ = cb;
+  reading_ = false;
+  // The poll handle was never initialized.
+  if (fd_ == -1) {
+    if (cb != nullptr)
+      cb(this);
+    return;
+  }
+  poll_.close(close_cb_, this);
+#if defined(__linux__)
+  // uv_close() has already removed the fd from the poller.
+  ::close(fd_);
+#endif
+  fd_ = -1;
+}
+
+ns_udp* ns_udp_gro::handle() {
+  return handle_;
+}
+
+bool ns_udp_gro::gro() {
+  return gro_;
+}
+
+int ns_udp_gro::start_() {
+  if (fd_ == -1)
+    return UV_EBADF;
+  if (recv_ == nullptr)
+    return UV_EINVAL;
+
+  int r = poll_.start(UV_READABLE, poll_cb_, this);
+  if (r == NSUV_OK)
+    reading_ = true;
+  return r;
+}
+
+bool ns_udp_gro::read_() {
+#if defined(__linux__)
+  alignas(struct cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))];
+  struct sockaddr_storage addr;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cm;
+  size_t segment_size;
+  size_t off = 0;
+  ssize_t nread;
+
+  iov.iov_base = buf_;
+  iov.iov_len = kBufSize;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &addr;
+  msg.msg_namelen = sizeof(addr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+
+  do {
+    nread = recvmsg(fd_, &msg, MSG_DONTWAIT);
+  } while (nread == -1 && errno == EINTR);
+
+  if (nread == -1) {
+    if (errno == EAGAIN)
+      return false;
+    int err = -errno;
+    handle_->stats_.read(err);
+    recv_(this, err, nullptr, 0, nullptr);
+    return false;
+  }
+
+  segment_size = static_cast<size_t>(nread);
+  for (cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+      int size;
+      std::memcpy(&size, CMSG_DATA(cm), sizeof(size));
+      if (size > 0)
+        segment_size = static_cast<size_t>(size);
+    }
+  }
+
+  // An empty datagram is still one datagram.
+  do {
+    size_t n = 0;
+    size_t bytes = 0;
+
+    while (n < kMaxSegments && (off < static_cast<size_t>(nread) || n == 0)) {
+      size_t len = static_cast<size_t>(nread) - off;
+      if (len > segment_size)
+        len = segment_size;
+      dgrams_[n++] = uv_buf_init(buf_ + off, len);
+      off += len;
+      bytes += len;
+    }
+
+    handle_->stats_.read(bytes);
+    recv_(this, 0, dgrams_, n, reinterpret_cast<struct sockaddr*>(&addr));
+    // The callback could have stopped or closed this.
+    if (!reading_)
+      return false;
+  } while (off < static_cast<size_t>(nread));
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+void ns_udp_gro::poll_cb_(ns_poll*, int status, int, ns_udp_gro* self) {
+  if (status < 0) {
+    self->handle_->stats_.read(status);
+    self->recv_(self, status, nullptr, 0, nullptr);
+    return;
+  }
+
+  for (size_t i = 0; i < kMaxReads && self->read_(); i++) {}
+}
+
+void ns_udp_gro::close_cb_(ns_poll*, ns_udp_gro* self) {
+  if (self->close_cb_ptr_ != nullptr)
+    self->close_cb_ptr_(self);
+}
+
+template <typename CB_T>
+void ns_udp_gro::recv_proxy_(ns_udp_gro* gro,
+                             int status,
+                             const uv_buf_t* dgrams,
+                             size_t ndgrams,
+                             const struct sockaddr* addr) {
+  auto* cb_ = reinterpret_cast<CB_T>(gro->recv_cb_ptr_);
+  NSUV_TRACE_HANDLE("udp_gro_recv", gro->handle_, cb_);
+  uint64_t start = gro->handle_->stats_.cb_start();
+  cb_(gro, status, dgrams, ndgrams, addr);
+  gro->handle_->stats_.cb_end(start);
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp_gro::recv_proxy_(ns_udp_gro* gro,
+                             int status,
+                             const uv_buf_t* dgrams,
+                             size_t ndgrams,
+                             const struct sockaddr* addr) {
+  auto* cb_ = reinterpret_cast<CB_T>(gro->recv_cb_ptr_);
+  NSUV_TRACE_HANDLE("udp_gro_recv", gro->handle_, cb_);
+  uint64_t start = gro->handle_->stats_.cb_start();
+  cb_(gro, status, dgrams, ndgrams, addr,
+      static_cast<D_T*>(gro->recv_cb_data_));
+  gro->handle_->stats_.cb_end(start);
+}
+
+template <typename CB_T, typename D_T>
+void ns_udp_gro::recv_proxy_wp_(ns_udp_gro* gro,
+                                int status,
+                                const uv_buf_t* dgrams,
+                                size_t ndgrams,
+                                const struct sockaddr* addr) {
+  auto* cb_ = reinterpret_cast<CB_T>(gro->recv_cb_ptr_);
+  NSUV_TRACE_HANDLE("udp_gro_recv", gro->handle_, cb_);
+  auto data = gro->recv_cb_wp_.lock();
+  uint64_t start = gro->handle_->stats_.cb_start();
+  cb_(gro, status, dgrams, ndgrams, addr, std::static_pointer_cast<D_T>(data));
+  gro->handle_->stats_.cb_end(start);
+}
+
+
+/* ns_addr */
+
+int ns_addr::init(const struct sockaddr* addr) {
+  *this = ns_addr();
+
+  if (addr->sa_family == AF_INET) {
+    auto* a = reinterpret_cast<const struct sockaddr_in*>(addr);
+    std::memcpy(ip_, &a->sin_addr, sizeof(a->sin_addr));
+    port_ = a->sin_port;
+  } else if (addr->sa_family == AF_INET6) {
+    auto* a = reinterpret_cast<const struct sockaddr_in6*>(addr);
+    std::memcpy(ip_, &a->sin6_addr, sizeof(a->sin6_addr));
+    scope_id_ = a->sin6_scope_id;
+    port_ = a->sin6_port;
+  } else {
+    return UV_EAFNOSUPPORT;
+  }
+
+  family_ = static_cast<uint8_t>(addr->sa_family);
+  return NSUV_OK;
+}
+
+void ns_addr::to_sockaddr(struct sockaddr_storage* addr) const {
+  std::memset(addr, 0, sizeof(*addr));
+
+  if (family_ == AF_INET) {
+    auto* a = reinterpret_cast<struct sockaddr_in*>(addr);
+    a->sin_family = AF_INET;
+    a->sin_port = port_;
+    std::memcpy(&a->sin_addr, ip_, sizeof(a->sin_addr));
+  } else if (family_ == AF_INET6) {
+    auto* a = reinterpret_cast<struct sockaddr_in6*>(addr);
+    a->sin6_family = AF_INET6;
+    a->sin6_port = port_;
+    a->sin6_scope_id = scope_id_;
+    std::memcpy(&a->sin6_addr, ip_, sizeof(a->sin6_addr));
+  }
+}
+
+int ns_addr::family() const {
+  return family_;
+}
+
+uint16_t ns_addr::port() const {
+  return ntohs(port_);
+}
+
+uint64_t ns_addr::hash(uint64_t seed) const {
+  static_assert(sizeof(ns_addr) == 24, "ns_addr must be three words");
+  uint64_t words[3];
+  uint64_t h = seed ^ 0x9e3779b97f4a7c15ull;
+
+  std::memcpy(words, this, sizeof(words));
+  for (uint64_t w : words) {
+    // murmur3's 64-bit finalizer.
+    h ^= w;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+  }
+
+  return h;
+}
+
+bool ns_addr::operator==(const ns_addr& other) const {
+  return std::memcmp(this, &other, sizeof(*this)) == 0;
+}
+
+bool ns_addr::operator!=(const ns_addr& other) const {
+  return !(*this == other);
+}
+
+
+/* ns_udp_sessions */
+
+template <class S_T>
+ns_udp_sessions<S_T>::~ns_udp_sessions() {
+  destroy_all_();
+}
+
+template <class S_T>
+int ns_udp_sessions<S_T>::init(uv_loop_t* loop,
+                               uint64_t idle_timeout,
+                               ns_session_recv_cb recv_cb,
+                               ns_session_expire_cb expire_cb) {
+  int r;
+
+  if (recv_cb == nullptr)
+    return UV_EINVAL;
+
+  r = table_.init();
+  if (r != NSUV_OK)
+    return r;
+
+  r = timer_.init(loop);
+  if (r != NSUV_OK) {
+    table_.destroy();
+    return r;
+  }
+
+  if (uv_random(nullptr, nullptr, &seed_, sizeof(seed_), 0, nullptr) != 0)
+    seed_ = uv_hrtime();
+
+  idle_timeout_ = idle_timeout;
+  recv_cb_ = recv_cb;
+  expire_cb_ = expire_cb;
+
+  if (idle_timeout > 0) {
+    uint64_t interval = idle_timeout / 4 > 0 ? idle_timeout / 4 : 1;
+    r = timer_.start(timer_cb_, interval, interval, this);
+    if (r != NSUV_OK) {
+      close_cb_ptr_ = nullptr;
+      timer_closing_ = true;
+      timer_.close(close_cb_, this);
+      table_.destroy();
+      return r;
+    }
+  }
+  uv_unref(timer_.base_handle());
+
+  return NSUV_OK;
+}
+
+template <class S_T>
+int ns_udp_sessions<S_T>::dispatch(const struct sockaddr* addr,
+                                   ssize_t nread,
+                                   const uv_buf_t* buf) {
+  ns_addr key;
+  uint64_t hash;
+  size_t idx;
+  entry* e;
+
+  // libuv's way of saying there's nothing left to read.
+  if (addr == nullptr)
+    return NSUV_OK;
+  if (table_.capacity() == 0)
+    return UV_EINVAL;
+
+  int r = key.init(addr);
+  if (r != NSUV_OK)
+    return r;
+
+  hash = key.hash(seed_);
+  idx = find_(key, hash);
+  e = table_.at(idx);
+
+  if (e == nullptr) {
+    if (max_sessions_ != 0 && table_.size() >= max_sessions_)
+      return UV_ENOBUFS;
+    r = table_.reserve();
+    if (r != NSUV_OK)
+      return r;
+
+    e = new (std::nothrow) entry();
+    if (e == nullptr)
+      return UV_ENOMEM;
+    e->addr = key;
+    e->hash = hash;
+    table_.insert(find_(key, hash), e);
+  } else {
+    table_.unlink(e);
+  }
+
+  e->last_seen = uv_now(timer_.get_loop());
+  table_.push_back(e);
+  recv_cb_(this, &e->state, e->addr, nread, buf);
+
+  return NSUV_OK;
+}
+
+template <class S_T>
+S_T* ns_udp_sessions<S_T>::get(const ns_addr& addr) {
+  if (table_.capacity() == 0)
+    return nullptr;
+
+  entry* e = table_.at(find_(addr, addr.hash(seed_)));
+  return e == nullptr ? nullptr : &e->state;
+}
+
+template <class S_T>
+int ns_udp_sessions<S_T>::remove(const ns_addr& addr) {
+  if (table_.capacity() == 0)
+    return UV_ENOENT;
+
+  entry* e = table_.at(find_(addr, addr.hash(seed_)));
+  if (e == nullptr)
+    return UV_ENOENT;
+
+  table_.erase(e);
+  delete e;
+  return NSUV_OK;
+}
+
+template <class S_T>
+void ns_udp_sessions<S_T>::set_max_sessions(size_t max) {
+  max_sessions_ = max;
+}
+
+template <class S_T>
+size_t ns_udp_sessions<S_T>::size() {
+  return table_.size();
+}
+
+template <class S_T>
+void ns_udp_sessions<S_T>::close(void (*cb)(ns_udp_sessions<S_T>*)) {
+  close_cb_ptr_ = cb;
+  destroy_all_();
+  table_.destroy();
+  // A failed init() is still closing the timer, so cb waits for that.
+  if (timer_closing_)
+    return;
+  // The timer was never initialized, or has already been closed.
+  if (timer_.get_type() == UV_UNKNOWN_HANDLE || timer_.is_closing()) {
+    if (cb != nullptr)
+      cb(this);
+    return;
+  }
+  timer_closing_ = true;
+  timer_.close(close_cb_, this);
+}
+
+template <class S_T>
+size_t ns_udp_sessions<S_T>::find_(const ns_addr& addr, uint64_t hash) {
+  return table_.find(hash, [&addr](const entry* e) {
+    return e->addr == addr;
+  });
+}
+
+template <class S_T>
+void ns_udp_sessions<S_T>::destroy_all_() {
+  entry* e = table_.head();
+
+  table_.clear();
+  while (e != nullptr) {
+    entry* next = e->next;
+    delete e;
+    e = next;
+  }
+}
+
+template <class S_T>
+void ns_udp_sessions<S_T>::timer_cb_(ns_timer* timer,
+                                     ns_udp_sessions<S_T>* self) {
+  uint64_t now = uv_now(timer->get_loop());
+
+  // Least recently active first, so stop at the first one still in use.
+  while (self->table_.head() != nullptr &&
+         now - self->table_.head()->last_seen >= self->idle_timeout_) {
+    entry* e = self->table_.head();
+    self->table_.erase(e);
+    if (self->expire_cb_ != nullptr)
+      self->expire_cb_(self, &e->state, e->addr);
+    delete e;
+  }
+}
+
+template <class S_T>
+void ns_udp_sessions<S_T>::close_cb_(ns_timer*, ns_udp_sessions<S_T>* self) {
+  self->timer_closing_ = false;
+  if (self->close_cb_ptr_ != nullptr)
+    self->close_cb_ptr_(self);
+}
+
+
+/* ns_udp_reuseport */
+
+ns_udp_reuseport::~ns_udp_reuseport() {
+  close();
+}
+
+int ns_udp_reuseport::init(const struct sockaddr* addr, size_t count) {
+#if defined(_WIN32)
+  (void)addr;
+  (void)count;
+  return UV_ENOTSUP;
+#else
+  int len = util::addr_size(addr);
+  int one = 1;
+
+  if (len < 0)
+    return len;
+  if (count == 0)
+    return UV_EINVAL;
+  if (fds_ != nullptr)
+    return UV_EBUSY;
+
+  fds_ = new (std::nothrow) int[count];
+  if (fds_ == nullptr)
+    return UV_ENOMEM;
+  for (size_t i = 0; i < count; i++)
+    fds_[i] = -1;
+  count_ = count;
+
+  for (size_t i = 0; i < count; i++) {
+#if defined(SOCK_CLOEXEC)
+    int fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+#else
+    int fd = socket(addr->sa_family, SOCK_DGRAM, 0);
+#endif
+    int err = 0;
+
+    if (fd == -1) {
+      err = -errno;
+    } else {
+      fds_[i] = fd;
+#if !defined(SOCK_CLOEXEC)
+      // Not atomic, so a fork() from another thread can still inherit it.
+      if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        err = -errno;
+#endif
+      if (err == 0 &&
+          (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+           ::bind(fd, addr, len) == -1)) {
+        err = -errno;
+      }
+    }
+
+    if (err != 0) {
+      close();
+      return err;
+    }
+  }
+
+  return NSUV_OK;
+#endif
+}
+
+int ns_udp_reuseport::steer_by_cpu() {
+#if defined(__linux__)
+  struct sock_filter code[] = {
+    // A = the CPU that received the packet.
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0,
+      static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(count_) },
+    // Index into the group, in the order the sockets were bound.
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+  int fd = -1;
+
+  // The program applies to the whole group, so any socket will do.
+  for (size_t i = 0; i < count_ && fd == -1; i++)
+    fd = fds_[i];
+  if (fd == -1)
+    return UV_EBADF;
+
+  if (setsockopt(fd,
+                 SOL_SOCKET,
+                 SO_ATTACH_REUSEPORT_CBPF,
+                 &prog,
+                 sizeof(prog)) == -1) {
+    return -errno;
+  }
+
+  return NSUV_OK;
+#else
+  return UV_ENOTSUP;
+#endif
+}
+
+int ns_udp_reuseport::open(size_t i, ns_udp* handle) {
+  if (i >= count_)
+    return UV_EINVAL;
+  if (fds_[i] == -1)
+    return UV_EBADF;
+
+  int r = uv_udp_open(handle->uv_handle(), fds_[i]);
+  if (r == NSUV_OK)
+    fds_[i] = -1;
+  return r;
+}
+
+size_t ns_udp_reuseport::size() {
+  return count_;
+}
+
+void ns_udp_reuseport::close() {
+#if !defined(_WIN32)
+  for (size_t i = 0; i < count_; i++) {
+    if (fds_[i] != -1)
+      ::close(fds_[i]);
+  }
+#endif
+  delete[] fds_;
+  fds_ = nullptr;
+  count_ = 0;
+}
+
+
+/* ns_mutex */
+
+ns_mutex::ns_mutex(int* er, bool recursive) : auto_destruct_(true) {
+  *er = recursive ? init_recursive() : init();
+}
+
+ns_mutex::~ns_mutex() {
+  if (auto_destruct_ && !destroyed_)
+    destroy();
+}
+
+int ns_mutex::init(bool ad) {
+  auto_destruct_ = ad;
+  destroyed_ = false;
+  return uv_mutex_init(&mutex_);
+}
+
+int ns_mutex::init_recursive(bool ad) {
+  auto_destruct_ = ad;
+  destroyed_ = false;
+  return uv_mutex_init_recursive(&mutex_);
+}
+
+void ns_mutex::destroy() {
+  destroyed_ = true;
+  uv_mutex_destroy(&mutex_);
+}
+
+void ns_mutex::lock() {
+  uv_mutex_lock(&mutex_);
+}
+
+int ns_mutex::trylock() {
+  return uv_mutex_trylock(&mutex_);
+}
+
+void ns_mutex::unlock() {
+  uv_mutex_unlock(&mutex_);
+}
+
+bool ns_mutex::destroyed() {
+  return destroyed_;
+}
+
+uv_mutex_t* ns_mutex::base() {
+  return &mutex_;
+}
+
+ns_mutex::scoped_lock::scoped_lock(ns_mutex* mutex) : ns_mutex_(*mutex) {
+  uv_mutex_lock(&ns_mutex_.mutex_);
+}
+
+ns_mutex::scoped_lock::scoped_lock(const ns_mutex& mutex) : ns_mutex_(mutex) {
+  uv_mutex_lock(&ns_mutex_.mutex_);
+}
+
+ns_mutex::scoped_lock::~scoped_lock() {
+  uv_mutex_unlock(&ns_mutex_.mutex_);
+}
+
+/* ns_rwlock */
+
+ns_rwlock::ns_rwlock(int* er) : auto_destruct_(true) {
+  *er = init();
+}
+
+ns_rwlock::~ns_rwlock() {
+  if (auto_destruct_)
+    destroy();
+}
+
+int ns_rwlock::init(bool ad) {
+  auto_destruct_ = ad;
+  destroyed_ = false;
+  return uv_rwlock_init(&lock_);
+}
+
+void ns_rwlock::destroy() {
+  destroyed_ = true;
+  uv_rwlock_destroy(&lock_);
+}
+
+void ns_rwlock::rdlock() {
+  uv_rwlock_rdlock(&lock_);
+}
+
+int ns_rwlock::tryrdlock() {
+  return uv_rwlock_tryrdlock(&lock_);
+}
+
+void ns_rwlock::rdunlock() {
+  uv_rwlock_rdunlock(&lock_);
+}
+
+void ns_rwlock::wrlock() {
+  uv_rwlock_wrlock(&lock_);
+}
+
+int ns_rwlock::trywrlock() {
+  return uv_rwlock_trywrlock(&lock_);
+}
+
+void ns_rwlock::wrunlock() {
+  uv_rwlock_wrunlock(&lock_);
+}
+
+bool ns_rwlock::destroyed() {
+  return destroyed_;
+}
+
+uv_rwlock_t* ns_rwlock::base() {
+  return &lock_;
+}
+
+ns_rwlock::scoped_rdlock::scoped_rdlock(ns_rwlock* lock) : ns_rwlock_(*lock) {
+  uv_rwlock_rdlock(&ns_rwlock_.lock_);
+}
+
+ns_rwlock::scoped_rdlock::scoped_rdlock(const ns_rwlock& lock) :
+    ns_rwlock_(lock) {
+  uv_rwlock_rdlock(&ns_rwlock_.lock_);
+}
+
+ns_rwlock::scoped_rdlock::~scoped_rdlock() {
+  uv_rwlock_rdunlock(&ns_rwlock_.lock_);
+}
+
+ns_rwlock::scoped_wrlock::scoped_wrlock(ns_rwlock* lock) : ns_rwlock_(*lock) {
+  uv_rwlock_wrlock(&ns_rwlock_.lock_);
+}
+
+ns_rwlock::scoped_wrlock::scoped_wrlock(const ns_rwlock& lock) :
+    ns_rwlock_(lock) {
+  uv_rwlock_wrlock(&ns_rwlock_.lock_);
+}
+
+ns_rwlock::scoped_wrlock::~scoped_wrlock() {
+  uv_rwlock_wrunlock(&ns_rwlock_.lock_);
+}
+
+
+/* ns_thread */
+
+int ns_thread::create(ns_thread_cb cb) {
+  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+
+  return uv_thread_create(&thread_,
+                          util::check_null_cb(cb, &create_proxy_<decltype(cb)>),
+                          this);
+}
+
+template <typename D_T>
+int ns_thread::create(ns_thread_cb_d<D_T> cb, D_T* data) {
+  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  thread_cb_data_ = data;
+
+  return uv_thread_create(
+      &thread_,
+      util::check_null_cb(cb, &create_proxy_<decltype(cb), D_T>),
+      this);
+}
+
+int ns_thread::create(void (*cb)(ns_thread*, void*), std::nullptr_t) {
+  return create(cb, NSUV_CAST_NULLPTR);
+}
+
+template <typename D_T>
+int ns_thread::create(ns_thread_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {
+  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  thread_cb_wp_ = data;
+
+  return uv_thread_create(
+      &thread_,
+      util::check_null_cb(cb, &create_proxy_wp_<decltype(cb), D_T>),
+      this);
+}
+
+int ns_thread::create_ex(const uv_thread_options_t* params,
+                         ns_thread_cb cb) {
+  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+
+  return uv_thread_create_ex(
+      &thread_,
+      params,
+      util::check_null_cb(cb, &create_proxy_<decltype(cb)>),
+      this);
+}
+
+template <typename D_T>
+int ns_thread::create_ex(const uv_thread_options_t* params,
+                         ns_thread_cb_d<D_T> cb,
+                         D_T* data) {
+  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  thread_cb_data_ = data;
+
+  return uv_thread_create_ex(
+      &thread_,
+      params,
+      util::check_null_cb(cb, &create_proxy_<decltype(cb), D_T>),
+      this);
 }
 
-int ns_udp::send(ns_udp_send* req,
-                 const uv_buf_t bufs[],
-                 size_t nbufs,
-                 const struct sockaddr* addr,
-                 void (*cb)(ns_udp_send*, int, void*),
-                 std::nullptr_t) {
-  return send(req, bufs, nbufs, addr, cb, NSUV_CAST_NULLPTR);
+int ns_thread::create_ex(const uv_thread_options_t* params,
+                         void (*cb)(ns_thread*, void*),
+                         std::nullptr_t) {
+  return create_ex(params, cb, NSUV_CAST_NULLPTR);
 }
 
 template <typename D_T>
-int ns_udp::send(ns_udp_send* req,
-                 const uv_buf_t bufs[],
-                 size_t nbufs,
-                 const struct sockaddr* addr,
-                 ns_udp_send_cb_wp<D_T> cb,
-                 std::weak_ptr<D_T> data) {
-  int r = req->init(bufs, nbufs, addr, cb, data);
-  if (r != 0)
-    return r;
+int ns_thread::create_ex(const uv_thread_options_t* params,
+                         ns_thread_cb_wp<D_T> cb,
+                         std::weak_ptr<D_T> data) {
+  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+  thread_cb_wp_ = data;
 
-  return uv_udp_send(
-      req->uv_req(),
-      uv_handle(),
-      req->bufs(),
-      req->size(),
-      addr,
-      util::check_null_cb(cb, &send_proxy_wp_<decltype(cb), D_T>));
+  return uv_thread_create_ex(
+      &thread_,
+      params,
+      util::check_null_cb(cb, &create_proxy_wp_<decltype(cb), D_T>),
+      this);
 }
 
-template <typename D_T>
-int ns_udp::send(ns_udp_send* req,
-                 const std::vector<uv_buf_t>& bufs,
-                 const struct sockaddr* addr,
-                 ns_udp_send_cb_d<D_T> cb,
-                 D_T* data) {
-  int r = req->init(bufs, addr, cb, data);
-  if (r != 0)
-    return r;
+int ns_thread::join() {
+  return uv_thread_join(&thread_);
+}
 
-  return uv_udp_send(req->uv_req(),
-                     uv_handle(),
-                     req->bufs(),
-                     req->size(),
-                     addr,
-                     util::check_null_cb(cb, &send_proxy_<decltype(cb), D_T>));
+uv_thread_t ns_thread::base() {
+  return thread_;
 }
 
-int ns_udp::send(ns_udp_send* req,
-                 const std::vector<uv_buf_t>& bufs,
-                 const struct sockaddr* addr,
-                 void (*cb)(ns_udp_send*, int, void*),
-                 std::nullptr_t) {
-  return send(req, bufs, addr, cb, NSUV_CAST_NULLPTR);
+bool ns_thread::equal(uv_thread_t* t2) {
+  return uv_thread_equal(&thread_, t2) == 0;
 }
 
-template <typename D_T>
-int ns_udp::send(ns_udp_send* req,
-                 const std::vector<uv_buf_t>& bufs,
-                 const struct sockaddr* addr,
-                 ns_udp_send_cb_wp<D_T> cb,
-                 std::weak_ptr<D_T> data) {
-  int r = req->init(bufs, addr, cb, data);
-  if (r != 0)
-    return r;
+bool ns_thread::equal(uv_thread_t&& t2) {
+  return uv_thread_equal(&thread_, &t2) == 0;
+}
 
-  return uv_udp_send(
-      req->uv_req(),
-      uv_handle(),
-      req->bufs(),
-      req->size(),
-      addr,
-      util::check_null_cb(cb, &send_proxy_wp_<decltype(cb), D_T>));
+bool ns_thread::equal(ns_thread* t2) {
+  return t2->equal(&thread_) == 0;
 }
 
-const sockaddr* ns_udp::local_addr() {
-  if (local_addr_ == nullptr) {
-    local_addr_.reset(new (std::nothrow) struct sockaddr_storage());
-    if (local_addr_ == nullptr)
-      return nullptr;
+bool ns_thread::equal(ns_thread&& t2) {
+  return t2.equal(&thread_) == 0;
+}
 
-    int len = sizeof(struct sockaddr_storage);
-    int r = getsockname(
-        reinterpret_cast<struct sockaddr*>(local_addr_.get()),
-        &len);
-    if (r != 0)
-      local_addr_.reset(nullptr);
-  }
+bool ns_thread::equal(const uv_thread_t& t1, const uv_thread_t& t2) {
+  return uv_thread_equal(&t1, &t2) == 0;
+}
 
-  return reinterpret_cast<struct sockaddr*>(local_addr_.get());
+bool ns_thread::equal(uv_thread_t&& t1, uv_thread_t&& t2) {
+  return uv_thread_equal(&t1, &t2) == 0;
 }
 
-const sockaddr* ns_udp::remote_addr() {
-  return reinterpret_cast<struct sockaddr*>(remote_addr_.get());
+uv_thread_t ns_thread::self() {
+  return uv_thread_self();
 }
 
 template <typename CB_T>
-void ns_udp::send_proxy_(uv_udp_send_t* uv_req, int status) {
-  auto* ureq = ns_udp_send::cast(uv_req);
-  auto* cb_ = reinterpret_cast<CB_T>(ureq->req_cb_);
-  cb_(ureq, status);
+void ns_thread::create_proxy_(void* arg) {
+  auto* wrap = static_cast<ns_thread*>(arg);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->thread_cb_ptr_);
+  cb_(wrap);
 }
 
 template <typename CB_T, typename D_T>
-void ns_udp::send_proxy_(uv_udp_send_t* uv_req, int status) {
-  auto* ureq = ns_udp_send::cast(uv_req);
-  auto* cb_ = reinterpret_cast<CB_T>(ureq->req_cb_);
-  cb_(ureq, status, static_cast<D_T*>(ureq->req_cb_data_));
+void ns_thread::create_proxy_(void* arg) {
+  auto* wrap = static_cast<ns_thread*>(arg);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->thread_cb_ptr_);
+  cb_(wrap, static_cast<D_T*>(wrap->thread_cb_data_));
 }
 
 template <typename CB_T, typename D_T>
-void ns_udp::send_proxy_wp_(uv_udp_send_t* uv_req, int status) {
-  auto* ureq = ns_udp_send::cast(uv_req);
-  auto* cb_ = reinterpret_cast<CB_T>(ureq->req_cb_);
-  auto data = ureq->req_cb_wp_.lock();
-  cb_(ureq, status, std::static_pointer_cast<D_T>(data));
+void ns_thread::create_proxy_wp_(void* arg) {
+  auto* wrap = static_cast<ns_thread*>(arg);
+  auto* cb_ = reinterpret_cast<CB_T>(wrap->thread_cb_ptr_);
+  auto data = wrap->thread_cb_wp_.lock();
+  cb_(wrap, std::static_pointer_cast<D_T>(data));
 }
 
 
-/* ns_mutex */
 
-ns_mutex::ns_mutex(int* er, bool recursive) : auto_destruct_(true) {
-  *er = recursive ? init_recursive() : init();
-}
+/* ns_watchdog */
 
-ns_mutex::~ns_mutex() {
-  if (auto_destruct_ && !destroyed_)
-    destroy();
+ns_watchdog::~ns_watchdog() {
+  stop();
 }
 
-int ns_mutex::init(bool ad) {
-  auto_destruct_ = ad;
-  destroyed_ = false;
-  return uv_mutex_init(&mutex_);
-}
+int ns_watchdog::start(uv_loop_t* loop,
+                       uint64_t threshold,
+                       ns_watchdog_cb cb) {
+  uint64_t interval = threshold / 2 > 0 ? threshold / 2 : 1;
+  int r;
 
-int ns_mutex::init_recursive(bool ad) {
-  auto_destruct_ = ad;
-  destroyed_ = false;
-  return uv_mutex_init_recursive(&mutex_);
-}
+  if (loop == nullptr || threshold == 0)
+    return UV_EINVAL;
+  if (running_)
+    return UV_EBUSY;
+
+  slot_ = util::cb_slot::current();
+  if (slot_->watched)
+    return UV_EBUSY;
+
+  timer_ = new (std::nothrow) ns_timer();
+  if (timer_ == nullptr)
+    return UV_ENOMEM;
+  r = timer_->init(loop);
+  if (r != 0) {
+    delete timer_;
+    timer_ = nullptr;
+    return r;
+  }
 
-void ns_mutex::destroy() {
-  destroyed_ = true;
-  uv_mutex_destroy(&mutex_);
-}
+  r = mutex_.init();
+  if (r == 0) {
+    r = uv_cond_init(&cond_);
+    if (r != 0)
+      mutex_.destroy();
+  }
+  if (r != 0) {
+    timer_->close_and_delete();
+    timer_ = nullptr;
+    return r;
+  }
 
-void ns_mutex::lock() {
-  uv_mutex_lock(&mutex_);
+  cb_ = cb;
+  threshold_ = threshold * 1000 * 1000;
+  reported_ = 0;
+  stall_count_ = 0;
+  last_stall_ = ns_stall();
+  stopping_ = false;
+  suspended_.store(false, std::memory_order_relaxed);
+  heartbeat_.store(uv_hrtime(), std::memory_order_release);
+
+  r = timer_->start(heartbeat_cb_, interval, interval, this);
+  if (r == 0)
+    r = thread_.create(thread_cb_, this);
+  if (r != 0) {
+    timer_->close_and_delete();
+    timer_ = nullptr;
+    uv_cond_destroy(&cond_);
+    mutex_.destroy();
+    return r;
+  }
+
+  timer_->unref();
+  slot_->watched = true;
+  running_ = true;
+  return 0;
 }
 
-int ns_mutex::trylock() {
-  return uv_mutex_trylock(&mutex_);
+void ns_watchdog::stop() {
+  if (!running_)
+    return;
+
+  mutex_.lock();
+  stopping_ = true;
+  uv_cond_signal(&cond_);
+  mutex_.unlock();
+  // Can only fail if the thread was already joined, which running_ prevents.
+  int r = thread_.join();
+  static_cast<void>(r);
+
+  timer_->close_and_delete();
+  timer_ = nullptr;
+  slot_->watched = false;
+  uv_cond_destroy(&cond_);
+  mutex_.destroy();
+  running_ = false;
 }
 
-void ns_mutex::unlock() {
-  uv_mutex_unlock(&mutex_);
+uint64_t ns_watchdog::stall_count() {
+  if (!running_)
+    return stall_count_;
+  ns_mutex::scoped_lock lock(mutex_);
+  return stall_count_;
 }
 
-bool ns_mutex::destroyed() {
-  return destroyed_;
+ns_stall ns_watchdog::last_stall() {
+  if (!running_)
+    return last_stall_;
+  ns_mutex::scoped_lock lock(mutex_);
+  return last_stall_;
 }
 
-uv_mutex_t* ns_mutex::base() {
-  return &mutex_;
+void ns_watchdog::suspend() {
+  suspended_.store(true, std::memory_order_release);
 }
 
-ns_mutex::scoped_lock::scoped_lock(ns_mutex* mutex) : ns_mutex_(*mutex) {
-  uv_mutex_lock(&ns_mutex_.mutex_);
+void ns_watchdog::resume() {
+  // The time spent suspended doesn't count.
+  heartbeat_.store(uv_hrtime(), std::memory_order_release);
+  suspended_.store(false, std::memory_order_release);
 }
 
-ns_mutex::scoped_lock::scoped_lock(const ns_mutex& mutex) : ns_mutex_(mutex) {
-  uv_mutex_lock(&ns_mutex_.mutex_);
+void ns_watchdog::heartbeat_cb_(ns_timer*, ns_watchdog* wd) {
+  wd->heartbeat_.store(uv_hrtime(), std::memory_order_release);
 }
 
-ns_mutex::scoped_lock::~scoped_lock() {
-  uv_mutex_unlock(&ns_mutex_.mutex_);
+void ns_watchdog::thread_cb_(ns_thread*, ns_watchdog* wd) {
+  // Check a few times per threshold so stalls are caught close to it.
+  uint64_t interval = wd->threshold_ / 4;
+
+  wd->mutex_.lock();
+  while (!wd->stopping_) {
+    static_cast<void>(uv_cond_timedwait(&wd->cond_,
+                                        wd->mutex_.base(),
+                                        interval));
+    if (wd->stopping_)
+      break;
+    wd->mutex_.unlock();
+    wd->check_(uv_hrtime());
+    wd->mutex_.lock();
+  }
+  wd->mutex_.unlock();
+}
+
+void ns_watchdog::check_(uint64_t now) {
+  uint64_t beat = heartbeat_.load(std::memory_order_acquire);
+  ns_stall stall;
+
+  // Only report each stall once.
+  if (now - beat <= threshold_ || beat == reported_)
+    return;
+  if (suspended_.load(std::memory_order_acquire))
+    return;
+  reported_ = beat;
+  stall.duration = now - beat;
+
+  uint64_t start = slot_->start.load(std::memory_order_acquire);
+  if (start != 0) {
+    const char* cb = slot_->cb.load(std::memory_order_relaxed);
+    const void* ptr = slot_->ptr.load(std::memory_order_relaxed);
+    void (*fn)() = slot_->fn.load(std::memory_order_relaxed);
+    int type = slot_->type.load(std::memory_order_relaxed);
+    bool req = slot_->req.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Otherwise the callback returned while reading, so the loop is moving.
+    if (slot_->start.load(std::memory_order_relaxed) == start) {
+      stall.cb = cb;
+      stall.ptr = ptr;
+      stall.fn = fn;
+      stall.type_name =
+          req ? uv_req_type_name(static_cast<uv_req_type>(type)) :
+                uv_handle_type_name(static_cast<uv_handle_type>(type));
+      stall.cb_time = now > start ? now - start : 0;
+    }
+  }
+
+  mutex_.lock();
+  last_stall_ = stall;
+  stall_count_++;
+  mutex_.unlock();
+
+  if (cb_ != nullptr)
+    cb_(this, stall);
 }
 
-/* ns_rwlock */
+int util::addr_size(const struct sockaddr* addr) {
+  if (addr == nullptr) {
+    return 0;
+  }
 
-ns_rwlock::ns_rwlock(int* er) : auto_destruct_(true) {
-  *er = init();
+  int len;
+  if (addr->sa_family == AF_INET) {
+    len = sizeof(struct sockaddr_in);
+  } else if (addr->sa_family == AF_INET6) {
+    len = sizeof(struct sockaddr_in6);
+#if defined(AF_UNIX) && !defined(_WIN32)
+  } else if (addr->sa_family == AF_UNIX) {
+    len = sizeof(struct sockaddr_un);
+#endif
+  } else {
+    return UV_EINVAL;
+  }
+
+  return len;
 }
 
-ns_rwlock::~ns_rwlock() {
-  if (auto_destruct_)
-    destroy();
+size_t util::bufs_size(const uv_buf_t bufs[], size_t nbufs) {
+  size_t size = 0;
+  for (size_t i = 0; i < nbufs; i++)
+    size += bufs[i].len;
+  return size;
 }
 
-int ns_rwlock::init(bool ad) {
-  auto_destruct_ = ad;
-  destroyed_ = false;
-  return uv_rwlock_init(&lock_);
+template <typename T, typename U>
+T util::check_null_cb(U cb, T proxy) {
+  if (cb == nullptr) return nullptr;
+  return proxy;
 }
 
-void ns_rwlock::destroy() {
-  destroyed_ = true;
-  uv_rwlock_destroy(&lock_);
+void util::io_stats::read(ssize_t nread) {
+#if defined(NSUV_ENABLE_STATS)
+  stats_.read_cbs++;
+  if (nread > 0)
+    stats_.bytes_read += nread;
+#else
+  static_cast<void>(nread);
+#endif
 }
 
-void ns_rwlock::rdlock() {
-  uv_rwlock_rdlock(&lock_);
+template <typename F>
+void util::io_stats::write(const uv_buf_t bufs[], size_t nbufs, F queue_size) {
+#if defined(NSUV_ENABLE_STATS)
+  stats_.writes++;
+  for (size_t i = 0; i < nbufs; i++)
+    stats_.bytes_written += bufs[i].len;
+  size_t size = queue_size();
+  if (size > stats_.peak_write_queue_size)
+    stats_.peak_write_queue_size = size;
+#else
+  static_cast<void>(bufs);
+  static_cast<void>(nbufs);
+  static_cast<void>(queue_size);
+#endif
 }
 
-int ns_rwlock::tryrdlock() {
-  return uv_rwlock_tryrdlock(&lock_);
+void util::io_stats::try_write(ssize_t nwritten) {
+#if defined(NSUV_ENABLE_STATS)
+  if (nwritten > 0) {
+    stats_.writes++;
+    stats_.bytes_written += nwritten;
+  }
+#else
+  static_cast<void>(nwritten);
+#endif
 }
 
-void ns_rwlock::rdunlock() {
-  uv_rwlock_rdunlock(&lock_);
+void util::io_stats::write_cb() {
+#if defined(NSUV_ENABLE_STATS)
+  stats_.write_cbs++;
+#endif
 }
 
-void ns_rwlock::wrlock() {
-  uv_rwlock_wrlock(&lock_);
+uint64_t util::io_stats::cb_start() {
+#if defined(NSUV_ENABLE_STATS)
+  return uv_hrtime();
+#else
+  return 0;
+#endif
 }
 
-int ns_rwlock::trywrlock() {
-  return uv_rwlock_trywrlock(&lock_);
+void util::io_stats::cb_end(uint64_t start) {
+#if defined(NSUV_ENABLE_STATS)
+  stats_.cb_time += uv_hrtime() - start;
+#else
+  static_cast<void>(start);
+#endif
 }
 
-void ns_rwlock::wrunlock() {
-  uv_rwlock_wrunlock(&lock_);
+ns_io_stats util::io_stats::get() {
+#if defined(NSUV_ENABLE_STATS)
+  return stats_;
+#else
+  return ns_io_stats();
+#endif
 }
 
-bool ns_rwlock::destroyed() {
-  return destroyed_;
+void util::io_stats::reset() {
+#if defined(NSUV_ENABLE_STATS)
+  stats_ = ns_io_stats();
+#endif
+}
+
+uint64_t ns_histogram::percentile(double p) const {
+  if (count == 0)
+    return 0;
+
+  // Nearest rank, so the 50th percentile of 3 samples is the 2nd one.
+  double rank = p / 100 * count;
+  uint64_t target = static_cast<uint64_t>(rank);
+  if (target < rank)
+    target++;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    seen += buckets[i];
+    if (seen > 0 && seen >= target)
+      return i == 0 ? 0 : (uint64_t{ 1 } << i) - 1;
+  }
+
+  return max;
 }
 
-uv_rwlock_t* ns_rwlock::base() {
-  return &lock_;
-}
+void util::histogram::record(uint64_t value) {
+  size_t bucket = 0;
+#if defined(__GNUC__) || defined(__clang__)
+  if (value != 0)
+    bucket = 64 - __builtin_clzll(value);
+#else
+  for (uint64_t v = value; v != 0; v >>= 1)
+    bucket++;
+#endif
+  if (bucket >= ns_histogram::kBuckets)
+    bucket = ns_histogram::kBuckets - 1;
+
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
 
-ns_rwlock::scoped_rdlock::scoped_rdlock(ns_rwlock* lock) : ns_rwlock_(*lock) {
-  uv_rwlock_rdlock(&ns_rwlock_.lock_);
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
 }
 
-ns_rwlock::scoped_rdlock::scoped_rdlock(const ns_rwlock& lock) :
-    ns_rwlock_(lock) {
-  uv_rwlock_rdlock(&ns_rwlock_.lock_);
+ns_histogram util::histogram::get() {
+  ns_histogram h;
+  h.count = count_.load(std::memory_order_relaxed);
+  h.sum = sum_.load(std::memory_order_relaxed);
+  h.max = max_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < ns_histogram::kBuckets; i++)
+    h.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+  return h;
 }
 
-ns_rwlock::scoped_rdlock::~scoped_rdlock() {
-  uv_rwlock_rdunlock(&ns_rwlock_.lock_);
+void util::histogram::reset() {
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+  for (size_t i = 0; i < ns_histogram::kBuckets; i++)
+    buckets_[i].store(0, std::memory_order_relaxed);
 }
 
-ns_rwlock::scoped_wrlock::scoped_wrlock(ns_rwlock* lock) : ns_rwlock_(*lock) {
-  uv_rwlock_wrlock(&ns_rwlock_.lock_);
+ns_threadpool_stats util::pool_histograms::get() {
+  ns_threadpool_stats stats;
+  stats.queue_wait = queue_wait.get();
+  stats.service_time = service_time.get();
+  stats.total = total.get();
+  return stats;
 }
 
-ns_rwlock::scoped_wrlock::scoped_wrlock(const ns_rwlock& lock) :
-    ns_rwlock_(lock) {
-  uv_rwlock_wrlock(&ns_rwlock_.lock_);
+void util::pool_histograms::reset() {
+  queue_wait.reset();
+  service_time.reset();
+  total.reset();
 }
 
-ns_rwlock::scoped_wrlock::~scoped_wrlock() {
-  uv_rwlock_wrunlock(&ns_rwlock_.lock_);
+void util::pool_timer::submit() {
+#if defined(NSUV_ENABLE_STATS)
+  submit_ = uv_hrtime();
+#endif
 }
 
-
-/* ns_thread */
-
-int ns_thread::create(ns_thread_cb cb) {
-  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-
-  return uv_thread_create(&thread_,
-                          util::check_null_cb(cb, &create_proxy_<decltype(cb)>),
-                          this);
+void util::pool_timer::start(pool_histograms* h) {
+#if defined(NSUV_ENABLE_STATS)
+  start_ = uv_hrtime();
+  h->queue_wait.record(start_ - submit_);
+#else
+  static_cast<void>(h);
+#endif
 }
 
-template <typename D_T>
-int ns_thread::create(ns_thread_cb_d<D_T> cb, D_T* data) {
-  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  thread_cb_data_ = data;
+void util::pool_timer::end(pool_histograms* h) {
+#if defined(NSUV_ENABLE_STATS)
+  h->service_time.record(uv_hrtime() - start_);
+#else
+  static_cast<void>(h);
+#endif
+}
 
-  return uv_thread_create(
-      &thread_,
-      util::check_null_cb(cb, &create_proxy_<decltype(cb), D_T>),
-      this);
+void util::pool_timer::complete(histogram* total) {
+#if defined(NSUV_ENABLE_STATS)
+  total->record(uv_hrtime() - submit_);
+#else
+  static_cast<void>(total);
+#endif
 }
 
-int ns_thread::create(void (*cb)(ns_thread*, void*), std::nullptr_t) {
-  return create(cb, NSUV_CAST_NULLPTR);
+util::cb_slot* util::cb_slot::current() {
+  static thread_local cb_slot slot;
+  return &slot;
 }
 
-template <typename D_T>
-int ns_thread::create(ns_thread_cb_wp<D_T> cb, std::weak_ptr<D_T> data) {
-  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  thread_cb_wp_ = data;
+util::cb_trace::cb_trace(const char* cb,
+                         const void* ptr,
+                         int type,
+                         bool req,
+                         void (*fn)()) {
+#if defined(NSUV_HAVE_USDT)
+  cb_ = cb;
+  ptr_ = ptr;
+  type_ = req ? uv_req_type_name(static_cast<uv_req_type>(type)) :
+                uv_handle_type_name(static_cast<uv_handle_type>(type));
+  DTRACE_PROBE3(nsuv, cb__entry, cb_, ptr_, type_);
+#endif
 
-  return uv_thread_create(
-      &thread_,
-      util::check_null_cb(cb, &create_proxy_wp_<decltype(cb), D_T>),
-      this);
+#if defined(NSUV_ENABLE_WATCHDOG)
+  slot_ = cb_slot::current();
+  if (!slot_->watched)
+    return;
+  counted_ = true;
+  // Only the outermost callback is reported.
+  if (slot_->depth++ > 0)
+    return;
+
+  // Orders the start = 0 from the last callback before the stores below.
+  std::atomic_thread_fence(std::memory_order_release);
+  slot_->cb.store(cb, std::memory_order_relaxed);
+  slot_->ptr.store(ptr, std::memory_order_relaxed);
+  slot_->fn.store(fn, std::memory_order_relaxed);
+  slot_->type.store(type, std::memory_order_relaxed);
+  slot_->req.store(req, std::memory_order_relaxed);
+  slot_->start.store(uv_hrtime(), std::memory_order_release);
+#else
+  static_cast<void>(cb);
+  static_cast<void>(ptr);
+  static_cast<void>(type);
+  static_cast<void>(req);
+  static_cast<void>(fn);
+#endif
 }
 
-int ns_thread::create_ex(const uv_thread_options_t* params,
-                         ns_thread_cb cb) {
-  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
+util::cb_trace::~cb_trace() {
+#if defined(NSUV_ENABLE_WATCHDOG)
+  if (counted_ && --slot_->depth == 0)
+    slot_->start.store(0, std::memory_order_release);
+#endif
+#if defined(NSUV_HAVE_USDT)
+  DTRACE_PROBE3(nsuv, cb__return, cb_, ptr_, type_);
+#endif
+}
 
-  return uv_thread_create_ex(
-      &thread_,
-      params,
-      util::check_null_cb(cb, &create_proxy_<decltype(cb)>),
-      this);
+util::write_payload::write_payload(write_payload&& other) noexcept
+    : ptr_(other.ptr_), release_(other.release_) {
+  other.ptr_ = nullptr;
+  other.release_ = nullptr;
 }
 
-template <typename D_T>
-int ns_thread::create_ex(const uv_thread_options_t* params,
-                         ns_thread_cb_d<D_T> cb,
-                         D_T* data) {
-  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  thread_cb_data_ = data;
+util::write_payload& util::write_payload::operator=(
+    write_payload&& other) noexcept {
+  if (this != &other) {
+    reset(other.ptr_, other.release_);
+    other.ptr_ = nullptr;
+    other.release_ = nullptr;
+  }
+  return *this;
+}
 
-  return uv_thread_create_ex(
-      &thread_,
-      params,
-      util::check_null_cb(cb, &create_proxy_<decltype(cb), D_T>),
-      this);
+util::write_payload::~write_payload() {
+  reset();
 }
 
-int ns_thread::create_ex(const uv_thread_options_t* params,
-                         void (*cb)(ns_thread*, void*),
-                         std::nullptr_t) {
-  return create_ex(params, cb, NSUV_CAST_NULLPTR);
+bool util::write_payload::empty() {
+  return ptr_ == nullptr;
 }
 
-template <typename D_T>
-int ns_thread::create_ex(const uv_thread_options_t* params,
-                         ns_thread_cb_wp<D_T> cb,
-                         std::weak_ptr<D_T> data) {
-  thread_cb_ptr_ = reinterpret_cast<void (*)()>(cb);
-  thread_cb_wp_ = data;
+void util::write_payload::reset(void* ptr, void (*release)(void*)) {
+  void* old = ptr_;
+  void (*old_release)(void*) = release_;
 
-  return uv_thread_create_ex(
-      &thread_,
-      params,
-      util::check_null_cb(cb, &create_proxy_wp_<decltype(cb), D_T>),
-      this);
+  ptr_ = ptr;
+  release_ = release;
+  if (old != nullptr)
+    old_release(old);
 }
 
-int ns_thread::join() {
-  return uv_thread_join(&thread_);
+template <class E>
+util::lru_table<E>::~lru_table() {
+  destroy();
 }
 
-uv_thread_t ns_thread::base() {
-  return thread_;
+template <class E>
+int util::lru_table<E>::init() {
+  if (buckets_ != nullptr)
+    return UV_EBUSY;
+  buckets_ = new (std::nothrow) E*[kMinBuckets]();
+  if (buckets_ == nullptr)
+    return UV_ENOMEM;
+  nbuckets_ = kMinBuckets;
+  return NSUV_OK;
 }
 
-bool ns_thread::equal(uv_thread_t* t2) {
-  return uv_thread_equal(&thread_, t2) == 0;
+template <class E>
+void util::lru_table<E>::destroy() {
+  delete[] buckets_;
+  buckets_ = nullptr;
+  nbuckets_ = 0;
+  size_ = 0;
+  head_ = nullptr;
+  tail_ = nullptr;
 }
 
-bool ns_thread::equal(uv_thread_t&& t2) {
-  return uv_thread_equal(&thread_, &t2) == 0;
-}
+template <class E>
+template <typename F>
+size_t util::lru_table<E>::find(uint64_t hash, F eq) {
+  size_t mask = nbuckets_ - 1;
+  size_t idx = hash & mask;
 
-bool ns_thread::equal(ns_thread* t2) {
-  return t2->equal(&thread_) == 0;
-}
+  while (buckets_[idx] != nullptr) {
+    E* e = buckets_[idx];
+    if (e->hash == hash && eq(e))
+      break;
+    idx = (idx + 1) & mask;
+  }
 
-bool ns_thread::equal(ns_thread&& t2) {
-  return t2.equal(&thread_) == 0;
+  return idx;
 }
 
-bool ns_thread::equal(const uv_thread_t& t1, const uv_thread_t& t2) {
-  return uv_thread_equal(&t1, &t2) == 0;
+template <class E>
+E* util::lru_table<E>::at(size_t idx) {
+  return buckets_[idx];
 }
 
-bool ns_thread::equal(uv_thread_t&& t1, uv_thread_t&& t2) {
-  return uv_thread_equal(&t1, &t2) == 0;
-}
+template <class E>
+int util::lru_table<E>::reserve() {
+  // Keep the load factor under 3/4.
+  if ((size_ + 1) * 4 <= nbuckets_ * 3)
+    return NSUV_OK;
 
-uv_thread_t ns_thread::self() {
-  return uv_thread_self();
+  size_t nbuckets = nbuckets_ * 2;
+  E** buckets = new (std::nothrow) E*[nbuckets]();
+  if (buckets == nullptr)
+    return UV_ENOMEM;
+
+  for (size_t i = 0; i < nbuckets_; i++) {
+    E* e = buckets_[i];
+    if (e == nullptr)
+      continue;
+    size_t idx = e->hash & (nbuckets - 1);
+    while (buckets[idx] != nullptr)
+      idx = (idx + 1) & (nbuckets - 1);
+    buckets[idx] = e;
+  }
+
+  delete[] buckets_;
+  buckets_ = buckets;
+  nbuckets_ = nbuckets;
+  return NSUV_OK;
 }
 
-template <typename CB_T>
-void ns_thread::create_proxy_(void* arg) {
-  auto* wrap = static_cast<ns_thread*>(arg);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->thread_cb_ptr_);
-  cb_(wrap);
+template <class E>
+void util::lru_table<E>::insert(size_t idx, E* e) {
+  e->prev = nullptr;
+  e->next = nullptr;
+  buckets_[idx] = e;
+  size_++;
+}
+
+// Backward shift deletion, so lookups never need tombstones.
+template <class E>
+void util::lru_table<E>::erase(E* e) {
+  size_t mask = nbuckets_ - 1;
+  size_t idx = find(e->hash, [e](const E* other) { return other == e; });
+  size_t j = idx;
+
+  if (e->prev != nullptr || head_ == e)
+    unlink(e);
+  buckets_[idx] = nullptr;
+  size_--;
+
+  for (;;) {
+    j = (j + 1) & mask;
+    if (buckets_[j] == nullptr)
+      return;
+
+    // Move the entry back unless its home bucket lies in (idx, j].
+    size_t home = buckets_[j]->hash & mask;
+    bool stays = idx <= j ? (idx < home && home <= j) :
+                            (idx < home || home <= j);
+    if (stays)
+      continue;
+
+    buckets_[idx] = buckets_[j];
+    buckets_[j] = nullptr;
+    idx = j;
+  }
 }
 
-template <typename CB_T, typename D_T>
-void ns_thread::create_proxy_(void* arg) {
-  auto* wrap = static_cast<ns_thread*>(arg);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->thread_cb_ptr_);
-  cb_(wrap, static_cast<D_T*>(wrap->thread_cb_data_));
+template <class E>
+void util::lru_table<E>::clear() {
+  if (buckets_ != nullptr)
+    std::memset(buckets_, 0, nbuckets_ * sizeof(*buckets_));
+  size_ = 0;
+  head_ = nullptr;
+  tail_ = nullptr;
 }
 
-template <typename CB_T, typename D_T>
-void ns_thread::create_proxy_wp_(void* arg) {
-  auto* wrap = static_cast<ns_thread*>(arg);
-  auto* cb_ = reinterpret_cast<CB_T>(wrap->thread_cb_ptr_);
-  auto data = wrap->thread_cb_wp_.lock();
-  cb_(wrap, std::static_pointer_cast<D_T>(data));
+template <class E>
+size_t util::lru_table<E>::size() {
+  return size_;
 }
 
-int util::addr_size(const struct sockaddr* addr) {
-  if (addr == nullptr) {
-    return 0;
-  }
+template <class E>
+size_t util::lru_table<E>::capacity() {
+  return nbuckets_;
+}
 
-  int len;
-  if (addr->sa_family == AF_INET) {
-    len = sizeof(struct sockaddr_in);
-  } else if (addr->sa_family == AF_INET6) {
-    len = sizeof(struct sockaddr_in6);
-#if defined(AF_UNIX) && !defined(_WIN32)
-  } else if (addr->sa_family == AF_UNIX) {
-    len = sizeof(struct sockaddr_un);
-#endif
-  } else {
-    return UV_EINVAL;
-  }
+template <class E>
+E* util::lru_table<E>::head() {
+  return head_;
+}
 
-  return len;
+template <class E>
+void util::lru_table<E>::push_back(E* e) {
+  e->prev = tail_;
+  e->next = nullptr;
+  if (tail_ == nullptr)
+    head_ = e;
+  else
+    tail_->next = e;
+  tail_ = e;
 }
 
-template <typename T, typename U>
-T util::check_null_cb(U cb, T proxy) {
-  if (cb == nullptr) return nullptr;
-  return proxy;
+template <class E>
+void util::lru_table<E>::unlink(E* e) {
+  if (e->prev == nullptr)
+    head_ = e->next;
+  else
+    e->prev->next = e->next;
+  if (e->next == nullptr)
+    tail_ = e->prev;
+  else
+    e->next->prev = e->prev;
+  e->prev = nullptr;
+  e->next = nullptr;
 }
 
 template <class T>
@@ -2432,6 +8668,11 @@ const T* util::no_throw_vec<T>::data() {
   return data_;
 }
 
+template <class T>
+T* util::no_throw_vec<T>::mutable_data_() {
+  return data_;
+}
+
 template <class T>
 size_t util::no_throw_vec<T>::size() {
   return size_;
@@ -2478,7 +8719,309 @@ int util::no_throw_vec<T>::replace(const T* b, size_t n) {
   return NSUV_OK;
 }
 
+#if defined(NSUV_HAVE_SSE2)
+namespace util {
+inline unsigned int ctz32(uint32_t mask) {
+#if defined(_MSC_VER)
+  unsigned long idx;  // NOLINT(runtime/int)
+  _BitScanForward(&idx, mask);
+  return idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+}  // namespace util
+#endif
+
+const char* util::find_lf(const char* s, const char* end) {
+#if defined(NSUV_HAVE_AVX2)
+  const __m256i lf32 = _mm256_set1_epi8('\n');
+  while (end - s >= 32) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+    uint32_t mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, lf32)));
+    if (mask != 0)
+      return s + util::ctz32(mask);
+    s += 32;
+  }
+#endif
+#if defined(NSUV_HAVE_SSE2)
+  const __m128i lf16 = _mm_set1_epi8('\n');
+  while (end - s >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    uint32_t mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf16)));
+    if (mask != 0)
+      return s + util::ctz32(mask);
+    s += 16;
+  }
+#endif
+  if (s >= end)
+    return nullptr;
+  return static_cast<const char*>(std::memchr(s, '\n', end - s));
+}
+
+util::line_reader::~line_reader() {
+  delete[] slab_;
+  delete[] carry_;
+}
+
+int util::line_reader::init() {
+  if (slab_ != nullptr)
+    return NSUV_OK;
+
+  slab_ = new (std::nothrow) char[kSlabSize];
+  if (slab_ == nullptr)
+    return UV_ENOMEM;
+  return NSUV_OK;
+}
+
+void util::line_reader::alloc(uv_buf_t* buf) {
+  if (slab_ == nullptr) {
+    *buf = uv_buf_init(nullptr, 0);
+  } else {
+    *buf = uv_buf_init(slab_, kSlabSize);
+  }
+}
+
+void util::line_reader::max_line(size_t len) {
+  max_line_ = len;
+}
+
+int util::line_reader::carry_append(const char* s, size_t len) {
+  if (carry_len_ + len > max_line_)
+    return UV_ENOBUFS;
+
+  if (carry_len_ + len > carry_cap_) {
+    size_t cap = carry_cap_ == 0 ? 256 : carry_cap_ * 2;
+    while (cap < carry_len_ + len)
+      cap *= 2;
+    char* carry = new (std::nothrow) char[cap];
+    if (carry == nullptr)
+      return UV_ENOMEM;
+    if (carry_len_ > 0)
+      std::memcpy(carry, carry_, carry_len_);
+    delete[] carry_;
+    carry_ = carry;
+    carry_cap_ = cap;
+  }
+
+  std::memcpy(carry_ + carry_len_, s, len);
+  carry_len_ += len;
+  return NSUV_OK;
+}
+
+template <typename F>
+void util::line_reader::split(const char* data, size_t len, F emit) {
+  const char* end = data + len;
+  const char* p = data;
+  const char* lf;
+  size_t n = 0;
+
+  auto push = [&](const char* base, size_t line_len) {
+    if (line_len > 0 && base[line_len - 1] == '\r')
+      line_len--;
+    lines_[n++] = uv_buf_init(const_cast<char*>(base),
+                              static_cast<unsigned int>(line_len));
+  };
+
+  // Finish the line that was started in a previous read.
+  if (carry_len_ > 0 || discarding_) {
+    lf = find_lf(p, end);
+    if (lf == nullptr) {
+      if (!discarding_) {
+        int er = carry_append(p, len);
+        if (er != NSUV_OK) {
+          carry_len_ = 0;
+          discarding_ = true;
+          emit(er, nullptr, 0);
+        }
+      }
+      return;
+    }
+
+    if (discarding_) {
+      discarding_ = false;
+    } else {
+      int er = carry_append(p, lf - p);
+      if (er != NSUV_OK) {
+        carry_len_ = 0;
+        if (!emit(er, nullptr, 0))
+          return;
+      } else {
+        push(carry_, carry_len_);
+      }
+    }
+    p = lf + 1;
+  }
+
+  while (p < end && (lf = find_lf(p, end)) != nullptr) {
+    if (static_cast<size_t>(lf - p) > max_line_) {
+      if (n > 0 && !emit(0, lines_, n))
+        return;
+      n = 0;
+      if (!emit(UV_ENOBUFS, nullptr, 0))
+        return;
+    } else {
+      push(p, lf - p);
+      if (n == kBatchSize) {
+        if (!emit(0, lines_, n))
+          return;
+        n = 0;
+      }
+    }
+    p = lf + 1;
+  }
+
+  if (n > 0 && !emit(0, lines_, n))
+    return;
+
+  // Everything that referenced carry_ has been emitted, so it can be reused
+  // for the trailing partial line.
+  carry_len_ = 0;
+  if (p < end) {
+    int er = carry_append(p, end - p);
+    if (er != NSUV_OK) {
+      discarding_ = true;
+      emit(er, nullptr, 0);
+    }
+  }
+}
+
+template <typename F>
+void util::line_reader::finish(int status, F emit) {
+  if (carry_len_ > 0) {
+    uv_buf_t line = uv_buf_init(carry_, static_cast<unsigned int>(carry_len_));
+    carry_len_ = 0;
+    emit(status, &line, 1);
+  } else {
+    emit(status, nullptr, 0);
+  }
+  discarding_ = false;
+}
+
+util::ring_buffer::~ring_buffer() {
+#if defined(__linux__)
+  if (mirrored_) {
+    munmap(data_, 2 * cap_);
+    return;
+  }
+#endif
+  delete[] data_;
+}
+
+int util::ring_buffer::init(size_t capacity, bool mirror) {
+  if (data_ != nullptr)
+    return NSUV_OK;
+  if (capacity == 0)
+    return UV_EINVAL;
+
+#if defined(__linux__)
+  if (mirror) {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t cap = (capacity + page - 1) / page * page;
+    data_ = map_mirrored(cap);
+    if (data_ != nullptr) {
+      cap_ = cap;
+      mirrored_ = true;
+      return NSUV_OK;
+    }
+  }
+#else
+  static_cast<void>(mirror);
+#endif
+
+  data_ = new (std::nothrow) char[capacity];
+  if (data_ == nullptr)
+    return UV_ENOMEM;
+  cap_ = capacity;
+  return NSUV_OK;
+}
+
+char* util::ring_buffer::map_mirrored(size_t cap) {
+#if defined(__linux__)
+  int fd = memfd_create("nsuv-ring", MFD_CLOEXEC);
+  if (fd == -1)
+    return nullptr;
+
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, cap) == 0) {
+    // Reserve twice the space, then map the same pages into both halves.
+    base = mmap(
+        nullptr, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (base != MAP_FAILED) {
+    char* p = static_cast<char*>(base);
+    if (mmap(p, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+            MAP_FAILED ||
+        mmap(p + cap,
+             cap,
+             PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED,
+             fd,
+             0) == MAP_FAILED) {
+      munmap(base, 2 * cap);
+      base = MAP_FAILED;
+    }
+  }
+
+  close(fd);
+  return base == MAP_FAILED ? nullptr : static_cast<char*>(base);
+#else
+  static_cast<void>(cap);
+  return nullptr;
+#endif
+}
+
+void util::ring_buffer::alloc(uv_buf_t* buf) {
+  if (mirrored_) {
+    // The free space may run past the end into the second mapping.
+    *buf = uv_buf_init(data_ + head_ + len_, cap_ - len_);
+    return;
+  }
+
+  // Move unread data to the front once there's more room there.
+  if (head_ > 0 && cap_ - head_ - len_ < head_) {
+    std::memmove(data_, data_ + head_, len_);
+    head_ = 0;
+  }
+  *buf = uv_buf_init(data_ + head_ + len_, cap_ - head_ - len_);
+}
+
+void util::ring_buffer::commit(size_t len) {
+  len_ += len;
+}
+
+uv_buf_t util::ring_buffer::readable() {
+  return uv_buf_init(data_ + head_, len_);
+}
+
+void util::ring_buffer::consume(size_t len) {
+  len_ -= len;
+  head_ += len;
+  if (len_ == 0)
+    head_ = 0;
+  else if (head_ >= cap_)
+    head_ -= cap_;
+}
+
+size_t util::ring_buffer::size() {
+  return len_;
+}
+
+size_t util::ring_buffer::capacity() {
+  return cap_;
+}
+
+bool util::ring_buffer::mirrored() {
+  return mirrored_;
+}
+
 #undef NSUV_CAST_NULLPTR
+#undef NSUV_TRACE_HANDLE
+#undef NSUV_TRACE_REQ
+#undef NSUV_TRACE_OBJ
 
 }  // namespace nsuv
 
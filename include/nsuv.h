@@ -2,7 +2,9 @@
 #define INCLUDE_NSUV_H_
 
 #include <uv.h>
+#include <atomic>
 #include <memory>
+#include <string>
 #include <vector>
 
 /* Allow users to define if they don't want the warning. */
@@ -22,6 +24,17 @@
 #endif
 #endif
 
+/* USDT probes around the callback proxies are opt-in, and need <sys/sdt.h>
+ * (systemtap-sdt-dev) to be available. Each callback fires nsuv:cb__entry and
+ * nsuv:cb__return with the callback kind, the handle or request pointer and
+ * its type name.
+ */
+#if defined(NSUV_ENABLE_USDT) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    define NSUV_HAVE_USDT 1
+#  endif
+#endif
+
 #if !defined(DEBUG) && defined(_MSC_VER)
 #  define NSUV_INLINE __forceinline
 #elif !defined(DEBUG) && defined(__clang__) && __has_attribute(always_inline)
@@ -72,15 +85,114 @@ class ns_prepare;
 class ns_tcp;
 class ns_timer;
 class ns_udp;
+class ns_udp_batch;
+class ns_udp_gro;
+template <class>
+class ns_udp_sessions;
+class ns_udp_reuseport;
+class ns_relay;
+class ns_zerocopy;
 
 /* everything else */
+class ns_addr;
+class ns_fs_cache;
+class ns_fs_pool;
+class ns_fs_uring;
+class ns_fs_walk;
+class ns_loop;
+class ns_mapped_file;
 class ns_mutex;
+class ns_shared_buf;
 class ns_rwlock;
 class ns_thread;
+class ns_watchdog;
+
+/* Snapshot of the I/O counters kept by ns_stream and ns_udp. They're only
+ * maintained when NSUV_ENABLE_STATS is defined, otherwise they're always 0.
+ * Writes include ns_udp sends, and reads the datagrams read by ns_udp_gro.
+ * ns_udp doesn't wrap uv_udp_recv_start(), so what it receives otherwise
+ * isn't counted.
+ */
+struct ns_io_stats {
+  uint64_t bytes_read = 0;
+  uint64_t read_cbs = 0;
+  uint64_t bytes_written = 0;
+  uint64_t writes = 0;
+  uint64_t write_cbs = 0;
+  size_t peak_write_queue_size = 0;
+  // Nanoseconds spent in read and write callbacks.
+  uint64_t cb_time = 0;
+};
+
+/* Reported by ns_watchdog when its loop stops making progress. Times are in
+ * nanoseconds.
+ */
+struct ns_stall {
+  // Time since the loop's last heartbeat.
+  uint64_t duration = 0;
+  // The nsuv callback that was running, with the handle or request it was
+  // called for and the user's callback. cb is nullptr if the loop was blocked
+  // outside of an nsuv callback, or without NSUV_ENABLE_WATCHDOG.
+  const char* cb = nullptr;
+  const void* ptr = nullptr;
+  const char* type_name = nullptr;
+  void (*fn)() = nullptr;
+  // How long that callback had been running.
+  uint64_t cb_time = 0;
+};
+
+/* Snapshot of a log2 latency histogram in nanoseconds. buckets[0] counts
+ * samples of 0 and buckets[i] samples in [2^(i-1), 2^i).
+ */
+struct ns_histogram {
+  enum : size_t { kBuckets = 64 };
+
+  // Upper bound of the bucket holding the pth percentile, p being 0-100.
+  NSUV_INLINE uint64_t percentile(double p) const;
+
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+  uint64_t buckets[kBuckets] = {};
+};
+
+/* Threadpool timing of ns_work requests. Only maintained when
+ * NSUV_ENABLE_STATS is defined.
+ */
+struct ns_threadpool_stats {
+  // From submission until the request starts running on a pool thread.
+  ns_histogram queue_wait;
+  // Time spent running on the pool thread.
+  ns_histogram service_time;
+  // From submission until the callback runs on the loop thread.
+  ns_histogram total;
+};
+
+/* Snapshot of the per-iteration metrics collected by ns_loop. All times are
+ * in nanoseconds. An iteration is measured from one prepare phase to the next,
+ * and poll time from the prepare phase to the check phase of the same
+ * iteration, so it includes the I/O callbacks run by poll.
+ */
+struct ns_loop_metrics {
+  uint64_t iterations = 0;
+  uint64_t iteration_time = 0;
+  uint64_t max_iteration_time = 0;
+  uint64_t poll_time = 0;
+  // Time spent blocked in poll. Only collected if configure_idle_time() was
+  // called before the loop started running.
+  uint64_t idle_time = 0;
+  // Longest iteration minus the time it spent idle (or in poll if idle time
+  // isn't collected). This is how late a timer or I/O event could have been.
+  uint64_t max_lag = 0;
+  // Events delivered by poll. Requires libuv >= 1.45.0, otherwise always 0.
+  uint64_t events = 0;
+  uint64_t max_events = 0;
+};
 
 namespace util {
 
 NSUV_INLINE int addr_size(const struct sockaddr*);
+NSUV_INLINE size_t bufs_size(const uv_buf_t bufs[], size_t nbufs);
 
 template <typename T, typename U>
 T check_null_cb(U cb, T proxy);
@@ -95,12 +207,266 @@ class no_throw_vec {
   NSUV_INLINE int reserve(size_t n);
   NSUV_INLINE int replace(const T* b, size_t n);
  private:
+  template <class, class>
+  friend class nsuv::ns_stream;
+
+  // For adjusting an ns_write's bufs after they were copied in.
+  NSUV_INLINE T* mutable_data_();
+
   T datasml_[4];  // match uv_write_t::bufsml.
   T* data_ = &datasml_[0];
   size_t size_ = 0;
   size_t capacity_ = sizeof(datasml_) / sizeof(datasml_[0]);
 };
 
+// Return a pointer to the first '\n' in [s, end), or nullptr if there is none.
+// Uses AVX2 or SSE2 when enabled at compile time, otherwise memchr().
+NSUV_INLINE const char* find_lf(const char* s, const char* end);
+
+// State for ns_stream::read_lines_start(). Owns the slab libuv reads into and
+// the buffer that holds a partial line until the rest of it arrives.
+class line_reader {
+ public:
+  enum : size_t { kSlabSize = 64 * 1024, kBatchSize = 64 };
+
+  line_reader() = default;
+  line_reader(const line_reader&) = delete;
+  line_reader& operator=(const line_reader&) = delete;
+  NSUV_INLINE ~line_reader();
+
+  NSUV_INLINE NSUV_WUR int init();
+  NSUV_INLINE void alloc(uv_buf_t* buf);
+  NSUV_INLINE void max_line(size_t len);
+  // Split data and pass complete lines to emit(status, lines, nlines) in
+  // batches of at most kBatchSize. Stops early if emit returns false.
+  template <typename F>
+  NSUV_INLINE void split(const char* data, size_t len, F emit);
+  // Flush any partial line along with the final read status.
+  template <typename F>
+  NSUV_INLINE void finish(int status, F emit);
+
+ private:
+  NSUV_INLINE int carry_append(const char* s, size_t len);
+
+  char* slab_ = nullptr;
+  char* carry_ = nullptr;
+  size_t carry_len_ = 0;
+  size_t carry_cap_ = 0;
+  size_t max_line_ = kSlabSize;
+  // Set when a line exceeded max_line_, so the rest of it is dropped.
+  bool discarding_ = false;
+  uv_buf_t lines_[kBatchSize];
+};
+
+// Fixed-capacity buffer for ns_stream::read_ring_start(). On Linux the
+// memory is mapped twice back to back, so both the readable and writable
+// regions are always contiguous and nothing is ever moved. Otherwise unread
+// data is moved to the front when the end of the buffer is reached.
+class ring_buffer {
+ public:
+  ring_buffer() = default;
+  ring_buffer(const ring_buffer&) = delete;
+  ring_buffer& operator=(const ring_buffer&) = delete;
+  NSUV_INLINE ~ring_buffer();
+
+  // capacity is rounded up to the page size when mirrored.
+  NSUV_INLINE NSUV_WUR int init(size_t capacity, bool mirror = true);
+  // Free space to read into. Empty if the buffer is full.
+  NSUV_INLINE void alloc(uv_buf_t* buf);
+  NSUV_INLINE void commit(size_t len);
+  NSUV_INLINE uv_buf_t readable();
+  NSUV_INLINE void consume(size_t len);
+  NSUV_INLINE size_t size();
+  NSUV_INLINE size_t capacity();
+  NSUV_INLINE bool mirrored();
+
+ private:
+  NSUV_INLINE char* map_mirrored(size_t cap);
+
+  char* data_ = nullptr;
+  size_t cap_ = 0;
+  size_t head_ = 0;
+  size_t len_ = 0;
+  bool mirrored_ = false;
+};
+
+// Counters behind ns_io_stats. Every method is a no-op unless
+// NSUV_ENABLE_STATS is defined, so they cost nothing when disabled.
+class io_stats {
+ public:
+  NSUV_INLINE void read(ssize_t nread);
+  // queue_size() returns the write queue size after the write was queued.
+  template <typename F>
+  NSUV_INLINE void write(const uv_buf_t bufs[], size_t nbufs, F queue_size);
+  NSUV_INLINE void try_write(ssize_t nwritten);
+  NSUV_INLINE void write_cb();
+  // Returns the start time to pass to cb_end().
+  NSUV_INLINE uint64_t cb_start();
+  NSUV_INLINE void cb_end(uint64_t start);
+  NSUV_INLINE ns_io_stats get();
+  NSUV_INLINE void reset();
+
+#if defined(NSUV_ENABLE_STATS)
+
+ private:
+  ns_io_stats stats_;
+#endif
+};
+
+// Recording side of ns_histogram. Lock-free, so it can be recorded to from
+// any thread.
+class histogram {
+ public:
+  NSUV_INLINE void record(uint64_t value);
+  NSUV_INLINE ns_histogram get();
+  NSUV_INLINE void reset();
+
+ private:
+  std::atomic<uint64_t> count_{ 0 };
+  std::atomic<uint64_t> sum_{ 0 };
+  std::atomic<uint64_t> max_{ 0 };
+  std::atomic<uint64_t> buckets_[ns_histogram::kBuckets] = {};
+};
+
+struct pool_histograms {
+  NSUV_INLINE ns_threadpool_stats get();
+  NSUV_INLINE void reset();
+
+  histogram queue_wait;
+  histogram service_time;
+  histogram total;
+};
+
+// Timestamps behind ns_threadpool_stats. Every method is a no-op unless
+// NSUV_ENABLE_STATS is defined. start() and end() run on the pool thread.
+class pool_timer {
+ public:
+  NSUV_INLINE void submit();
+  NSUV_INLINE void start(pool_histograms* h);
+  NSUV_INLINE void end(pool_histograms* h);
+  NSUV_INLINE void complete(histogram* total);
+
+#if defined(NSUV_ENABLE_STATS)
+
+ private:
+  uint64_t submit_ = 0;
+  uint64_t start_ = 0;
+#endif
+};
+
+// The callback currently running on a thread, published for ns_watchdog.
+// Only written while an ns_watchdog is watching the thread. The loop thread
+// is the only writer, and start is written last (and is 0 while the rest is
+// being written), so a reader seeing the same start before and after reading
+// the other fields got a consistent copy.
+struct cb_slot {
+  static NSUV_INLINE cb_slot* current();
+
+  std::atomic<uint64_t> start{ 0 };
+  std::atomic<const char*> cb{ nullptr };
+  std::atomic<const void*> ptr{ nullptr };
+  std::atomic<void (*)()> fn{ nullptr };
+  std::atomic<int> type{ 0 };
+  std::atomic<bool> req{ false };
+  // Only accessed from the thread the slot belongs to.
+  bool watched = false;
+  size_t depth = 0;
+};
+
+// Placed around every proxy that calls into user code. Fires the USDT probes
+// if they're available and, with NSUV_ENABLE_WATCHDOG, records the callback
+// in the thread's cb_slot if it's being watched. Nothing is dereferenced on
+// return since the callback may have freed it.
+class cb_trace {
+ public:
+  NSUV_INLINE cb_trace(const char* cb,
+                       const void* ptr,
+                       int type,
+                       bool req,
+                       void (*fn)());
+  NSUV_INLINE ~cb_trace();
+  cb_trace(const cb_trace&) = delete;
+  cb_trace& operator=(const cb_trace&) = delete;
+
+ private:
+#if defined(NSUV_ENABLE_WATCHDOG)
+  cb_slot* slot_;
+  bool counted_ = false;
+#endif
+#if defined(NSUV_HAVE_USDT)
+  const char* cb_;
+  const void* ptr_;
+  const char* type_;
+#endif
+};
+
+// Payload an ns_write owns until the write completes, whatever its type, as
+// a pointer and the function that releases it.
+class write_payload {
+ public:
+  write_payload() = default;
+  write_payload(const write_payload&) = delete;
+  write_payload& operator=(const write_payload&) = delete;
+  NSUV_INLINE write_payload(write_payload&& other) noexcept;
+  NSUV_INLINE write_payload& operator=(write_payload&& other) noexcept;
+  NSUV_INLINE ~write_payload();
+
+  NSUV_INLINE bool empty();
+  // Release the current payload, if any, and take ownership of ptr.
+  NSUV_INLINE void reset(void* ptr = nullptr, void (*release)(void*) = nullptr);
+
+ private:
+  void* ptr_ = nullptr;
+  void (*release_)(void*) = nullptr;
+};
+
+// Open addressing table of E* with linear probing, plus an intrusive list of
+// entries in least recently used order. E needs uint64_t hash, E* prev and
+// E* next members. Entries aren't owned, and not all of them need to be in
+// the list.
+template <class E>
+class lru_table {
+ public:
+  lru_table() = default;
+  lru_table(const lru_table&) = delete;
+  lru_table& operator=(const lru_table&) = delete;
+  NSUV_INLINE ~lru_table();
+
+  NSUV_INLINE NSUV_WUR int init();
+  // Frees the buckets. The entries are left alone.
+  NSUV_INLINE void destroy();
+  // Bucket of the entry with hash for which eq(e) is true, or the empty
+  // bucket it would be inserted in.
+  template <typename F>
+  NSUV_INLINE size_t find(uint64_t hash, F eq);
+  NSUV_INLINE E* at(size_t idx);
+  // Makes room for one more entry, which moves the entries around.
+  NSUV_INLINE NSUV_WUR int reserve();
+  NSUV_INLINE void insert(size_t idx, E* e);
+  // Also drops the entry from the list.
+  NSUV_INLINE void erase(E* e);
+  // Empties the table and the list. The entries are left alone.
+  NSUV_INLINE void clear();
+  NSUV_INLINE size_t size();
+  // 0 before init() and after destroy().
+  NSUV_INLINE size_t capacity();
+
+  NSUV_INLINE E* head();
+  NSUV_INLINE void push_back(E* e);
+  NSUV_INLINE void unlink(E* e);
+
+ private:
+  enum : size_t { kMinBuckets = 16 };
+
+  // Capacity is a power of 2, empty buckets are nullptr.
+  E** buckets_ = nullptr;
+  size_t nbuckets_ = 0;
+  size_t size_ = 0;
+  // Least recently used first.
+  E* head_ = nullptr;
+  E* tail_ = nullptr;
+};
+
 }  // namespace util
 
 /**
@@ -196,6 +562,43 @@ class ns_connect : public ns_req<uv_connect_t, ns_connect<H_T>, H_T> {
 };
 
 
+/* ns_shared_buf */
+
+/* Reference counted immutable buffer, allocated along with its data. Each
+ * write() of an ns_shared_buf holds a reference until the write completes,
+ * so the same payload can be written to any number of streams with a single
+ * allocation. The reference count is atomic, but the data must not be
+ * modified once the buffer has been written.
+ */
+class ns_shared_buf {
+ public:
+  /* Both return a buffer with a reference count of 1, or nullptr if len is
+   * too large or the allocation failed. The first leaves the contents
+   * uninitialized.
+   */
+  static NSUV_INLINE NSUV_WUR ns_shared_buf* create(size_t len);
+  static NSUV_INLINE NSUV_WUR ns_shared_buf* create(const char* data,
+                                                    size_t len);
+  ns_shared_buf(const ns_shared_buf&) = delete;
+  ns_shared_buf& operator=(const ns_shared_buf&) = delete;
+
+  NSUV_INLINE char* data();
+  NSUV_INLINE size_t size();
+  NSUV_INLINE uv_buf_t buf();
+  NSUV_INLINE void ref();
+  /* Free the buffer once the last reference is released. */
+  NSUV_INLINE void unref();
+  NSUV_INLINE size_t ref_count();
+
+ private:
+  explicit ns_shared_buf(size_t len) : refs_(1), len_(len) {}
+  ~ns_shared_buf() = default;
+
+  std::atomic<size_t> refs_;
+  size_t len_;
+};
+
+
 /* ns_write */
 
 template <class H_T>
@@ -208,6 +611,7 @@ class ns_write : public ns_req<uv_write_t, ns_write<H_T>, H_T> {
   template <class, class>
   friend class ns_stream;
   friend class ns_tcp;
+  friend class ns_zerocopy;
 
   template <typename CB, typename D_T = void>
   NSUV_INLINE NSUV_WUR int init(const uv_buf_t bufs[],
@@ -228,7 +632,21 @@ class ns_write : public ns_req<uv_write_t, ns_write<H_T>, H_T> {
                                 CB cb,
                                 std::weak_ptr<D_T> data);
 
+  // Move the owned payload out so it can be released after a callback that
+  // may reuse or delete the req. bufs() remains valid while payload lives.
+  NSUV_INLINE void take_payload_(util::write_payload* payload);
+  // Take ownership of payload, returning the buffer to write.
+  NSUV_INLINE NSUV_WUR int own_(ns_shared_buf* payload, uv_buf_t* buf);
+  NSUV_INLINE NSUV_WUR int own_(std::string&& payload, uv_buf_t* buf);
+  NSUV_INLINE NSUV_WUR int own_(std::vector<char>&& payload, uv_buf_t* buf);
+  NSUV_INLINE NSUV_WUR int own_(std::unique_ptr<char[]> payload,
+                                size_t len,
+                                uv_buf_t* buf);
+
   util::no_throw_vec<uv_buf_t> bufs_;
+  util::write_payload payload_;
+  // Next free req when parked in the ns_stream write_fast() pool.
+  ns_write<H_T>* pool_next_ = nullptr;
 };
 
 
@@ -268,6 +686,9 @@ class ns_udp_send : public ns_req<uv_udp_send_t, ns_udp_send, ns_udp> {
 
   util::no_throw_vec<uv_buf_t> bufs_;
   std::unique_ptr<struct sockaddr_storage> addr_;
+  // Used while ns_udp holds the send back from libuv.
+  ns_udp_send* held_next_ = nullptr;
+  uv_udp_send_cb held_cb_ = nullptr;
 };
 
 
@@ -324,13 +745,18 @@ class ns_fs : public ns_base_req<uv_fs_t, ns_fs> {
  public:
   NSUV_CB_FNS(ns_fs_cb, ns_fs*)
 
+  NSUV_INLINE ~ns_fs();
+
   NSUV_INLINE uv_fs_type get_type();
   NSUV_INLINE ssize_t get_result();
   NSUV_INLINE int get_system_error();
   NSUV_INLINE void* get_ptr();
   NSUV_INLINE const char* get_path();
   NSUV_INLINE uv_stat_t* get_statbuf();
-  // TODO(trevnorris): Automate this in the destructor?
+  /* Frees what the last request allocated. It's done automatically before
+   * the next request starts and when the ns_fs is destroyed, so this only
+   * needs calling to release the memory sooner.
+   */
   NSUV_INLINE void cleanup();
 
   NSUV_INLINE NSUV_WUR int scandir_next(uv_dirent_t* ent);
@@ -392,8 +818,34 @@ class ns_fs : public ns_base_req<uv_fs_t, ns_fs> {
   NSUV_FS_FN(lchown, const char* path, uv_uid_t uid, uv_gid_t gid)
   NSUV_FS_FN(statfs, const char* path)
 
+  /* Time from submission until the callback runs, for requests of type.
+   * libuv runs fs requests on the threadpool itself, so unlike ns_work's
+   * there's no queue wait or service time. Only maintained when
+   * NSUV_ENABLE_STATS is defined.
+   */
+  static NSUV_INLINE ns_histogram get_stats(uv_fs_type type);
+  static NSUV_INLINE void reset_stats();
+
  private:
+  friend class ns_fs_pool;
+  friend class ns_fs_uring;
+
+  enum : size_t { kFsTypes = 64 };
+
   NSUV_PROXY_FNS(cb_proxy_, uv_fs_t*)
+
+  static NSUV_INLINE util::histogram* histogram_(uv_fs_type type);
+  static NSUV_INLINE void recycle_(ns_fs_pool* pool, ns_fs* req);
+  // Clean up after the previous request, if there was one.
+  NSUV_INLINE void reset_();
+  NSUV_INLINE int submitted_(int r);
+
+  util::pool_timer pool_timer_;
+  // Kept outside of uv_fs_t, which may hold garbage before the first request.
+  bool needs_cleanup_ = false;
+  // Between an async request's submission and its callback.
+  bool in_flight_ = false;
+  ns_fs_pool* pool_ = nullptr;
 };
 
 #undef NSUV_FS_FN
@@ -469,14 +921,20 @@ class ns_work : public ns_base_req<uv_work_t, ns_work> {
                                       ns_work_cb_wp<D_T> work_cb,
                                       std::weak_ptr<D_T> data);
 
+  static NSUV_INLINE ns_threadpool_stats get_stats();
+  static NSUV_INLINE void reset_stats();
+
  private:
   NSUV_PROXY_FNS(work_proxy_, uv_work_t*)
   NSUV_PROXY_FNS(after_proxy_, uv_work_t*, int)
 
+  static NSUV_INLINE util::pool_histograms* histograms_();
+
   void (*work_cb_ptr_)() = nullptr;
   void (*after_cb_ptr_)() = nullptr;
   void* cb_data_ = nullptr;
   std::weak_ptr<void> cb_wp_;
+  util::pool_timer pool_timer_;
 };
 
 
@@ -520,6 +978,13 @@ class ns_handle : public UV_T {
   static NSUV_INLINE H_T* cast(uv_handle_t* handle);
   static NSUV_INLINE H_T* cast(UV_T* handle);
 
+ protected:
+  // Called from the close callback, before the user's. Hidden by types that
+  // need to finish something the handle's callbacks would otherwise have.
+  NSUV_INLINE void closed_();
+  // Used instead of a close proxy when there's no callback to call.
+  static NSUV_INLINE void closed_proxy_(uv_handle_t* handle);
+
  private:
   NSUV_PROXY_FNS(close_proxy_, uv_handle_t* handle)
 
@@ -540,9 +1005,25 @@ class ns_stream : public ns_handle<UV_T, H_T> {
   NSUV_CB_FNS(ns_alloc_cb, H_T*, size_t, uv_buf_t*)
   NSUV_CB_FNS(ns_read_cb, H_T*, ssize_t, const uv_buf_t*)
   NSUV_CB_FNS(ns_write_cb, ns_write<H_T>*, int)
+  NSUV_CB_FNS(ns_lines_cb, H_T*, int, const uv_buf_t*, size_t)
+  NSUV_CB_FNS(ns_watermark_cb, H_T*, bool, size_t)
+  NSUV_CB_FNS(ns_write_fast_cb, H_T*, int)
+  NSUV_CB_FNS(ns_pump_cb, H_T*, int)
+  NSUV_CB_FNS(ns_ring_read_cb, H_T*, ssize_t, const uv_buf_t*)
+
+  enum : size_t {
+    kPumpChunkSize = 64 * 1024,
+    // Writes to dst a pump() can have pending before it stops reading.
+    kPumpMaxChunks = 4,
+  };
+
+  NSUV_INLINE ~ns_stream();
 
   NSUV_INLINE uv_stream_t* base_stream();
   NSUV_INLINE size_t get_write_queue_size();
+  /* Counters for this stream. See ns_io_stats. */
+  NSUV_INLINE ns_io_stats get_stats();
+  NSUV_INLINE void reset_stats();
   NSUV_INLINE int is_readable();
   NSUV_INLINE int is_writable();
   NSUV_INLINE NSUV_WUR int set_blocking(bool blocking);
@@ -608,12 +1089,296 @@ class ns_stream : public ns_handle<UV_T, H_T> {
                                  const std::vector<uv_buf_t>& bufs,
                                  ns_write_cb_wp<D_T> cb,
                                  std::weak_ptr<D_T> data);
+  /* Write an ns_shared_buf. req holds a reference to buf that's released
+   * after the callback returns, so the caller can unref() buf right after
+   * this returns.
+   */
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 ns_shared_buf* buf,
+                                 ns_write_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 ns_shared_buf* buf,
+                                 ns_write_cb_d<D_T> cb,
+                                 D_T* data);
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 ns_shared_buf* buf,
+                                 void (*cb)(ns_write<H_T>*, int, void*),
+                                 std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 ns_shared_buf* buf,
+                                 ns_write_cb_wp<D_T> cb,
+                                 std::weak_ptr<D_T> data);
+  /* Write a payload that req takes ownership of, so it doesn't need to be
+   * kept alive by the caller. It's released after the callback returns.
+   * std::string and std::vector payloads are moved into a heap allocation,
+   * and UV_ENOMEM is returned if that fails.
+   */
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::string&& payload,
+                                 ns_write_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::string&& payload,
+                                 ns_write_cb_d<D_T> cb,
+                                 D_T* data);
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::string&& payload,
+                                 void (*cb)(ns_write<H_T>*, int, void*),
+                                 std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::string&& payload,
+                                 ns_write_cb_wp<D_T> cb,
+                                 std::weak_ptr<D_T> data);
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::vector<char>&& payload,
+                                 ns_write_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::vector<char>&& payload,
+                                 ns_write_cb_d<D_T> cb,
+                                 D_T* data);
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::vector<char>&& payload,
+                                 void (*cb)(ns_write<H_T>*, int, void*),
+                                 std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::vector<char>&& payload,
+                                 ns_write_cb_wp<D_T> cb,
+                                 std::weak_ptr<D_T> data);
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::unique_ptr<char[]> payload,
+                                 size_t len,
+                                 ns_write_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::unique_ptr<char[]> payload,
+                                 size_t len,
+                                 ns_write_cb_d<D_T> cb,
+                                 D_T* data);
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::unique_ptr<char[]> payload,
+                                 size_t len,
+                                 void (*cb)(ns_write<H_T>*, int, void*),
+                                 std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<H_T>* req,
+                                 std::unique_ptr<char[]> payload,
+                                 size_t len,
+                                 ns_write_cb_wp<D_T> cb,
+                                 std::weak_ptr<D_T> data);
+  NSUV_INLINE NSUV_WUR int try_write(const uv_buf_t bufs[], size_t nbufs);
+  NSUV_INLINE NSUV_WUR int try_write(const std::vector<uv_buf_t>& bufs);
+
+  /* Write bufs with uv_try_write() first, and only queue what couldn't be
+   * sent immediately using an ns_write taken from a pool owned by the stream.
+   * The buffers must stay valid until the callback is called. If everything
+   * was sent a zero-length write is queued instead, so the callback still
+   * runs after those of earlier writes and is cancelled on close like theirs,
+   * or before write_fast() returns when set_write_fast_sync(true) has been
+   * called.
+   */
+  NSUV_INLINE NSUV_WUR int write_fast(const uv_buf_t bufs[],
+                                      size_t nbufs,
+                                      ns_write_fast_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write_fast(const uv_buf_t bufs[],
+                                      size_t nbufs,
+                                      ns_write_fast_cb_d<D_T> cb,
+                                      D_T* data);
+  NSUV_INLINE NSUV_WUR int write_fast(const uv_buf_t bufs[],
+                                      size_t nbufs,
+                                      void (*cb)(H_T*, int, void*),
+                                      std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write_fast(const uv_buf_t bufs[],
+                                      size_t nbufs,
+                                      ns_write_fast_cb_wp<D_T> cb,
+                                      std::weak_ptr<D_T> data);
+  /* Whether write_fast() calls the callback synchronously when everything
+   * could be written immediately. Defaults to false.
+   */
+  NSUV_INLINE void set_write_fast_sync(bool sync);
+
+  /* Read from the stream and split the data on '\n', stripping a preceding
+   * '\r'. Complete lines are passed to the callback in batches as views into
+   * internal memory, and are only valid for the duration of the callback.
+   * status is 0 for regular batches, UV_ENOBUFS if a line longer than the max
+   * line length was dropped, or the read error (e.g. UV_EOF) along with any
+   * trailing partial line. Call read_stop() to stop reading.
+   */
+  NSUV_INLINE NSUV_WUR int read_lines_start(ns_lines_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int read_lines_start(ns_lines_cb_d<D_T> cb, D_T* data);
+  NSUV_INLINE NSUV_WUR int read_lines_start(
+      void (*cb)(H_T*, int, const uv_buf_t*, size_t, void*), std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int read_lines_start(ns_lines_cb_wp<D_T> cb,
+                                            std::weak_ptr<D_T> data);
+  /* Max number of bytes a single line can have. Defaults to 64KB. */
+  NSUV_INLINE NSUV_WUR int set_max_line_length(size_t len);
+
+  /* Call cb with true and the write queue size once the queue grows past
+   * high, and then with false once it drains to low or below. The queue is
+   * checked after each write() and after each write completes, so writes
+   * made while a watermark is set always get a completion callback. Passing
+   * a high of 0 disables the watermarks.
+   */
+  NSUV_INLINE NSUV_WUR int set_write_watermarks(size_t low,
+                                                size_t high,
+                                                ns_watermark_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int set_write_watermarks(size_t low,
+                                                size_t high,
+                                                ns_watermark_cb_d<D_T> cb,
+                                                D_T* data);
+  NSUV_INLINE NSUV_WUR int set_write_watermarks(
+      size_t low,
+      size_t high,
+      void (*cb)(H_T*, bool, size_t, void*),
+      std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int set_write_watermarks(size_t low,
+                                                size_t high,
+                                                ns_watermark_cb_wp<D_T> cb,
+                                                std::weak_ptr<D_T> data);
+  /* Whether the write queue has passed the high watermark and not yet
+   * drained back to the low watermark.
+   */
+  NSUV_INLINE bool is_write_paused();
+
+  /* Read directly into a ring buffer of at least capacity bytes owned by the
+   * stream, so no alloc callback is needed. The callback receives nread as
+   * read_start() would, along with all unconsumed data as one contiguous
+   * buffer. Data stays in the ring until it's released with read_consume(),
+   * which may be called at any time, so a partial message can be left for
+   * the next callback without copying it. Reading pauses while the ring is
+   * full and resumes once read_consume() frees space. An existing ring keeps
+   * its capacity and unconsumed data. Call read_stop() to stop reading.
+   */
+  NSUV_INLINE NSUV_WUR int read_ring_start(size_t capacity,
+                                           ns_ring_read_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int read_ring_start(size_t capacity,
+                                           ns_ring_read_cb_d<D_T> cb,
+                                           D_T* data);
+  NSUV_INLINE NSUV_WUR int read_ring_start(
+      size_t capacity,
+      void (*cb)(H_T*, ssize_t, const uv_buf_t*, void*),
+      std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int read_ring_start(size_t capacity,
+                                           ns_ring_read_cb_wp<D_T> cb,
+                                           std::weak_ptr<D_T> data);
+  /* Release len bytes from the front of the ring. */
+  NSUV_INLINE NSUV_WUR int read_consume(size_t len);
+  /* Unconsumed data in the ring, or an empty buffer if there's no ring. */
+  NSUV_INLINE uv_buf_t read_ring_data();
+
+  /* Write everything read from this stream to dst, and shut down dst once
+   * this stream reaches EOF. Reading stops while kPumpMaxChunks writes are
+   * pending on dst and restarts as they complete, so no more than
+   * (kPumpMaxChunks + 1) * kPumpChunkSize bytes are buffered per pump however
+   * slow dst is. The callback is called with 0 once dst has been shut down,
+   * or with the first read, write or shutdown error, after which reading has
+   * stopped. Closing this stream calls it with UV_ECANCELED from the close
+   * callback, before the one passed to close(), so this stream mustn't be
+   * closed again or freed from there. This stream must not be read from by
+   * anything else meanwhile.
+   * Returns UV_EBUSY if a previous pump is still running or has writes that
+   * haven't completed.
+   */
+  NSUV_INLINE NSUV_WUR int pump(H_T* dst, ns_pump_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int pump(H_T* dst, ns_pump_cb_d<D_T> cb, D_T* data);
+  NSUV_INLINE NSUV_WUR int pump(H_T* dst,
+                                void (*cb)(H_T*, int, void*),
+                                std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int pump(H_T* dst,
+                                ns_pump_cb_wp<D_T> cb,
+                                std::weak_ptr<D_T> data);
+
+ protected:
+  NSUV_INLINE void closed_();
 
  private:
+  friend class ns_handle<UV_T, H_T>;
+  friend class ns_relay;
+  friend class ns_zerocopy;
+
+  struct pump_chunk : public ns_write<H_T> {
+    char data[kPumpChunkSize];
+  };
+
+  // State for pump(). It's left behind if the stream is destroyed while
+  // writes to dst are pending, and freed once the last one completes.
+  struct pump_state {
+    H_T* src = nullptr;
+    H_T* dst = nullptr;
+    // Chunk handed to libuv by pump_alloc_proxy_().
+    pump_chunk* cur = nullptr;
+    pump_chunk* pool = nullptr;
+    // Pending writes plus the shutdown, if any.
+    size_t inflight = 0;
+    // Bytes read and written to dst.
+    uint64_t bytes = 0;
+    uv_shutdown_t shutdown_req;
+    bool paused = false;
+    bool done = false;
+  };
+
   NSUV_PROXY_FNS(listen_proxy_, uv_stream_t* handle, int status)
   NSUV_PROXY_FNS(alloc_proxy_, uv_handle_t*, size_t, uv_buf_t*)
   NSUV_PROXY_FNS(read_proxy_, uv_stream_t*, ssize_t, const uv_buf_t*)
   NSUV_PROXY_FNS(write_proxy_, uv_write_t* uv_req, int status)
+  NSUV_PROXY_FNS(lines_proxy_, uv_stream_t*, ssize_t, const uv_buf_t*)
+  NSUV_PROXY_FNS(watermark_proxy_, H_T*, bool, size_t)
+  NSUV_PROXY_FNS(write_fast_proxy_, uv_write_t* uv_req, int status)
+  NSUV_PROXY_FNS(pump_done_proxy_, H_T*, int)
+  NSUV_PROXY_FNS(ring_read_proxy_, uv_stream_t*, ssize_t, const uv_buf_t*)
+
+  static NSUV_INLINE void lines_alloc_proxy_(uv_handle_t*, size_t, uv_buf_t*);
+  static NSUV_INLINE void write_drain_proxy_(uv_write_t* uv_req, int status);
+  static NSUV_INLINE void write_fast_release_proxy_(uv_write_t* uv_req, int);
+  static NSUV_INLINE void ring_alloc_proxy_(uv_handle_t*, size_t, uv_buf_t*);
+  static NSUV_INLINE void pump_alloc_proxy_(uv_handle_t*, size_t, uv_buf_t*);
+  static NSUV_INLINE void pump_read_proxy_(uv_stream_t*,
+                                           ssize_t,
+                                           const uv_buf_t*);
+  static NSUV_INLINE void pump_write_proxy_(uv_write_t* uv_req, int status);
+  static NSUV_INLINE void pump_shutdown_proxy_(uv_shutdown_t* req, int status);
+  static NSUV_INLINE void pump_complete_(pump_state* state, int status);
+  static NSUV_INLINE void pump_free_(pump_state* state);
+  NSUV_INLINE NSUV_WUR int write_(ns_write<H_T>* req, uv_write_cb cb);
+  template <typename CB, typename D_T>
+  NSUV_INLINE NSUV_WUR int write_owned_(ns_write<H_T>* req,
+                                        uv_buf_t buf,
+                                        CB cb,
+                                        D_T data,
+                                        uv_write_cb proxy);
+  template <typename CB, typename D_T>
+  NSUV_INLINE NSUV_WUR int write_fast_(const uv_buf_t bufs[],
+                                       size_t nbufs,
+                                       CB cb,
+                                       D_T data,
+                                       uv_write_cb proxy);
+  NSUV_INLINE ns_write<H_T>* acquire_write_();
+  NSUV_INLINE void release_write_(ns_write<H_T>* req);
+  NSUV_INLINE void check_high_watermark_();
+  NSUV_INLINE void check_low_watermark_();
+  NSUV_INLINE NSUV_WUR int ring_init_(size_t capacity);
+  template <typename F>
+  NSUV_INLINE void ring_read_(ssize_t nread, F emit);
+  NSUV_INLINE NSUV_WUR int pump_init_(H_T* dst);
+  NSUV_INLINE NSUV_WUR int pump_start_();
+  NSUV_INLINE void pump_finish_(int status);
+  NSUV_INLINE NSUV_WUR int init_line_reader_();
+  template <typename F>
+  NSUV_INLINE void split_lines_(ssize_t nread, const uv_buf_t* buf, F emit);
 
   void (*listen_cb_ptr_)() = nullptr;
   void* listen_cb_data_ = nullptr;
@@ -622,6 +1387,26 @@ class ns_stream : public ns_handle<UV_T, H_T> {
   void (*read_cb_ptr_)() = nullptr;
   void* read_cb_data_ = nullptr;
   std::weak_ptr<void> read_cb_wp_;
+  std::unique_ptr<util::line_reader> line_reader_;
+  std::unique_ptr<util::ring_buffer> ring_;
+  uv_read_cb ring_proxy_ = nullptr;
+  // Set when reading was stopped because the ring filled up.
+  bool ring_paused_ = false;
+  util::io_stats stats_;
+  void (*wm_cb_ptr_)() = nullptr;
+  void (*wm_proxy_)(H_T*, bool, size_t) = nullptr;
+  void* wm_cb_data_ = nullptr;
+  std::weak_ptr<void> wm_cb_wp_;
+  size_t wm_low_ = 0;
+  size_t wm_high_ = 0;
+  bool wm_paused_ = false;
+  // Max number of idle reqs kept around for write_fast().
+  enum : size_t { kWritePoolMax = 32 };
+  ns_write<H_T>* write_pool_ = nullptr;
+  size_t write_pool_size_ = 0;
+  bool write_fast_sync_ = false;
+  pump_state* pump_ = nullptr;
+  void (*pump_proxy_)(H_T*, int) = nullptr;
 };
 
 
@@ -741,6 +1526,214 @@ class ns_tcp : public ns_stream<uv_tcp_t, ns_tcp> {
 };
 
 
+/* ns_relay */
+
+/* Relays bytes in both directions between two connected ns_tcp handles. On
+ * Linux the data is moved socket to socket through a pipe with splice(), so
+ * it's never copied to userspace unless the destination can't keep up, in
+ * which case what's already in the pipe is queued with write() and the
+ * source stops reading until it has been written. Elsewhere, or if splice()
+ * isn't supported, each direction is an ns_stream::pump() instead. Once a
+ * side reaches EOF the other side is shut down. The callback
+ * is called once both directions have finished, or on the first error, and
+ * is a good place to close both handles. The relay must stay valid until
+ * they're closed.
+ */
+class ns_relay {
+ public:
+  using ns_relay_cb = void (*)(ns_relay*, int);
+
+  enum : size_t { kChunkSize = 64 * 1024 };
+
+  ns_relay() = default;
+  ns_relay(const ns_relay&) = delete;
+  ns_relay& operator=(const ns_relay&) = delete;
+  NSUV_INLINE ~ns_relay();
+
+  NSUV_INLINE NSUV_WUR int start(ns_tcp* a, ns_tcp* b, ns_relay_cb cb);
+  /* Whether to try splice() at all. Must be called before start(). */
+  NSUV_INLINE void set_use_splice(bool use);
+  NSUV_INLINE uint64_t bytes_a_to_b();
+  NSUV_INLINE uint64_t bytes_b_to_a();
+  /* Bytes that went through userspace buffers. */
+  NSUV_INLINE uint64_t bytes_copied();
+
+ private:
+  enum : size_t {
+    kSplicesPerCb = 32,
+    // Spilling a pipe takes at most a couple of chunks per direction.
+    kPoolMax = 4,
+  };
+
+  struct chunk : public ns_write<ns_tcp> {
+    chunk* next = nullptr;
+    char data[kChunkSize];
+  };
+
+  struct direction {
+    ns_relay* relay = nullptr;
+    ns_tcp* src = nullptr;
+    ns_tcp* dst = nullptr;
+    uv_shutdown_t shutdown_req;
+    // Bytes spliced, plus those pumped once the pump has finished.
+    uint64_t bytes = 0;
+    int pipe_fds[2] = { -1, -1 };
+    size_t pipe_len = 0;
+    bool splice = false;
+    // Set while src->pump() is moving the data instead.
+    bool pumping = false;
+    bool paused = false;
+    bool eof = false;
+    bool done = false;
+  };
+
+  NSUV_INLINE NSUV_WUR int start_(direction* d, ns_tcp* src, ns_tcp* dst);
+  NSUV_INLINE NSUV_WUR int read_start_(direction* d);
+  NSUV_INLINE NSUV_WUR int pump_start_(direction* d);
+  NSUV_INLINE uint64_t pumped_(direction* d);
+  NSUV_INLINE void pump_(direction* d);
+  NSUV_INLINE NSUV_WUR int spill_(direction* d);
+  NSUV_INLINE void shutdown_(direction* d);
+  NSUV_INLINE void done_(direction* d);
+  NSUV_INLINE void fail_(int status);
+  NSUV_INLINE chunk* acquire_();
+  NSUV_INLINE void release_(chunk* c);
+  static NSUV_INLINE void alloc_cb_(ns_tcp*, size_t, uv_buf_t* buf, direction*);
+  static NSUV_INLINE void read_cb_(ns_tcp*,
+                                   ssize_t nread,
+                                   const uv_buf_t*,
+                                   direction* d);
+  static NSUV_INLINE void write_cb_(ns_write<ns_tcp>* req,
+                                    int status,
+                                    direction* d);
+  static NSUV_INLINE void pump_cb_(ns_tcp*, int status, direction* d);
+  static NSUV_INLINE void shutdown_cb_(uv_shutdown_t* req, int status);
+
+  direction a_to_b_;
+  direction b_to_a_;
+  ns_relay_cb cb_ = nullptr;
+  chunk* pool_ = nullptr;
+  size_t pool_size_ = 0;
+  uint64_t bytes_copied_ = 0;
+  bool use_splice_ = true;
+  bool finished_ = false;
+};
+
+
+/* ns_zerocopy */
+
+/* Sends writes for an ns_tcp with MSG_ZEROCOPY, so the kernel transmits
+ * straight from the write's buffers instead of copying them. The buffers
+ * must stay untouched until the write's callback, which is only called once
+ * the kernel has reported on the socket's error queue that it's done with
+ * them. Writes are sent in order, but shouldn't be mixed with
+ * ns_tcp::write() while any are pending. Errors are reported through the
+ * write callbacks. Only supported on Linux, init() returns UV_ENOTSUP
+ * elsewhere.
+ */
+class ns_zerocopy {
+ public:
+  enum : size_t { kDefaultMinSize = 16 * 1024 };
+
+  ns_zerocopy() = default;
+  ns_zerocopy(const ns_zerocopy&) = delete;
+  ns_zerocopy& operator=(const ns_zerocopy&) = delete;
+
+  /* Enable SO_ZEROCOPY on the handle's socket. handle must be connected.
+   * Until this succeeds, write() returns UV_EBADF.
+   */
+  NSUV_INLINE NSUV_WUR int init(ns_tcp* handle);
+  NSUV_INLINE NSUV_WUR int write(ns_write<ns_tcp>* req,
+                                 const uv_buf_t bufs[],
+                                 size_t nbufs,
+                                 ns_tcp::ns_write_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<ns_tcp>* req,
+                                 const uv_buf_t bufs[],
+                                 size_t nbufs,
+                                 ns_tcp::ns_write_cb_d<D_T> cb,
+                                 D_T* data);
+  NSUV_INLINE NSUV_WUR int write(ns_write<ns_tcp>* req,
+                                 const uv_buf_t bufs[],
+                                 size_t nbufs,
+                                 void (*cb)(ns_write<ns_tcp>*, int, void*),
+                                 std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int write(ns_write<ns_tcp>* req,
+                                 const uv_buf_t bufs[],
+                                 size_t nbufs,
+                                 ns_tcp::ns_write_cb_wp<D_T> cb,
+                                 std::weak_ptr<D_T> data);
+  /* Writes smaller than size are passed to ns_tcp::write() when nothing is
+   * pending, since pinning the pages costs more than copying them.
+   */
+  NSUV_INLINE void set_min_size(size_t size);
+  /* Cancel pending writes with UV_ECANCELED and stop watching the socket.
+   * Must be called before the ns_tcp is closed. cb is called after the
+   * write callbacks, once it's safe to free this object, and before close()
+   * returns if init() never succeeded.
+   */
+  NSUV_INLINE void close(void (*cb)(ns_zerocopy*));
+  /* Number of completions read from the error queue, and how many of them
+   * the kernel reported as having copied the data anyway (e.g. loopback).
+   */
+  NSUV_INLINE uint64_t completions();
+  NSUV_INLINE uint64_t copied();
+
+ private:
+  struct entry {
+    ns_write<ns_tcp>* req;
+    uv_write_cb proxy;
+    entry* next;
+    size_t buf_idx;
+    size_t offset;
+    // Range of sendmsg() calls made for this write, and how many of them the
+    // kernel has released.
+    uint32_t first_seq;
+    uint32_t nseq;
+    uint32_t ndone;
+    int status;
+    bool sent;
+  };
+
+  template <typename CB, typename D_T>
+  NSUV_INLINE NSUV_WUR int write_(ns_write<ns_tcp>* req,
+                                  const uv_buf_t bufs[],
+                                  size_t nbufs,
+                                  CB cb,
+                                  D_T data,
+                                  uv_write_cb proxy);
+  NSUV_INLINE bool use_copy_(const uv_buf_t bufs[], size_t nbufs);
+  NSUV_INLINE int flush_();
+  NSUV_INLINE void drain_();
+  NSUV_INLINE void ack_(uint32_t lo, uint32_t hi);
+  NSUV_INLINE void fail_(int status);
+  NSUV_INLINE void complete_();
+  NSUV_INLINE void update_poll_();
+  static NSUV_INLINE void poll_cb_(ns_poll*, int, int, ns_zerocopy* self);
+  static NSUV_INLINE void close_cb_(ns_poll*, ns_zerocopy* self);
+
+  ns_tcp* handle_ = nullptr;
+  ns_poll poll_;
+  // dup() of the socket, so it can be polled alongside the ns_tcp.
+  int fd_ = -1;
+  int poll_events_ = 0;
+  entry* head_ = nullptr;
+  entry* tail_ = nullptr;
+  // First entry with data left to send.
+  entry* unsent_ = nullptr;
+  uint32_t next_seq_ = 0;
+  uint32_t pending_acks_ = 0;
+  size_t min_size_ = kDefaultMinSize;
+  uint64_t completions_ = 0;
+  uint64_t copied_ = 0;
+  // Set when sendmsg() hit the optmem limit, so wait for completions instead
+  // of writability.
+  bool wait_acks_ = false;
+  void (*close_cb_ptr_)(ns_zerocopy*) = nullptr;
+};
+
+
 /* ns_timer */
 
 class ns_timer : public ns_handle<uv_timer_t, ns_timer> {
@@ -807,11 +1800,671 @@ NSUV_LOOP_WATCHER_DEFINE(prepare)
 #undef NSUV_LOOP_WATCHER_DEFINE
 
 
+/* ns_fs_uring */
+
+#define NSUV_FS_URING_FN(name, ...)                                            \
+  NSUV_INLINE NSUV_WUR int name(ns_fs*, __VA_ARGS__, ns_fs::ns_fs_cb);         \
+  template <typename D_T>                                                      \
+  NSUV_INLINE NSUV_WUR int name(                                               \
+      ns_fs*, __VA_ARGS__, ns_fs::ns_fs_cb_d<D_T>, D_T*);                      \
+  template <typename D_T>                                                      \
+  NSUV_INLINE NSUV_WUR int name(                                               \
+      ns_fs*, __VA_ARGS__, ns_fs::ns_fs_cb_wp<D_T>, std::weak_ptr<D_T>);
+
+/* Runs ns_fs requests on an io_uring instead of libuv's threadpool. Requests
+ * keep their usual callbacks and getters, and are still released with
+ * ns_fs::cleanup(). Submissions are batched and flushed once per loop
+ * iteration from a prepare handle, and completions are read when the ring's
+ * eventfd becomes readable.
+ *
+ * A request goes to the threadpool instead when the ring is full or closing,
+ * when cb is nullptr (which makes it synchronous, as with ns_fs), or when
+ * init() failed. init() needs Linux 5.6 or later and returns UV_ENOSYS on
+ * older kernels, and UV_ENOTSUP on other platforms.
+ */
+class ns_fs_uring {
+ public:
+  enum : size_t { kDefaultEntries = 128 };
+
+  ns_fs_uring() = default;
+  ns_fs_uring(const ns_fs_uring&) = delete;
+  ns_fs_uring& operator=(const ns_fs_uring&) = delete;
+
+  /* At most entries requests are on the ring at once. The kernel rounds it
+   * up to a power of two.
+   */
+  NSUV_INLINE NSUV_WUR int init(uv_loop_t* loop,
+                                size_t entries = kDefaultEntries);
+
+  NSUV_FS_URING_FN(close, uv_file file)
+  NSUV_FS_URING_FN(open, const char* path, int flags, int mode)
+  NSUV_FS_URING_FN(read,
+                   uv_file file,
+                   const uv_buf_t bufs[],
+                   unsigned int nbufs,
+                   int64_t offset)
+  NSUV_FS_URING_FN(read,
+                   uv_file file,
+                   const std::vector<uv_buf_t>& bufs,
+                   int64_t offset)
+  NSUV_FS_URING_FN(write,
+                   uv_file file,
+                   const uv_buf_t bufs[],
+                   unsigned int nbufs,
+                   int64_t offset)
+  NSUV_FS_URING_FN(write,
+                   uv_file file,
+                   const std::vector<uv_buf_t>& bufs,
+                   int64_t offset)
+  NSUV_FS_URING_FN(fsync, uv_file file)
+  NSUV_FS_URING_FN(fdatasync, uv_file file)
+  NSUV_FS_URING_FN(stat, const char* path)
+  NSUV_FS_URING_FN(fstat, uv_file file)
+  NSUV_FS_URING_FN(lstat, const char* path)
+
+  /* Requests already on the ring still complete, new ones go to the
+   * threadpool. cb is called after their callbacks, once it's safe to free
+   * this object.
+   */
+  NSUV_INLINE void close(void (*cb)(ns_fs_uring*));
+  /* Requests run on the ring, and those passed to the threadpool. */
+  NSUV_INLINE uint64_t submitted();
+  NSUV_INLINE uint64_t fallbacks();
+
+ private:
+  // The arguments of a request, in the order NSUV_FS_URING_FN passes them.
+  struct op {
+    uv_fs_type type;
+    uv_file file;
+    const char* path;
+    const uv_buf_t* bufs;
+    size_t nbufs;
+    int64_t offset;
+    int flags;
+    int mode;
+  };
+
+  static NSUV_INLINE void poll_cb_(ns_poll*, int, int, ns_fs_uring* ring);
+  static NSUV_INLINE void prepare_cb_(ns_prepare*, ns_fs_uring* ring);
+  static NSUV_INLINE void poll_close_cb_(ns_poll*, ns_fs_uring* ring);
+  static NSUV_INLINE void prepare_close_cb_(ns_prepare*, ns_fs_uring* ring);
+  NSUV_INLINE NSUV_WUR int setup_(size_t entries);
+  NSUV_INLINE void destroy_();
+  NSUV_INLINE bool use_ring_(bool has_cb);
+  NSUV_INLINE NSUV_WUR int submit_(ns_fs* req, const op& o, uv_fs_cb proxy);
+  NSUV_INLINE void flush_();
+  NSUV_INLINE void reap_();
+  NSUV_INLINE void complete_(ns_fs* req, int res);
+
+  ns_poll poll_;
+  ns_prepare prepare_;
+  uv_loop_t* loop_ = nullptr;
+  void (*close_cb_ptr_)(ns_fs_uring*) = nullptr;
+  int ring_fd_ = -1;
+  int event_fd_ = -1;
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  void* sqes_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+  // Shared with the kernel, they point into the mapped rings.
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t* sq_mask_ = nullptr;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  uint32_t* cq_mask_ = nullptr;
+  void* cqes_ = nullptr;
+  size_t entries_ = 0;
+  // Requests on the ring, and how many of them io_uring_enter() hasn't seen.
+  size_t inflight_ = 0;
+  size_t unsubmitted_ = 0;
+  uint64_t submitted_ = 0;
+  uint64_t fallbacks_ = 0;
+  bool closing_ = false;
+};
+
+#undef NSUV_FS_URING_FN
+
+
+/* ns_mapped_file */
+
+/* A read-only, shared mapping of a whole file, for hot read paths that would
+ * otherwise ns_fs::read() the same data over and over. span() returns a
+ * uv_buf_t pointing straight into the mapping, which can be passed to
+ * ns_tcp::write() without copying. The mapping must outlive any write or
+ * prefetch using it, and the buffers must not be written to.
+ *
+ * Touching a page that isn't resident blocks the loop on disk I/O, so
+ * prefetch() pages a range in on the threadpool before it's needed. Not
+ * supported on Windows, where open() and map() return UV_ENOTSUP.
+ */
+class ns_mapped_file {
+ public:
+  NSUV_CB_FNS(ns_prefetch_cb, ns_mapped_file*, int)
+
+  ns_mapped_file() = default;
+  ns_mapped_file(const ns_mapped_file&) = delete;
+  ns_mapped_file& operator=(const ns_mapped_file&) = delete;
+  NSUV_INLINE ~ns_mapped_file();
+
+  NSUV_INLINE NSUV_WUR int open(const char* path);
+  /* Map an already open file. file isn't closed by close(). */
+  NSUV_INLINE NSUV_WUR int map(uv_file file);
+  NSUV_INLINE const char* data();
+  NSUV_INLINE size_t size();
+  /* len bytes from offset, cut short at the end of the file. On Windows,
+   * where uv_buf_t's length is 32 bits, also cut short at UINT_MAX.
+   */
+  NSUV_INLINE uv_buf_t span(size_t offset, size_t len);
+  /* Advise the kernel to read the range ahead with madvise(MADV_WILLNEED)
+   * and fault its pages in on the threadpool. cb is called with 0 once
+   * they're resident, or with an error.
+   */
+  NSUV_INLINE NSUV_WUR int prefetch(uv_loop_t* loop,
+                                    size_t offset,
+                                    size_t len,
+                                    ns_prefetch_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int prefetch(uv_loop_t* loop,
+                                    size_t offset,
+                                    size_t len,
+                                    ns_prefetch_cb_d<D_T> cb,
+                                    D_T* data);
+  NSUV_INLINE NSUV_WUR int prefetch(uv_loop_t* loop,
+                                    size_t offset,
+                                    size_t len,
+                                    void (*cb)(ns_mapped_file*, int, void*),
+                                    std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int prefetch(uv_loop_t* loop,
+                                    size_t offset,
+                                    size_t len,
+                                    ns_prefetch_cb_wp<D_T> cb,
+                                    std::weak_ptr<D_T> data);
+  /* Unmap the file. Returns UV_EBUSY while prefetches are pending. If the
+   * ns_mapped_file is destroyed instead, the mapping stays until they're
+   * done, and their callbacks aren't called.
+   */
+  NSUV_INLINE NSUV_WUR int close();
+
+ private:
+  struct prefetch_state;
+  struct prefetch_req;
+
+  NSUV_PROXY_FNS(prefetch_proxy_, prefetch_req* req, int status)
+  static NSUV_INLINE void prefetch_work_(ns_work*, prefetch_req* req);
+  static NSUV_INLINE void prefetch_done_(ns_work*, int, prefetch_req* req);
+  NSUV_INLINE prefetch_req* new_prefetch_(void (*cb)(),
+                                          void (*proxy)(prefetch_req*, int));
+  NSUV_INLINE NSUV_WUR int prefetch_(uv_loop_t* loop,
+                                     size_t offset,
+                                     size_t len,
+                                     prefetch_req* req);
+
+  char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t page_size_ = 0;
+  // Created by the first prefetch of a mapping.
+  prefetch_state* state_ = nullptr;
+  bool mapped_ = false;
+};
+
+
+/* ns_fs_walk */
+
+/* Recursively walks a directory tree with up to concurrency opendir(),
+ * readdir(), closedir() and lstat() requests on the threadpool at once,
+ * instead of chaining one request after another. Each readdir() reads up to
+ * batch_size entries. cb is called once for every entry below the root, in
+ * no particular order, and done_cb once the walk is over.
+ *
+ * Symlinks aren't followed. Entries whose type the filesystem doesn't report
+ * are lstat()'d, and so is every entry with kStat. Anything removed during
+ * the walk is skipped, any other error stops the walk and is passed to
+ * done_cb. The walker must not be destroyed before done_cb is called.
+ */
+class ns_fs_walk {
+ public:
+  enum : size_t { kDefaultConcurrency = 16, kDefaultBatchSize = 64 };
+  enum : int { kStat = 1 };
+
+  struct entry {
+    // The root joined with the entry's relative path, and its last component.
+    const char* path;
+    const char* name;
+    uv_dirent_type_t type;
+    // 0 for entries directly in the root.
+    size_t depth;
+    // Only set if the entry was lstat()'d.
+    const uv_stat_t* statbuf;
+  };
+
+  NSUV_CB_FNS(ns_walk_cb, ns_fs_walk*, const entry*)
+  NSUV_CB_FNS(ns_walk_done_cb, ns_fs_walk*, int)
+
+  ns_fs_walk() = default;
+  ns_fs_walk(const ns_fs_walk&) = delete;
+  ns_fs_walk& operator=(const ns_fs_walk&) = delete;
+  NSUV_INLINE ~ns_fs_walk();
+
+  NSUV_INLINE NSUV_WUR int init(uv_loop_t* loop,
+                                size_t concurrency = kDefaultConcurrency,
+                                size_t batch_size = kDefaultBatchSize,
+                                int flags = 0);
+  NSUV_INLINE NSUV_WUR int start(const char* path,
+                                 ns_walk_cb cb,
+                                 ns_walk_done_cb done_cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int start(const char* path,
+                                 ns_walk_cb_d<D_T> cb,
+                                 ns_walk_done_cb_d<D_T> done_cb,
+                                 D_T* data);
+  NSUV_INLINE NSUV_WUR int start(
+      const char* path,
+      void (*cb)(ns_fs_walk*, const entry*, void*),
+      void (*done_cb)(ns_fs_walk*, int, void*),
+      std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int start(const char* path,
+                                 ns_walk_cb_wp<D_T> cb,
+                                 ns_walk_done_cb_wp<D_T> done_cb,
+                                 std::weak_ptr<D_T> data);
+  /* No new requests are made, and done_cb is called with UV_ECANCELED once
+   * those in flight finish.
+   */
+  NSUV_INLINE void stop();
+  NSUV_INLINE bool is_active();
+  /* Counters for the current or last walk. */
+  NSUV_INLINE uint64_t entries();
+  NSUV_INLINE uint64_t directories();
+  NSUV_INLINE size_t peak_inflight();
+
+ private:
+  struct job;
+
+  NSUV_PROXY_FNS(walk_proxy_, ns_fs_walk* walk, ns_fs* req, const entry* ent)
+  NSUV_PROXY_FNS(done_proxy_, ns_fs_walk* walk, ns_fs* req, int status)
+  static NSUV_INLINE void opendir_cb_(ns_fs* req, job* j);
+  static NSUV_INLINE void readdir_cb_(ns_fs* req, job* j);
+  static NSUV_INLINE void closedir_cb_(ns_fs* req, job* j);
+  static NSUV_INLINE void lstat_cb_(ns_fs* req, job* j);
+  static NSUV_INLINE uv_dirent_type_t dirent_type_(uint64_t mode);
+  NSUV_INLINE NSUV_WUR int start_(const char* path);
+  NSUV_INLINE job* new_job_(bool dir);
+  NSUV_INLINE void free_job_(job* j);
+  NSUV_INLINE void free_jobs_();
+  NSUV_INLINE void queue_(job* j);
+  NSUV_INLINE void queue_dir_(const std::string& path, size_t depth);
+  NSUV_INLINE NSUV_WUR int dispatch_(job* j);
+  NSUV_INLINE void pump_();
+  NSUV_INLINE void readdir_(job* j);
+  NSUV_INLINE void closedir_(job* j);
+  NSUV_INLINE void add_dirent_(job* j, const uv_dirent_t* ent);
+  NSUV_INLINE void emit_(ns_fs* req,
+                         const std::string& path,
+                         size_t name_off,
+                         uv_dirent_type_t type,
+                         size_t depth,
+                         const uv_stat_t* statbuf);
+  NSUV_INLINE void fail_(int status);
+  NSUV_INLINE void finish_job_(job* j);
+
+  uv_loop_t* loop_ = nullptr;
+  size_t concurrency_ = kDefaultConcurrency;
+  size_t batch_size_ = kDefaultBatchSize;
+  int flags_ = 0;
+  void (*walk_cb_ptr_)() = nullptr;
+  void (*done_cb_ptr_)() = nullptr;
+  void (*walk_proxy_ptr_)(ns_fs_walk*, ns_fs*, const entry*) = nullptr;
+  void (*done_proxy_ptr_)(ns_fs_walk*, ns_fs*, int) = nullptr;
+  void* cb_data_ = nullptr;
+  std::weak_ptr<void> cb_wp_;
+  // Requests waiting for a free slot, oldest first, and finished jobs kept
+  // so their path and dirent storage can be reused.
+  job* pending_head_ = nullptr;
+  job* pending_tail_ = nullptr;
+  job* free_head_ = nullptr;
+  std::string path_;
+  size_t inflight_ = 0;
+  size_t peak_inflight_ = 0;
+  uint64_t entries_ = 0;
+  uint64_t directories_ = 0;
+  int status_ = 0;
+  bool active_ = false;
+  bool stopping_ = false;
+};
+
+
+/* ns_fs_pool */
+
+#define NSUV_FS_POOL_FN(name, ...)                                             \
+  NSUV_INLINE NSUV_WUR int name(__VA_ARGS__, ns_fs::ns_fs_cb);                 \
+  template <typename D_T>                                                      \
+  NSUV_INLINE NSUV_WUR int name(__VA_ARGS__, ns_fs::ns_fs_cb_d<D_T>, D_T*);    \
+  template <typename D_T>                                                      \
+  NSUV_INLINE NSUV_WUR int name(                                               \
+      __VA_ARGS__, ns_fs::ns_fs_cb_wp<D_T>, std::weak_ptr<D_T>);
+
+/* Runs ns_fs requests on a loop without the caller owning an ns_fs. Requests
+ * come from a free list and go back to it, cleaned up, as soon as their
+ * callback returns, so the ns_fs passed to cb must not be kept after that.
+ * cb can still chain another request on it, like a read after an open, and
+ * it goes back once the last one's callback returns. Once the pool has as
+ * many requests as are ever in flight at once, it stops allocating.
+ *
+ * cb is required, there are no synchronous requests through the pool. The
+ * pool must outlive the requests made through it.
+ */
+class ns_fs_pool {
+ public:
+  enum : size_t { kDefaultMaxFree = 64 };
+
+  ns_fs_pool() = default;
+  ns_fs_pool(const ns_fs_pool&) = delete;
+  ns_fs_pool& operator=(const ns_fs_pool&) = delete;
+  NSUV_INLINE ~ns_fs_pool();
+
+  /* At most max_free idle requests are kept, any beyond that are freed. */
+  NSUV_INLINE NSUV_WUR int init(uv_loop_t* loop,
+                                size_t max_free = kDefaultMaxFree);
+
+  NSUV_FS_POOL_FN(close, uv_file file)
+  NSUV_FS_POOL_FN(open, const char* path, int flags, int mode)
+  NSUV_FS_POOL_FN(read,
+                  uv_file file,
+                  const uv_buf_t bufs[],
+                  unsigned int nbufs,
+                  int64_t offset)
+  NSUV_FS_POOL_FN(read,
+                  uv_file file,
+                  const std::vector<uv_buf_t>& bufs,
+                  int64_t offset)
+  NSUV_FS_POOL_FN(unlink, const char* path)
+  NSUV_FS_POOL_FN(write,
+                  uv_file file,
+                  const uv_buf_t bufs[],
+                  unsigned int nbufs,
+                  int64_t offset)
+  NSUV_FS_POOL_FN(write,
+                  uv_file file,
+                  const std::vector<uv_buf_t>& bufs,
+                  int64_t offset)
+  NSUV_FS_POOL_FN(copyfile, const char* path, const char* new_path, int flags)
+  NSUV_FS_POOL_FN(mkdir, const char* path, int mode)
+  NSUV_FS_POOL_FN(mkdtemp, const char* tpl)
+  NSUV_FS_POOL_FN(mkstemp, const char* tpl)
+  NSUV_FS_POOL_FN(rmdir, const char* path)
+  NSUV_FS_POOL_FN(scandir, const char* path, int flags)
+  NSUV_FS_POOL_FN(opendir, const char* path)
+  NSUV_FS_POOL_FN(readdir, uv_dir_t* dir)
+  NSUV_FS_POOL_FN(closedir, uv_dir_t* dir)
+  NSUV_FS_POOL_FN(stat, const char* path)
+  NSUV_FS_POOL_FN(fstat, uv_file file)
+  NSUV_FS_POOL_FN(rename, const char* path, const char* new_path)
+  NSUV_FS_POOL_FN(fsync, uv_file file)
+  NSUV_FS_POOL_FN(fdatasync, uv_file file)
+  NSUV_FS_POOL_FN(ftruncate, uv_file file, int64_t offset)
+  NSUV_FS_POOL_FN(sendfile,
+                  uv_file out_fd,
+                  uv_file in_fd,
+                  int64_t in_offset,
+                  size_t length)
+  NSUV_FS_POOL_FN(access, const char* path, int mode)
+  NSUV_FS_POOL_FN(chmod, const char* path, int mode)
+  NSUV_FS_POOL_FN(utime, const char* path, double atime, double mtime)
+  NSUV_FS_POOL_FN(futime, uv_file file, double atime, double mtime)
+  NSUV_FS_POOL_FN(lutime, const char* path, double atime, double mtime)
+  NSUV_FS_POOL_FN(lstat, const char* path)
+  NSUV_FS_POOL_FN(link, const char* path, const char* new_path)
+  NSUV_FS_POOL_FN(symlink, const char* path, const char* new_path, int flags)
+  NSUV_FS_POOL_FN(readlink, const char* path)
+  NSUV_FS_POOL_FN(realpath, const char* path)
+  NSUV_FS_POOL_FN(fchmod, uv_file file, int mode)
+  NSUV_FS_POOL_FN(chown, const char* path, uv_uid_t uid, uv_gid_t gid)
+  NSUV_FS_POOL_FN(fchown, uv_file file, uv_uid_t uid, uv_gid_t gid)
+  NSUV_FS_POOL_FN(lchown, const char* path, uv_uid_t uid, uv_gid_t gid)
+  NSUV_FS_POOL_FN(statfs, const char* path)
+
+  /* Requests in flight, and idle ones waiting on the free list. */
+  NSUV_INLINE size_t active();
+  NSUV_INLINE size_t available();
+  /* How many times a request had to be allocated. */
+  NSUV_INLINE uint64_t allocations();
+
+ private:
+  friend class ns_fs;
+
+  NSUV_INLINE ns_fs* acquire_();
+  NSUV_INLINE void release_(ns_fs* req);
+  NSUV_INLINE NSUV_WUR int submitted_(ns_fs* req, int r);
+
+  uv_loop_t* loop_ = nullptr;
+  std::vector<ns_fs*> free_;
+  size_t max_free_ = kDefaultMaxFree;
+  size_t active_ = 0;
+  uint64_t allocations_ = 0;
+};
+
+#undef NSUV_FS_POOL_FN
+
+
+/* ns_fs_cache */
+
+#define NSUV_FS_CACHE_FN(name)                                                 \
+  NSUV_INLINE NSUV_WUR int name(const char* path, ns_fs_cache_cb cb);         \
+  template <typename D_T>                                                      \
+  NSUV_INLINE NSUV_WUR int name(                                               \
+      const char* path, ns_fs_cache_cb_d<D_T> cb, D_T* data);                  \
+  NSUV_INLINE NSUV_WUR int name(                                               \
+      const char* path,                                                        \
+      void (*cb)(ns_fs_cache*, const result*, void*),                          \
+      std::nullptr_t);                                                         \
+  template <typename D_T>                                                      \
+  NSUV_INLINE NSUV_WUR int name(                                               \
+      const char* path, ns_fs_cache_cb_wp<D_T> cb, std::weak_ptr<D_T> data);
+
+/* Caches the results of stat(), lstat() and realpath() on a loop, for hot
+ * paths that would otherwise go to the threadpool on every call. A hit calls
+ * cb before returning. A miss runs the request through an ns_fs_pool, and
+ * concurrent misses on the same path wait on that one request instead of
+ * making their own. Results are only valid during the callback.
+ *
+ * Entries expire ttl milliseconds after they're cached. With kWatch, the
+ * directory each cached path is in is also watched with uv_fs_event, and a
+ * change to a path's directory entry drops its results right away. Changes
+ * that don't show up there, like a symlink earlier in the path being
+ * retargeted, are only picked up by the TTL. A ttl of 0 leaves invalidation
+ * to the watchers alone.
+ *
+ * UV_ENOENT and UV_ENOTDIR are cached like successes, other errors aren't.
+ * close() must be called, and its callback run, before the cache is freed.
+ */
+class ns_fs_cache {
+ public:
+  enum : uint64_t { kDefaultTtl = 1000 };
+  enum : size_t { kDefaultMaxEntries = 4096 };
+  enum : int { kWatch = 1 };
+
+  struct result {
+    // 0, or the error the request failed with.
+    int status;
+    // Set by stat() and lstat() when status is 0.
+    const uv_stat_t* statbuf;
+    // Set by realpath() when status is 0.
+    const char* path;
+  };
+
+  NSUV_CB_FNS(ns_fs_cache_cb, ns_fs_cache*, const result*)
+
+  ns_fs_cache() = default;
+  ns_fs_cache(const ns_fs_cache&) = delete;
+  ns_fs_cache& operator=(const ns_fs_cache&) = delete;
+  NSUV_INLINE ~ns_fs_cache();
+
+  /* Once there are max_entries results, the least recently used is dropped
+   * to make room. Watchers don't keep the loop alive.
+   */
+  NSUV_INLINE NSUV_WUR int init(uv_loop_t* loop,
+                                uint64_t ttl = kDefaultTtl,
+                                int flags = 0,
+                                size_t max_entries = kDefaultMaxEntries);
+
+  NSUV_FS_CACHE_FN(stat)
+  NSUV_FS_CACHE_FN(lstat)
+  NSUV_FS_CACHE_FN(realpath)
+
+  /* Drop the cached results for path, or every result if path is nullptr.
+   * Requests in flight still call back, but their results aren't cached.
+   */
+  NSUV_INLINE void invalidate(const char* path = nullptr);
+  /* cb is called once requests in flight have called back and the watchers
+   * are closed, which may be before close() returns.
+   */
+  NSUV_INLINE void close(void (*cb)(ns_fs_cache*));
+  /* Results currently cached, and how lookups were answered. */
+  NSUV_INLINE size_t size();
+  NSUV_INLINE uint64_t hits();
+  NSUV_INLINE uint64_t misses();
+
+ private:
+  enum kind : uint8_t { kStatOp, kLstatOp, kRealpathOp, kDirWatch };
+
+  struct entry;
+  // A callback waiting on a request.
+  struct waiter {
+    waiter* next;
+    void (*proxy)(ns_fs_cache*, const waiter*, const result*);
+    void (*cb_ptr)();
+    void* cb_data;
+    std::weak_ptr<void> cb_wp;
+  };
+
+  NSUV_PROXY_FNS(cache_proxy_,
+                 ns_fs_cache* cache,
+                 const waiter* w,
+                 const result* res)
+  static NSUV_INLINE void fs_cb_(ns_fs* req, entry* e);
+  static NSUV_INLINE void event_cb_(uv_fs_event_t* handle,
+                                    const char* filename,
+                                    int events,
+                                    int status);
+  static NSUV_INLINE void event_close_cb_(uv_handle_t* handle);
+  NSUV_INLINE NSUV_WUR int request_(kind k,
+                                    const char* path,
+                                    const waiter& w);
+  NSUV_INLINE uint64_t hash_(kind k, const char* path, size_t len);
+  NSUV_INLINE size_t find_(kind k,
+                           const char* path,
+                           size_t len,
+                           uint64_t hash);
+  NSUV_INLINE entry* insert_(kind k, const char* path, size_t len);
+  NSUV_INLINE void remove_(entry* e);
+  NSUV_INLINE void watch_(entry* e);
+  NSUV_INLINE void unwatch_(entry* e);
+  NSUV_INLINE void finish_close_();
+
+  uv_loop_t* loop_ = nullptr;
+  ns_fs_pool pool_;
+  // Holds cached results, requests in flight and directory watchers. Only
+  // cached results are in the list, least recently used first.
+  util::lru_table<entry> table_;
+  size_t size_ = 0;
+  size_t max_entries_ = kDefaultMaxEntries;
+  uint64_t ttl_ = kDefaultTtl;
+  uint64_t seed_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  size_t pending_ = 0;
+  size_t handles_ = 0;
+  int flags_ = 0;
+  bool closing_ = false;
+  void (*close_cb_ptr_)(ns_fs_cache*) = nullptr;
+};
+
+#undef NSUV_FS_CACHE_FN
+
+
+/* ns_loop */
+
+/* Either owns a uv_loop_t (init()) or wraps an existing one such as
+ * uv_default_loop() (init(uv_loop_t*)). Metrics are collected by an unref'd
+ * ns_prepare/ns_check pair, so they don't keep the loop alive.
+ */
+class ns_loop {
+ public:
+  ns_loop() = default;
+  ns_loop(const ns_loop&) = delete;
+  ns_loop& operator=(const ns_loop&) = delete;
+
+  NSUV_INLINE NSUV_WUR int init();
+  NSUV_INLINE NSUV_WUR int init(uv_loop_t* loop);
+  /* Must be called before the loop starts running to have idle_time. */
+  NSUV_INLINE NSUV_WUR int configure_idle_time();
+  NSUV_INLINE int run(uv_run_mode mode = UV_RUN_DEFAULT);
+  NSUV_INLINE void stop();
+  /* Closes the metrics handles. An owned loop is then run once to finish
+   * closing them and closed, which returns UV_EBUSY if other handles are
+   * still open. A wrapped loop is never run, the handles finish closing the
+   * next time its owner runs it, and this must stay valid until then. init()
+   * returns UV_EBUSY meanwhile.
+   */
+  NSUV_INLINE NSUV_WUR int close();
+  NSUV_INLINE bool alive();
+  NSUV_INLINE uint64_t now();
+  NSUV_INLINE void update_time();
+  NSUV_INLINE uv_loop_t* base();
+
+  NSUV_INLINE NSUV_WUR int metrics_start();
+  NSUV_INLINE NSUV_WUR int metrics_stop();
+  NSUV_INLINE ns_loop_metrics get_metrics();
+  NSUV_INLINE void reset_metrics();
+
+ private:
+  static NSUV_INLINE void prepare_cb_(ns_prepare*, ns_loop* loop);
+  static NSUV_INLINE void check_cb_(ns_check*, ns_loop* loop);
+  static NSUV_INLINE void prepare_close_cb_(ns_prepare*, ns_loop* loop);
+  static NSUV_INLINE void check_close_cb_(ns_check*, ns_loop* loop);
+  NSUV_INLINE void end_iteration_(uint64_t now);
+  NSUV_INLINE uint64_t events_();
+
+  uv_loop_t storage_;
+  uv_loop_t* loop_ = nullptr;
+  ns_prepare prepare_;
+  ns_check check_;
+  ns_loop_metrics metrics_;
+  // Start of the current iteration, which is also when poll starts. 0 if
+  // there's no iteration being measured.
+  uint64_t iter_start_ = 0;
+  // Time the current iteration spent waiting in poll, as used for max_lag.
+  uint64_t iter_wait_ = 0;
+  uint64_t idle_start_ = 0;
+  uint64_t events_start_ = 0;
+  // Metrics handles that are still closing.
+  int closing_ = 0;
+  bool idle_time_ = false;
+  bool metrics_init_ = false;
+};
+
+
 /* ns_udp */
 
 class ns_udp : public ns_handle<uv_udp_t, ns_udp> {
  public:
   NSUV_CB_FNS(ns_udp_send_cb, ns_udp_send*, int)
+  NSUV_CB_FNS(ns_watermark_cb, ns_udp*, bool, size_t)
+
+  /* What send() does while the send queue is above its high watermark. */
+  enum send_policy {
+    // Queue it anyway, the watermark callback is the only signal.
+    kSendQueue,
+    // Fail with UV_ENOBUFS.
+    kSendReject,
+    // Hold it in nsuv until the queue drains to the low watermark. Once more
+    // than high bytes are held, the oldest held sends are dropped and their
+    // callbacks called with UV_ECANCELED, so stale data is shed first.
+    kSendDropOldest,
+  };
 
   NSUV_INLINE NSUV_WUR int init(uv_loop_t*);
   NSUV_INLINE NSUV_WUR int init_ex(uv_loop_t*, unsigned int);
@@ -879,13 +2532,93 @@ class ns_udp : public ns_handle<uv_udp_t, ns_udp> {
                                 ns_udp_send_cb_wp<D_T> cb,
                                 std::weak_ptr<D_T> data);
 
+  /* Apply policy once uv_udp_get_send_queue_size() grows past high, until
+   * it drains to low or below. cb, if given, is called with true and the
+   * queue size when that starts and with false when it ends. The queue is
+   * checked after each send() and after each send completes, so sends made
+   * while a watermark is set always get a completion callback. Passing a
+   * high of 0 disables the watermarks and sends any held datagrams. Sends
+   * from ns_udp_batch count towards the queue but aren't held back.
+   */
+  NSUV_INLINE NSUV_WUR int set_send_watermarks(size_t low,
+                                               size_t high,
+                                               send_policy policy);
+  NSUV_INLINE NSUV_WUR int set_send_watermarks(size_t low,
+                                               size_t high,
+                                               send_policy policy,
+                                               ns_watermark_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int set_send_watermarks(size_t low,
+                                               size_t high,
+                                               send_policy policy,
+                                               ns_watermark_cb_d<D_T> cb,
+                                               D_T* data);
+  NSUV_INLINE NSUV_WUR int set_send_watermarks(
+      size_t low,
+      size_t high,
+      send_policy policy,
+      void (*cb)(ns_udp*, bool, size_t, void*),
+      std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int set_send_watermarks(size_t low,
+                                               size_t high,
+                                               send_policy policy,
+                                               ns_watermark_cb_wp<D_T> cb,
+                                               std::weak_ptr<D_T> data);
+  /* Whether the send queue has passed the high watermark and not yet
+   * drained back to the low watermark.
+   */
+  NSUV_INLINE bool is_send_paused();
+  /* Bytes held back by kSendDropOldest, and how many sends it dropped. */
+  NSUV_INLINE size_t held_send_size();
+  NSUV_INLINE uint64_t dropped_sends();
+
   NSUV_INLINE const struct sockaddr* local_addr();
   NSUV_INLINE const struct sockaddr* remote_addr();
+  /* Counters for this handle. See ns_io_stats. */
+  NSUV_INLINE ns_io_stats get_stats();
+  NSUV_INLINE void reset_stats();
 
  private:
+  friend class ns_udp_batch;
+  friend class ns_udp_gro;
+
   NSUV_PROXY_FNS(send_proxy_, uv_udp_send_t* uv_req, int status)
+  NSUV_PROXY_FNS(watermark_proxy_, ns_udp*, bool, size_t)
+  static NSUV_INLINE void send_drain_proxy_(uv_udp_send_t* uv_req, int);
+  NSUV_INLINE NSUV_WUR int send_(ns_udp_send* req,
+                                 const struct sockaddr* addr,
+                                 uv_udp_send_cb cb);
+  NSUV_INLINE int set_send_watermarks_(size_t low,
+                                       size_t high,
+                                       send_policy policy,
+                                       void (*proxy)(ns_udp*, bool, size_t));
+  NSUV_INLINE void hold_send_(ns_udp_send* req, uv_udp_send_cb cb);
+  NSUV_INLINE void release_held_sends_();
+  NSUV_INLINE void complete_dropped_sends_();
+  NSUV_INLINE void check_send_high_watermark_();
+  NSUV_INLINE void check_send_low_watermark_();
   std::unique_ptr<struct sockaddr_storage> local_addr_;
   std::unique_ptr<struct sockaddr_storage> remote_addr_;
+  util::io_stats stats_;
+  void (*wm_cb_ptr_)() = nullptr;
+  void (*wm_proxy_)(ns_udp*, bool, size_t) = nullptr;
+  void* wm_cb_data_ = nullptr;
+  std::weak_ptr<void> wm_cb_wp_;
+  size_t wm_low_ = 0;
+  size_t wm_high_ = 0;
+  send_policy wm_policy_ = kSendQueue;
+  bool wm_paused_ = false;
+  // Sends held by kSendDropOldest, oldest first, and the ones it dropped
+  // whose callbacks still have to run.
+  ns_udp_send* held_head_ = nullptr;
+  ns_udp_send* held_tail_ = nullptr;
+  ns_udp_send* dropped_head_ = nullptr;
+  ns_udp_send* dropped_tail_ = nullptr;
+  size_t held_size_ = 0;
+  uint64_t dropped_sends_ = 0;
+  bool releasing_ = false;
+  bool completing_ = false;
 };
 
 
@@ -894,6 +2627,356 @@ class ns_udp : public ns_handle<uv_udp_t, ns_udp> {
  */
 
 
+/* ns_udp_batch */
+
+/* Collects datagrams for an ns_udp and sends them with as few syscalls as
+ * possible: sendmmsg() on Linux, otherwise one uv_udp_try_send() each. What
+ * the socket can't take right away is queued with uv_udp_send(), as is the
+ * last datagram so the callback is never called synchronously. The callback
+ * runs once every datagram was sent or failed, with the first error if any.
+ * Buffers aren't copied, so they must stay valid until then. Queued
+ * datagrams count towards the handle's send watermarks, but a batch is sent
+ * whatever the send policy.
+ *
+ * With set_gso(true), runs of equal-size datagrams to the same peer are
+ * handed to the kernel as one message with UDP_SEGMENT, which splits them
+ * back up after the stack has been traversed once. If the kernel or device
+ * can't do that, the batch silently falls back to one datagram per message.
+ */
+class ns_udp_batch {
+ public:
+  NSUV_CB_FNS(ns_udp_batch_cb, ns_udp_batch*, int)
+
+  ns_udp_batch() = default;
+  ns_udp_batch(const ns_udp_batch&) = delete;
+  ns_udp_batch& operator=(const ns_udp_batch&) = delete;
+  NSUV_INLINE ~ns_udp_batch();
+
+  /* capacity is the most datagrams that can be added before send(). */
+  NSUV_INLINE NSUV_WUR int init(ns_udp* handle, size_t capacity);
+  /* addr must be nullptr if the handle is connected. Returns UV_ENOBUFS once
+   * the batch is full and UV_EBUSY while it's being sent.
+   */
+  NSUV_INLINE NSUV_WUR int add(const uv_buf_t& buf,
+                               const struct sockaddr* addr);
+  /* Split buf into datagrams of segment_size bytes, the last one possibly
+   * shorter. Either all of them are added or none are.
+   */
+  NSUV_INLINE NSUV_WUR int add_segments(const uv_buf_t& buf,
+                                        size_t segment_size,
+                                        const struct sockaddr* addr);
+  /* Only has an effect on Linux. Off by default. */
+  NSUV_INLINE void set_gso(bool enable);
+  NSUV_INLINE bool gso();
+  /* Returns an error without calling cb if the batch is empty or none of it
+   * could be queued, in which case sent() and failed() still apply. The
+   * batch is empty again by the time cb runs, so it can be refilled there.
+   */
+  NSUV_INLINE NSUV_WUR int send(ns_udp_batch_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int send(ns_udp_batch_cb_d<D_T> cb, D_T* data);
+  NSUV_INLINE NSUV_WUR int send(void (*cb)(ns_udp_batch*, int, void*),
+                                std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int send(ns_udp_batch_cb_wp<D_T> cb,
+                                std::weak_ptr<D_T> data);
+  NSUV_INLINE ns_udp* handle();
+  /* Datagrams waiting to be sent. */
+  NSUV_INLINE size_t size();
+  /* Outcome of the last send(): how many datagrams were sent, how many
+   * failed, and how many syscalls sendmmsg() or try_send() took.
+   */
+  NSUV_INLINE size_t sent();
+  NSUV_INLINE size_t failed();
+  NSUV_INLINE size_t syscalls();
+  /* How many of the sent datagrams were segmented by the kernel. */
+  NSUV_INLINE size_t gso_segments();
+
+ private:
+  enum : size_t {
+    kMmsgChunk = 64,
+    // UDP_MAX_SEGMENTS on older kernels, and the largest IPv4 UDP payload.
+    kGsoMaxSegments = 64,
+    kGsoMaxBytes = 65507,
+  };
+
+  struct slot {
+    uv_udp_send_t req;
+    uv_buf_t buf;
+    struct sockaddr_storage addr;
+    bool has_addr;
+  };
+
+  NSUV_PROXY_FNS(done_proxy_, ns_udp_batch* batch, int status)
+
+  NSUV_INLINE NSUV_WUR int send_();
+  NSUV_INLINE size_t try_send_(size_t count);
+  NSUV_INLINE size_t gso_run_(size_t i, size_t end);
+  NSUV_INLINE void fail_(int status);
+  NSUV_INLINE const struct sockaddr* addr_(slot* s);
+  static NSUV_INLINE void queued_cb_(uv_udp_send_t* req, int status);
+
+  ns_udp* handle_ = nullptr;
+  slot* slots_ = nullptr;
+  size_t capacity_ = 0;
+  size_t count_ = 0;
+  size_t pending_ = 0;
+  size_t sent_ = 0;
+  size_t failed_ = 0;
+  size_t syscalls_ = 0;
+  size_t gso_segments_ = 0;
+  int status_ = 0;
+  bool sending_ = false;
+  bool gso_ = false;
+  void (*done_)(ns_udp_batch*, int) = nullptr;
+  void (*batch_cb_ptr_)() = nullptr;
+  void* batch_cb_data_ = nullptr;
+  std::weak_ptr<void> batch_cb_wp_;
+};
+
+
+/* ns_udp_gro */
+
+/* Receives for an ns_udp with UDP_GRO enabled, so the kernel can coalesce
+ * consecutive datagrams of a flow into one buffer. The buffer is split back
+ * into datagrams using the segment size the kernel reports, and they're all
+ * delivered to a single call of the callback. Datagrams in a call come from
+ * the same sender and only point into an internal buffer that's reused once
+ * the callback returns. Kernels without UDP_GRO deliver one datagram per
+ * call. Shouldn't be mixed with uv_udp_recv_start() on the same handle. Only
+ * supported on Linux, init() returns UV_ENOTSUP elsewhere.
+ */
+class ns_udp_gro {
+ public:
+  /* Errors are reported with a negative status and no datagrams. */
+  NSUV_CB_FNS(ns_udp_gro_cb,
+              ns_udp_gro*,
+              int,
+              const uv_buf_t*,
+              size_t,
+              const struct sockaddr*)
+
+  ns_udp_gro() = default;
+  ns_udp_gro(const ns_udp_gro&) = delete;
+  ns_udp_gro& operator=(const ns_udp_gro&) = delete;
+  NSUV_INLINE ~ns_udp_gro();
+
+  /* handle must be bound. */
+  NSUV_INLINE NSUV_WUR int init(ns_udp* handle);
+  NSUV_INLINE NSUV_WUR int start(ns_udp_gro_cb cb);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int start(ns_udp_gro_cb_d<D_T> cb, D_T* data);
+  NSUV_INLINE NSUV_WUR int start(void (*cb)(ns_udp_gro*,
+                                            int,
+                                            const uv_buf_t*,
+                                            size_t,
+                                            const struct sockaddr*,
+                                            void*),
+                                 std::nullptr_t);
+  template <typename D_T>
+  NSUV_INLINE NSUV_WUR int start(ns_udp_gro_cb_wp<D_T> cb,
+                                 std::weak_ptr<D_T> data);
+  NSUV_INLINE NSUV_WUR int stop();
+  /* Must be called before the ns_udp is closed. cb is called once it's safe
+   * to free this object, before close() returns if init() never succeeded.
+   */
+  NSUV_INLINE void close(void (*cb)(ns_udp_gro*));
+  NSUV_INLINE ns_udp* handle();
+  /* Whether the kernel accepted UDP_GRO. */
+  NSUV_INLINE bool gro();
+
+ private:
+  enum : size_t {
+    // Enough for any UDP payload, which also bounds a coalesced buffer.
+    kBufSize = 64 * 1024,
+    // UDP_GRO_CNT_MAX, the most datagrams the kernel coalesces.
+    kMaxSegments = 64,
+    // Like libuv, don't starve the loop on a busy socket.
+    kMaxReads = 32,
+  };
+
+  NSUV_PROXY_FNS(recv_proxy_,
+                 ns_udp_gro* gro,
+                 int status,
+                 const uv_buf_t* dgrams,
+                 size_t ndgrams,
+                 const struct sockaddr* addr)
+
+  NSUV_INLINE NSUV_WUR int start_();
+  NSUV_INLINE bool read_();
+  static NSUV_INLINE void poll_cb_(ns_poll*, int, int, ns_udp_gro* self);
+  static NSUV_INLINE void close_cb_(ns_poll*, ns_udp_gro* self);
+
+  ns_udp* handle_ = nullptr;
+  ns_poll poll_;
+  // dup() of the socket, so it can be polled alongside the ns_udp.
+  int fd_ = -1;
+  char* buf_ = nullptr;
+  uv_buf_t dgrams_[kMaxSegments];
+  bool gro_ = false;
+  bool reading_ = false;
+  ns_udp_gro_cb recv_ = nullptr;
+  void (*recv_cb_ptr_)() = nullptr;
+  void* recv_cb_data_ = nullptr;
+  std::weak_ptr<void> recv_cb_wp_;
+  void (*close_cb_ptr_)(ns_udp_gro*) = nullptr;
+};
+
+
+/* ns_addr */
+
+/* Compact copy of an IPv4 or IPv6 address and port, for use as a key. It's
+ * a fixed 24 bytes that compare and hash as plain words, instead of a
+ * sockaddr_storage. IPv4 and IPv4-mapped IPv6 addresses are distinct.
+ */
+class ns_addr {
+ public:
+  /* Returns UV_EAFNOSUPPORT for anything but AF_INET and AF_INET6. */
+  NSUV_INLINE NSUV_WUR int init(const struct sockaddr* addr);
+  NSUV_INLINE void to_sockaddr(struct sockaddr_storage* addr) const;
+  /* AF_INET, AF_INET6, or 0 if not initialized. */
+  NSUV_INLINE int family() const;
+  /* In host byte order. */
+  NSUV_INLINE uint16_t port() const;
+  /* Use a random seed where peers pick their own addresses, so they can't
+   * force collisions.
+   */
+  NSUV_INLINE uint64_t hash(uint64_t seed = 0) const;
+  NSUV_INLINE bool operator==(const ns_addr& other) const;
+  NSUV_INLINE bool operator!=(const ns_addr& other) const;
+
+ private:
+  // In network byte order. IPv4 uses the first 4 bytes of ip_.
+  uint8_t ip_[16] = {};
+  uint32_t scope_id_ = 0;
+  uint16_t port_ = 0;
+  uint8_t family_ = 0;
+  uint8_t pad_ = 0;
+};
+
+
+/* ns_udp_sessions */
+
+/* Per-peer state for a UDP server. dispatch() routes each received datagram
+ * to the session of the address it came from, creating a default-constructed
+ * S_T for new peers, and calls the receive callback with it. Sessions that
+ * haven't received anything in idle_timeout milliseconds are passed to the
+ * expire callback and then destroyed. S_T pointers stay valid for the life of
+ * the session.
+ *
+ * Sessions live in an open-addressing table keyed by ns_addr with a random
+ * hash seed, and in a list ordered by last activity so expiry only looks at
+ * sessions that are actually idle. The expiry timer doesn't keep the loop
+ * alive.
+ */
+template <class S_T>
+class ns_udp_sessions {
+ public:
+  using ns_session_recv_cb = void (*)(ns_udp_sessions<S_T>*,
+                                      S_T*,
+                                      const ns_addr&,
+                                      ssize_t,
+                                      const uv_buf_t*);
+  using ns_session_expire_cb = void (*)(ns_udp_sessions<S_T>*,
+                                        S_T*,
+                                        const ns_addr&);
+
+  ns_udp_sessions() = default;
+  ns_udp_sessions(const ns_udp_sessions&) = delete;
+  ns_udp_sessions& operator=(const ns_udp_sessions&) = delete;
+  NSUV_INLINE ~ns_udp_sessions();
+
+  /* An idle_timeout of 0 disables expiry. expire_cb can be nullptr. */
+  NSUV_INLINE NSUV_WUR int init(uv_loop_t* loop,
+                                uint64_t idle_timeout,
+                                ns_session_recv_cb recv_cb,
+                                ns_session_expire_cb expire_cb);
+  /* Pass along what a uv_udp_recv_cb, or each datagram an ns_udp_gro
+   * callback, received. Calls without an address are ignored. Returns
+   * UV_ENOBUFS if a new peer would exceed the session limit.
+   */
+  NSUV_INLINE NSUV_WUR int dispatch(const struct sockaddr* addr,
+                                    ssize_t nread,
+                                    const uv_buf_t* buf);
+  /* Returns nullptr if there's no session for addr. */
+  NSUV_INLINE S_T* get(const ns_addr& addr);
+  /* Destroys the session without calling the expire callback. */
+  NSUV_INLINE NSUV_WUR int remove(const ns_addr& addr);
+  /* 0, the default, means no limit. */
+  NSUV_INLINE void set_max_sessions(size_t max);
+  NSUV_INLINE size_t size();
+  /* Destroys every session without calling the expire callback, then calls
+   * cb once it's safe to free or init() this object again. Can also be
+   * called if init() was never called or failed, in which case cb may be
+   * called before close() returns.
+   */
+  NSUV_INLINE void close(void (*cb)(ns_udp_sessions<S_T>*));
+
+ private:
+  struct entry {
+    ns_addr addr;
+    uint64_t hash;
+    uint64_t last_seen;
+    entry* prev;
+    entry* next;
+    S_T state;
+  };
+
+  NSUV_INLINE size_t find_(const ns_addr& addr, uint64_t hash);
+  NSUV_INLINE void destroy_all_();
+  static NSUV_INLINE void timer_cb_(ns_timer*, ns_udp_sessions<S_T>* self);
+  static NSUV_INLINE void close_cb_(ns_timer*, ns_udp_sessions<S_T>* self);
+
+  ns_timer timer_;
+  // Every session is in the list, least recently active first.
+  util::lru_table<entry> table_;
+  size_t max_sessions_ = 0;
+  uint64_t seed_ = 0;
+  uint64_t idle_timeout_ = 0;
+  ns_session_recv_cb recv_cb_ = nullptr;
+  ns_session_expire_cb expire_cb_ = nullptr;
+  void (*close_cb_ptr_)(ns_udp_sessions<S_T>*) = nullptr;
+  bool timer_closing_ = false;
+};
+
+
+/* ns_udp_reuseport */
+
+/* A group of UDP sockets bound to the same address with SO_REUSEPORT, so the
+ * kernel spreads incoming datagrams over them and each can be read by an
+ * ns_udp on a different loop and thread. All sockets are bound up front by
+ * init(), which fixes their order in the kernel's group. open() then hands
+ * shard i to an ns_udp, which must be initialized on the loop that will read
+ * it and not yet bound; it's safe to call from that loop's thread.
+ *
+ * By default the kernel picks a socket by hashing the 4-tuple.
+ * steer_by_cpu() replaces that with a classic BPF program that picks shard
+ * cpu % size(), so with thread i pinned to CPU i datagrams are handled on the
+ * core that received them. Not supported on Windows, and steering is Linux
+ * only.
+ */
+class ns_udp_reuseport {
+ public:
+  ns_udp_reuseport() = default;
+  ns_udp_reuseport(const ns_udp_reuseport&) = delete;
+  ns_udp_reuseport& operator=(const ns_udp_reuseport&) = delete;
+  NSUV_INLINE ~ns_udp_reuseport();
+
+  NSUV_INLINE NSUV_WUR int init(const struct sockaddr* addr, size_t count);
+  NSUV_INLINE NSUV_WUR int steer_by_cpu();
+  /* Each shard can only be opened once. */
+  NSUV_INLINE NSUV_WUR int open(size_t i, ns_udp* handle);
+  NSUV_INLINE size_t size();
+  /* Closes the sockets that haven't been opened yet. */
+  NSUV_INLINE void close();
+
+ private:
+  // -1 once a socket was handed to an ns_udp.
+  int* fds_ = nullptr;
+  size_t count_ = 0;
+};
+
+
 /* ns_mutex */
 
 class ns_mutex {
@@ -1047,6 +3130,66 @@ class ns_thread {
   std::weak_ptr<void> thread_cb_wp_;
 };
 
+
+
+/* ns_watchdog */
+
+/* Watches a loop from its own thread and reports when the loop goes longer
+ * than the threshold without running its heartbeat timer. With
+ * NSUV_ENABLE_WATCHDOG defined, the stall also names the nsuv callback that
+ * was running at the time; the define makes every callback record itself, so
+ * it's off by default. start() and stop() must be called from the loop's
+ * thread, and only one ns_watchdog can watch a thread. The callback runs on
+ * the watchdog thread, once per stall.
+ *
+ * The heartbeat only runs inside uv_run(), so time spent outside of it counts
+ * as a stall unless the watchdog is suspended first.
+ */
+class ns_watchdog {
+ public:
+  using ns_watchdog_cb = void (*)(ns_watchdog*, const ns_stall&);
+
+  ns_watchdog() = default;
+  ns_watchdog(const ns_watchdog&) = delete;
+  ns_watchdog& operator=(const ns_watchdog&) = delete;
+  NSUV_INLINE ~ns_watchdog();
+
+  /* threshold is in milliseconds. cb can be nullptr to only keep count. */
+  NSUV_INLINE NSUV_WUR int start(uv_loop_t* loop,
+                                 uint64_t threshold,
+                                 ns_watchdog_cb cb);
+  NSUV_INLINE void stop();
+  /* For when the loop stops running for a while. Both are called from the
+   * loop's thread.
+   */
+  NSUV_INLINE void suspend();
+  NSUV_INLINE void resume();
+  NSUV_INLINE uint64_t stall_count();
+  NSUV_INLINE ns_stall last_stall();
+
+ private:
+  static NSUV_INLINE void heartbeat_cb_(ns_timer*, ns_watchdog* wd);
+  static NSUV_INLINE void thread_cb_(ns_thread*, ns_watchdog* wd);
+  NSUV_INLINE void check_(uint64_t now);
+
+  ns_thread thread_;
+  ns_mutex mutex_;
+  uv_cond_t cond_;
+  ns_timer* timer_ = nullptr;
+  util::cb_slot* slot_ = nullptr;
+  ns_watchdog_cb cb_ = nullptr;
+  std::atomic<uint64_t> heartbeat_{ 0 };
+  std::atomic<bool> suspended_{ false };
+  uint64_t threshold_ = 0;
+  // Only accessed from the watchdog thread.
+  uint64_t reported_ = 0;
+  // Guarded by mutex_.
+  ns_stall last_stall_;
+  uint64_t stall_count_ = 0;
+  bool stopping_ = false;
+  bool running_ = false;
+};
+
 }  // namespace nsuv
 
 #undef NSUV_CB_FNS
@@ -0,0 +1,15 @@
+/* Stand-in for systemtap's <sys/sdt.h>, so `make usdt` can compile the
+ * NSUV_ENABLE_USDT code without it installed. The probes only evaluate their
+ * arguments.
+ */
+#ifndef TEST_STUB_SYS_SDT_H_
+#define TEST_STUB_SYS_SDT_H_
+
+#define DTRACE_PROBE3(provider, name, arg1, arg2, arg3)                        \
+  do {                                                                         \
+    static_cast<void>(arg1);                                                   \
+    static_cast<void>(arg2);                                                   \
+    static_cast<void>(arg3);                                                   \
+  } while (0)
+
+#endif  // TEST_STUB_SYS_SDT_H_
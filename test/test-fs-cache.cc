@@ -0,0 +1,283 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+
+using nsuv::ns_fs;
+using nsuv::ns_fs_cache;
+using nsuv::ns_timer;
+
+#define FIXTURE "test/fixtures/lorem_ipsum.txt"
+#define MISSING "test/fixtures/missing"
+#define TEST_FILE "test_file_cache"
+
+struct stat_result {
+  int status = 1;
+  int64_t size = -1;
+  int cb_called = 0;
+};
+
+static ns_fs_cache* cache;
+static ns_timer timer;
+static int64_t fixture_size;
+static int realpath_cb_called;
+static int close_cb_called;
+static int attempts;
+
+
+static void write_file(const char* path, size_t len) {
+  static char data[64];
+  ns_fs req;
+  uv_buf_t buf = uv_buf_init(data, len);
+  int fd = req.open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+  ASSERT_GE(fd, 0);
+  req.cleanup();
+  ASSERT(static_cast<int>(len) == req.write(fd, &buf, 1, 0));
+  req.cleanup();
+  ASSERT(0 == req.close(fd));
+  req.cleanup();
+}
+
+
+static void stat_cb(ns_fs_cache* c,
+                    const ns_fs_cache::result* res,
+                    stat_result* result) {
+  ASSERT_PTR_EQ(c, cache);
+  ASSERT_NULL(res->path);
+  result->status = res->status;
+  if (res->status == 0)
+    result->size = res->statbuf->st_size;
+  else
+    ASSERT_NULL(res->statbuf);
+  result->cb_called++;
+}
+
+
+static void lstat_cb(ns_fs_cache*,
+                     const ns_fs_cache::result* res,
+                     std::weak_ptr<stat_result> data) {
+  auto result = data.lock();
+  ASSERT(0 == res->status);
+  ASSERT(S_ISREG(res->statbuf->st_mode));
+  result->size = res->statbuf->st_size;
+  result->cb_called++;
+}
+
+
+static void realpath_cb(ns_fs_cache*,
+                        const ns_fs_cache::result* res,
+                        void* data) {
+  std::string path = res->path;
+  std::string suffix = "/" FIXTURE;
+
+  ASSERT_NULL(data);
+  ASSERT(0 == res->status);
+  ASSERT_NULL(res->statbuf);
+  ASSERT(path[0] == '/');
+  ASSERT_GT(path.size(), suffix.size());
+  ASSERT(path.substr(path.size() - suffix.size()) == suffix);
+  realpath_cb_called++;
+}
+
+
+static void close_cb(ns_fs_cache* c) {
+  ASSERT_PTR_EQ(c, cache);
+  close_cb_called++;
+}
+
+
+TEST_CASE("fs_cache", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  stat_result first;
+  stat_result second;
+  stat_result missing;
+  auto shared = std::make_shared<stat_result>();
+  ns_fs req;
+
+  ASSERT(0 == req.stat(FIXTURE));
+  fixture_size = req.get_statbuf()->st_size;
+  req.cleanup();
+
+  cache = new ns_fs_cache();
+  ASSERT(UV_EINVAL == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(UV_EINVAL == cache->init(nullptr));
+  ASSERT(UV_EINVAL == cache->init(loop, 1000, 0, 0));
+  // Nothing would ever invalidate the results.
+  ASSERT(UV_EINVAL == cache->init(loop, 0));
+  ASSERT(0 == cache->init(loop, 60000));
+  ASSERT(UV_EBUSY == cache->init(loop));
+
+  // Both wait on the same request.
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &second));
+  ASSERT(0 == cache->stat(MISSING, stat_cb, &missing));
+  ASSERT(0 == cache->realpath("test/fixtures/one_file/../lorem_ipsum.txt",
+                              realpath_cb,
+                              nullptr));
+  ASSERT(0 == cache->lstat(FIXTURE, lstat_cb, TO_WEAK(shared)));
+  ASSERT(0 == first.cb_called);
+  ASSERT(0 == cache->size());
+  ASSERT(0 == cache->hits());
+  ASSERT(5 == cache->misses());
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+  ASSERT(1 == first.cb_called);
+  ASSERT(1 == second.cb_called);
+  ASSERT(0 == first.status);
+  ASSERT(fixture_size == first.size);
+  ASSERT(fixture_size == second.size);
+  ASSERT(UV_ENOENT == missing.status);
+  ASSERT(1 == realpath_cb_called);
+  ASSERT(1 == shared->cb_called);
+  ASSERT(fixture_size == shared->size);
+  ASSERT(4 == cache->size());
+
+  // Hits call back before returning, errors included.
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(2 == first.cb_called);
+  ASSERT(fixture_size == first.size);
+  ASSERT(0 == cache->stat(MISSING, stat_cb, &missing));
+  ASSERT(2 == missing.cb_called);
+  ASSERT(UV_ENOENT == missing.status);
+  ASSERT(0 == cache->realpath("test/fixtures/one_file/../lorem_ipsum.txt",
+                              realpath_cb,
+                              nullptr));
+  ASSERT(2 == realpath_cb_called);
+  ASSERT(0 == cache->lstat(FIXTURE, lstat_cb, TO_WEAK(shared)));
+  ASSERT(2 == shared->cb_called);
+  ASSERT(4 == cache->hits());
+  ASSERT(5 == cache->misses());
+
+  // Only stat() was dropped.
+  cache->invalidate(FIXTURE);
+  ASSERT(2 == cache->size());
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(2 == first.cb_called);
+  ASSERT(6 == cache->misses());
+  // Requests in flight call back, but their results aren't cached.
+  cache->invalidate();
+  ASSERT(0 == cache->size());
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(3 == first.cb_called);
+  ASSERT(0 == cache->size());
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(7 == cache->misses());
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == cache->size());
+
+  cache->close(close_cb);
+  ASSERT(1 == close_cb_called);
+  ASSERT(UV_EINVAL == cache->stat(FIXTURE, stat_cb, &first));
+
+  // Results expire after ttl.
+  ASSERT(0 == cache->init(loop, 10));
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(1 == cache->hits());
+  uv_sleep(20);
+  uv_update_time(loop);
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(2 == cache->misses());
+  // Closing waits on the request in flight.
+  cache->close(close_cb);
+  ASSERT(1 == close_cb_called);
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(2 == close_cb_called);
+  ASSERT(7 == first.cb_called);
+
+  // Evicted least recently used first.
+  ASSERT(0 == cache->init(loop, 60000, 0, 2));
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(0 == cache->stat(MISSING, stat_cb, &missing));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(0 == cache->lstat(FIXTURE, lstat_cb, TO_WEAK(shared)));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(2 == cache->size());
+  ASSERT(0 == cache->stat(FIXTURE, stat_cb, &first));
+  ASSERT(2 == cache->hits());
+  ASSERT(0 == cache->stat(MISSING, stat_cb, &missing));
+  ASSERT(4 == cache->misses());
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+  delete cache;
+
+  make_valgrind_happy();
+}
+
+
+static void watch_stat_cb(ns_fs_cache*,
+                          const ns_fs_cache::result* res,
+                          stat_result* result) {
+  result->status = res->status;
+  result->size = res->status == 0 ? res->statbuf->st_size : -1;
+  result->cb_called++;
+}
+
+
+// Polls until the watcher has dropped the result, which makes the next
+// stat() a miss.
+static void timer_cb(ns_timer*, stat_result* result) {
+  uint64_t misses = cache->misses();
+
+  ASSERT(0 == cache->stat(TEST_FILE, watch_stat_cb, result));
+  if (cache->misses() == misses) {
+    ASSERT_GT(100, ++attempts);
+    return;
+  }
+
+  timer.close();
+}
+
+
+TEST_CASE("fs_cache_watch", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  stat_result result;
+
+  close_cb_called = 0;
+  write_file(TEST_FILE, 10);
+
+  // Only the watcher drops results.
+  cache = new ns_fs_cache();
+  ASSERT(0 == cache->init(loop, 0, ns_fs_cache::kWatch));
+  ASSERT(0 == cache->stat(TEST_FILE, watch_stat_cb, &result));
+  // The watcher doesn't keep the loop alive.
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == result.cb_called);
+  ASSERT(10 == result.size);
+  ASSERT(0 == cache->stat(TEST_FILE, watch_stat_cb, &result));
+  ASSERT(2 == result.cb_called);
+  ASSERT(1 == cache->hits());
+
+  // Changed behind the cache's back.
+  write_file(TEST_FILE, 20);
+  ASSERT(0 == timer.init(loop));
+  ASSERT(0 == timer.start(timer_cb, 10, 10, &result));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(20 == result.size);
+
+  attempts = 0;
+  unlink(TEST_FILE);
+  ASSERT(0 == timer.init(loop));
+  ASSERT(0 == timer.start(timer_cb, 10, 10, &result));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(UV_ENOENT == result.status);
+
+  // The watcher's close is still pending.
+  cache->close(close_cb);
+  ASSERT(0 == close_cb_called);
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == close_cb_called);
+
+  delete cache;
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,215 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_fs;
+using nsuv::ns_mapped_file;
+using nsuv::ns_tcp;
+using nsuv::ns_write;
+
+#define TEST_FILE "test_file_mapped"
+#define EMPTY_FILE "test_file_mapped_empty"
+#define LARGE_FILE "test_file_mapped_large"
+#define FILE_SIZE (1024 * 1024 + 123)
+#define SPAN_OFFSET 5000
+#define SPAN_SIZE (256 * 1024)
+
+static ns_mapped_file mapped;
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_connect<ns_tcp> connect_req;
+static ns_write<ns_tcp> write_req;
+static std::vector<char> contents;
+static std::vector<char> received;
+static int prefetch_cb_called;
+static int close_cb_called;
+
+
+static void write_file(const char* path, const char* data, size_t len) {
+  ns_fs req;
+  uv_buf_t buf = uv_buf_init(const_cast<char*>(data), len);
+  int fd = req.open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+  ASSERT_GE(fd, 0);
+  req.cleanup();
+  ASSERT(static_cast<int>(len) == req.write(fd, &buf, 1, 0));
+  req.cleanup();
+  ASSERT(0 == req.close(fd));
+  req.cleanup();
+}
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t* buf) {
+  if (nread == UV_EOF) {
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  ASSERT_GE(nread, 0);
+  received.insert(received.end(), buf->base, buf->base + nread);
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  ASSERT(0 == incoming.read_start(alloc_cb, read_cb));
+}
+
+
+static void write_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  req->handle()->close(close_cb);
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  // Written straight out of the mapping.
+  uv_buf_t buf = mapped.span(SPAN_OFFSET, SPAN_SIZE);
+
+  ASSERT(status == 0);
+  ASSERT(0 == req->handle()->write(&write_req, &buf, 1, write_cb));
+}
+
+
+static void prefetch_cb(ns_mapped_file* file, int status, int* data) {
+  ASSERT_PTR_EQ(file, &mapped);
+  ASSERT_PTR_EQ(data, &prefetch_cb_called);
+  ASSERT(0 == status);
+  ASSERT(0 == prefetch_cb_called++);
+}
+
+
+TEST_CASE("fs_mapped_file", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  ns_mapped_file empty;
+  struct sockaddr_in addr;
+  uv_buf_t buf;
+
+  contents.resize(FILE_SIZE);
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = static_cast<char>(i % 251);
+  write_file(TEST_FILE, contents.data(), contents.size());
+  write_file(EMPTY_FILE, "", 0);
+
+  ASSERT(UV_ENOENT == mapped.open(TEST_FILE "_missing"));
+  ASSERT(UV_EINVAL ==
+         mapped.prefetch(loop, 0, 1, prefetch_cb, &prefetch_cb_called));
+
+  ASSERT(0 == mapped.open(TEST_FILE));
+  ASSERT(UV_EBUSY == mapped.open(TEST_FILE));
+  ASSERT(FILE_SIZE == mapped.size());
+  ASSERT(0 == memcmp(mapped.data(), contents.data(), FILE_SIZE));
+
+  buf = mapped.span(FILE_SIZE - 10, 100);
+  ASSERT_PTR_EQ(buf.base, mapped.data() + FILE_SIZE - 10);
+  ASSERT(10 == buf.len);
+  ASSERT(0 == mapped.span(FILE_SIZE, 1).len);
+
+  ASSERT(0 == empty.open(EMPTY_FILE));
+  ASSERT(0 == empty.size());
+  ASSERT_NULL(empty.data());
+  ASSERT(0 == empty.span(0, 1).len);
+  ASSERT(0 == empty.close());
+
+  ASSERT(0 == mapped.prefetch(loop,
+                              SPAN_OFFSET,
+                              SPAN_SIZE,
+                              prefetch_cb,
+                              &prefetch_cb_called));
+  ASSERT(UV_EINVAL == mapped.prefetch(loop,
+                                      FILE_SIZE + 1,
+                                      1,
+                                      prefetch_cb,
+                                      &prefetch_cb_called));
+  ASSERT(UV_EBUSY == mapped.close());
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == prefetch_cb_called);
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(loop));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+  ASSERT(0 == client.init(loop));
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+  ASSERT(3 == close_cb_called);
+  ASSERT(SPAN_SIZE == received.size());
+  ASSERT(0 == memcmp(received.data(), &contents[SPAN_OFFSET], SPAN_SIZE));
+
+  ASSERT(0 == mapped.close());
+  ASSERT_NULL(mapped.data());
+  unlink(TEST_FILE);
+  unlink(EMPTY_FILE);
+
+  make_valgrind_happy();
+}
+
+
+static void orphan_prefetch_cb(ns_mapped_file*, int) {
+  FAIL("should not be called");
+}
+
+
+TEST_CASE("fs_mapped_file_lifetime", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  auto* file = new ns_mapped_file();
+  static char page[4096];
+
+  write_file(TEST_FILE, page, sizeof(page));
+
+  // Destroyed with a prefetch pending, which keeps the mapping and doesn't
+  // call back.
+  ASSERT(0 == file->open(TEST_FILE));
+  ASSERT(0 == file->prefetch(loop, 0, 4096, orphan_prefetch_cb));
+  ASSERT(0 == file->prefetch(loop, 0, 1, orphan_prefetch_cb));
+  delete file;
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  unlink(TEST_FILE);
+
+  // Spans of 4 GiB or more aren't truncated.
+  if (sizeof(size_t) > 4) {
+    const uint64_t large = 5ull * 1024 * 1024 * 1024;
+    ns_mapped_file mapped_large;
+    ns_fs req;
+    int fd = req.open(LARGE_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR);
+    ASSERT_GE(fd, 0);
+    req.cleanup();
+    ASSERT(0 == req.ftruncate(fd, large));
+    req.cleanup();
+    ASSERT(0 == mapped_large.map(fd));
+    ASSERT(0 == req.close(fd));
+    ASSERT(large == mapped_large.span(0, large).len);
+    ASSERT(large - 10 == mapped_large.span(10, SIZE_MAX).len);
+    ASSERT(0 == mapped_large.close());
+    unlink(LARGE_FILE);
+  }
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,213 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include <memory>
+
+using nsuv::ns_fs;
+using nsuv::ns_fs_pool;
+
+#define TEST_FILE "test_file_pool"
+#define REQ_COUNT 32
+#define CHUNK_SIZE 16
+
+static ns_fs_pool* pool;
+static uv_file file;
+static char chunks[REQ_COUNT][CHUNK_SIZE];
+static char read_bufs[REQ_COUNT][CHUNK_SIZE];
+static int write_cb_called;
+static int read_cb_called;
+static int stat_cb_called;
+static int close_cb_called;
+static int realpath_cb_called;
+
+
+static void realpath_cb(ns_fs* req) {
+  ASSERT(0 == req->get_result());
+  ASSERT_NOT_NULL(req->get_ptr());
+  // Not cleaned up, it's done by the next request on req.
+  if (realpath_cb_called++ == 0)
+    ASSERT(0 == req->realpath(req->get_loop(), "test/fixtures", realpath_cb));
+}
+
+
+TEST_CASE("fs_auto_cleanup", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  ns_fs req;
+
+  // Each of these allocates, and none are cleaned up by hand. Leaks show up
+  // under ASan or valgrind.
+  ASSERT_LT(0, req.scandir("test/fixtures", 0));
+  ASSERT(0 == req.stat("test/fixtures/lorem_ipsum.txt"));
+  ASSERT(0 == req.realpath("test/fixtures"));
+  ASSERT_NOT_NULL(req.get_ptr());
+
+  realpath_cb_called = 0;
+  ASSERT(0 == req.realpath(loop, "test/fixtures", realpath_cb));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(2 == realpath_cb_called);
+
+  // Cleaning up by hand still works, and doing it twice is harmless.
+  req.cleanup();
+  req.cleanup();
+  ASSERT_NULL(req.get_ptr());
+
+  {
+    ns_fs scoped;
+    ASSERT(0 == scoped.realpath("test/fixtures"));
+  }
+
+  make_valgrind_happy();
+}
+
+
+static void close_cb(ns_fs* req) {
+  ASSERT(0 == req->get_result());
+  close_cb_called++;
+}
+
+
+static void stat_cb(ns_fs* req, std::weak_ptr<size_t> data) {
+  auto size = data.lock();
+  ASSERT(0 == req->get_result());
+  ASSERT(*size == req->get_statbuf()->st_size);
+  stat_cb_called++;
+  ASSERT(0 == pool->close(file, close_cb));
+}
+
+
+static void read_cb(ns_fs* req, char* buf) {
+  size_t i = (buf - read_bufs[0]) / CHUNK_SIZE;
+
+  ASSERT(CHUNK_SIZE == req->get_result());
+  ASSERT(0 == memcmp(buf, chunks[i], CHUNK_SIZE));
+  if (++read_cb_called < REQ_COUNT)
+    return;
+
+  // Every request is back on the free list except this one. The writes
+  // started from open_cb, so there are REQ_COUNT + 1 in all.
+  ASSERT(1 == pool->active());
+  ASSERT(REQ_COUNT == pool->available());
+  static auto size = std::make_shared<size_t>(REQ_COUNT * CHUNK_SIZE);
+  ASSERT(0 == pool->fstat(file, stat_cb, TO_WEAK(size)));
+}
+
+
+static void write_cb(ns_fs* req, char* buf) {
+  ASSERT(CHUNK_SIZE == req->get_result());
+  ASSERT(buf[0] == 'a' + (buf - chunks[0]) / CHUNK_SIZE % 26);
+  if (++write_cb_called < REQ_COUNT)
+    return;
+
+  for (int i = 0; i < REQ_COUNT; i++) {
+    uv_buf_t b = uv_buf_init(read_bufs[i], CHUNK_SIZE);
+    int64_t off = i * CHUNK_SIZE;
+    ASSERT(0 == pool->read(file, &b, 1, off, read_cb, read_bufs[i]));
+  }
+}
+
+
+static void open_cb(ns_fs* req) {
+  ASSERT_GE(req->get_result(), 0);
+  file = static_cast<uv_file>(req->get_result());
+
+  for (int i = 0; i < REQ_COUNT; i++) {
+    uv_buf_t b = uv_buf_init(chunks[i], CHUNK_SIZE);
+    int64_t off = i * CHUNK_SIZE;
+    ASSERT(0 == pool->write(file, &b, 1, off, write_cb, chunks[i]));
+  }
+}
+
+
+static void chained_close_cb(ns_fs* req, int* calls) {
+  ASSERT(0 == req->get_result());
+  ASSERT(1 == pool->active());
+  (*calls)++;
+}
+
+
+static void chained_read_cb(ns_fs* req, int* calls) {
+  ASSERT(CHUNK_SIZE == req->get_result());
+  ASSERT(0 == memcmp(read_bufs[0], chunks[0], CHUNK_SIZE));
+  (*calls)++;
+  ASSERT(0 == req->close(req->get_loop(), file, chained_close_cb, calls));
+}
+
+
+// The usual ns_fs idiom of chaining each step on the same request.
+static void chained_open_cb(ns_fs* req, int* calls) {
+  uv_buf_t b = uv_buf_init(read_bufs[0], CHUNK_SIZE);
+
+  ASSERT_GE(req->get_result(), 0);
+  file = static_cast<uv_file>(req->get_result());
+  (*calls)++;
+  ASSERT(0 ==
+         req->read(req->get_loop(), file, &b, 1, 0, chained_read_cb, calls));
+  ASSERT(1 == pool->active());
+}
+
+
+TEST_CASE("fs_pool", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  uv_buf_t buf = uv_buf_init(chunks[0], CHUNK_SIZE);
+
+  pool = new ns_fs_pool();
+  for (int i = 0; i < REQ_COUNT; i++)
+    memset(chunks[i], 'a' + i % 26, CHUNK_SIZE);
+  unlink(TEST_FILE);
+
+  ASSERT(UV_EINVAL == pool->close(0, close_cb));
+  ASSERT(UV_EINVAL == pool->init(nullptr));
+  ASSERT(0 == pool->init(loop));
+  ASSERT(UV_EINVAL == pool->close(0, nullptr));
+  // Failing synchronously returns the request straight away.
+  ASSERT(UV_EINVAL == pool->write(0, &buf, 0, 0, write_cb, chunks[0]));
+  ASSERT(0 == pool->active());
+  ASSERT(1 == pool->available());
+  ASSERT(1 == pool->allocations());
+
+  ASSERT(0 == pool->open(TEST_FILE,
+                         O_RDWR | O_CREAT | O_TRUNC,
+                         S_IRUSR | S_IWUSR,
+                         open_cb));
+  ASSERT(1 == pool->active());
+  ASSERT(UV_EBUSY == pool->init(loop));
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+  ASSERT(REQ_COUNT == write_cb_called);
+  ASSERT(REQ_COUNT == read_cb_called);
+  ASSERT(1 == stat_cb_called);
+  ASSERT(1 == close_cb_called);
+  ASSERT(0 == pool->active());
+  ASSERT(REQ_COUNT + 1 == pool->available());
+  // The reads, fstat and close reused the earlier requests.
+  ASSERT(REQ_COUNT + 1 == pool->allocations());
+
+  // Shrinking the free list frees what doesn't fit.
+  ASSERT(0 == pool->init(loop, 4));
+  ASSERT(4 == pool->available());
+
+  // Reused from its own callback, the request stays out of the free list
+  // until the chain ends.
+  int chained_calls = 0;
+  memset(read_bufs[0], 0, CHUNK_SIZE);
+  ASSERT(0 == pool->open(TEST_FILE,
+                         O_RDONLY,
+                         0,
+                         chained_open_cb,
+                         &chained_calls));
+  ASSERT(3 == pool->available());
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(3 == chained_calls);
+  ASSERT(0 == pool->active());
+  ASSERT(4 == pool->available());
+
+  delete pool;
+  unlink(TEST_FILE);
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,255 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+using nsuv::ns_fs;
+using nsuv::ns_fs_uring;
+
+#define TEST_FILE "test_file_uring"
+
+static ns_fs_uring* uring;
+static ns_fs fs_req;
+static uv_file file;
+static char data1[] = "uring-buffer\n";
+static char data2[] = "second-buffer\n";
+static char read_buf[64];
+static bool on_ring;
+static int ops;
+static int uring_close_cb_called;
+static int read_cb_called;
+static std::shared_ptr<size_t> read_len;
+
+
+static void uring_close_cb(ns_fs_uring* handle) {
+  ASSERT_PTR_EQ(handle, uring);
+  uring_close_cb_called++;
+}
+
+
+static void check_init(int r) {
+  // Kernels without io_uring, or with it disabled, still go through the
+  // threadpool.
+  on_ring = r == 0;
+  if (!on_ring) {
+    ASSERT((r == UV_ENOSYS || r == UV_ENOTSUP || r == UV_EPERM));
+  }
+}
+
+
+static void lstat_cb(ns_fs* req) {
+  ASSERT(UV_FS_LSTAT == req->get_type());
+  ASSERT(UV_ENOENT == req->get_result());
+  ASSERT_NULL(req->get_ptr());
+  ops++;
+  req->cleanup();
+  uring->close(uring_close_cb);
+}
+
+
+static void stat_cb(ns_fs* req) {
+  ASSERT(UV_FS_STAT == req->get_type());
+  ASSERT(0 == req->get_result());
+  ASSERT_PTR_EQ(req->get_ptr(), req->get_statbuf());
+  ASSERT(sizeof(data1) + sizeof(data2) - 2 == req->get_statbuf()->st_size);
+  ASSERT(S_ISREG(req->get_statbuf()->st_mode));
+  ops++;
+  req->cleanup();
+  ASSERT(0 == uring->lstat(req, TEST_FILE "_missing", lstat_cb));
+}
+
+
+static void close_cb(ns_fs* req) {
+  ASSERT(UV_FS_CLOSE == req->get_type());
+  ASSERT(0 == req->get_result());
+  ops++;
+  req->cleanup();
+  ASSERT(0 == uring->stat(req, TEST_FILE, stat_cb));
+}
+
+
+static void read_pos_cb(ns_fs* req, std::weak_ptr<size_t> data) {
+  auto len = data.lock();
+  ASSERT(UV_FS_READ == req->get_type());
+  ASSERT(static_cast<ssize_t>(*len) == req->get_result());
+  // An offset of -1 reads from the file position, still at the start.
+  ASSERT(0 == memcmp(read_buf, data1, *len));
+  ops++;
+  req->cleanup();
+  read_len.reset();
+  ASSERT(0 == uring->close(req, file, close_cb));
+}
+
+
+static void read_cb(ns_fs* req, std::vector<uv_buf_t>* bufs) {
+  ASSERT(UV_FS_READ == req->get_type());
+  ASSERT(static_cast<ssize_t>(sizeof(data2) - 1) == req->get_result());
+  ASSERT(0 == memcmp(read_buf, data2, sizeof(data2) - 1));
+  ops++;
+  req->cleanup();
+  delete bufs;
+
+  read_len = std::make_shared<size_t>(4);
+  uv_buf_t buf = uv_buf_init(read_buf, *read_len);
+  memset(read_buf, 0, sizeof(read_buf));
+  ASSERT(0 == uring->read(
+      req, file, &buf, 1, -1, read_pos_cb, TO_WEAK(read_len)));
+}
+
+
+static void fstat_cb(ns_fs* req) {
+  ASSERT(UV_FS_FSTAT == req->get_type());
+  ASSERT(0 == req->get_result());
+  ASSERT(sizeof(data1) + sizeof(data2) - 2 == req->get_statbuf()->st_size);
+  ops++;
+  req->cleanup();
+
+  auto* bufs = new std::vector<uv_buf_t>();
+  bufs->push_back(uv_buf_init(read_buf, sizeof(read_buf)));
+  ASSERT(0 == uring->read(req, file, *bufs, sizeof(data1) - 1, read_cb, bufs));
+}
+
+
+static void fdatasync_cb(ns_fs* req) {
+  ASSERT(UV_FS_FDATASYNC == req->get_type());
+  ASSERT(0 == req->get_result());
+  ops++;
+  req->cleanup();
+  ASSERT(0 == uring->fstat(req, file, fstat_cb));
+}
+
+
+static void fsync_cb(ns_fs* req) {
+  ASSERT(UV_FS_FSYNC == req->get_type());
+  ASSERT(0 == req->get_result());
+  ops++;
+  req->cleanup();
+  ASSERT(0 == uring->fdatasync(req, file, fdatasync_cb));
+}
+
+
+static void write_cb(ns_fs* req, char* data) {
+  ASSERT_PTR_EQ(data, data1);
+  ASSERT(UV_FS_WRITE == req->get_type());
+  ASSERT(static_cast<ssize_t>(sizeof(data1) + sizeof(data2) - 2) ==
+         req->get_result());
+  ops++;
+  req->cleanup();
+  ASSERT(0 == uring->fsync(req, file, fsync_cb));
+}
+
+
+static void open_cb(ns_fs* req) {
+  uv_buf_t bufs[] = { uv_buf_init(data1, sizeof(data1) - 1),
+                      uv_buf_init(data2, sizeof(data2) - 1) };
+
+  ASSERT(UV_FS_OPEN == req->get_type());
+  ASSERT_GE(req->get_result(), 0);
+  ASSERT(0 == strcmp(TEST_FILE, req->get_path()));
+  file = static_cast<uv_file>(req->get_result());
+  ops++;
+  req->cleanup();
+  // The bufs are copied, so they can go out of scope before the write runs.
+  ASSERT(0 == uring->write(req, file, bufs, 2, 0, write_cb, data1));
+}
+
+
+TEST_CASE("fs_uring", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+
+  unlink(TEST_FILE);
+  ops = 0;
+  uring_close_cb_called = 0;
+  uring = new ns_fs_uring();
+
+  check_init(uring->init(loop));
+  ASSERT(0 == uring->open(&fs_req,
+                          TEST_FILE,
+                          O_RDWR | O_CREAT | O_TRUNC,
+                          S_IRUSR | S_IWUSR,
+                          open_cb));
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+  ASSERT(10 == ops);
+  ASSERT(1 == uring_close_cb_called);
+  if (on_ring) {
+    ASSERT(10 == uring->submitted());
+    ASSERT(0 == uring->fallbacks());
+  } else {
+    ASSERT(0 == uring->submitted());
+    ASSERT(10 == uring->fallbacks());
+  }
+
+  delete uring;
+  unlink(TEST_FILE);
+
+  make_valgrind_happy();
+}
+
+
+static void read_count_cb(ns_fs* req) {
+  ASSERT(UV_FS_READ == req->get_type());
+  ASSERT(static_cast<ssize_t>(sizeof(data1) - 1) == req->get_result());
+  read_cb_called++;
+  req->cleanup();
+}
+
+
+TEST_CASE("fs_uring_fallback", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  ns_fs reqs[4];
+  char bufs[4][sizeof(data1)];
+  ns_fs sync_req;
+  uv_buf_t buf = uv_buf_init(data1, sizeof(data1) - 1);
+  int r;
+
+  unlink(TEST_FILE);
+  read_cb_called = 0;
+  uring_close_cb_called = 0;
+  uring = new ns_fs_uring();
+
+  r = sync_req.open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  ASSERT_GE(r, 0);
+  file = r;
+  sync_req.cleanup();
+  ASSERT(static_cast<int>(sizeof(data1) - 1) ==
+         sync_req.write(file, &buf, 1, 0));
+  sync_req.cleanup();
+
+  // Only one request fits on the ring, the rest go to the threadpool.
+  check_init(uring->init(loop, 1));
+  for (int i = 0; i < 4; i++) {
+    buf = uv_buf_init(bufs[i], sizeof(bufs[i]));
+    ASSERT(0 == uring->read(&reqs[i], file, &buf, 1, 0, read_count_cb));
+  }
+  // Without a callback the request runs synchronously, like ns_fs.
+  buf = uv_buf_init(bufs[0], sizeof(bufs[0]));
+  ASSERT(static_cast<int>(sizeof(data1) - 1) ==
+         uring->read(&sync_req, file, &buf, 1, 0, nullptr));
+  sync_req.cleanup();
+  // Requests already on the ring finish before the close callback.
+  uring->close(uring_close_cb);
+  ASSERT((0 == uring_close_cb_called || !on_ring));
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+  ASSERT(4 == read_cb_called);
+  ASSERT(1 == uring_close_cb_called);
+  for (int i = 0; i < 4; i++)
+    ASSERT(0 == memcmp(bufs[i], data1, sizeof(data1) - 1));
+  ASSERT((on_ring ? 1 : 0) == uring->submitted());
+  ASSERT((on_ring ? 4 : 5) == uring->fallbacks());
+
+  ASSERT(0 == sync_req.close(file));
+  sync_req.cleanup();
+  delete uring;
+  unlink(TEST_FILE);
+
+  make_valgrind_happy();
+}
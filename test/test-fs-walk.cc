@@ -0,0 +1,254 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+using nsuv::ns_fs;
+using nsuv::ns_fs_walk;
+
+#define FIXTURES "test/fixtures"
+#define TREE_ROOT FIXTURES "/walk_tree"
+#define TREE_DEPTH 3
+#define TREE_FANOUT 4
+#define TREE_FILES 8
+
+struct walk_result {
+  std::map<std::string, uv_dirent_type_t> types;
+  std::map<std::string, size_t> depths;
+  size_t stat_bytes = 0;
+  int status = 1;
+  int done_cb_called = 0;
+  // Left over from a failed run of fs_walk_tree.
+  bool skip_tree = false;
+};
+
+static int stop_after;
+
+
+static void rm_tree(const std::string& path) {
+  ns_fs req;
+  uv_dirent_t ent;
+
+  if (req.scandir(path.c_str(), 0) < 0) {
+    req.cleanup();
+    return;
+  }
+  while (req.scandir_next(&ent) != UV_EOF) {
+    std::string child = path + "/" + ent.name;
+    ns_fs unlink_req;
+    if (ent.type == UV_DIRENT_DIR) {
+      rm_tree(child);
+    } else {
+      ASSERT(0 == unlink_req.unlink(child.c_str()));
+      unlink_req.cleanup();
+    }
+  }
+  req.cleanup();
+  ASSERT(0 == req.rmdir(path.c_str()));
+  req.cleanup();
+}
+
+
+// Every directory has TREE_FILES files, of i + 1 bytes, and directories
+// down to TREE_DEPTH levels below the root.
+static void make_tree(const std::string& path, size_t depth) {
+  static char data[TREE_FILES];
+  ns_fs req;
+
+  ASSERT(0 == req.mkdir(path.c_str(), 0755));
+  req.cleanup();
+
+  for (int i = 0; i < TREE_FILES; i++) {
+    std::string file = path + "/file" + std::to_string(i);
+    uv_buf_t buf = uv_buf_init(data, i + 1);
+    int fd = req.open(file.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    ASSERT_GE(fd, 0);
+    req.cleanup();
+    ASSERT(i + 1 == req.write(fd, &buf, 1, 0));
+    req.cleanup();
+    ASSERT(0 == req.close(fd));
+    req.cleanup();
+  }
+
+  if (depth == TREE_DEPTH)
+    return;
+  for (int i = 0; i < TREE_FANOUT; i++)
+    make_tree(path + "/dir" + std::to_string(i), depth + 1);
+}
+
+
+static void walk_cb(ns_fs_walk*,
+                    const ns_fs_walk::entry* ent,
+                    walk_result* result) {
+  std::string path = ent->path;
+
+  if (result->skip_tree &&
+      path.compare(0, strlen(TREE_ROOT), TREE_ROOT) == 0) {
+    return;
+  }
+  ASSERT(0 == strcmp(ent->name, path.substr(path.rfind('/') + 1).c_str()));
+  ASSERT(result->types.count(path) == 0);
+  result->types[path] = ent->type;
+  result->depths[path] = ent->depth;
+  if (ent->statbuf != nullptr)
+    result->stat_bytes += ent->statbuf->st_size;
+}
+
+
+static void done_cb(ns_fs_walk* walk, int status, walk_result* result) {
+  ASSERT(!walk->is_active());
+  result->status = status;
+  result->done_cb_called++;
+}
+
+
+TEST_CASE("fs_walk", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  ns_fs_walk walk;
+  walk_result result;
+
+  result.skip_tree = true;
+  ASSERT(UV_EINVAL == walk.start(FIXTURES, walk_cb, done_cb, &result));
+  ASSERT(UV_EINVAL == walk.init(loop, 0));
+  ASSERT(UV_EINVAL == walk.init(loop, 4, 0));
+  ASSERT(0 == walk.init(loop, 4, 1));
+  ASSERT(0 == walk.start(FIXTURES, walk_cb, done_cb, &result));
+  ASSERT(walk.is_active());
+  ASSERT(UV_EBUSY == walk.start(FIXTURES, walk_cb, done_cb, &result));
+  ASSERT(UV_EBUSY == walk.init(loop));
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+  ASSERT(1 == result.done_cb_called);
+  ASSERT(0 == result.status);
+  ASSERT(4 == result.types.size());
+  ASSERT(UV_DIRENT_FILE == result.types[FIXTURES "/empty_file"]);
+  ASSERT(UV_DIRENT_FILE == result.types[FIXTURES "/lorem_ipsum.txt"]);
+  ASSERT(UV_DIRENT_DIR == result.types[FIXTURES "/one_file"]);
+  ASSERT(UV_DIRENT_FILE == result.types[FIXTURES "/one_file/one_file"]);
+  ASSERT(0 == result.depths[FIXTURES "/one_file"]);
+  ASSERT(1 == result.depths[FIXTURES "/one_file/one_file"]);
+  ASSERT(0 == result.stat_bytes);
+  ASSERT_GE(walk.directories(), 2);
+  ASSERT_GE(walk.peak_inflight(), 2);
+  ASSERT_GE(4, walk.peak_inflight());
+
+  // A trailing slash doesn't end up in the paths.
+  result = walk_result();
+  ASSERT(0 == walk.start(FIXTURES "/one_file/", walk_cb, done_cb, &result));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(0 == result.status);
+  ASSERT(1 == result.types.size());
+  ASSERT(UV_DIRENT_FILE == result.types[FIXTURES "/one_file/one_file"]);
+
+  result = walk_result();
+  ASSERT(0 == walk.start(FIXTURES "/missing", walk_cb, done_cb, &result));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == result.done_cb_called);
+  ASSERT(UV_ENOENT == result.status);
+  ASSERT(0 == walk.entries());
+
+  make_valgrind_happy();
+}
+
+
+static void count_cb(ns_fs_walk* walk, const ns_fs_walk::entry*, void*) {
+  if (walk->entries() == static_cast<uint64_t>(stop_after))
+    walk->stop();
+}
+
+
+static void stop_done_cb(ns_fs_walk*, int status, void*) {
+  ASSERT(UV_ECANCELED == status);
+  stop_after = 0;
+}
+
+
+static void wp_walk_cb(ns_fs_walk*,
+                       const ns_fs_walk::entry* ent,
+                       std::weak_ptr<walk_result> data) {
+  auto result = data.lock();
+  ASSERT(ent->statbuf);
+  ASSERT(((ent->type == UV_DIRENT_DIR) == S_ISDIR(ent->statbuf->st_mode)));
+  if (ent->type == UV_DIRENT_FILE) {
+    ASSERT(0 == strncmp(ent->name, "file", 4));
+    result->stat_bytes += ent->statbuf->st_size;
+  }
+  result->types[ent->path] = ent->type;
+  result->depths[ent->path] = ent->depth;
+}
+
+
+static void wp_done_cb(ns_fs_walk*,
+                       int status,
+                       std::weak_ptr<walk_result> data) {
+  auto result = data.lock();
+  result->status = status;
+  result->done_cb_called++;
+}
+
+
+TEST_CASE("fs_walk_tree", "[fs]") {
+  uv_loop_t* loop = uv_default_loop();
+  size_t dirs = 0;
+  size_t level = 1;
+  ns_fs_walk walk;
+  walk_result result;
+
+  // A synthetic tree, cleaned up afterwards.
+  rm_tree(TREE_ROOT);
+  make_tree(TREE_ROOT, 0);
+  for (int i = 0; i < TREE_DEPTH; i++) {
+    level *= TREE_FANOUT;
+    dirs += level;
+  }
+  const size_t files = (dirs + 1) * TREE_FILES;
+
+  // Same results whether requests run one at a time or in parallel.
+  for (size_t concurrency : { 1, 16 }) {
+    result = walk_result();
+    ASSERT(0 == walk.init(loop, concurrency, 3));
+    ASSERT(0 == walk.start(TREE_ROOT, walk_cb, done_cb, &result));
+    ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+
+    ASSERT(0 == result.status);
+    ASSERT(dirs + files == result.types.size());
+    ASSERT(dirs + files == walk.entries());
+    ASSERT(dirs + 1 == walk.directories());
+    ASSERT_GE(concurrency, walk.peak_inflight());
+    ASSERT(TREE_DEPTH ==
+           result.depths[TREE_ROOT "/dir1/dir2/dir3/file7"]);
+    ASSERT(UV_DIRENT_DIR == result.types[TREE_ROOT "/dir3/dir0"]);
+  }
+
+  // Every entry is lstat()'d with kStat.
+  auto shared = std::make_shared<walk_result>();
+  ASSERT(0 == walk.init(loop, 8, 64, ns_fs_walk::kStat));
+  ASSERT(0 == walk.start(TREE_ROOT, wp_walk_cb, wp_done_cb, TO_WEAK(shared)));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == shared->done_cb_called);
+  ASSERT(0 == shared->status);
+  ASSERT(dirs + files == shared->types.size());
+  ASSERT((dirs + 1) * (TREE_FILES * (TREE_FILES + 1) / 2) ==
+         shared->stat_bytes);
+  ASSERT_GE(8, walk.peak_inflight());
+
+  // Stopping from the callback still closes every open directory.
+  stop_after = 10;
+  ASSERT(0 == walk.init(loop, 4, 2));
+  ASSERT(0 == walk.start(TREE_ROOT, count_cb, stop_done_cb, nullptr));
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(0 == stop_after);
+  ASSERT(10 == walk.entries());
+  ASSERT(!walk.is_active());
+
+  rm_tree(TREE_ROOT);
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,117 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+using nsuv::ns_loop;
+using nsuv::ns_loop_metrics;
+using nsuv::ns_timer;
+
+#define TIMER_COUNT 3
+#define BUSY_TIME (20 * 1000 * 1000)
+
+static ns_timer timer;
+static int timer_cb_called;
+static int close_cb_called;
+static int owner_cb_called;
+
+
+static void close_cb(ns_timer*) {
+  close_cb_called++;
+}
+
+
+static void timer_cb(ns_timer* handle, ns_loop* loop) {
+  ASSERT_PTR_EQ(handle->get_loop(), loop->base());
+
+  // Block the loop once so there's lag to measure.
+  if (timer_cb_called++ == 0) {
+    uint64_t start = uv_hrtime();
+    while (uv_hrtime() - start < BUSY_TIME) {}
+  }
+
+  if (timer_cb_called == TIMER_COUNT)
+    handle->close(close_cb);
+}
+
+
+static void owner_timer_cb(ns_timer* handle) {
+  owner_cb_called++;
+  handle->close();
+}
+
+
+TEST_CASE("loop_metrics", "[loop]") {
+  ns_loop loop;
+  ns_loop_metrics metrics;
+
+  ASSERT(UV_EINVAL == loop.close());
+  ASSERT(UV_EINVAL == loop.metrics_start());
+
+  ASSERT(0 == loop.init());
+  ASSERT(0 == loop.configure_idle_time());
+  ASSERT(0 == loop.metrics_start());
+  // The metrics handles alone don't keep the loop alive.
+  ASSERT(!loop.alive());
+
+  ASSERT(0 == timer.init(loop.base()));
+  ASSERT(0 == timer.start(timer_cb, 10, 10, &loop));
+  ASSERT(0 == loop.run());
+
+  ASSERT(TIMER_COUNT == timer_cb_called);
+  ASSERT(1 == close_cb_called);
+
+  metrics = loop.get_metrics();
+  ASSERT_GE(metrics.iterations, TIMER_COUNT);
+  ASSERT_GT(metrics.idle_time, 0);
+  ASSERT_GE(metrics.poll_time, metrics.idle_time);
+  ASSERT_GE(metrics.iteration_time, metrics.poll_time);
+  ASSERT_GE(metrics.max_iteration_time, metrics.max_lag);
+  ASSERT_GE(metrics.max_lag, BUSY_TIME);
+  ASSERT_GE(metrics.events, metrics.max_events);
+
+  // Nothing is measured while the loop isn't running.
+  ASSERT(0 == loop.run(UV_RUN_NOWAIT));
+  ASSERT(metrics.iterations == loop.get_metrics().iterations);
+
+  loop.reset_metrics();
+  ASSERT(0 == loop.get_metrics().iterations);
+  ASSERT(0 == loop.get_metrics().max_lag);
+
+  ASSERT(0 == loop.metrics_stop());
+  ASSERT(0 == loop.close());
+  ASSERT_NULL(loop.base());
+}
+
+
+TEST_CASE("loop_metrics_default_loop", "[loop]") {
+  ns_loop loop;
+
+  ASSERT(0 == loop.init(uv_default_loop()));
+  ASSERT_PTR_EQ(uv_default_loop(), loop.base());
+  ASSERT(0 == loop.metrics_start());
+
+  timer_cb_called = 0;
+  close_cb_called = 0;
+  ASSERT(0 == timer.init(loop.base()));
+  ASSERT(0 == timer.start(timer_cb, 1, 1, &loop));
+  ASSERT(0 == loop.run());
+
+  ASSERT(TIMER_COUNT == timer_cb_called);
+  ASSERT_GE(loop.get_metrics().iterations, TIMER_COUNT);
+  // Without idle time the whole poll phase counts as waiting.
+  ASSERT(0 == loop.get_metrics().idle_time);
+
+  // A wrapped loop is left open, and isn't run by close().
+  ASSERT(0 == timer.init(loop.base()));
+  ASSERT(0 == timer.start(owner_timer_cb, 0, 0));
+  ASSERT(0 == loop.close());
+  ASSERT(0 == owner_cb_called);
+  ASSERT(UV_EBUSY == loop.init(uv_default_loop()));
+
+  // The metrics handles finish closing once the owner runs it.
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  ASSERT(1 == owner_cb_called);
+  ASSERT(0 == loop.init(uv_default_loop()));
+  ASSERT(0 == loop.close());
+
+  make_valgrind_happy();
+}
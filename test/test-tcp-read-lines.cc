@@ -0,0 +1,272 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <string>
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_tcp;
+using nsuv::ns_write;
+
+#define LINE_COUNT 2000
+#define CHUNK_COUNT 64
+
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_write<ns_tcp> write_reqs[CHUNK_COUNT];
+static std::vector<char> payload;
+static std::vector<std::string> expected;
+static std::vector<std::string> received;
+static size_t max_line_length;
+static int close_cb_called;
+static int connection_cb_called;
+static int write_cb_called;
+static int enobufs_called;
+static int eof_called;
+static int batch_cb_called;
+
+
+static uint32_t next_rand(uint32_t* seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void write_cb(ns_write<ns_tcp>*, int status) {
+  ASSERT(status == 0);
+  if (++write_cb_called == CHUNK_COUNT)
+    client.close(close_cb);
+}
+
+
+static void lines_cb(ns_tcp* handle,
+                     int status,
+                     const uv_buf_t* lines,
+                     size_t nlines) {
+  ASSERT(nlines <= nsuv::util::line_reader::kBatchSize);
+  batch_cb_called++;
+
+  for (size_t i = 0; i < nlines; i++) {
+    ASSERT_NULL(memchr(lines[i].base, '\n', lines[i].len));
+    received.push_back(std::string(lines[i].base, lines[i].len));
+  }
+
+  if (status == UV_ENOBUFS) {
+    ASSERT(nlines == 0);
+    enobufs_called++;
+    return;
+  }
+
+  if (status < 0) {
+    ASSERT(status == UV_EOF);
+    eof_called++;
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  ASSERT(status == 0);
+  ASSERT(nlines > 0);
+}
+
+
+static void lines_data_cb(ns_tcp* handle,
+                          int status,
+                          const uv_buf_t* lines,
+                          size_t nlines,
+                          std::vector<std::string>* data) {
+  ASSERT_PTR_EQ(data, &received);
+  lines_cb(handle, status, lines, nlines);
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  if (max_line_length > 0)
+    ASSERT(0 == incoming.set_max_line_length(max_line_length));
+  ASSERT(0 == incoming.read_lines_start(lines_cb));
+  connection_cb_called++;
+}
+
+
+static void connection_data_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  ASSERT(0 == incoming.read_lines_start(lines_data_cb, &received));
+  connection_cb_called++;
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  size_t chunk = payload.size() / CHUNK_COUNT;
+  size_t offset = 0;
+  uv_buf_t buf;
+
+  ASSERT(status == 0);
+
+  // Use an odd sized chunk so lines and "\r\n" pairs are split across reads.
+  for (int i = 0; i < CHUNK_COUNT; i++) {
+    size_t len = i == CHUNK_COUNT - 1 ? payload.size() - offset : chunk;
+    buf = uv_buf_init(&payload[offset], len);
+    ASSERT(0 == req->handle()->write(&write_reqs[i], &buf, 1, write_cb));
+    offset += len;
+  }
+}
+
+
+static void make_payload(size_t max_len, bool crlf) {
+  uint32_t seed = 42;
+
+  payload.clear();
+  expected.clear();
+  received.clear();
+
+  for (int i = 0; i < LINE_COUNT; i++) {
+    std::string line;
+    size_t len = next_rand(&seed) % max_len;
+    for (size_t j = 0; j < len; j++)
+      line.push_back('a' + next_rand(&seed) % 26);
+    if (crlf && next_rand(&seed) % 2)
+      line.push_back('\r');
+    line.push_back('\n');
+    payload.insert(payload.end(), line.begin(), line.end());
+    line.resize(len);
+    expected.push_back(line);
+  }
+
+  // Trailing partial line is delivered with UV_EOF.
+  const char partial[] = "partial";
+  payload.insert(payload.end(), partial, partial + sizeof(partial) - 1);
+  expected.push_back(partial);
+}
+
+
+static void run_test(ns_tcp::ns_listen_cb cb) {
+  ns_connect<ns_tcp> connect_req;
+  struct sockaddr_in addr;
+
+  close_cb_called = 0;
+  connection_cb_called = 0;
+  write_cb_called = 0;
+  enobufs_called = 0;
+  eof_called = 0;
+  batch_cb_called = 0;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(1 == connection_cb_called);
+  ASSERT(CHUNK_COUNT == write_cb_called);
+  ASSERT(1 == eof_called);
+  ASSERT(3 == close_cb_called);
+}
+
+
+TEST_CASE("find_lf", "[tcp]") {
+  std::vector<char> data(4 * 1024 * 1024);
+  uint32_t seed = 7;
+
+  // Vary the density of '\n' throughout the buffer.
+  for (size_t i = 0; i < data.size(); i++) {
+    uint32_t r = next_rand(&seed);
+    uint32_t density = (i / 65536) % 4 == 0 ? 4 : 512;
+    data[i] = r % density == 0 ? '\n' : 'a' + r % 26;
+  }
+
+  const char* end = data.data() + data.size();
+  const char* p = data.data();
+  const char* q = data.data();
+  size_t found = 0;
+
+  while (true) {
+    const char* a = nsuv::util::find_lf(p, end);
+    const char* b = static_cast<const char*>(memchr(q, '\n', end - q));
+    ASSERT_PTR_EQ(a, b);
+    if (a == nullptr)
+      break;
+    found++;
+    p = a + 1;
+    q = b + 1;
+  }
+  ASSERT_GT(found, 0);
+
+  // Every offset and short length around the SIMD widths.
+  for (size_t len = 0; len < 80; len++) {
+    for (size_t pos = 0; pos <= len; pos++) {
+      std::vector<char> buf(len + 1, 'a');
+      if (pos < len)
+        buf[pos] = '\n';
+      const char* r = nsuv::util::find_lf(buf.data(), buf.data() + len);
+      if (pos < len)
+        ASSERT_PTR_EQ(r, buf.data() + pos);
+      else
+        ASSERT_NULL(r);
+    }
+  }
+}
+
+
+TEST_CASE("tcp_read_lines", "[tcp]") {
+  max_line_length = 0;
+  make_payload(200, true);
+
+  run_test(connection_cb);
+
+  ASSERT(0 == enobufs_called);
+  ASSERT(expected == received);
+  // Lines must have been delivered in batches.
+  ASSERT(batch_cb_called < LINE_COUNT);
+
+  make_valgrind_happy();
+}
+
+
+TEST_CASE("tcp_read_lines_with_data", "[tcp]") {
+  max_line_length = 0;
+  make_payload(3000, true);
+
+  run_test(connection_data_cb);
+
+  ASSERT(expected == received);
+
+  make_valgrind_happy();
+}
+
+
+TEST_CASE("tcp_read_lines_max_length", "[tcp]") {
+  std::vector<std::string> fits;
+
+  max_line_length = 100;
+  make_payload(200, false);
+
+  run_test(connection_cb);
+
+  for (auto& line : expected) {
+    if (line.size() <= max_line_length)
+      fits.push_back(line);
+  }
+  // Each line that didn't fit is dropped and reported once.
+  ASSERT_GT(expected.size() - fits.size(), 0);
+  ASSERT(expected.size() - fits.size() == static_cast<size_t>(enobufs_called));
+  ASSERT(fits == received);
+
+  make_valgrind_happy();
+}
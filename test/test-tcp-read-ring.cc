@@ -0,0 +1,208 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_tcp;
+using nsuv::ns_timer;
+using nsuv::ns_write;
+using nsuv::util::ring_buffer;
+
+#define RING_SIZE 4096
+#define MSG_COUNT 2000
+#define MAX_MSG_SIZE 3000
+
+static ns_timer timer;
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_write<ns_tcp> write_req;
+static std::vector<char> payload;
+static size_t msgs_parsed;
+static size_t bytes_parsed;
+static bool held;
+static int pause_count;
+static int close_cb_called;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static uint32_t msg_size(size_t i) {
+  return static_cast<uint32_t>((i * 7919) % MAX_MSG_SIZE);
+}
+
+
+// Each message is a 4 byte length followed by that many bytes of i % 256.
+static void build_payload() {
+  payload.clear();
+  for (size_t i = 0; i < MSG_COUNT; i++) {
+    uint32_t len = msg_size(i);
+    const char* p = reinterpret_cast<const char*>(&len);
+    payload.insert(payload.end(), p, p + sizeof(len));
+    payload.insert(payload.end(), len, static_cast<char>(i % 256));
+  }
+}
+
+
+// Consume every complete message, leaving a trailing partial one in place.
+static void parse(ns_tcp* handle) {
+  uv_buf_t data = handle->read_ring_data();
+  size_t off = 0;
+  uint32_t len;
+
+  while (data.len - off >= sizeof(len)) {
+    memcpy(&len, data.base + off, sizeof(len));
+    if (data.len - off - sizeof(len) < len)
+      break;
+    ASSERT(msg_size(msgs_parsed) == len);
+    ASSERT(0 == memcmp(data.base + off,
+                       &payload[bytes_parsed + off],
+                       sizeof(len) + len));
+    off += sizeof(len) + len;
+    msgs_parsed++;
+  }
+
+  bytes_parsed += off;
+  ASSERT(0 == handle->read_consume(off));
+}
+
+
+static void timer_cb(ns_timer* handle) {
+  ASSERT(held);
+  held = false;
+  // Frees space in the full ring, which restarts reading.
+  parse(&incoming);
+  handle->close();
+}
+
+
+static void read_cb(ns_tcp* handle,
+                    ssize_t nread,
+                    const uv_buf_t* data,
+                    size_t* bytes) {
+  ASSERT_PTR_EQ(bytes, &bytes_parsed);
+  // Nothing is read while the ring is full.
+  ASSERT(!held);
+
+  if (nread == UV_EOF) {
+    ASSERT(0 == data->len);
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  ASSERT_GT(nread, 0);
+  ASSERT_PTR_EQ(data->base, handle->read_ring_data().base);
+  ASSERT_GE(data->len, static_cast<size_t>(nread));
+
+  // Leave the ring full once to check that reading pauses.
+  if (pause_count == 0 && data->len == RING_SIZE) {
+    pause_count++;
+    held = true;
+    ASSERT(0 == timer.init(handle->get_loop()));
+    ASSERT(0 == timer.start(timer_cb, 20, 0));
+    return;
+  }
+
+  parse(handle);
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  ASSERT(0 == incoming.read_ring_start(RING_SIZE, read_cb, &bytes_parsed));
+  ASSERT(0 == incoming.read_ring_data().len);
+}
+
+
+static void write_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  req->handle()->close(close_cb);
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  uv_buf_t buf = uv_buf_init(payload.data(), payload.size());
+
+  ASSERT(status == 0);
+  ASSERT(0 == req->handle()->write(&write_req, &buf, 1, write_cb));
+}
+
+
+TEST_CASE("ring_buffer", "[tcp]") {
+  for (bool mirror : { false, true }) {
+    ring_buffer ring;
+    uv_buf_t buf;
+    size_t cap;
+
+    ASSERT(UV_EINVAL == ring.init(0, mirror));
+    ASSERT(0 == ring.init(100, mirror));
+    cap = ring.capacity();
+    ASSERT_GE(cap, 100);
+#if defined(__linux__)
+    ASSERT(mirror == ring.mirrored());
+#endif
+
+    ring.alloc(&buf);
+    ASSERT(cap == buf.len);
+    memset(buf.base, 'a', cap - 10);
+    ring.commit(cap - 10);
+    ring.consume(cap - 20);
+    ASSERT(10 == ring.size());
+
+    // Write across the end of the buffer. The readable region stays
+    // contiguous either way.
+    ring.alloc(&buf);
+    ASSERT(cap - 10 == buf.len);
+    memset(buf.base, 'b', 20);
+    ring.commit(20);
+    buf = ring.readable();
+    ASSERT(30 == buf.len);
+    ASSERT(0 == memcmp(buf.base, "aaaaaaaaaabbbbbbbbbbbbbbbbbbbb", 30));
+
+    ring.consume(30);
+    ASSERT(0 == ring.size());
+    ring.alloc(&buf);
+    ASSERT(cap == buf.len);
+    ring.commit(cap);
+    ring.alloc(&buf);
+    ASSERT(0 == buf.len);
+  }
+}
+
+
+TEST_CASE("tcp_read_ring", "[tcp]") {
+  ns_connect<ns_tcp> connect_req;
+  struct sockaddr_in addr;
+
+  build_payload();
+
+  ASSERT(UV_EINVAL == incoming.read_consume(0));
+  ASSERT(0 == incoming.read_ring_data().len);
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(1 == pause_count);
+  ASSERT(!held);
+  ASSERT(MSG_COUNT == msgs_parsed);
+  ASSERT(payload.size() == bytes_parsed);
+  ASSERT(3 == close_cb_called);
+
+  make_valgrind_happy();
+}
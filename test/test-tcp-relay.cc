@@ -0,0 +1,387 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#if !defined(_WIN32)
+# include <sys/socket.h>
+# include <unistd.h>
+#endif
+
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_relay;
+using nsuv::ns_tcp;
+using nsuv::ns_timer;
+using nsuv::ns_write;
+
+#define REQUEST_SIZE (8 * 1024 * 1024)
+#define RESPONSE_SIZE (1024 * 1024)
+
+// How the proxy moves the data between incoming and outgoing.
+enum proxy_mode { kPump, kRelay, kRelayNoSplice };
+
+static proxy_mode mode;
+static ns_timer timer;
+static ns_tcp proxy_server;
+static ns_tcp upstream_server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_tcp outgoing;
+static ns_tcp upstream;
+static ns_relay* relay;
+static ns_connect<ns_tcp> client_connect_req;
+static ns_connect<ns_tcp> outgoing_connect_req;
+static ns_write<ns_tcp> client_write_req;
+static ns_write<ns_tcp> upstream_write_req;
+static uv_shutdown_t client_shutdown_req;
+static uv_shutdown_t upstream_shutdown_req;
+static std::vector<char> request;
+static std::vector<char> response;
+static size_t client_bytes_read;
+static size_t upstream_bytes_read;
+static int client_done;
+static int upstream_done;
+static int pump_cb_called;
+static int relay_cb_called;
+static int close_cb_called;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void client_finish() {
+  // Close once the response was read and the request was fully written.
+  if (++client_done == 2)
+    client.close(close_cb);
+}
+
+
+static void upstream_finish() {
+  if (++upstream_done == 2)
+    upstream.close(close_cb);
+}
+
+
+static void client_read_cb(ns_tcp*, ssize_t nread, const uv_buf_t* buf) {
+  if (nread == UV_EOF) {
+    ASSERT(response.size() == client_bytes_read);
+    return client_finish();
+  }
+
+  ASSERT(nread >= 0);
+  ASSERT(client_bytes_read + nread <= response.size());
+  ASSERT(0 == memcmp(buf->base, &response[client_bytes_read], nread));
+  client_bytes_read += nread;
+}
+
+
+static void upstream_read_cb(ns_tcp*, ssize_t nread, const uv_buf_t* buf) {
+  if (nread == UV_EOF) {
+    ASSERT(request.size() == upstream_bytes_read);
+    return upstream_finish();
+  }
+
+  ASSERT(nread >= 0);
+  ASSERT(upstream_bytes_read + nread <= request.size());
+  ASSERT(0 == memcmp(buf->base, &request[upstream_bytes_read], nread));
+  upstream_bytes_read += nread;
+}
+
+
+static void client_shutdown_cb(uv_shutdown_t*, int status) {
+  ASSERT(status == 0);
+  client_finish();
+}
+
+
+static void upstream_shutdown_cb(uv_shutdown_t*, int status) {
+  ASSERT(status == 0);
+  upstream_finish();
+}
+
+
+static void timer_cb(ns_timer* handle) {
+  // Upstream isn't reading yet, so the proxy must have stopped reading from
+  // the client instead of buffering the whole request.
+  ASSERT(0 == upstream_bytes_read);
+  ASSERT_GT(client.get_write_queue_size(), REQUEST_SIZE / 2);
+  if (mode != kPump)
+    ASSERT_GT(request.size(), relay->bytes_a_to_b());
+  ASSERT(0 == upstream.read_start(alloc_cb, upstream_read_cb));
+  handle->close();
+}
+
+
+static void pump_done() {
+  if (++pump_cb_called < 2)
+    return;
+  incoming.close(close_cb);
+  outgoing.close(close_cb);
+}
+
+
+static void pump_cb(ns_tcp* handle, int status) {
+  ASSERT_PTR_EQ(handle, &incoming);
+  ASSERT(status == 0);
+  pump_done();
+}
+
+
+static void pump_data_cb(ns_tcp* handle, int status, size_t* data) {
+  ASSERT_PTR_EQ(handle, &outgoing);
+  ASSERT_PTR_EQ(data, &client_bytes_read);
+  ASSERT(status == 0);
+  pump_done();
+}
+
+
+static void relay_cb(ns_relay* handle, int status) {
+  ASSERT_PTR_EQ(handle, relay);
+  ASSERT(status == 0);
+  relay_cb_called++;
+  incoming.close(close_cb);
+  outgoing.close(close_cb);
+}
+
+
+static void outgoing_connect_cb(ns_connect<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  ASSERT_PTR_EQ(req->handle(), &outgoing);
+
+  if (mode != kPump) {
+    ASSERT(0 == relay->start(&incoming, &outgoing, relay_cb));
+    return;
+  }
+
+  ASSERT(0 == incoming.pump(&outgoing, pump_cb));
+  ASSERT(UV_EBUSY == incoming.pump(&outgoing, pump_cb));
+  ASSERT(0 == outgoing.pump(&incoming, pump_data_cb, &client_bytes_read));
+}
+
+
+static void proxy_connection_cb(ns_tcp* handle, int status) {
+  struct sockaddr_in addr;
+  int buffer_size = 16 * 1024;
+
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  handle->close(close_cb);
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort2, &addr));
+  ASSERT(0 == outgoing.init_ex(handle->get_loop(), AF_INET));
+  ASSERT(0 == uv_send_buffer_size(outgoing.base_handle(), &buffer_size));
+  ASSERT(0 == outgoing.connect(&outgoing_connect_req,
+                               SOCKADDR_CONST_CAST(&addr),
+                               outgoing_connect_cb));
+}
+
+
+static void upstream_connection_cb(ns_tcp* handle, int status) {
+  uv_buf_t buf = uv_buf_init(response.data(), response.size());
+
+  ASSERT(status == 0);
+  ASSERT(0 == upstream.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&upstream));
+  handle->close(close_cb);
+
+  // Respond right away so both directions are busy at the same time.
+  ASSERT(0 == upstream.write(&upstream_write_req, &buf, 1, nullptr));
+  ASSERT(0 == uv_shutdown(&upstream_shutdown_req,
+                          upstream.base_stream(),
+                          upstream_shutdown_cb));
+  // Delay reading the request so the proxy has to apply backpressure.
+  ASSERT(0 == timer.init(handle->get_loop()));
+  ASSERT(0 == timer.start(timer_cb, 100, 0));
+}
+
+
+static void client_connect_cb(ns_connect<ns_tcp>* req, int status) {
+  uv_buf_t buf = uv_buf_init(request.data(), request.size());
+
+  ASSERT(status == 0);
+  ASSERT(0 == req->handle()->read_start(alloc_cb, client_read_cb));
+  ASSERT(0 == req->handle()->write(&client_write_req, &buf, 1, nullptr));
+  ASSERT(0 == uv_shutdown(&client_shutdown_req,
+                          req->handle()->base_stream(),
+                          client_shutdown_cb));
+}
+
+
+static void run_test(proxy_mode m) {
+  struct sockaddr_in addr;
+  int buffer_size = 16 * 1024;
+
+  mode = m;
+  request.resize(REQUEST_SIZE);
+  response.resize(RESPONSE_SIZE);
+  for (size_t i = 0; i < request.size(); i++)
+    request[i] = static_cast<char>(i % 251);
+  for (size_t i = 0; i < response.size(); i++)
+    response[i] = static_cast<char>(i % 239);
+
+  client_bytes_read = 0;
+  upstream_bytes_read = 0;
+  client_done = 0;
+  upstream_done = 0;
+  pump_cb_called = 0;
+  relay_cb_called = 0;
+  close_cb_called = 0;
+
+  if (mode != kPump) {
+    relay = new ns_relay();
+    relay->set_use_splice(mode == kRelay);
+  }
+
+  // Small socket buffers keep the kernel from absorbing the request.
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort2, &addr));
+  ASSERT(0 == upstream_server.init(uv_default_loop()));
+  ASSERT(0 == upstream_server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == uv_recv_buffer_size(upstream_server.base_handle(),
+                                  &buffer_size));
+  ASSERT(0 == upstream_server.listen(128, upstream_connection_cb));
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == proxy_server.init(uv_default_loop()));
+  ASSERT(0 == proxy_server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == uv_recv_buffer_size(proxy_server.base_handle(), &buffer_size));
+  ASSERT(0 == proxy_server.listen(128, proxy_connection_cb));
+
+  ASSERT(0 == client.init_ex(uv_default_loop(), AF_INET));
+  ASSERT(0 == uv_send_buffer_size(client.base_handle(), &buffer_size));
+  ASSERT(0 == client.connect(&client_connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             client_connect_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(6 == close_cb_called);
+  ASSERT(request.size() == upstream_bytes_read);
+  ASSERT(response.size() == client_bytes_read);
+  if (mode == kPump) {
+    ASSERT(2 == pump_cb_called);
+    return;
+  }
+
+  ASSERT(1 == relay_cb_called);
+  ASSERT(request.size() == relay->bytes_a_to_b());
+  ASSERT(response.size() == relay->bytes_b_to_a());
+}
+
+
+TEST_CASE("tcp_pump", "[tcp]") {
+  run_test(kPump);
+
+  make_valgrind_happy();
+}
+
+
+#if !defined(_WIN32)
+static void pump_close_cb(ns_tcp* handle, int status) {
+  ASSERT_PTR_EQ(handle, &incoming);
+  ASSERT(UV_ECANCELED == status);
+  ASSERT(handle->is_closing());
+  ASSERT(0 == close_cb_called);
+  pump_cb_called++;
+  outgoing.close(close_cb);
+}
+
+
+TEST_CASE("tcp_pump_close", "[tcp]") {
+  uv_loop_t* loop = uv_default_loop();
+  int fds[2];
+
+  pump_cb_called = 0;
+  close_cb_called = 0;
+
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  ASSERT(0 == incoming.init(loop));
+  ASSERT(0 == incoming.open(fds[0]));
+  ASSERT(0 == outgoing.init(loop));
+  ASSERT(0 == outgoing.open(fds[1]));
+
+  // There's no EOF or error to end the pump, so close() has to.
+  ASSERT(0 == incoming.pump(&outgoing, pump_close_cb));
+  incoming.close(close_cb);
+  ASSERT(0 == pump_cb_called);
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == pump_cb_called);
+  ASSERT(2 == close_cb_called);
+
+  make_valgrind_happy();
+}
+
+
+static void pump_eof_cb(ns_tcp* handle, int status) {
+  ASSERT_PTR_EQ(handle, &incoming);
+  ASSERT(0 == status);
+  pump_cb_called++;
+  // Closing the stream that's pumped doesn't call this again.
+  handle->close(close_cb);
+  outgoing.close(close_cb);
+}
+
+
+TEST_CASE("tcp_pump_close_from_cb", "[tcp]") {
+  uv_loop_t* loop = uv_default_loop();
+  int src_fds[2];
+  int dst_fds[2];
+
+  pump_cb_called = 0;
+  close_cb_called = 0;
+
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, src_fds));
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, dst_fds));
+  ASSERT(0 == incoming.init(loop));
+  ASSERT(0 == incoming.open(src_fds[0]));
+  ASSERT(0 == outgoing.init(loop));
+  ASSERT(0 == outgoing.open(dst_fds[0]));
+
+  ASSERT(0 == incoming.pump(&outgoing, pump_eof_cb));
+  ASSERT(0 == shutdown(src_fds[1], SHUT_WR));
+
+  ASSERT(0 == uv_run(loop, UV_RUN_DEFAULT));
+  ASSERT(1 == pump_cb_called);
+  ASSERT(2 == close_cb_called);
+
+  ::close(src_fds[1]);
+  ::close(dst_fds[1]);
+
+  make_valgrind_happy();
+}
+#endif
+
+
+TEST_CASE("tcp_relay", "[tcp]") {
+  run_test(kRelay);
+
+#if defined(__linux__)
+  // Only what couldn't be spliced while upstream wasn't reading is copied.
+  ASSERT_GT(relay->bytes_a_to_b() + relay->bytes_b_to_a(),
+            relay->bytes_copied());
+#endif
+  delete relay;
+
+  make_valgrind_happy();
+}
+
+
+TEST_CASE("tcp_relay_no_splice", "[tcp]") {
+  run_test(kRelayNoSplice);
+
+  ASSERT(relay->bytes_a_to_b() + relay->bytes_b_to_a() ==
+         relay->bytes_copied());
+  delete relay;
+
+  make_valgrind_happy();
+}
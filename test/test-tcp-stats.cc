@@ -0,0 +1,121 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+using nsuv::ns_connect;
+using nsuv::ns_io_stats;
+using nsuv::ns_tcp;
+using nsuv::ns_write;
+
+#define REQ_COUNT 4
+#define CHUNK_SIZE (256 * 1024)
+
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_write<ns_tcp> write_reqs[REQ_COUNT];
+static char chunk[CHUNK_SIZE];
+static size_t bytes_read;
+static int read_cb_called;
+static int write_cb_called;
+static int close_cb_called;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t*) {
+  read_cb_called++;
+  if (nread < 0) {
+    ASSERT(nread == UV_EOF);
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  bytes_read += nread;
+}
+
+
+static void write_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  if (++write_cb_called == REQ_COUNT)
+    req->handle()->close(close_cb);
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  ASSERT(0 == incoming.read_start(alloc_cb, read_cb));
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  uv_buf_t buf = uv_buf_init(chunk, sizeof(chunk));
+
+  ASSERT(status == 0);
+  for (int i = 0; i < REQ_COUNT; i++)
+    ASSERT(0 == req->handle()->write(&write_reqs[i], &buf, 1, write_cb));
+}
+
+
+TEST_CASE("tcp_stats", "[tcp]") {
+  ns_connect<ns_tcp> connect_req;
+  struct sockaddr_in addr;
+  ns_io_stats stats;
+  int buffer_size = 16 * 1024;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+  // Keep the writes from all going straight to the socket.
+  ASSERT(0 == uv_send_buffer_size(client.base_handle(), &buffer_size));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(REQ_COUNT == write_cb_called);
+  ASSERT(3 == close_cb_called);
+  ASSERT(static_cast<size_t>(REQ_COUNT) * CHUNK_SIZE == bytes_read);
+
+  stats = client.get_stats();
+#if defined(NSUV_ENABLE_STATS)
+  ASSERT(static_cast<uint64_t>(REQ_COUNT) * CHUNK_SIZE == stats.bytes_written);
+  ASSERT(REQ_COUNT == stats.writes);
+  ASSERT(REQ_COUNT == stats.write_cbs);
+  ASSERT_GT(stats.peak_write_queue_size, 0);
+  ASSERT(0 == stats.read_cbs);
+
+  stats = incoming.get_stats();
+  ASSERT(bytes_read == stats.bytes_read);
+  ASSERT(static_cast<uint64_t>(read_cb_called) == stats.read_cbs);
+  ASSERT_GT(stats.cb_time, 0);
+  ASSERT(0 == stats.bytes_written);
+#else
+  ASSERT(0 == stats.bytes_written);
+  ASSERT(0 == stats.writes);
+#endif
+
+  incoming.reset_stats();
+  stats = incoming.get_stats();
+  ASSERT(0 == stats.bytes_read);
+  ASSERT(0 == stats.read_cbs);
+  ASSERT(0 == stats.cb_time);
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,241 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#if !defined(_WIN32)
+# include <sys/socket.h>
+#endif
+
+#include <memory>
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_tcp;
+using nsuv::ns_write;
+
+#define SMALL_SIZE 64
+#define LARGE_SIZE (4 * 1024 * 1024)
+#define TOTAL_SIZE (5 * SMALL_SIZE + LARGE_SIZE)
+
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static std::vector<char> payload;
+static size_t bytes_read;
+static int close_cb_called;
+static int sync_cb_called;
+static int deferred_cb_called;
+static int large_cb_called;
+static int wp_cb_called;
+static std::vector<int> order;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t* buf) {
+  if (nread < 0) {
+    ASSERT(nread == UV_EOF);
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  ASSERT(bytes_read + nread <= payload.size());
+  ASSERT(0 == memcmp(buf->base, &payload[bytes_read], nread));
+  bytes_read += nread;
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  ASSERT(0 == incoming.read_start(alloc_cb, read_cb));
+}
+
+
+static void sync_cb(ns_tcp* handle, int status) {
+  ASSERT_PTR_EQ(handle, &client);
+  ASSERT(status == 0);
+  sync_cb_called++;
+}
+
+
+static void deferred_cb(ns_tcp* handle, int status, size_t* data) {
+  ASSERT_PTR_EQ(handle, &client);
+  ASSERT_PTR_EQ(data, &bytes_read);
+  ASSERT(status == 0);
+  ASSERT(0 == large_cb_called);
+  deferred_cb_called++;
+}
+
+
+static void large_cb(ns_tcp* handle, int status) {
+  ASSERT_PTR_EQ(handle, &client);
+  ASSERT(status == 0);
+  ASSERT(1 == deferred_cb_called);
+  ASSERT(0 == wp_cb_called);
+  large_cb_called++;
+}
+
+
+static void wp_cb(ns_tcp* handle, int status, std::weak_ptr<int> wp) {
+  auto data = wp.lock();
+  ASSERT_PTR_EQ(handle, &client);
+  ASSERT(status == 0);
+  ASSERT(data);
+  ASSERT(42 == *data);
+  ASSERT(1 == large_cb_called);
+  wp_cb_called++;
+  handle->close(close_cb);
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  static std::shared_ptr<int> wp_data = std::make_shared<int>(42);
+  ns_tcp* handle = req->handle();
+  char* p = payload.data();
+  uv_buf_t bufs[2];
+
+  ASSERT(status == 0);
+
+  // Nothing is queued, so a small write goes straight to the socket.
+  bufs[0] = uv_buf_init(p, SMALL_SIZE);
+  ASSERT(SMALL_SIZE == handle->try_write(bufs, 1));
+  p += SMALL_SIZE;
+
+  handle->set_write_fast_sync(true);
+  bufs[0] = uv_buf_init(p, SMALL_SIZE / 2);
+  bufs[1] = uv_buf_init(p + SMALL_SIZE / 2, SMALL_SIZE / 2);
+  ASSERT(0 == handle->write_fast(bufs, 2, sync_cb));
+  ASSERT(1 == sync_cb_called);
+  p += SMALL_SIZE;
+
+  handle->set_write_fast_sync(false);
+  bufs[0] = uv_buf_init(p, SMALL_SIZE);
+  ASSERT(0 == handle->write_fast(bufs, 1, deferred_cb, &bytes_read));
+  ASSERT(0 == deferred_cb_called);
+  p += SMALL_SIZE;
+
+  bufs[0] = uv_buf_init(p, SMALL_SIZE);
+  ASSERT(0 == handle->write_fast(bufs, 1, nullptr));
+  p += SMALL_SIZE;
+
+  // Too large for the send buffer, so the remainder gets queued.
+  bufs[0] = uv_buf_init(p, LARGE_SIZE);
+  ASSERT(0 == handle->write_fast(bufs, 1, large_cb));
+  ASSERT_GT(handle->get_write_queue_size(), 0);
+  ASSERT_GT(LARGE_SIZE, handle->get_write_queue_size());
+  p += LARGE_SIZE;
+
+  // Writes behind queued data are queued as well, even in sync mode.
+  handle->set_write_fast_sync(true);
+  bufs[0] = uv_buf_init(p, SMALL_SIZE);
+  ASSERT(0 == handle->write_fast(bufs, 1, wp_cb, std::weak_ptr<int>(wp_data)));
+  ASSERT(0 == wp_cb_called);
+  p += SMALL_SIZE;
+
+  ASSERT_PTR_EQ(p, payload.data() + payload.size());
+  ASSERT(0 == large_cb_called);
+}
+
+
+TEST_CASE("tcp_write_fast", "[tcp]") {
+  ns_connect<ns_tcp> connect_req;
+  struct sockaddr_in addr;
+  int buffer_size = 16 * 1024;
+
+  payload.resize(TOTAL_SIZE);
+  for (size_t i = 0; i < payload.size(); i++)
+    payload[i] = static_cast<char>(i % 251);
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+  ASSERT(0 == uv_send_buffer_size(client.base_handle(), &buffer_size));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(1 == sync_cb_called);
+  ASSERT(1 == deferred_cb_called);
+  ASSERT(1 == large_cb_called);
+  ASSERT(1 == wp_cb_called);
+  ASSERT(3 == close_cb_called);
+  ASSERT(payload.size() == bytes_read);
+
+  make_valgrind_happy();
+}
+
+
+#if !defined(_WIN32)
+static void order_fast_cb(ns_tcp* handle, int status, int* tag) {
+  ASSERT_PTR_EQ(handle, &client);
+  ASSERT(status == 0);
+  order.push_back(*tag);
+}
+
+
+static void order_write_cb(ns_write<ns_tcp>*, int status, int* tag) {
+  ASSERT(status == 0);
+  order.push_back(*tag);
+}
+
+
+static void order_close_cb(ns_tcp*) {
+  order.push_back(0);
+}
+
+
+TEST_CASE("tcp_write_fast_order", "[tcp]") {
+  static int tags[] = { 1, 2, 3, 4, 5 };
+  ns_write<ns_tcp> req;
+  char data[] = "x";
+  uv_buf_t buf = uv_buf_init(data, 1);
+  int fds[2];
+
+  ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.open(fds[0]));
+  ASSERT(0 == incoming.init(uv_default_loop()));
+  ASSERT(0 == incoming.open(fds[1]));
+  client.set_write_fast_sync(false);
+
+  // Nothing is pending, but the callback still waits for the loop.
+  ASSERT(0 == client.write_fast(&buf, 1, order_fast_cb, &tags[0]));
+  // Completes right away, but its callback still comes after.
+  ASSERT(0 == client.write(&req, &buf, 1, order_write_cb, &tags[1]));
+  // These wait for the write() before them.
+  ASSERT(0 == client.write_fast(&buf, 1, order_fast_cb, &tags[2]));
+  ASSERT(0 == client.write_fast(&buf, 1, order_fast_cb, &tags[3]));
+  ASSERT(order.empty());
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  ASSERT((order == std::vector<int>{ 1, 2, 3, 4 }));
+
+  // Its zero-length write already completed, so closing still reports
+  // success, and before the close callback.
+  order.clear();
+  ASSERT(0 == client.write_fast(&buf, 1, order_fast_cb, &tags[4]));
+  client.close(order_close_cb);
+  incoming.close();
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  ASSERT((order == std::vector<int>{ 5, 0 }));
+
+  make_valgrind_happy();
+}
+#endif
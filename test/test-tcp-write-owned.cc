@@ -0,0 +1,163 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_tcp;
+using nsuv::ns_write;
+
+#define LARGE_SIZE (1024 * 1024)
+
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_write<ns_tcp> write_reqs[6];
+static std::vector<char> expected;
+static std::vector<char> received;
+static size_t large_data;
+static int close_cb_called;
+static int write_cb_called;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t* buf) {
+  if (nread < 0) {
+    ASSERT(nread == UV_EOF);
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  received.insert(received.end(), buf->base, buf->base + nread);
+}
+
+
+static void check_bufs(ns_write<ns_tcp>* req, const char* data, size_t len) {
+  // The payload is still owned by the req during the callback.
+  ASSERT(1 == req->size());
+  ASSERT(len == req->bufs()[0].len);
+  ASSERT(0 == memcmp(req->bufs()[0].base, data, len));
+}
+
+
+static void short_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  check_bufs(req, "short", 5);
+  write_cb_called++;
+}
+
+
+static void large_cb(ns_write<ns_tcp>* req, int status, size_t* data) {
+  ASSERT(status == 0);
+  ASSERT_PTR_EQ(data, &large_data);
+  check_bufs(req, &expected[5], LARGE_SIZE);
+  write_cb_called++;
+}
+
+
+static void vec_cb(ns_write<ns_tcp>* req,
+                   int status,
+                   std::weak_ptr<int> data) {
+  ASSERT(status == 0);
+  ASSERT(data.lock());
+  ASSERT(7 == *data.lock());
+  check_bufs(req, "vector", 6);
+  write_cb_called++;
+}
+
+
+static void last_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  check_bufs(req, "again", 5);
+  write_cb_called++;
+  req->handle()->close(close_cb);
+}
+
+
+static void ptr_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  check_bufs(req, "unique", 6);
+  write_cb_called++;
+  // Reusing the req from its own callback doesn't release the new payload.
+  ASSERT(0 == req->handle()->write(req, std::string("again"), last_cb));
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  ASSERT(0 == incoming.read_start(alloc_cb, read_cb));
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  static std::shared_ptr<int> wp_data = std::make_shared<int>(7);
+  ns_tcp* handle = req->handle();
+  std::string str("short");
+  std::vector<char> vec = { 'v', 'e', 'c', 't', 'o', 'r' };
+  std::unique_ptr<char[]> ptr(new char[6]);
+
+  ASSERT(status == 0);
+
+  // Short enough to be stored inline by std::string.
+  ASSERT(0 == handle->write(&write_reqs[0], std::move(str), short_cb));
+  ASSERT(0 == handle->write(&write_reqs[1],
+                            std::string(&expected[5], LARGE_SIZE),
+                            large_cb,
+                            &large_data));
+  ASSERT(0 == handle->write(&write_reqs[2],
+                            std::move(vec),
+                            vec_cb,
+                            std::weak_ptr<int>(wp_data)));
+  memcpy(ptr.get(), "unique", 6);
+  ASSERT(0 == handle->write(&write_reqs[3], std::move(ptr), 6, ptr_cb));
+  ASSERT(0 == handle->write(&write_reqs[4],
+                            std::vector<char>(10, 'x'),
+                            nullptr));
+  ASSERT(0 == handle->write(&write_reqs[5], std::string(), nullptr));
+}
+
+
+TEST_CASE("tcp_write_owned", "[tcp]") {
+  ns_connect<ns_tcp> connect_req;
+  struct sockaddr_in addr;
+  const char* tail = "vectoruniquexxxxxxxxxxagain";
+
+  expected.assign({ 's', 'h', 'o', 'r', 't' });
+  for (size_t i = 0; i < LARGE_SIZE; i++)
+    expected.push_back(static_cast<char>(i % 249));
+  expected.insert(expected.end(), tail, tail + strlen(tail));
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(5 == write_cb_called);
+  ASSERT(3 == close_cb_called);
+  ASSERT(expected == received);
+
+  make_valgrind_happy();
+}
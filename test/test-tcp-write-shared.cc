@@ -0,0 +1,169 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_shared_buf;
+using nsuv::ns_tcp;
+using nsuv::ns_write;
+
+#define CLIENT_COUNT 8
+#define PAYLOAD_SIZE (256 * 1024)
+
+static ns_tcp server;
+static ns_tcp clients[CLIENT_COUNT];
+static ns_tcp incoming[CLIENT_COUNT];
+static ns_connect<ns_tcp> connect_reqs[CLIENT_COUNT];
+static ns_write<ns_tcp> write_reqs[CLIENT_COUNT];
+static size_t bytes_read[CLIENT_COUNT];
+static std::vector<char> payload;
+static ns_shared_buf* shared;
+static int accepted;
+static int close_cb_called;
+static int write_cb_called;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void incoming_close_cb(ns_tcp*) {
+  if (++close_cb_called == 2 * CLIENT_COUNT)
+    server.close(close_cb);
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void incoming_read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t*) {
+  ASSERT(nread == UV_EOF);
+  handle->close(incoming_close_cb);
+}
+
+
+static void client_read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t* buf) {
+  size_t i = handle - clients;
+
+  ASSERT(nread >= 0);
+  ASSERT(bytes_read[i] + nread <= payload.size());
+  ASSERT(0 == memcmp(buf->base, &payload[bytes_read[i]], nread));
+  bytes_read[i] += nread;
+  if (bytes_read[i] == payload.size())
+    handle->close(close_cb);
+}
+
+
+static void write_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  // The req's reference is held until the callback returns.
+  ASSERT_GE(shared->ref_count(), 1);
+  ASSERT(1 == req->size());
+  ASSERT_PTR_EQ(req->bufs()[0].base, shared->data());
+  write_cb_called++;
+}
+
+
+static void write_data_cb(ns_write<ns_tcp>* req, int status, int* data) {
+  ASSERT_PTR_EQ(data, &write_cb_called);
+  write_cb(req, status);
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming[accepted].init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming[accepted]));
+  ASSERT(0 == incoming[accepted].read_start(alloc_cb, incoming_read_cb));
+  if (++accepted < CLIENT_COUNT)
+    return;
+
+  shared = ns_shared_buf::create(payload.data(), payload.size());
+  ASSERT_NOT_NULL(shared);
+  ASSERT(1 == shared->ref_count());
+  ASSERT(payload.size() == shared->size());
+
+  for (int i = 0; i < CLIENT_COUNT; i++) {
+    if (i % 3 == 0)
+      ASSERT(0 == incoming[i].write(&write_reqs[i], shared, write_cb));
+    else if (i % 3 == 1)
+      ASSERT(0 == incoming[i].write(&write_reqs[i], shared, nullptr));
+    else
+      ASSERT(0 == incoming[i].write(
+          &write_reqs[i], shared, write_data_cb, &write_cb_called));
+  }
+
+  ASSERT(CLIENT_COUNT + 1 == shared->ref_count());
+  // Every write holds its own reference, so ours can go right away.
+  shared->unref();
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == req->handle()->read_start(alloc_cb, client_read_cb));
+}
+
+
+TEST_CASE("shared_buf_ref", "[tcp]") {
+  ns_shared_buf* buf = ns_shared_buf::create(4);
+
+  ASSERT_NOT_NULL(buf);
+  ASSERT(4 == buf->size());
+  memcpy(buf->data(), "ping", 4);
+  ASSERT_PTR_EQ(buf->buf().base, buf->data());
+  ASSERT(4 == buf->buf().len);
+
+  buf->ref();
+  ASSERT(2 == buf->ref_count());
+  buf->unref();
+  ASSERT(1 == buf->ref_count());
+  ASSERT(0 == memcmp(buf->data(), "ping", 4));
+  buf->unref();
+
+  buf = ns_shared_buf::create(nullptr, 0);
+  ASSERT_NOT_NULL(buf);
+  ASSERT(0 == buf->size());
+  buf->unref();
+
+  // The header wouldn't fit on top.
+  ASSERT_NULL(ns_shared_buf::create(SIZE_MAX));
+}
+
+
+TEST_CASE("tcp_write_shared", "[tcp]") {
+  struct sockaddr_in addr;
+
+  payload.resize(PAYLOAD_SIZE);
+  for (size_t i = 0; i < payload.size(); i++)
+    payload[i] = static_cast<char>(i % 253);
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+
+  for (int i = 0; i < CLIENT_COUNT; i++) {
+    ASSERT(0 == clients[i].init(uv_default_loop()));
+    ASSERT(0 == clients[i].connect(&connect_reqs[i],
+                                   SOCKADDR_CONST_CAST(&addr),
+                                   connect_cb));
+  }
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(CLIENT_COUNT == accepted);
+  // Two out of every three writes have a callback.
+  ASSERT(CLIENT_COUNT - (CLIENT_COUNT + 1) / 3 == write_cb_called);
+  ASSERT(2 * CLIENT_COUNT + 1 == close_cb_called);
+  for (int i = 0; i < CLIENT_COUNT; i++)
+    ASSERT(payload.size() == bytes_read[i]);
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,193 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+using nsuv::ns_connect;
+using nsuv::ns_tcp;
+using nsuv::ns_timer;
+using nsuv::ns_write;
+
+#define REQ_COUNT 16
+#define CHUNK_SIZE (256 * 1024)
+#define LOW_WATERMARK 0
+#define HIGH_WATERMARK (512 * 1024)
+
+static ns_timer timer;
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_write<ns_tcp> write_reqs[REQ_COUNT];
+static char chunk[CHUNK_SIZE];
+static bool use_write_cb;
+static size_t bytes_read;
+static int close_cb_called;
+static int write_cb_called;
+static int pressure_cb_called;
+static int drain_cb_called;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t*) {
+  if (nread < 0) {
+    ASSERT(nread == UV_EOF);
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  bytes_read += nread;
+}
+
+
+static void timer_cb(ns_timer* handle) {
+  // The client must still be waiting on the server to read.
+  ASSERT(client.is_write_paused());
+  ASSERT(0 == drain_cb_called);
+  ASSERT(0 == incoming.read_start(alloc_cb, read_cb));
+  handle->close();
+}
+
+
+static void write_cb(ns_write<ns_tcp>*, int status) {
+  ASSERT(status == 0);
+  write_cb_called++;
+}
+
+
+static void watermark_cb(ns_tcp* handle, bool paused, size_t size) {
+  ASSERT_PTR_EQ(handle, &client);
+  ASSERT(paused == handle->is_write_paused());
+
+  if (paused) {
+    ASSERT(0 == pressure_cb_called);
+    ASSERT_GT(size, HIGH_WATERMARK);
+    ASSERT(size == handle->get_write_queue_size());
+    pressure_cb_called++;
+    return;
+  }
+
+  ASSERT(1 == pressure_cb_called);
+  ASSERT(size == LOW_WATERMARK);
+  drain_cb_called++;
+
+  // Everything has been handed to the kernel, so the remaining write
+  // callbacks will still report success.
+  handle->close(close_cb);
+}
+
+
+static void watermark_data_cb(ns_tcp* handle,
+                              bool paused,
+                              size_t size,
+                              int* data) {
+  ASSERT_PTR_EQ(data, &write_cb_called);
+  watermark_cb(handle, paused, size);
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  // Delay reading so the client's write queue backs up.
+  ASSERT(0 == timer.init(handle->get_loop()));
+  ASSERT(0 == timer.start(timer_cb, 100, 0));
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  uv_buf_t buf = uv_buf_init(chunk, sizeof(chunk));
+
+  ASSERT(status == 0);
+
+  for (int i = 0; i < REQ_COUNT; i++) {
+    if (use_write_cb)
+      ASSERT(0 == req->handle()->write(&write_reqs[i], &buf, 1, write_cb));
+    else
+      ASSERT(0 == req->handle()->write(&write_reqs[i], &buf, 1, nullptr));
+  }
+
+  ASSERT(1 == pressure_cb_called);
+  ASSERT(req->handle()->is_write_paused());
+}
+
+
+static void run_test() {
+  ns_connect<ns_tcp> connect_req;
+  struct sockaddr_in addr;
+  int buffer_size = 16 * 1024;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+  ASSERT(0 == uv_send_buffer_size(client.base_handle(), &buffer_size));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(1 == pressure_cb_called);
+  ASSERT(1 == drain_cb_called);
+  ASSERT(!client.is_write_paused());
+  ASSERT(3 == close_cb_called);
+  ASSERT(static_cast<size_t>(REQ_COUNT) * CHUNK_SIZE == bytes_read);
+}
+
+
+static void reset_counters() {
+  bytes_read = 0;
+  close_cb_called = 0;
+  write_cb_called = 0;
+  pressure_cb_called = 0;
+  drain_cb_called = 0;
+}
+
+
+TEST_CASE("tcp_write_watermarks", "[tcp]") {
+  reset_counters();
+  use_write_cb = true;
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(UV_EINVAL == client.set_write_watermarks(10, 5, watermark_cb));
+  ASSERT(0 == client.set_write_watermarks(LOW_WATERMARK,
+                                          HIGH_WATERMARK,
+                                          watermark_cb));
+  ASSERT(!client.is_write_paused());
+
+  run_test();
+
+  ASSERT(REQ_COUNT == write_cb_called);
+
+  make_valgrind_happy();
+}
+
+
+TEST_CASE("tcp_write_watermarks_no_write_cb", "[tcp]") {
+  reset_counters();
+  use_write_cb = false;
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.set_write_watermarks(LOW_WATERMARK,
+                                          HIGH_WATERMARK,
+                                          watermark_data_cb,
+                                          &write_cb_called));
+
+  run_test();
+
+  ASSERT(0 == write_cb_called);
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,212 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <vector>
+
+using nsuv::ns_connect;
+using nsuv::ns_tcp;
+using nsuv::ns_write;
+using nsuv::ns_zerocopy;
+
+#define REQ_COUNT 4
+#define CHUNK_SIZE (1024 * 1024)
+#define SMALL_SIZE 100
+
+static ns_tcp server;
+static ns_tcp client;
+static ns_tcp incoming;
+static ns_zerocopy zerocopy;
+static ns_write<ns_tcp> small_req;
+static ns_write<ns_tcp> write_reqs[REQ_COUNT];
+static std::vector<char> payload;
+static size_t bytes_read;
+static bool cancel_writes;
+static int close_cb_called;
+static int zerocopy_close_cb_called;
+static int small_cb_called;
+static int write_cb_called;
+
+
+static void close_cb(ns_tcp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(ns_tcp*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void read_cb(ns_tcp* handle, ssize_t nread, const uv_buf_t* buf) {
+  if (nread < 0) {
+    ASSERT((nread == UV_EOF || (cancel_writes && nread == UV_ECONNRESET)));
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+
+  ASSERT(bytes_read + nread <= payload.size());
+  if (!cancel_writes)
+    ASSERT(0 == memcmp(buf->base, &payload[bytes_read], nread));
+  bytes_read += nread;
+}
+
+
+static void zerocopy_close_cb(ns_zerocopy* handle) {
+  ASSERT_PTR_EQ(handle, &zerocopy);
+  ASSERT(REQ_COUNT == write_cb_called);
+  zerocopy_close_cb_called++;
+  client.close(close_cb);
+}
+
+
+static void small_cb(ns_write<ns_tcp>* req, int status) {
+  ASSERT_PTR_EQ(req, &small_req);
+  ASSERT(status == 0);
+  ASSERT(0 == write_cb_called);
+  small_cb_called++;
+}
+
+
+static void write_cb(ns_write<ns_tcp>* req, int status, int* data) {
+  ASSERT_PTR_EQ(data, &write_cb_called);
+  ASSERT_PTR_EQ(req, &write_reqs[write_cb_called]);
+  ASSERT_PTR_EQ(req->handle(), &client);
+
+  if (cancel_writes) {
+    ASSERT(status == UV_ECANCELED);
+    write_cb_called++;
+    return;
+  }
+
+  ASSERT(status == 0);
+  ASSERT(1 == small_cb_called);
+  // The kernel must have released the pages before the callback.
+  ASSERT_GT(zerocopy.completions(), 0);
+  if (++write_cb_called == REQ_COUNT)
+    zerocopy.close(zerocopy_close_cb);
+}
+
+
+static void connection_cb(ns_tcp* handle, int status) {
+  ASSERT(status == 0);
+  ASSERT(0 == incoming.init(handle->get_loop()));
+  ASSERT(0 == handle->accept(&incoming));
+  ASSERT(0 == incoming.read_start(alloc_cb, read_cb));
+}
+
+
+static void connect_cb(ns_connect<ns_tcp>* req, int status) {
+  ns_tcp* handle = req->handle();
+  uv_buf_t buf;
+  int r;
+
+  ASSERT(status == 0);
+
+  r = zerocopy.init(handle);
+  if (r == UV_ENOTSUP || r == UV_ENOPROTOOPT) {
+    // Not supported by this platform or kernel.
+    handle->close(close_cb);
+    server.close(close_cb);
+    return;
+  }
+  ASSERT(0 == r);
+
+  // Small writes take the regular path.
+  buf = uv_buf_init(payload.data(), SMALL_SIZE);
+  ASSERT(0 == zerocopy.write(&small_req, &buf, 1, small_cb));
+
+  for (int i = 0; i < REQ_COUNT; i++) {
+    buf = uv_buf_init(&payload[SMALL_SIZE + i * CHUNK_SIZE], CHUNK_SIZE);
+    ASSERT(0 == zerocopy.write(&write_reqs[i],
+                               &buf,
+                               1,
+                               write_cb,
+                               &write_cb_called));
+  }
+  ASSERT(0 == write_cb_called);
+
+  if (cancel_writes)
+    zerocopy.close(zerocopy_close_cb);
+}
+
+
+static void run_test() {
+  ns_connect<ns_tcp> connect_req;
+  struct sockaddr_in addr;
+
+  payload.resize(SMALL_SIZE + REQ_COUNT * CHUNK_SIZE);
+  for (size_t i = 0; i < payload.size(); i++)
+    payload[i] = static_cast<char>(i % 241);
+
+  bytes_read = 0;
+  close_cb_called = 0;
+  zerocopy_close_cb_called = 0;
+  small_cb_called = 0;
+  write_cb_called = 0;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == server.listen(128, connection_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.connect(&connect_req,
+                             SOCKADDR_CONST_CAST(&addr),
+                             connect_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+}
+
+
+TEST_CASE("tcp_zerocopy", "[tcp]") {
+  cancel_writes = false;
+  run_test();
+
+  if (zerocopy_close_cb_called == 0) {
+    ASSERT(2 == close_cb_called);
+  } else {
+    ASSERT(1 == small_cb_called);
+    ASSERT(REQ_COUNT == write_cb_called);
+    ASSERT(3 == close_cb_called);
+    ASSERT(payload.size() == bytes_read);
+    ASSERT_GE(zerocopy.completions(), zerocopy.copied());
+  }
+
+  make_valgrind_happy();
+}
+
+
+TEST_CASE("tcp_zerocopy_close", "[tcp]") {
+  cancel_writes = true;
+  run_test();
+
+  if (zerocopy_close_cb_called > 0) {
+    ASSERT(REQ_COUNT == write_cb_called);
+    ASSERT(3 == close_cb_called);
+  }
+
+  make_valgrind_happy();
+}
+
+
+static void uninit_close_cb(ns_zerocopy*) {
+  zerocopy_close_cb_called++;
+}
+
+
+TEST_CASE("tcp_zerocopy_uninit", "[tcp]") {
+  ns_zerocopy unused;
+  char data[SMALL_SIZE] = {};
+  uv_buf_t buf = uv_buf_init(data, sizeof(data));
+
+  // Small writes would otherwise go to the missing ns_tcp.
+  ASSERT(UV_EBADF == unused.write(&small_req, &buf, 1, small_cb));
+  zerocopy_close_cb_called = 0;
+  unused.close(uninit_close_cb);
+  ASSERT(1 == zerocopy_close_cb_called);
+
+  make_valgrind_happy();
+}
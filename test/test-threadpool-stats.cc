@@ -0,0 +1,105 @@
+#include "../include/nsuv-inl.h"
+#include "./catch.hpp"
+#include "./helpers.h"
+
+using nsuv::ns_fs;
+using nsuv::ns_histogram;
+using nsuv::ns_threadpool_stats;
+using nsuv::ns_work;
+using nsuv::util::histogram;
+
+// More than the default threadpool size so some requests have to wait.
+#define WORK_COUNT 8
+#define WORK_TIME 10
+
+static ns_work work_reqs[WORK_COUNT];
+static ns_fs fs_req;
+static int after_work_cb_count;
+static int fs_cb_count;
+
+
+static void work_cb(ns_work*) {
+  uv_sleep(WORK_TIME);
+}
+
+
+static void after_work_cb(ns_work*, int status) {
+  ASSERT(status == 0);
+  after_work_cb_count++;
+}
+
+
+static void fs_cb(ns_fs* req) {
+  ASSERT(0 == req->get_result());
+  req->cleanup();
+  fs_cb_count++;
+}
+
+
+TEST_CASE("histogram", "[threadpool]") {
+  histogram h;
+  ns_histogram snap;
+
+  ASSERT(0 == h.get().percentile(50));
+
+  h.record(0);
+  h.record(3);
+  h.record(1000);
+  snap = h.get();
+  ASSERT(3 == snap.count);
+  ASSERT(1003 == snap.sum);
+  ASSERT(1000 == snap.max);
+  ASSERT(1 == snap.buckets[0]);
+  ASSERT(1 == snap.buckets[2]);
+  ASSERT(1 == snap.buckets[10]);
+  ASSERT(0 == snap.percentile(0));
+  ASSERT(3 == snap.percentile(50));
+  ASSERT(1023 == snap.percentile(100));
+
+  h.reset();
+  ASSERT(0 == h.get().count);
+  ASSERT(0 == h.get().max);
+}
+
+
+TEST_CASE("threadpool_stats", "[threadpool]") {
+  ns_threadpool_stats stats;
+
+  ns_work::reset_stats();
+  ns_fs::reset_stats();
+
+  for (int i = 0; i < WORK_COUNT; i++)
+    ASSERT(0 == work_reqs[i].queue_work(uv_default_loop(),
+                                        work_cb,
+                                        after_work_cb));
+  ASSERT(0 == fs_req.stat(uv_default_loop(), ".", fs_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  ASSERT(WORK_COUNT == after_work_cb_count);
+  ASSERT(1 == fs_cb_count);
+
+  stats = ns_work::get_stats();
+#if defined(NSUV_ENABLE_STATS)
+  uint64_t ms = 1000 * 1000;
+  ASSERT(WORK_COUNT == stats.queue_wait.count);
+  ASSERT(WORK_COUNT == stats.service_time.count);
+  ASSERT(WORK_COUNT == stats.total.count);
+  ASSERT_GE(stats.service_time.sum, WORK_COUNT * WORK_TIME * ms);
+  ASSERT_GE(stats.queue_wait.max, WORK_TIME * ms);
+  ASSERT_GE(stats.total.max, stats.queue_wait.max + WORK_TIME * ms);
+
+  ASSERT(1 == ns_fs::get_stats(UV_FS_STAT).count);
+  ASSERT_GT(ns_fs::get_stats(UV_FS_STAT).sum, 0);
+  ASSERT(0 == ns_fs::get_stats(UV_FS_OPEN).count);
+#else
+  ASSERT(0 == stats.total.count);
+  ASSERT(0 == ns_fs::get_stats(UV_FS_STAT).count);
+#endif
+
+  ns_work::reset_stats();
+  ns_fs::reset_stats();
+  ASSERT(0 == ns_work::get_stats().total.count);
+  ASSERT(0 == ns_fs::get_stats(UV_FS_STAT).count);
+
+  make_valgrind_happy();
+}
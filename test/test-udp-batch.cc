@@ -0,0 +1,139 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <vector>
+
+using nsuv::ns_io_stats;
+using nsuv::ns_udp;
+using nsuv::ns_udp_batch;
+
+// Small enough for the loopback receive buffer to hold every datagram.
+#define DGRAM_COUNT 100
+
+static ns_udp server;
+static ns_udp client;
+static ns_udp_batch batch;
+static struct sockaddr_in server_addr;
+static char payload[DGRAM_COUNT][8];
+static std::vector<char> too_big;
+static int recv_cb_called;
+static int batch_cb_called;
+static int close_cb_called;
+
+
+static void alloc_cb(uv_handle_t*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+static void recv_cb(uv_udp_t*,
+                    ssize_t nread,
+                    const uv_buf_t* buf,
+                    const struct sockaddr*,
+                    unsigned) {
+  if (nread == 0)
+    return;
+
+  // Datagrams arrive in the order they were added. The second batch loses
+  // the oversized one.
+  int i = recv_cb_called < DGRAM_COUNT ?
+      recv_cb_called : recv_cb_called - DGRAM_COUNT;
+  if (recv_cb_called >= DGRAM_COUNT + DGRAM_COUNT / 2)
+    i++;
+
+  ASSERT(nread == 8);
+  ASSERT(0 == memcmp(buf->base, payload[i], 8));
+  if (++recv_cb_called == 2 * DGRAM_COUNT - 1) {
+    server.close(close_cb);
+    client.close(close_cb);
+  }
+}
+
+
+static void second_batch_cb(ns_udp_batch* b, int status, int* data) {
+  ASSERT_PTR_EQ(b, &batch);
+  ASSERT_PTR_EQ(data, &batch_cb_called);
+  ASSERT(UV_EMSGSIZE == status);
+  ASSERT(DGRAM_COUNT - 1 == b->sent());
+  ASSERT(1 == b->failed());
+  batch_cb_called++;
+}
+
+
+static void first_batch_cb(ns_udp_batch* b, int status) {
+  const struct sockaddr* addr = SOCKADDR_CONST_CAST(&server_addr);
+  uv_buf_t big = uv_buf_init(too_big.data(), too_big.size());
+
+  ASSERT_PTR_EQ(b, &batch);
+  ASSERT(0 == status);
+  ASSERT(DGRAM_COUNT == b->sent());
+  ASSERT(0 == b->failed());
+  ASSERT(0 == b->size());
+#if defined(__linux__)
+  // The first datagram binds the socket, then one sendmmsg() per 64 for
+  // all but the last.
+  ASSERT(1 + static_cast<size_t>(DGRAM_COUNT - 2 + 63) / 64 == b->syscalls());
+#endif
+  batch_cb_called++;
+
+  // Refill from the callback, with one datagram that can't be sent.
+  for (int i = 0; i < DGRAM_COUNT; i++) {
+    uv_buf_t buf = uv_buf_init(payload[i], 8);
+    ASSERT(0 == b->add(i == DGRAM_COUNT / 2 ? big : buf, addr));
+  }
+  ASSERT(0 == b->send(second_batch_cb, &batch_cb_called));
+  ASSERT(UV_EBUSY == b->add(big, addr));
+  ASSERT(UV_EBUSY == b->send(first_batch_cb));
+}
+
+
+TEST_CASE("udp_batch", "[udp]") {
+  const struct sockaddr* addr = SOCKADDR_CONST_CAST(&server_addr);
+  ns_io_stats stats;
+
+  too_big.resize(70000);
+  for (int i = 0; i < DGRAM_COUNT; i++)
+    snprintf(payload[i], sizeof(payload[i]), "DG%05d", i);
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &server_addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(addr, 0));
+  ASSERT(0 == uv_udp_recv_start(&server, alloc_cb, recv_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(UV_EINVAL == batch.init(&client, 0));
+  ASSERT(0 == batch.init(&client, DGRAM_COUNT));
+  ASSERT(UV_EINVAL == batch.send(first_batch_cb));
+
+  for (int i = 0; i < DGRAM_COUNT; i++) {
+    uv_buf_t buf = uv_buf_init(payload[i], 8);
+    ASSERT(0 == batch.add(buf, addr));
+  }
+  ASSERT(UV_ENOBUFS == batch.add(uv_buf_init(payload[0], 8), addr));
+  ASSERT(DGRAM_COUNT == batch.size());
+  ASSERT_PTR_EQ(&client, batch.handle());
+  ASSERT(0 == batch.send(first_batch_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(2 == batch_cb_called);
+  ASSERT(2 * DGRAM_COUNT - 1 == recv_cb_called);
+  ASSERT(2 == close_cb_called);
+
+  stats = client.get_stats();
+#if defined(NSUV_ENABLE_STATS)
+  ASSERT(2 * DGRAM_COUNT - 1 == stats.writes);
+  ASSERT(8 * (2 * DGRAM_COUNT - 1) == stats.bytes_written);
+#else
+  ASSERT(0 == stats.writes);
+#endif
+
+  make_valgrind_happy();
+}
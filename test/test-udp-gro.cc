@@ -0,0 +1,135 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <vector>
+
+using nsuv::ns_io_stats;
+using nsuv::ns_udp;
+using nsuv::ns_udp_batch;
+using nsuv::ns_udp_gro;
+
+#define SEGMENT_SIZE 1000
+#define SEGMENT_COUNT 64
+// The last datagram is shorter than the rest.
+#define PAYLOAD_SIZE (SEGMENT_SIZE * SEGMENT_COUNT - SEGMENT_SIZE / 2)
+
+static ns_udp server;
+static ns_udp client;
+static ns_udp_gro gro;
+static ns_udp_batch batch;
+static std::vector<char> payload;
+static size_t bytes_received;
+static size_t dgrams_received;
+static size_t max_dgrams;
+static int recv_cb_called;
+static int close_cb_called;
+
+
+static void close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+static void gro_close_cb(ns_udp_gro* handle) {
+  ASSERT_PTR_EQ(handle, &gro);
+  server.close(close_cb);
+  client.close(close_cb);
+}
+
+
+static void recv_cb(ns_udp_gro* handle,
+                    int status,
+                    const uv_buf_t* dgrams,
+                    size_t ndgrams,
+                    const struct sockaddr* addr,
+                    size_t* data) {
+  ASSERT_PTR_EQ(handle, &gro);
+  ASSERT_PTR_EQ(data, &bytes_received);
+  ASSERT(0 == status);
+  ASSERT_NOT_NULL(addr);
+  ASSERT_GT(ndgrams, 0);
+  recv_cb_called++;
+
+  // Every datagram comes back with its original boundaries.
+  for (size_t i = 0; i < ndgrams; i++) {
+    size_t off = bytes_received;
+    ASSERT(dgrams[i].len == (off + SEGMENT_SIZE > PAYLOAD_SIZE ?
+        SEGMENT_SIZE / 2 : SEGMENT_SIZE));
+    ASSERT(0 == memcmp(dgrams[i].base, &payload[off], dgrams[i].len));
+    bytes_received += dgrams[i].len;
+  }
+
+  dgrams_received += ndgrams;
+  if (ndgrams > max_dgrams)
+    max_dgrams = ndgrams;
+  if (dgrams_received == SEGMENT_COUNT) {
+    ASSERT(0 == handle->stop());
+    handle->close(gro_close_cb);
+  }
+}
+
+
+TEST_CASE("udp_gro", "[udp]") {
+  struct sockaddr_in addr;
+  uv_buf_t buf;
+  int buffer_size = 1024 * 1024;
+  ns_io_stats stats;
+
+  payload.resize(PAYLOAD_SIZE);
+  for (size_t i = 0; i < payload.size(); i++)
+    payload[i] = static_cast<char>(i % 251);
+  buf = uv_buf_init(payload.data(), payload.size());
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(UV_EBADF == gro.start(recv_cb, &bytes_received));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == uv_recv_buffer_size(server.base_handle(), &buffer_size));
+  ASSERT(0 == gro.init(&server));
+  ASSERT_PTR_EQ(&server, gro.handle());
+  ASSERT(0 == gro.start(recv_cb, &bytes_received));
+
+  // Send the payload as one segmented burst so there's something to
+  // coalesce on loopback.
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == batch.init(&client, SEGMENT_COUNT));
+  batch.set_gso(true);
+  ASSERT(0 == batch.add_segments(buf,
+                                 SEGMENT_SIZE,
+                                 SOCKADDR_CONST_CAST(&addr)));
+  ASSERT(0 == batch.send(nullptr));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(SEGMENT_COUNT == dgrams_received);
+  ASSERT(payload.size() == bytes_received);
+  ASSERT(2 == close_cb_called);
+  // Fewer callbacks than datagrams, unless the kernel can't coalesce.
+  ASSERT((!gro.gro() || !batch.gso() || max_dgrams > 1));
+
+  stats = server.get_stats();
+#if defined(NSUV_ENABLE_STATS)
+  ASSERT(payload.size() == stats.bytes_read);
+  ASSERT(static_cast<uint64_t>(recv_cb_called) == stats.read_cbs);
+#else
+  ASSERT(0 == stats.bytes_read);
+#endif
+
+  make_valgrind_happy();
+}
+
+
+static void uninit_close_cb(ns_udp_gro*) {
+  close_cb_called++;
+}
+
+
+TEST_CASE("udp_gro_uninit", "[udp]") {
+  ns_udp_gro unused;
+
+  close_cb_called = 0;
+  unused.close(uninit_close_cb);
+  ASSERT(1 == close_cb_called);
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,135 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <vector>
+
+using nsuv::ns_udp;
+using nsuv::ns_udp_batch;
+
+#define SEGMENT_SIZE 1000
+#define SEGMENT_COUNT 64
+// The last datagram is shorter than the rest.
+#define PAYLOAD_SIZE (SEGMENT_SIZE * SEGMENT_COUNT - SEGMENT_SIZE / 2)
+
+static ns_udp server;
+static ns_udp client;
+static ns_udp_batch batch;
+static struct sockaddr_in server_addr;
+static std::vector<char> payload;
+static size_t bytes_received;
+static int recv_cb_called;
+static int batch_cb_called;
+static int close_cb_called;
+
+
+static void alloc_cb(uv_handle_t*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+static void recv_cb(uv_udp_t*,
+                    ssize_t nread,
+                    const uv_buf_t* buf,
+                    const struct sockaddr*,
+                    unsigned) {
+  size_t off = bytes_received % PAYLOAD_SIZE;
+
+  if (nread == 0)
+    return;
+
+  // The kernel split the segmented sends back into the original datagrams.
+  ASSERT(nread == (off + SEGMENT_SIZE > PAYLOAD_SIZE ?
+      SEGMENT_SIZE / 2 : SEGMENT_SIZE));
+  ASSERT(0 == memcmp(buf->base, &payload[off], nread));
+  bytes_received += nread;
+  if (++recv_cb_called == 2 * SEGMENT_COUNT) {
+    server.close(close_cb);
+    client.close(close_cb);
+  }
+}
+
+
+static void second_batch_cb(ns_udp_batch* b, int status) {
+  ASSERT(0 == status);
+  ASSERT(SEGMENT_COUNT == b->sent());
+  ASSERT(0 == b->gso_segments());
+  batch_cb_called++;
+}
+
+
+static void first_batch_cb(ns_udp_batch* b, int status) {
+  const struct sockaddr* addr = SOCKADDR_CONST_CAST(&server_addr);
+  uv_buf_t buf = uv_buf_init(payload.data(), payload.size());
+
+  ASSERT(0 == status);
+  ASSERT(SEGMENT_COUNT == b->sent());
+  ASSERT(0 == b->failed());
+#if defined(__linux__)
+  // Everything but the last datagram goes out as one segmented message,
+  // unless the kernel doesn't support it.
+  ASSERT((SEGMENT_COUNT - 1 == b->gso_segments() || !b->gso()));
+  ASSERT(1 == b->syscalls());
+#endif
+  batch_cb_called++;
+
+  // Same again without segmentation.
+  b->set_gso(false);
+  ASSERT(0 == b->add_segments(buf, SEGMENT_SIZE, addr));
+  ASSERT(0 == b->send(second_batch_cb));
+}
+
+
+TEST_CASE("udp_gso", "[udp]") {
+  const struct sockaddr* addr = SOCKADDR_CONST_CAST(&server_addr);
+  uv_buf_t buf;
+  struct sockaddr_in client_addr;
+  int buffer_size = 1024 * 1024;
+
+  payload.resize(PAYLOAD_SIZE);
+  for (size_t i = 0; i < payload.size(); i++)
+    payload[i] = static_cast<char>(i % 251);
+  buf = uv_buf_init(payload.data(), payload.size());
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &server_addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(addr, 0));
+  ASSERT(0 == uv_recv_buffer_size(server.base_handle(), &buffer_size));
+  ASSERT(0 == uv_udp_recv_start(&server, alloc_cb, recv_cb));
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", 0, &client_addr));
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.bind(SOCKADDR_CONST_CAST(&client_addr), 0));
+
+  ASSERT(0 == batch.init(&client, SEGMENT_COUNT));
+  ASSERT(!batch.gso());
+  batch.set_gso(true);
+#if defined(__linux__)
+  ASSERT(batch.gso());
+#endif
+
+  ASSERT(UV_EINVAL == batch.add_segments(buf, 0, addr));
+  ASSERT(0 == batch.add(uv_buf_init(payload.data(), 1), addr));
+  // Doesn't fit anymore, and nothing is added.
+  ASSERT(UV_ENOBUFS == batch.add_segments(buf, SEGMENT_SIZE, addr));
+  ASSERT(1 == batch.size());
+  ASSERT(0 == batch.init(&client, SEGMENT_COUNT));
+  ASSERT(0 == batch.add_segments(buf, SEGMENT_SIZE, addr));
+  ASSERT(SEGMENT_COUNT == batch.size());
+  ASSERT(0 == batch.send(first_batch_cb));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(2 == batch_cb_called);
+  ASSERT(2 * SEGMENT_COUNT == recv_cb_called);
+  ASSERT(2 * payload.size() == bytes_received);
+  ASSERT(2 == close_cb_called);
+
+  make_valgrind_happy();
+}
@@ -0,0 +1,125 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <fcntl.h>
+
+using nsuv::ns_async;
+using nsuv::ns_thread;
+using nsuv::ns_udp;
+using nsuv::ns_udp_reuseport;
+
+#define SHARD_COUNT 2
+#define SEND_COUNT 100
+
+struct shard {
+  uv_loop_t loop;
+  ns_udp handle;
+  ns_async stop;
+  ns_thread thread;
+  int received;
+  char slab[65536];
+};
+
+static ns_udp_reuseport group;
+static shard shards[SHARD_COUNT];
+static std::atomic<int> total_received;
+static char payload[] = "PING";
+
+
+static void alloc_cb(uv_handle_t* handle, size_t, uv_buf_t* buf) {
+  // Each shard reads on its own thread, so each needs its own buffer.
+  shard* s = static_cast<shard*>(handle->data);
+  buf->base = s->slab;
+  buf->len = sizeof(s->slab);
+}
+
+
+static void recv_cb(uv_udp_t* handle,
+                    ssize_t nread,
+                    const uv_buf_t*,
+                    const struct sockaddr*,
+                    unsigned) {
+  shard* s = static_cast<shard*>(handle->data);
+
+  if (nread == 0)
+    return;
+
+  ASSERT(nread == 4);
+  s->received++;
+  // The last datagram tells every shard to stop.
+  if (++total_received == SEND_COUNT) {
+    for (auto& other : shards)
+      ASSERT(0 == other.stop.send());
+  }
+}
+
+
+static void stop_cb(ns_async* handle, shard* s) {
+  handle->close();
+  s->handle.close();
+}
+
+
+static void thread_cb(ns_thread*, shard* s) {
+  ASSERT(0 == uv_run(&s->loop, UV_RUN_DEFAULT));
+}
+
+
+TEST_CASE("udp_reuseport", "[udp]") {
+  struct sockaddr_in addr;
+  struct sockaddr_storage name;
+  uv_buf_t buf = uv_buf_init(payload, 4);
+  ns_udp client;
+  uv_os_fd_t fd;
+  int namelen;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(UV_EINVAL == group.init(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == group.init(SOCKADDR_CONST_CAST(&addr), SHARD_COUNT));
+  ASSERT(SHARD_COUNT == group.size());
+  ASSERT(UV_EBUSY == group.init(SOCKADDR_CONST_CAST(&addr), SHARD_COUNT));
+#if defined(__linux__)
+  ASSERT(0 == group.steer_by_cpu());
+#endif
+
+  for (size_t i = 0; i < SHARD_COUNT; i++) {
+    shard* s = &shards[i];
+    ASSERT(0 == uv_loop_init(&s->loop));
+    ASSERT(0 == s->handle.init(&s->loop));
+    ASSERT(0 == group.open(i, &s->handle));
+    ASSERT(UV_EBADF == group.open(i, &s->handle));
+    namelen = sizeof(name);
+    ASSERT(0 == s->handle.getsockname(reinterpret_cast<sockaddr*>(&name),
+                                      &namelen));
+    ASSERT(kTestPort ==
+           ntohs(reinterpret_cast<struct sockaddr_in*>(&name)->sin_port));
+    // Not inherited by child processes.
+    ASSERT(0 == uv_fileno(s->handle.base_handle(), &fd));
+    ASSERT(FD_CLOEXEC & fcntl(fd, F_GETFD));
+    s->handle.set_data(s);
+    ASSERT(0 == uv_udp_recv_start(&s->handle, alloc_cb, recv_cb));
+    ASSERT(0 == s->stop.init(&s->loop, stop_cb, s));
+  }
+  ASSERT(UV_EINVAL == group.open(SHARD_COUNT, &shards[0].handle));
+
+  // Every shard must be reading before anything is sent.
+  for (auto& s : shards)
+    ASSERT(0 == s.thread.create(thread_cb, &s));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  for (int i = 0; i < SEND_COUNT; i++)
+    ASSERT(4 == client.try_send(&buf, 1, SOCKADDR_CONST_CAST(&addr)));
+
+  for (auto& s : shards) {
+    ASSERT(0 == s.thread.join());
+    ASSERT(0 == uv_loop_close(&s.loop));
+  }
+
+  ASSERT(SEND_COUNT == total_received);
+  ASSERT(SEND_COUNT == shards[0].received + shards[1].received);
+
+  group.close();
+  ASSERT(0 == group.size());
+  client.close();
+  make_valgrind_happy();
+}
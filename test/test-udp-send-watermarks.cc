@@ -0,0 +1,371 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+#include <vector>
+
+using nsuv::ns_udp;
+using nsuv::ns_udp_batch;
+using nsuv::ns_udp_send;
+
+#define SEND_COUNT 10
+#define DGRAM_SIZE 400
+#define HIGH_WATERMARK 1000
+
+static ns_udp server;
+static ns_udp client;
+static ns_udp_send send_reqs[SEND_COUNT];
+static char payloads[SEND_COUNT][DGRAM_SIZE];
+static struct sockaddr_in addr;
+static std::vector<int> received;
+static std::vector<int> statuses;
+static std::vector<bool> watermark_events;
+static size_t expected_received;
+static int send_cb_called;
+static int close_cb_called;
+static int done;
+
+
+static void close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+static void finish() {
+  // Close once every send completed and the server saw what got through.
+  if (++done < 2)
+    return;
+  ASSERT(!client.is_send_paused());
+  server.close(close_cb);
+  client.close(close_cb);
+}
+
+
+static void alloc_cb(uv_handle_t*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void recv_cb(uv_udp_t*,
+                    ssize_t nread,
+                    const uv_buf_t* buf,
+                    const struct sockaddr*,
+                    unsigned) {
+  if (nread == 0)
+    return;
+  ASSERT(DGRAM_SIZE == nread);
+  received.push_back(buf->base[0]);
+  if (received.size() == expected_received)
+    finish();
+}
+
+
+static void watermark_cb(ns_udp* handle, bool paused, size_t size, int* data) {
+  ASSERT_PTR_EQ(handle, &client);
+  ASSERT_PTR_EQ(data, &send_cb_called);
+  ASSERT(paused == handle->is_send_paused());
+  if (paused)
+    ASSERT_GT(size, HIGH_WATERMARK);
+  else
+    ASSERT(0 == size);
+  watermark_events.push_back(paused);
+}
+
+
+static void send_cb(ns_udp_send* req, int status) {
+  statuses[req - send_reqs] = status;
+  if (++send_cb_called == SEND_COUNT)
+    finish();
+}
+
+
+// Sends everything in the same loop iteration so the datagrams pile up in
+// libuv's queue, and returns how many sends it took to hit the high watermark.
+static int run_test(ns_udp::send_policy policy) {
+  int accepted = 0;
+
+  expected_received = SEND_COUNT;
+  done = 0;
+  received.clear();
+  statuses.assign(SEND_COUNT, 1);
+  watermark_events.clear();
+  send_cb_called = 0;
+  close_cb_called = 0;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == uv_udp_recv_start(&server, alloc_cb, recv_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(UV_EINVAL == client.set_send_watermarks(2, 1, policy));
+  ASSERT(0 == client.set_send_watermarks(0,
+                                         HIGH_WATERMARK,
+                                         policy,
+                                         watermark_cb,
+                                         &send_cb_called));
+
+  for (int i = 0; i < SEND_COUNT; i++) {
+    uv_buf_t buf = uv_buf_init(payloads[i], DGRAM_SIZE);
+    memset(payloads[i], i, DGRAM_SIZE);
+    int r = client.send(&send_reqs[i],
+                        &buf,
+                        1,
+                        SOCKADDR_CONST_CAST(&addr),
+                        send_cb);
+    if (accepted == 0 && client.is_send_paused())
+      accepted = i + 1;
+    if (r == UV_ENOBUFS) {
+      ASSERT(ns_udp::kSendReject == policy);
+      ASSERT_GT(accepted, 0);
+      statuses[i] = r;
+      if (++send_cb_called == SEND_COUNT)
+        finish();
+      continue;
+    }
+    ASSERT(0 == r);
+  }
+  ASSERT_GT(accepted, 0);
+  ASSERT_GT(SEND_COUNT - 2, accepted);
+
+  // The rejected sends don't leave anything for the server to wait on.
+  if (ns_udp::kSendReject == policy)
+    expected_received = accepted;
+  // Only the newest held sends that fit under the high watermark survive.
+  if (ns_udp::kSendDropOldest == policy)
+    expected_received = accepted + HIGH_WATERMARK / DGRAM_SIZE;
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(SEND_COUNT == send_cb_called);
+  ASSERT(2 == close_cb_called);
+  ASSERT(2 == watermark_events.size());
+  ASSERT(watermark_events[0]);
+  ASSERT(!watermark_events[1]);
+  ASSERT(!client.is_send_paused());
+  ASSERT(0 == client.held_send_size());
+  ASSERT(expected_received == received.size());
+  for (int i = 0; i < accepted; i++) {
+    ASSERT(0 == statuses[i]);
+    ASSERT(i == received[i]);
+  }
+
+  return accepted;
+}
+
+
+TEST_CASE("udp_send_watermarks_queue", "[udp]") {
+  run_test(ns_udp::kSendQueue);
+
+  for (int i = 0; i < SEND_COUNT; i++) {
+    ASSERT(0 == statuses[i]);
+    ASSERT(i == received[i]);
+  }
+  ASSERT(0 == client.dropped_sends());
+
+  make_valgrind_happy();
+}
+
+
+TEST_CASE("udp_send_watermarks_reject", "[udp]") {
+  int accepted = run_test(ns_udp::kSendReject);
+
+  for (int i = accepted; i < SEND_COUNT; i++)
+    ASSERT(UV_ENOBUFS == statuses[i]);
+  ASSERT(0 == client.dropped_sends());
+
+  make_valgrind_happy();
+}
+
+
+TEST_CASE("udp_send_watermarks_drop_oldest", "[udp]") {
+  int accepted = run_test(ns_udp::kSendDropOldest);
+  int kept = HIGH_WATERMARK / DGRAM_SIZE;
+  int first_kept = SEND_COUNT - kept;
+
+  ASSERT(static_cast<size_t>(first_kept - accepted) == client.dropped_sends());
+  for (int i = accepted; i < SEND_COUNT; i++)
+    ASSERT((i < first_kept ? UV_ECANCELED : 0) == statuses[i]);
+  for (int i = 0; i < kept; i++)
+    ASSERT(first_kept + i == received[accepted + i]);
+
+  make_valgrind_happy();
+}
+
+
+#define BURST_COUNT 50000
+
+static int burst_cb_called;
+static int burst_cancelled;
+
+
+static void burst_close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+static void burst_send_cb(ns_udp_send* req, int status) {
+  if (status == UV_ECANCELED)
+    burst_cancelled++;
+  else
+    ASSERT(0 == status);
+  if (++burst_cb_called == BURST_COUNT)
+    req->handle()->close(burst_close_cb);
+}
+
+
+TEST_CASE("udp_send_watermarks_drop_burst", "[udp]") {
+  // Completing a burst of dropped sends mustn't recurse once per send.
+  std::vector<ns_udp_send> reqs(BURST_COUNT);
+  char data[1] = { 'x' };
+  uv_buf_t buf = uv_buf_init(data, sizeof(data));
+  uint64_t dropped = client.dropped_sends();
+
+  close_cb_called = 0;
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.set_send_watermarks(0, 1, ns_udp::kSendDropOldest));
+
+  for (auto& req : reqs) {
+    ASSERT(0 == client.send(&req,
+                            &buf,
+                            1,
+                            SOCKADDR_CONST_CAST(&addr),
+                            burst_send_cb));
+  }
+  ASSERT(client.is_send_paused());
+  ASSERT_GT(client.dropped_sends() - dropped, BURST_COUNT / 2);
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(BURST_COUNT == burst_cb_called);
+  ASSERT(client.dropped_sends() - dropped ==
+         static_cast<uint64_t>(burst_cancelled));
+  ASSERT(1 == close_cb_called);
+
+  make_valgrind_happy();
+}
+
+
+#define MIXED_SENDS 3
+#define MIXED_BATCH 4
+#define MIXED_LATE 2
+
+static ns_udp_batch batch;
+static int mixed_pending;
+
+
+static void mixed_close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+// Waits on every callback and on the drained event, which only comes after
+// the last one.
+static void mixed_finish() {
+  if (--mixed_pending == 0)
+    client.close(mixed_close_cb);
+}
+
+
+static void mixed_watermark_cb(ns_udp*, bool paused, size_t) {
+  watermark_events.push_back(paused);
+  if (!paused)
+    mixed_finish();
+}
+
+
+static void mixed_send_cb(ns_udp_send* req, int status) {
+  statuses[req - send_reqs] = status;
+  mixed_finish();
+}
+
+
+static void mixed_batch_cb(ns_udp_batch* b, int status) {
+  ASSERT_PTR_EQ(b, &batch);
+  ASSERT(0 == status);
+  ASSERT(MIXED_BATCH == b->sent());
+  mixed_finish();
+}
+
+
+static void run_mixed_test(ns_udp::send_policy policy) {
+  static_assert(MIXED_SENDS + MIXED_LATE <= SEND_COUNT, "too many sends");
+
+  statuses.assign(SEND_COUNT, 1);
+  watermark_events.clear();
+  close_cb_called = 0;
+  // Every send, the batch and the drained event.
+  mixed_pending = MIXED_SENDS + MIXED_LATE + 2;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(0 == client.set_send_watermarks(0,
+                                         HIGH_WATERMARK,
+                                         policy,
+                                         mixed_watermark_cb));
+  ASSERT(0 == batch.init(&client, MIXED_BATCH));
+
+  for (int i = 0; i < MIXED_SENDS; i++) {
+    uv_buf_t buf = uv_buf_init(payloads[i], DGRAM_SIZE);
+    ASSERT(0 == client.send(&send_reqs[i],
+                            &buf,
+                            1,
+                            SOCKADDR_CONST_CAST(&addr),
+                            mixed_send_cb));
+  }
+  for (int i = 0; i < MIXED_BATCH; i++) {
+    uv_buf_t buf = uv_buf_init(payloads[MIXED_SENDS], DGRAM_SIZE);
+    ASSERT(0 == batch.add(buf, SOCKADDR_CONST_CAST(&addr)));
+  }
+  ASSERT(0 == batch.send(mixed_batch_cb));
+  ASSERT(client.is_send_paused());
+
+  // Sent while paused by the queued batch.
+  for (int i = MIXED_SENDS; i < MIXED_SENDS + MIXED_LATE; i++) {
+    uv_buf_t buf = uv_buf_init(payloads[i], DGRAM_SIZE);
+    int r = client.send(&send_reqs[i],
+                        &buf,
+                        1,
+                        SOCKADDR_CONST_CAST(&addr),
+                        mixed_send_cb);
+    if (ns_udp::kSendReject == policy) {
+      ASSERT(UV_ENOBUFS == r);
+      statuses[i] = r;
+      mixed_pending--;
+    } else {
+      ASSERT(0 == r);
+    }
+  }
+  if (ns_udp::kSendDropOldest == policy)
+    ASSERT(MIXED_LATE * DGRAM_SIZE == client.held_send_size());
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(0 == mixed_pending);
+  ASSERT(1 == close_cb_called);
+  ASSERT(2 == watermark_events.size());
+  ASSERT(watermark_events[0]);
+  ASSERT(!watermark_events[1]);
+  ASSERT(!client.is_send_paused());
+  ASSERT(0 == client.held_send_size());
+  for (int i = 0; i < MIXED_SENDS + MIXED_LATE; i++) {
+    if (ns_udp::kSendReject == policy && i >= MIXED_SENDS)
+      ASSERT(UV_ENOBUFS == statuses[i]);
+    else
+      ASSERT(0 == statuses[i]);
+  }
+}
+
+
+TEST_CASE("udp_send_watermarks_batch", "[udp]") {
+  // A batch's queued datagrams pause and resume sends like send() does.
+  for (auto policy : { ns_udp::kSendQueue,
+                       ns_udp::kSendReject,
+                       ns_udp::kSendDropOldest }) {
+    run_mixed_test(policy);
+  }
+
+  make_valgrind_happy();
+}
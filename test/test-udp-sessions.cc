@@ -0,0 +1,267 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+using nsuv::ns_addr;
+using nsuv::ns_timer;
+using nsuv::ns_udp;
+using nsuv::ns_udp_sessions;
+
+#define CLIENT_COUNT 2
+#define SEND_COUNT 3
+#define PEER_COUNT 1000
+
+struct peer_state {
+  int datagrams = 0;
+  size_t bytes = 0;
+};
+
+using sessions_t = ns_udp_sessions<peer_state>;
+
+static ns_udp server;
+static ns_udp clients[CLIENT_COUNT];
+static ns_timer timer;
+static sessions_t sessions;
+static char payload[] = "PING";
+static int recv_cb_called;
+static int expire_cb_called;
+static int close_cb_called;
+
+
+static struct sockaddr_in peer_addr(int i) {
+  struct sockaddr_in addr;
+  char ip[32];
+
+  snprintf(ip, sizeof(ip), "10.0.%d.%d", i / 256, i % 256);
+  ASSERT(0 == uv_ip4_addr(ip, 1000 + i, &addr));
+  return addr;
+}
+
+
+TEST_CASE("ns_addr", "[udp]") {
+  struct sockaddr_in a4 = peer_addr(1);
+  struct sockaddr_in b4 = peer_addr(2);
+  struct sockaddr_in6 a6;
+  struct sockaddr_storage ss;
+  struct sockaddr_un un;
+  ns_addr a;
+  ns_addr b;
+  ns_addr c;
+
+  ASSERT(0 == a.family());
+  ASSERT(0 == a.init(SOCKADDR_CONST_CAST(&a4)));
+  ASSERT(AF_INET == a.family());
+  ASSERT(1001 == a.port());
+  ASSERT(0 == b.init(SOCKADDR_CONST_CAST(&b4)));
+  ASSERT(a != b);
+  ASSERT(a.hash() != b.hash());
+
+  // Round trips through a sockaddr.
+  a.to_sockaddr(&ss);
+  ASSERT(0 == memcmp(&ss, &a4, sizeof(a4)));
+  ASSERT(0 == c.init(reinterpret_cast<struct sockaddr*>(&ss)));
+  ASSERT(a == c);
+  ASSERT(a.hash(42) == c.hash(42));
+  ASSERT(a.hash(42) != a.hash(43));
+
+  ASSERT(0 == uv_ip6_addr("::ffff:10.0.0.1", 1001, &a6));
+  ASSERT(0 == c.init(SOCKADDR_CONST_CAST(&a6)));
+  ASSERT(AF_INET6 == c.family());
+  ASSERT(1001 == c.port());
+  ASSERT(a != c);
+  c.to_sockaddr(&ss);
+  ASSERT(0 == memcmp(&ss, &a6, sizeof(a6)));
+
+  memset(&un, 0, sizeof(un));
+  un.sun_family = AF_UNIX;
+  ASSERT(UV_EAFNOSUPPORT == c.init(SOCKADDR_CONST_CAST(&un)));
+}
+
+
+static void table_recv_cb(sessions_t*,
+                          peer_state* state,
+                          const ns_addr&,
+                          ssize_t nread,
+                          const uv_buf_t*) {
+  state->datagrams++;
+  state->bytes += nread;
+}
+
+
+static void table_close_cb(sessions_t* handle) {
+  ASSERT_PTR_EQ(handle, &sessions);
+  close_cb_called++;
+}
+
+
+TEST_CASE("udp_sessions_table", "[udp]") {
+  uv_buf_t buf = uv_buf_init(payload, 4);
+  ns_addr addr;
+
+  close_cb_called = 0;
+  ASSERT(UV_EINVAL == sessions.init(uv_default_loop(), 0, nullptr, nullptr));
+  ASSERT(0 == sessions.init(uv_default_loop(), 0, table_recv_cb, nullptr));
+  ASSERT(UV_EBUSY ==
+         sessions.init(uv_default_loop(), 0, table_recv_cb, nullptr));
+
+  // Enough peers to grow the table a few times.
+  for (int round = 1; round <= 2; round++) {
+    for (int i = 0; i < PEER_COUNT; i++) {
+      struct sockaddr_in a = peer_addr(i);
+      ASSERT(0 == sessions.dispatch(SOCKADDR_CONST_CAST(&a), 4, &buf));
+    }
+  }
+  ASSERT(PEER_COUNT == sessions.size());
+  ASSERT(0 == sessions.dispatch(nullptr, 0, &buf));
+
+  // Removing every other peer shifts entries around, the rest must still be
+  // found.
+  for (int i = 0; i < PEER_COUNT; i += 2) {
+    struct sockaddr_in a = peer_addr(i);
+    ASSERT(0 == addr.init(SOCKADDR_CONST_CAST(&a)));
+    ASSERT(0 == sessions.remove(addr));
+    ASSERT(UV_ENOENT == sessions.remove(addr));
+    ASSERT_NULL(sessions.get(addr));
+  }
+  ASSERT(PEER_COUNT / 2 == sessions.size());
+  for (int i = 1; i < PEER_COUNT; i += 2) {
+    struct sockaddr_in a = peer_addr(i);
+    ASSERT(0 == addr.init(SOCKADDR_CONST_CAST(&a)));
+    peer_state* state = sessions.get(addr);
+    ASSERT_NOT_NULL(state);
+    ASSERT(2 == state->datagrams);
+    ASSERT(8 == state->bytes);
+  }
+
+  // Known peers are still let in once the limit is reached.
+  sessions.set_max_sessions(PEER_COUNT / 2);
+  struct sockaddr_in known = peer_addr(1);
+  struct sockaddr_in unknown = peer_addr(0);
+  ASSERT(0 == sessions.dispatch(SOCKADDR_CONST_CAST(&known), 4, &buf));
+  ASSERT(UV_ENOBUFS ==
+         sessions.dispatch(SOCKADDR_CONST_CAST(&unknown), 4, &buf));
+
+  sessions.close(table_close_cb);
+  ASSERT(0 == sessions.size());
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  ASSERT(1 == close_cb_called);
+
+  make_valgrind_happy();
+}
+
+
+static void uninit_close_cb(sessions_t*) {
+  close_cb_called++;
+}
+
+
+TEST_CASE("udp_sessions_close_uninit", "[udp]") {
+  sessions_t local;
+
+  close_cb_called = 0;
+  // There's no timer to wait for, so cb is called right away.
+  local.close(uninit_close_cb);
+  ASSERT(1 == close_cb_called);
+  ASSERT(UV_EINVAL == local.init(uv_default_loop(), 0, nullptr, nullptr));
+  local.close(uninit_close_cb);
+  ASSERT(2 == close_cb_called);
+
+  // Still usable afterwards.
+  ASSERT(0 == local.init(uv_default_loop(), 50, table_recv_cb, nullptr));
+  local.close(uninit_close_cb);
+  ASSERT(2 == close_cb_called);
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  ASSERT(3 == close_cb_called);
+
+  make_valgrind_happy();
+}
+
+
+static void close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+static void alloc_cb(uv_handle_t*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void recv_cb(uv_udp_t*,
+                    ssize_t nread,
+                    const uv_buf_t* buf,
+                    const struct sockaddr* addr,
+                    unsigned) {
+  ASSERT(0 == sessions.dispatch(addr, nread, buf));
+}
+
+
+static void session_recv_cb(sessions_t* handle,
+                            peer_state* state,
+                            const ns_addr& addr,
+                            ssize_t nread,
+                            const uv_buf_t* buf) {
+  ASSERT_PTR_EQ(handle, &sessions);
+  ASSERT_PTR_EQ(state, handle->get(addr));
+  ASSERT(AF_INET == addr.family());
+  ASSERT(4 == nread);
+  ASSERT(0 == memcmp(buf->base, payload, 4));
+  state->datagrams++;
+  recv_cb_called++;
+}
+
+
+static void session_expire_cb(sessions_t* handle,
+                              peer_state* state,
+                              const ns_addr& addr) {
+  ASSERT_PTR_EQ(handle, &sessions);
+  // Already gone from the table.
+  ASSERT_NULL(handle->get(addr));
+  ASSERT(SEND_COUNT == state->datagrams);
+  expire_cb_called++;
+}
+
+
+static void timer_cb(ns_timer* handle) {
+  // Both peers went quiet long ago.
+  ASSERT(CLIENT_COUNT * SEND_COUNT == recv_cb_called);
+  ASSERT(CLIENT_COUNT == expire_cb_called);
+  ASSERT(0 == sessions.size());
+  sessions.close(nullptr);
+  server.close(close_cb);
+  for (auto& client : clients)
+    client.close(close_cb);
+  handle->close();
+}
+
+
+TEST_CASE("udp_sessions", "[udp]") {
+  struct sockaddr_in addr;
+  uv_buf_t buf = uv_buf_init(payload, 4);
+
+  close_cb_called = 0;
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == uv_udp_recv_start(&server, alloc_cb, recv_cb));
+  ASSERT(0 == sessions.init(uv_default_loop(),
+                            50,
+                            session_recv_cb,
+                            session_expire_cb));
+
+  for (auto& client : clients) {
+    ASSERT(0 == client.init(uv_default_loop()));
+    for (int i = 0; i < SEND_COUNT; i++)
+      ASSERT(4 == client.try_send(&buf, 1, SOCKADDR_CONST_CAST(&addr)));
+  }
+
+  ASSERT(0 == timer.init(uv_default_loop()));
+  ASSERT(0 == timer.start(timer_cb, 300, 0));
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(CLIENT_COUNT + 1 == close_cb_called);
+
+  make_valgrind_happy();
+}
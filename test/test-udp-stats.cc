@@ -0,0 +1,99 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+using nsuv::ns_io_stats;
+using nsuv::ns_udp;
+using nsuv::ns_udp_send;
+
+#define SEND_COUNT 3
+
+static ns_udp server;
+static ns_udp client;
+static ns_udp_send send_reqs[SEND_COUNT];
+static char payload[] = "PING";
+static int recv_cb_called;
+static int send_cb_called;
+static int close_cb_called;
+
+
+static void alloc_cb(uv_handle_t*, size_t, uv_buf_t* buf) {
+  static char slab[65536];
+  buf->base = slab;
+  buf->len = sizeof(slab);
+}
+
+
+static void close_cb(ns_udp*) {
+  close_cb_called++;
+}
+
+
+static void recv_cb(uv_udp_t*,
+                    ssize_t nread,
+                    const uv_buf_t*,
+                    const struct sockaddr* addr,
+                    unsigned) {
+  if (nread == 0) {
+    ASSERT_NULL(addr);
+    return;
+  }
+
+  ASSERT(nread == 4);
+  if (++recv_cb_called == SEND_COUNT + 1) {
+    server.close(close_cb);
+    client.close(close_cb);
+  }
+}
+
+
+static void send_cb(ns_udp_send* req, int status, int* data) {
+  ASSERT(status == 0);
+  ASSERT_PTR_EQ(data, &send_cb_called);
+  ASSERT_PTR_EQ(req, &send_reqs[send_cb_called]);
+  send_cb_called++;
+}
+
+
+TEST_CASE("udp_stats", "[udp]") {
+  struct sockaddr_in addr;
+  uv_buf_t buf = uv_buf_init(payload, 4);
+  ns_io_stats stats;
+
+  ASSERT(0 == uv_ip4_addr("127.0.0.1", kTestPort, &addr));
+  ASSERT(0 == server.init(uv_default_loop()));
+  ASSERT(0 == server.bind(SOCKADDR_CONST_CAST(&addr), 0));
+  ASSERT(0 == uv_udp_recv_start(&server, alloc_cb, recv_cb));
+
+  ASSERT(0 == client.init(uv_default_loop()));
+  ASSERT(4 == client.try_send(&buf, 1, SOCKADDR_CONST_CAST(&addr)));
+  for (int i = 0; i < SEND_COUNT; i++) {
+    ASSERT(0 == client.send(&send_reqs[i],
+                            &buf,
+                            1,
+                            SOCKADDR_CONST_CAST(&addr),
+                            send_cb,
+                            &send_cb_called));
+  }
+
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+
+  ASSERT(SEND_COUNT + 1 == recv_cb_called);
+  ASSERT(SEND_COUNT == send_cb_called);
+  ASSERT(2 == close_cb_called);
+
+  stats = client.get_stats();
+#if defined(NSUV_ENABLE_STATS)
+  ASSERT(4 * (SEND_COUNT + 1) == stats.bytes_written);
+  ASSERT(SEND_COUNT + 1 == stats.writes);
+  ASSERT(SEND_COUNT == stats.write_cbs);
+  ASSERT_GT(stats.peak_write_queue_size, 0);
+#else
+  ASSERT(0 == stats.writes);
+#endif
+  ASSERT(0 == stats.bytes_read);
+
+  client.reset_stats();
+  ASSERT(0 == client.get_stats().writes);
+
+  make_valgrind_happy();
+}
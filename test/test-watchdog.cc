@@ -0,0 +1,91 @@
+#include "../include/nsuv-inl.h"
+#include "./helpers.h"
+
+using nsuv::ns_stall;
+using nsuv::ns_timer;
+using nsuv::ns_watchdog;
+
+#define THRESHOLD 50
+#define BLOCK_TIME 300
+
+static ns_watchdog watchdog;
+static ns_timer idle_timer;
+static ns_timer slow_timer;
+static ns_stall stall;
+static int watchdog_cb_called;
+static int slow_cb_called;
+
+
+static void watchdog_cb(ns_watchdog* wd, const ns_stall& s) {
+  ASSERT_PTR_EQ(wd, &watchdog);
+  stall = s;
+  watchdog_cb_called++;
+}
+
+
+static void slow_cb(ns_timer* handle) {
+  // Waiting in poll isn't a stall.
+  ASSERT(0 == watchdog.stall_count());
+  uv_sleep(BLOCK_TIME);
+  slow_cb_called++;
+  handle->close();
+}
+
+
+static void idle_cb(ns_timer* handle) {
+  ASSERT(0 == slow_timer.init(handle->get_loop()));
+  ASSERT(0 == slow_timer.start(slow_cb, 0, 0));
+  handle->close();
+}
+
+
+TEST_CASE("watchdog", "[watchdog]") {
+  ns_watchdog other;
+  uint64_t ms = 1000 * 1000;
+
+  ASSERT(UV_EINVAL == watchdog.start(uv_default_loop(), 0, watchdog_cb));
+  ASSERT(0 == watchdog.start(uv_default_loop(), THRESHOLD, watchdog_cb));
+  ASSERT(UV_EBUSY == watchdog.start(uv_default_loop(), THRESHOLD, nullptr));
+  // Only one watchdog per thread.
+  ASSERT(UV_EBUSY == other.start(uv_default_loop(), THRESHOLD, nullptr));
+
+  ASSERT(0 == idle_timer.init(uv_default_loop()));
+  ASSERT(0 == idle_timer.start(idle_cb, 4 * THRESHOLD, 0));
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  watchdog.stop();
+
+  ASSERT(1 == slow_cb_called);
+  ASSERT(1 == watchdog_cb_called);
+  ASSERT(1 == watchdog.stall_count());
+  ASSERT_GT(stall.duration, THRESHOLD * ms);
+#if defined(NSUV_ENABLE_WATCHDOG)
+  ASSERT(0 == strcmp("timer", stall.cb));
+  ASSERT(0 == strcmp("timer", stall.type_name));
+  ASSERT_PTR_EQ(&slow_timer, stall.ptr);
+  ASSERT(reinterpret_cast<void (*)()>(slow_cb) == stall.fn);
+  // The heartbeat can predate the callback starting.
+  ASSERT_GT(stall.cb_time, 0);
+  ASSERT_GE(stall.duration, stall.cb_time);
+  ASSERT(stall.cb_time == watchdog.last_stall().cb_time);
+#else
+  // Callbacks aren't tracked.
+  ASSERT_NULL(stall.cb);
+  ASSERT(0 == stall.cb_time);
+#endif
+
+  // Time outside of uv_run() isn't a stall while suspended.
+  ASSERT(0 == watchdog.start(uv_default_loop(), THRESHOLD, watchdog_cb));
+  watchdog.suspend();
+  uv_sleep(4 * THRESHOLD);
+  ASSERT(0 == watchdog.stall_count());
+  watchdog.resume();
+  ASSERT(0 == uv_run(uv_default_loop(), UV_RUN_DEFAULT));
+  ASSERT(0 == watchdog.stall_count());
+  watchdog.stop();
+
+  // The thread can be watched again once stopped.
+  ASSERT(0 == other.start(uv_default_loop(), THRESHOLD, nullptr));
+  other.stop();
+
+  make_valgrind_happy();
+}